@@ -9,6 +9,7 @@
 
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <netinet/in.h>
@@ -71,6 +72,15 @@ typedef struct {
 struct ipaddr_ctx {
     bool       netmask_mode;  /* -M flag: output prefix as netmask */
     bool       silent;        /* suppress output (for chained commands) */
+    bool       batch;         /* -f flag: processing a stream of addresses */
+    bool       reload;        /* -r flag: reload tables when files change */
+    size_t     memory_limit;  /* -m flag: memory for aggregate commands */
+    int        input_format;  /* -I flag: IPADDR_FORMAT_* */
+    int        output_format; /* -O flag: IPADDR_FORMAT_* */
+    const char *column;       /* --column: Parquet column to read */
+    int        pcap;          /* --pcap: IPADDR_PCAP_* addresses to read */
+    int        flow;          /* --flow: IPADDR_FLOW_* addresses to read */
+    const char *state;        /* --state: alloc/free state file */
     ipaddr_t   current;       /* current address being processed */
     int        argc;          /* remaining argument count */
     char     **argv;          /* remaining arguments */
@@ -91,6 +101,7 @@ struct ipaddr_ctx {
  * Supports:
  *   - IPv4: "192.168.1.1", "192.168.1.0/24", "192.168.1.0/255.255.255.0"
  *   - IPv6: "2001:db8::1", "2001:db8::/32", "fe80::1%eth0"
+ *   - Reverse DNS names: "1.1.168.192.in-addr.arpa", "8.b.d.0.1.0.0.2.ip6.arpa"
  *
  * Returns: 0 on success, non-zero on error.
  * On error, errmsg is set to a static error message string.
@@ -125,6 +136,36 @@ int ipaddr_format_addr(const ipaddr_t *addr, char *buf, size_t buflen);
  */
 int ipaddr_format_packed(const ipaddr_t *addr, char *buf, size_t buflen);
 
+/* ========== ipaddr_reverse.c ========== */
+
+/*
+ * Buffer size for reverse DNS names: 32 nibble labels and "ip6.arpa".
+ */
+#define IPADDR_REVERSE_STRLEN   73
+
+/*
+ * Format the reverse DNS name of the address, as Python's reverse_pointer:
+ * "1.1.168.192.in-addr.arpa", or 32 nibble labels and "ip6.arpa".
+ * buflen must be at least IPADDR_REVERSE_STRLEN.
+ */
+int ipaddr_reverse_pointer(const ipaddr_t *addr, char *buf, size_t buflen);
+
+/*
+ * Parse an in-addr.arpa or ip6.arpa name, with or without a final dot.
+ * A name with fewer labels than a full address, such as the name of a
+ * reverse zone, gives the network of the labels present.
+ */
+int ipaddr_parse_reverse(const char *str, ipaddr_t *addr, const char **errmsg);
+
+/*
+ * Write a PTR zone skeleton for the hosts of net (as Python's hosts()) to
+ * fp: an $ORIGIN line, then one record per host pointing to
+ * "ip-ADDRESS.DOMAIN." (domain NULL for "invalid").
+ * Returns 0 on success, IPADDR_ERR_USAGE if domain is not a valid length,
+ * IPADDR_ERR_INTERNAL if writing fails.
+ */
+int ipaddr_reverse_zone(const ipaddr_t *net, const char *domain, FILE *fp);
+
 /* ========== ipaddr_uint128.c ========== */
 
 /*
@@ -139,6 +180,23 @@ uint128_t ipaddr_to_uint128(const ipaddr_t *addr);
  */
 void ipaddr_from_uint128(ipaddr_t *addr, uint128_t val, const ipaddr_t *tmpl);
 
+/*
+ * Set result to the address n after addr, or n before it if negative,
+ * keeping its prefix length and zone.
+ * Returns 0 on success, IPADDR_ERR_USAGE if the result would be outside
+ * the address family.
+ */
+int ipaddr_add(const ipaddr_t *addr, uint128_t n, bool negative,
+               ipaddr_t *result);
+
+/*
+ * Get the distance from one address to another: *dist is |to - from| and
+ * *negative is true if to is below from.
+ * Returns 0 on success, IPADDR_ERR_USAGE if the families differ.
+ */
+int ipaddr_distance(const ipaddr_t *from, const ipaddr_t *to, uint128_t *dist,
+                    bool *negative);
+
 /*
  * Convert a 128-bit unsigned integer to a decimal string.
  * buf must be at least IPADDR_UINT128_STRLEN bytes.
@@ -222,6 +280,19 @@ int ipaddr_subnet(const ipaddr_t *addr, int new_prefix, int128_t index,
  */
 int ipaddr_super(const ipaddr_t *addr, int new_prefix, ipaddr_t *super);
 
+/*
+ * Callback for ipaddr_summarize(), called with each network in turn.
+ */
+typedef void (*ipaddr_net_fn)(const ipaddr_t *net, void *arg);
+
+/*
+ * Cover the addresses from first to last (inclusive, same family) with the
+ * fewest networks, calling fn for each in address order.
+ * Returns 0 on success, IPADDR_ERR_USAGE if the range is invalid.
+ */
+int ipaddr_summarize(const ipaddr_t *first, const ipaddr_t *last,
+                     ipaddr_net_fn fn, void *arg);
+
 /* ========== ipaddr_ipv6.c ========== */
 
 /*
@@ -279,6 +350,914 @@ bool ipaddr_contains(const ipaddr_t *a, const ipaddr_t *b);
  */
 bool ipaddr_overlaps(const ipaddr_t *a, const ipaddr_t *b);
 
+/* ========== ipaddr_mem.c ========== */
+
+/*
+ * Allocations of at least this size are backed by huge pages if possible.
+ */
+#define IPADDR_MEM_HUGE ((size_t)2 << 20)
+
+/*
+ * Allocate zeroed, cache-line aligned memory for a large table.
+ * Returns NULL on allocation failure.
+ */
+void *ipaddr_mem_alloc(size_t size);
+
+/*
+ * Free memory from ipaddr_mem_alloc().  size must be the size allocated.
+ */
+void ipaddr_mem_free(void *p, size_t size);
+
+/* ========== ipaddr_arena.c ========== */
+
+/*
+ * Bump allocator for objects that are freed together, such as everything
+ * read for one chunk of a batch.  Not thread-safe; see ipaddr_arena_thread().
+ */
+typedef struct ipaddr_arena ipaddr_arena_t;
+
+/*
+ * Create an empty arena.  Returns NULL on allocation failure.
+ */
+ipaddr_arena_t *ipaddr_arena_new(void);
+
+/*
+ * Free an arena and everything allocated from it.
+ */
+void ipaddr_arena_free(ipaddr_arena_t *arena);
+
+/*
+ * Allocate size bytes, suitably aligned for any object.
+ * Returns NULL on allocation failure.
+ */
+void *ipaddr_arena_alloc(ipaddr_arena_t *arena, size_t size);
+
+/*
+ * Copy a string into the arena.  Returns NULL on allocation failure.
+ */
+char *ipaddr_arena_strdup(ipaddr_arena_t *arena, const char *s);
+
+/*
+ * Free everything allocated from the arena, keeping its memory for reuse.
+ */
+void ipaddr_arena_reset(ipaddr_arena_t *arena);
+
+/*
+ * Get the memory held by the arena, in bytes.
+ */
+size_t ipaddr_arena_size(const ipaddr_arena_t *arena);
+
+/*
+ * Get the calling thread's arena, creating it on first use.  It is freed
+ * when the thread exits.  Returns NULL on allocation failure.
+ */
+ipaddr_arena_t *ipaddr_arena_thread(void);
+
+/* ========== ipaddr_record.c ========== */
+
+/*
+ * Address stream formats (-I and -O flags).
+ */
+#define IPADDR_FORMAT_TEXT    0  /* one address per line */
+#define IPADDR_FORMAT_BIN     1  /* binary records */
+#define IPADDR_FORMAT_ARROW   2  /* Arrow IPC stream (output only) */
+#define IPADDR_FORMAT_PARQUET 3  /* Parquet column (input only) */
+#define IPADDR_FORMAT_PCAP    4  /* pcap or pcapng capture (input only) */
+#define IPADDR_FORMAT_FLOW    5  /* NetFlow/IPFIX export (input only) */
+
+#define IPADDR_RECORD_SIZE        18      /* without extensions */
+#define IPADDR_RECORD_SCOPE       0x40    /* family flag: scope ID follows */
+#define IPADDR_RECORD_PAYLOAD     0x80    /* family flag: payload follows */
+#define IPADDR_RECORD_MAX_PAYLOAD 65535
+
+/*
+ * Write an address as a binary record, with a payload of len bytes unless
+ * payload is NULL.
+ * Returns 0 on success, IPADDR_ERR_USAGE if the payload is too long,
+ * IPADDR_ERR_INTERNAL on write errors.
+ */
+int ipaddr_record_write(FILE *fp, const ipaddr_t *addr, const void *payload,
+                        size_t len);
+
+/*
+ * Read a binary record.  If payload is not NULL, it must have room for
+ * IPADDR_RECORD_MAX_PAYLOAD + 1 bytes and receives the payload (if any)
+ * followed by a NUL; its length is stored in len if not NULL.
+ *
+ * Returns: 0 on success, IPADDR_ERR_BOOL at the end of input,
+ *          IPADDR_ERR_USAGE for malformed records, IPADDR_ERR_INTERNAL on
+ *          read errors.  errmsg is set on error.
+ */
+int ipaddr_record_read(FILE *fp, ipaddr_t *addr, char *payload, size_t *len,
+                       const char **errmsg);
+
+/* ========== ipaddr_arrow.c ========== */
+
+/*
+ * Writer of addresses as an Apache Arrow IPC stream.
+ */
+typedef struct ipaddr_arrow ipaddr_arrow_t;
+
+/*
+ * Create a writer to fp.  Returns NULL on allocation failure.
+ */
+ipaddr_arrow_t *ipaddr_arrow_new(FILE *fp);
+
+/*
+ * Free a writer.  Call ipaddr_arrow_finish() first to complete the stream.
+ */
+void ipaddr_arrow_free(ipaddr_arrow_t *w);
+
+/*
+ * Add an address as a row, with value (or NULL) in its value column.
+ * Rows are written in record batches as they fill.
+ * Returns 0 on success, IPADDR_ERR_USAGE if value is 2 GB or longer,
+ * IPADDR_ERR_INTERNAL on write or allocation errors.
+ */
+int ipaddr_arrow_add(ipaddr_arrow_t *w, const ipaddr_t *addr, const char *value);
+
+/*
+ * Check whether no row has been added yet, so that nothing, not even the
+ * schema, has been written.
+ */
+bool ipaddr_arrow_empty(const ipaddr_arrow_t *w);
+
+/*
+ * Write the remaining rows and the end-of-stream marker.
+ * Returns 0 on success, IPADDR_ERR_INTERNAL on write errors.
+ */
+int ipaddr_arrow_finish(ipaddr_arrow_t *w);
+
+/* ========== ipaddr_parquet.c ========== */
+
+/*
+ * Reader of a column of addresses from a Parquet file.
+ */
+typedef struct ipaddr_parquet ipaddr_parquet_t;
+
+/*
+ * Addresses decoded from one page of the column.  Null values have the
+ * family AF_UNSPEC and no errmsg.
+ */
+typedef struct {
+    size_t       first_row;   /* row of the first value, from 0 */
+    size_t       n;
+    ipaddr_t    *addrs;
+    const char **errmsg;      /* why a value is not an address, or NULL */
+    char       **text;        /* the value, where errmsg is set */
+} ipaddr_parquet_batch_t;
+
+/*
+ * Open the column named column of a Parquet file.
+ * Returns 0 on success, IPADDR_ERR_USAGE if the file cannot be read or
+ * the column is missing or unsupported, IPADDR_ERR_INTERNAL if out of
+ * memory.  errmsg is set on error.
+ */
+int ipaddr_parquet_open(const char *path, const char *column,
+                        ipaddr_parquet_t **pq, const char **errmsg);
+
+/*
+ * Get the next batch of the column, in row order.  Pages are decoded
+ * ahead by worker threads.  The batch is valid until the next call.
+ *
+ * Returns: 0 on success, IPADDR_ERR_BOOL after the last batch,
+ *          IPADDR_ERR_USAGE for malformed or unsupported pages,
+ *          IPADDR_ERR_INTERNAL if out of memory.  errmsg is set on error.
+ */
+int ipaddr_parquet_next(ipaddr_parquet_t *pq, const ipaddr_parquet_batch_t **batch,
+                        const char **errmsg);
+
+/*
+ * Close a reader.
+ */
+void ipaddr_parquet_close(ipaddr_parquet_t *pq);
+
+/* ========== ipaddr_pcap.c ========== */
+
+/*
+ * Reader of the IP addresses of the packets in a pcap or pcapng file.
+ */
+typedef struct ipaddr_pcap ipaddr_pcap_t;
+
+/*
+ * Addresses to read from each packet.
+ */
+#define IPADDR_PCAP_SRC   0x1
+#define IPADDR_PCAP_DST   0x2
+#define IPADDR_PCAP_BOTH  (IPADDR_PCAP_SRC | IPADDR_PCAP_DST)
+
+/*
+ * Open a capture file, reading the addresses selected by which.
+ * Returns 0 on success, IPADDR_ERR_USAGE if the file cannot be read or is
+ * not a capture of a supported link type, IPADDR_ERR_INTERNAL if out of
+ * memory.  errmsg is set on error.
+ */
+int ipaddr_pcap_open(const char *path, int which, ipaddr_pcap_t **pc,
+                     const char **errmsg);
+
+/*
+ * Get the next address, and the number of its packet (from 1).  Packets
+ * without an IPv4 or IPv6 header are skipped; with IPADDR_PCAP_BOTH, the
+ * source of a packet comes before its destination.
+ *
+ * Returns: 0 on success, IPADDR_ERR_BOOL at the end of the file,
+ *          IPADDR_ERR_USAGE if the file is truncated or malformed (packet
+ *          is then the offending packet), IPADDR_ERR_INTERNAL if out of
+ *          memory.  errmsg is set on error.
+ */
+int ipaddr_pcap_next(ipaddr_pcap_t *pc, ipaddr_t *addr, size_t *packet,
+                     const char **errmsg);
+
+/*
+ * Close a reader.  NULL is allowed.
+ */
+void ipaddr_pcap_close(ipaddr_pcap_t *pc);
+
+/* ========== ipaddr_flow.c ========== */
+
+/*
+ * Reader of the IP addresses of the flow records in a file of NetFlow v5,
+ * NetFlow v9 and IPFIX messages.
+ */
+typedef struct ipaddr_flow ipaddr_flow_t;
+
+/*
+ * Addresses to read from each record, as for ipaddr_pcap_open().  With
+ * IPADDR_FLOW_PREFIX, they carry the prefix length the exporter sent with
+ * them, if any.
+ */
+#define IPADDR_FLOW_SRC     IPADDR_PCAP_SRC
+#define IPADDR_FLOW_DST     IPADDR_PCAP_DST
+#define IPADDR_FLOW_BOTH    IPADDR_PCAP_BOTH
+#define IPADDR_FLOW_PREFIX  0x4
+
+/*
+ * Open an export file, reading the addresses selected by which.
+ * Returns 0 on success, IPADDR_ERR_USAGE if the file cannot be read,
+ * IPADDR_ERR_INTERNAL if out of memory.  errmsg is set on error.
+ */
+int ipaddr_flow_open(const char *path, int which, ipaddr_flow_t **fl,
+                     const char **errmsg);
+
+/*
+ * Get the next address, and the number of its message (from 1).  Records
+ * of templates not seen yet, or without address fields, are skipped; with
+ * IPADDR_FLOW_BOTH, the source of a record comes before its destination.
+ *
+ * Returns: 0 on success, IPADDR_ERR_BOOL at the end of the file,
+ *          IPADDR_ERR_USAGE if the file is truncated or malformed (message
+ *          is then the offending message), IPADDR_ERR_INTERNAL if out of
+ *          memory.  errmsg is set on error.
+ */
+int ipaddr_flow_next(ipaddr_flow_t *fl, ipaddr_t *addr, size_t *message,
+                     const char **errmsg);
+
+/*
+ * Close a reader.  NULL is allowed.
+ */
+void ipaddr_flow_close(ipaddr_flow_t *fl);
+
+/* ========== ipaddr_sort.c ========== */
+
+/*
+ * Sorter for address streams of any size, in ipaddr_cmp() order.  Uses at
+ * most about memory_limit bytes of memory, spilling to temporary files in
+ * $TMPDIR beyond that.
+ */
+typedef struct ipaddr_sorter ipaddr_sorter_t;
+
+/*
+ * Flags for ipaddr_sorter_new().
+ */
+#define IPADDR_SORT_UNIQ 0x1   /* drop duplicate addresses */
+
+/*
+ * Create an empty sorter.  A memory_limit of 0 selects a default.
+ * Returns NULL on allocation failure.
+ */
+ipaddr_sorter_t *ipaddr_sorter_new(size_t memory_limit, int flags);
+
+/*
+ * Free a sorter and its temporary files.
+ */
+void ipaddr_sorter_free(ipaddr_sorter_t *sorter);
+
+/*
+ * Add an address.  Returns 0 on success, IPADDR_ERR_INTERNAL (with errno
+ * set) if a spill failed, IPADDR_ERR_USAGE after ipaddr_sorter_next().
+ */
+int ipaddr_sorter_add(ipaddr_sorter_t *sorter, const ipaddr_t *addr);
+
+/*
+ * Get the next address in order.  Ends the input on the first call.
+ * Returns 0 on success, IPADDR_ERR_BOOL after the last address,
+ * IPADDR_ERR_INTERNAL (with errno set) on I/O errors.
+ */
+int ipaddr_sorter_next(ipaddr_sorter_t *sorter, ipaddr_t *addr);
+
+/* ========== ipaddr_filter.c ========== */
+
+/*
+ * Approximate membership filter over the /24 (IPv4) and /48 (IPv6) buckets
+ * covered by a set of prefixes.  May report false positives, never false
+ * negatives.
+ */
+typedef struct ipaddr_filter ipaddr_filter_t;
+
+/*
+ * Create an empty filter sized for nkeys buckets.
+ * Returns NULL on allocation failure.
+ */
+ipaddr_filter_t *ipaddr_filter_new(size_t nkeys);
+
+/*
+ * Free a filter.  NULL is allowed.
+ */
+void ipaddr_filter_free(ipaddr_filter_t *filter);
+
+/*
+ * Get the number of buckets a prefix expands into, or 0 if the prefix is too
+ * short to be filtered (its address family is then always passed).
+ */
+size_t ipaddr_filter_keys(const ipaddr_t *prefix);
+
+/*
+ * Add all buckets covered by a prefix.  May run concurrently with
+ * ipaddr_filter_maybe().
+ */
+void ipaddr_filter_add(ipaddr_filter_t *filter, const ipaddr_t *prefix);
+
+/*
+ * Check whether any added prefix may contain the address.
+ * Returns false only if no added prefix contains it.
+ */
+bool ipaddr_filter_maybe(const ipaddr_filter_t *filter, const ipaddr_t *addr);
+
+/*
+ * Prefetch the memory ipaddr_filter_maybe() will read for addr.
+ */
+void ipaddr_filter_prefetch(const ipaddr_filter_t *filter, const ipaddr_t *addr);
+
+/* ========== ipaddr_lpm.c ========== */
+
+/*
+ * Longest-prefix-match table mapping prefixes to optional string values.
+ * IPv4 and IPv6 prefixes may be mixed in one table.
+ *
+ * Lookups and walks may run concurrently with updates by one other thread.
+ * Memory unlinked by updates is held until ipaddr_lpm_reclaim(), which the
+ * updating thread may only call once no lookup that started before the
+ * updates is still running (see ipaddr_lpm_synchronize()).
+ */
+typedef struct ipaddr_lpm ipaddr_lpm_t;
+
+/*
+ * Callback for ipaddr_lpm_walk().  value is NULL for prefixes without one.
+ */
+typedef void (*ipaddr_lpm_walk_fn)(const ipaddr_t *prefix, const char *value,
+                                   void *arg);
+
+/*
+ * Create an empty table.
+ * Returns NULL on allocation failure.
+ */
+ipaddr_lpm_t *ipaddr_lpm_new(void);
+
+/*
+ * Free a table.  NULL is allowed.
+ */
+void ipaddr_lpm_free(ipaddr_lpm_t *lpm);
+
+/*
+ * Add a prefix with an optional value (NULL or "" for none).
+ * prefix must have zero host bits; re-adding a prefix replaces its value.
+ * Cost is proportional to the prefix length.
+ * Returns 0 on success, non-zero on allocation failure.
+ */
+int ipaddr_lpm_insert(ipaddr_lpm_t *lpm, const ipaddr_t *prefix,
+                      const char *value);
+
+/*
+ * Remove a prefix, pruning trie nodes that no longer lead to any prefix.
+ * prefix must have zero host bits.  Cost is proportional to the prefix length.
+ * Returns: 0 on success, IPADDR_ERR_BOOL if the prefix is not in the table.
+ */
+int ipaddr_lpm_delete(ipaddr_lpm_t *lpm, const ipaddr_t *prefix);
+
+/*
+ * Make memory retired by ipaddr_lpm_delete() and filter rebuilds available
+ * for reuse.  No lookup that started before those updates may still be
+ * running.
+ */
+void ipaddr_lpm_reclaim(ipaddr_lpm_t *lpm);
+
+/*
+ * Apply prefix table lines read from fp: "PREFIX [VALUE]" adds or replaces
+ * a prefix, "-PREFIX" withdraws one (a no-op if absent).  The value runs to
+ * the end of the line; host bits of prefixes are ignored.  Blank lines and
+ * lines starting with '#' are skipped.
+ *
+ * lineno is incremented for every line read.
+ * Returns: 0 on success, non-zero on error with errmsg set to an error
+ * message string; lines before the offending one have been applied.
+ */
+int ipaddr_lpm_read(ipaddr_lpm_t *lpm, FILE *fp, size_t *lineno,
+                    const char **errmsg);
+
+/*
+ * Parse one line of a prefix table (see ipaddr_lpm_read()) in place into
+ * its prefix and value, which points into line and is empty if there is
+ * none.  withdraw is set for a "-PREFIX" line.
+ * Returns: 0 on success, IPADDR_ERR_BOOL for a blank or comment line,
+ * IPADDR_ERR_USAGE if the prefix is invalid (errmsg set).
+ */
+int ipaddr_lpm_parse_line(char *line, ipaddr_t *prefix, const char **value,
+                          bool *withdraw, const char **errmsg);
+
+/*
+ * Load prefixes from a text file (see ipaddr_lpm_read()), or from an MRT
+ * dump (see ipaddr_lpm_load_mrt()).
+ *
+ * Returns: 0 on success, non-zero on error.
+ * On error, errmsg is set to an error message string and lineno to the
+ * offending line or MRT record (0 if the file could not be read).
+ */
+int ipaddr_lpm_load(ipaddr_lpm_t *lpm, const char *path, size_t *lineno,
+                    const char **errmsg);
+
+/*
+ * Find the longest prefix containing addr (or the whole network, if addr has
+ * a prefix length).  On a match, the prefix is stored in match (keeping the
+ * zone of addr) and its value in value.
+ *
+ * Returns: 0 on a match, IPADDR_ERR_BOOL if no prefix matches.
+ */
+int ipaddr_lpm_lookup(const ipaddr_lpm_t *lpm, const ipaddr_t *addr,
+                      ipaddr_t *match, const char **value);
+
+/*
+ * Result of one lookup of ipaddr_lpm_lookup_batch().
+ */
+typedef struct {
+    int         rc;      /* as returned by ipaddr_lpm_lookup() */
+    ipaddr_t    match;   /* set on a match */
+    const char *value;
+} ipaddr_lpm_result_t;
+
+/*
+ * Look up n addresses at once, storing the result for keys[i] in out[i].
+ * Same results as ipaddr_lpm_lookup() on each key, but the trie walks are
+ * interleaved so that their cache misses overlap.
+ *
+ * Returns: the number of keys that matched.
+ */
+size_t ipaddr_lpm_lookup_batch(const ipaddr_lpm_t *lpm, const ipaddr_t *keys,
+                               size_t n, ipaddr_lpm_result_t *out);
+
+/*
+ * Get the number of prefixes in the table.
+ */
+size_t ipaddr_lpm_count(const ipaddr_lpm_t *lpm);
+
+/*
+ * Call fn for every prefix in the table, in ipaddr_cmp() order.
+ */
+void ipaddr_lpm_walk(const ipaddr_lpm_t *lpm, ipaddr_lpm_walk_fn fn, void *arg);
+
+/*
+ * Call fn for every prefix of the smallest table that gives every address
+ * the same lookup value, or no match, as this one, in ipaddr_cmp() order.
+ * Returns 0 on success, IPADDR_ERR_INTERNAL if out of memory.
+ */
+int ipaddr_lpm_compress(const ipaddr_lpm_t *lpm, ipaddr_lpm_walk_fn fn,
+                        void *arg);
+
+/* Kinds of difference reported by ipaddr_lpm_diff() */
+#define IPADDR_LPM_ADDED    1
+#define IPADDR_LPM_REMOVED  2
+#define IPADDR_LPM_CHANGED  3   /* same prefix, other value */
+
+/*
+ * Callback for ipaddr_lpm_diff().  old_value and new_value are as for
+ * ipaddr_lpm_walk_fn, and NULL on the side the prefix is missing from.
+ */
+typedef void (*ipaddr_lpm_diff_fn)(const ipaddr_t *prefix, int kind,
+                                   const char *old_value,
+                                   const char *new_value, void *arg);
+
+/*
+ * Call fn for every prefix added, removed or given another value between
+ * tables old and new, in ipaddr_cmp() order.
+ */
+void ipaddr_lpm_diff(const ipaddr_lpm_t *old, const ipaddr_lpm_t *new,
+                     ipaddr_lpm_diff_fn fn, void *arg);
+
+/*
+ * Call fn, with a NULL value, for the fewest networks covering exactly
+ * the addresses whose ipaddr_lpm_lookup() result, prefix or value,
+ * differs between tables old and new, in ipaddr_cmp() order.
+ * Returns 0 on success, IPADDR_ERR_INTERNAL if out of memory.
+ */
+int ipaddr_lpm_diff_matches(const ipaddr_lpm_t *old, const ipaddr_lpm_t *new,
+                            ipaddr_lpm_walk_fn fn, void *arg);
+
+/*
+ * Build an ipaddr_filter over the table's prefixes, consulted by
+ * ipaddr_lpm_lookup() before walking the trie.  Worth it when most lookups
+ * miss, e.g. when checking a stream of addresses against a blocklist.
+ * Returns 0 on success, non-zero on allocation failure.
+ */
+int ipaddr_lpm_build_filter(ipaddr_lpm_t *lpm);
+
+/* ========== ipaddr_mrt.c ========== */
+
+/*
+ * Check whether a file is an MRT dump, or compressed with gzip, bzip2 or
+ * xz (and so taken for one).
+ */
+bool ipaddr_mrt_detect(const char *path);
+
+/*
+ * Add the unicast prefixes of the TABLE_DUMP_V2 RIB records of an MRT dump,
+ * each with the origin AS of its first route as value ("AS64500"), or none
+ * if no route has an AS path.  Compressed dumps are decompressed by gzip,
+ * bzip2 or xz, found in $PATH.
+ *
+ * record is set to the number of records read.
+ * Returns: 0 on success, IPADDR_ERR_USAGE if the dump cannot be read or is
+ * malformed, IPADDR_ERR_INTERNAL if out of memory.  errmsg is set on error.
+ */
+int ipaddr_lpm_load_mrt(ipaddr_lpm_t *lpm, const char *path, size_t *record,
+                        const char **errmsg);
+
+/* ========== ipaddr_reload.c ========== */
+
+/*
+ * Handle on a prefix table loaded from a file.  The table may be replaced
+ * while other threads look up addresses in it; readers never block.
+ */
+typedef struct ipaddr_lpm_handle ipaddr_lpm_handle_t;
+
+/*
+ * Flags for ipaddr_lpm_open().
+ */
+#define IPADDR_LPM_FILTER  0x1   /* build a lookup prefilter */
+#define IPADDR_LPM_WATCH   0x2   /* reload when the file changes */
+
+/*
+ * Open a handle on the prefix table loaded from path (see ipaddr_lpm_load()).
+ * With IPADDR_LPM_WATCH, a background thread reloads the table whenever the
+ * file changes; a file that fails to load is reported on stderr and the
+ * previous table stays in use.
+ *
+ * Returns: 0 on success, non-zero on error (errmsg and lineno as for
+ * ipaddr_lpm_load()).
+ */
+int ipaddr_lpm_open(const char *path, int flags, ipaddr_lpm_handle_t **handle,
+                    size_t *lineno, const char **errmsg);
+
+/*
+ * Stop watching and free the handle and its table.  NULL is allowed.
+ * No reader may hold the table.
+ */
+void ipaddr_lpm_close(ipaddr_lpm_handle_t *handle);
+
+/*
+ * Pin the current table for reading.  The table, and values returned by
+ * lookups in it, stay valid until ipaddr_lpm_release() with the same token.
+ */
+const ipaddr_lpm_t *ipaddr_lpm_acquire(ipaddr_lpm_handle_t *handle,
+                                       unsigned *token);
+
+/*
+ * Unpin a table pinned by ipaddr_lpm_acquire().
+ */
+void ipaddr_lpm_release(ipaddr_lpm_handle_t *handle, unsigned token);
+
+/*
+ * Replace the table of a handle.  The handle takes ownership of lpm; the old
+ * table is freed once no reader can still hold it, which this call waits for.
+ */
+void ipaddr_lpm_replace(ipaddr_lpm_handle_t *handle, ipaddr_lpm_t *lpm);
+
+/*
+ * Add or replace a prefix in the table of a handle, in place.  Readers see
+ * the update as soon as this returns and never wait for it.
+ * Returns 0 on success, non-zero on allocation failure.
+ */
+int ipaddr_lpm_update(ipaddr_lpm_handle_t *handle, const ipaddr_t *prefix,
+                      const char *value);
+
+/*
+ * Withdraw a prefix from the table of a handle, in place.
+ * Returns: 0 on success, IPADDR_ERR_BOOL if the prefix is not in the table.
+ */
+int ipaddr_lpm_withdraw(ipaddr_lpm_handle_t *handle, const ipaddr_t *prefix);
+
+/*
+ * Wait until no reader can hold memory retired by earlier updates and
+ * reclaim it.  Call after a batch of updates to bound memory use.
+ */
+void ipaddr_lpm_synchronize(ipaddr_lpm_handle_t *handle);
+
+/* ========== ipaddr_pool.c ========== */
+
+/*
+ * Subnet allocator over a network, with buddy-system free lists.
+ */
+typedef struct ipaddr_pool ipaddr_pool_t;
+
+/*
+ * Create a pool with all of net free.
+ * Returns NULL on allocation failure.
+ */
+ipaddr_pool_t *ipaddr_pool_new(const ipaddr_t *net);
+
+/*
+ * Free a pool.  NULL is allowed.
+ */
+void ipaddr_pool_free(ipaddr_pool_t *pool);
+
+/*
+ * Mark a subnet of the pool allocated.
+ * Returns: 0 on success, IPADDR_ERR_BOOL if it overlaps an allocation,
+ * IPADDR_ERR_USAGE if it is not within the pool, IPADDR_ERR_INTERNAL on
+ * allocation failure.
+ */
+int ipaddr_pool_reserve(ipaddr_pool_t *pool, const ipaddr_t *block);
+
+/*
+ * Allocate a subnet of prefix length prefix_len: the lowest one within the
+ * smallest free block that fits.
+ * Returns: 0 on success, IPADDR_ERR_BOOL if no free block fits,
+ * IPADDR_ERR_USAGE if prefix_len is out of range for the pool,
+ * IPADDR_ERR_INTERNAL on allocation failure.
+ */
+int ipaddr_pool_alloc(ipaddr_pool_t *pool, int prefix_len, ipaddr_t *block);
+
+/*
+ * Free an allocated subnet, merging it with its free buddies.  merged, if
+ * not NULL, is set to the free block it ended up in.
+ * Returns: 0 on success, IPADDR_ERR_BOOL if block is not allocated,
+ * IPADDR_ERR_INTERNAL on allocation failure.
+ */
+int ipaddr_pool_release(ipaddr_pool_t *pool, const ipaddr_t *block,
+                        ipaddr_t *merged);
+
+/*
+ * Allocate count subnets of prefix length prefix_len from the pool net,
+ * recording them in the state file at path (created if missing), and call
+ * fn with each once they are recorded.  Either all are allocated or none.
+ *
+ * Returns: 0 on success, IPADDR_ERR_BOOL if the pool has too little free
+ * space, IPADDR_ERR_USAGE if the state file cannot be read or prefix_len
+ * is out of range (errmsg and lineno as for ipaddr_lpm_load()),
+ * IPADDR_ERR_INTERNAL on allocation or write failure (errmsg set).
+ */
+int ipaddr_pool_state_alloc(const char *path, const ipaddr_t *net,
+                            int prefix_len, size_t count, ipaddr_net_fn fn,
+                            void *arg, size_t *lineno, const char **errmsg);
+
+/*
+ * Free a subnet recorded in the state file at path.  merged is set to the
+ * free block of its pool it ended up in.
+ * Returns: 0 on success, IPADDR_ERR_BOOL if block is not allocated, other
+ * errors as for ipaddr_pool_state_alloc().
+ */
+int ipaddr_pool_state_release(const char *path, const ipaddr_t *block,
+                              ipaddr_t *merged, size_t *lineno,
+                              const char **errmsg);
+
+/*
+ * A subnet requested of ipaddr_pool_plan().
+ */
+typedef struct {
+    int         prefix_len;   /* size requested */
+    const char *label;        /* for the caller; not used */
+    ipaddr_t    net;          /* subnet assigned */
+} ipaddr_plan_request_t;
+
+/*
+ * Assign aligned, non-overlapping subnets of net to n requests, largest
+ * first, each taking the best fit from the free lists of a pool.
+ * Returns: 0 on success, IPADDR_ERR_BOOL if the requests do not fit
+ * (failed is set to the index of the first one left out),
+ * IPADDR_ERR_USAGE if a prefix length is out of range for net (failed set
+ * as well), IPADDR_ERR_INTERNAL on allocation failure.
+ */
+int ipaddr_pool_plan(const ipaddr_t *net, ipaddr_plan_request_t *reqs,
+                     size_t n, size_t *failed);
+
+/* ========== ipaddr_inventory.c ========== */
+
+/*
+ * List of networks with optional labels, in input order.
+ */
+typedef struct ipaddr_inventory ipaddr_inventory_t;
+
+/*
+ * Create an empty inventory.
+ * Returns NULL on allocation failure.
+ */
+ipaddr_inventory_t *ipaddr_inventory_new(void);
+
+/*
+ * Free an inventory.  NULL is allowed.
+ */
+void ipaddr_inventory_free(ipaddr_inventory_t *inv);
+
+/*
+ * Get the number of networks in the inventory.
+ */
+size_t ipaddr_inventory_count(const ipaddr_inventory_t *inv);
+
+/*
+ * Add the network of net with an optional label (NULL or "" for none).
+ * Returns 0 on success, non-zero on allocation failure.
+ */
+int ipaddr_inventory_add(ipaddr_inventory_t *inv, const ipaddr_t *net,
+                         const char *label);
+
+/*
+ * Add networks from "NETWORK [LABEL]" lines read from a stream.  Blank
+ * lines and lines starting with # are skipped.  lineno is advanced past
+ * each line read.
+ * Returns: 0 on success, non-zero on error (errmsg set).
+ */
+int ipaddr_inventory_read(ipaddr_inventory_t *inv, FILE *fp, size_t *lineno,
+                          const char **errmsg);
+
+/*
+ * Add networks from a file (see ipaddr_inventory_read()).
+ */
+int ipaddr_inventory_load(ipaddr_inventory_t *inv, const char *path,
+                          size_t *lineno, const char **errmsg);
+
+/*
+ * Callback for ipaddr_inventory_conflicts(), called with a network and
+ * one it contains or equals.  Labels are NULL for networks without one.
+ */
+typedef void (*ipaddr_conflict_fn)(const ipaddr_t *outer, const char *outer_label,
+                                   const ipaddr_t *inner, const char *inner_label,
+                                   void *arg);
+
+/*
+ * Call fn for every pair of overlapping networks in the inventory, ordered
+ * by the inner network (in ipaddr_cmp() order, then input order) and then
+ * from the widest outer network in.  Reorders the inventory.
+ * Returns 0 on success, non-zero on allocation failure.
+ */
+int ipaddr_inventory_conflicts(ipaddr_inventory_t *inv, ipaddr_conflict_fn fn,
+                               void *arg);
+
+/*
+ * How much of a supernet the networks of an inventory cover.  Address
+ * counts saturate at the largest uint128_t, as ipaddr_num_addresses() does.
+ */
+typedef struct {
+    uint128_t total;        /* addresses in the supernet */
+    uint128_t covered;      /* addresses in at least one network */
+    size_t    holes;        /* networks covering the rest */
+    int       largest;      /* prefix length of the largest hole, -1 if none */
+    size_t    by_len[129];  /* holes by prefix length */
+} ipaddr_coverage_t;
+
+/*
+ * Measure the coverage of a supernet by the inventory in one sweep over the
+ * sorted networks, calling fn with each of the fewest networks covering the
+ * addresses left uncovered, in address order.  Reorders the inventory.
+ * Returns 0 on success.
+ */
+int ipaddr_inventory_coverage(ipaddr_inventory_t *inv, const ipaddr_t *super,
+                              ipaddr_net_fn fn, void *arg,
+                              ipaddr_coverage_t *cov);
+
+/* ========== ipaddr_heatmap.c ========== */
+
+/*
+ * Counts of addresses in the cells of a network, drawn as an image along a
+ * Hilbert curve, one pixel per cell.
+ */
+typedef struct ipaddr_heatmap ipaddr_heatmap_t;
+
+/* Most bits between the network and cell prefixes: 4096 x 4096 pixels */
+#define IPADDR_HEATMAP_MAX_BITS 24
+
+/*
+ * Image formats for ipaddr_heatmap_write().
+ */
+#define IPADDR_HEATMAP_PPM 0   /* binary PPM (P6) */
+#define IPADDR_HEATMAP_PNG 1   /* 8-bit indexed-color PNG */
+
+/*
+ * Create an empty map of net with cells of prefix_len, which must be an
+ * even number of bits, at most IPADDR_HEATMAP_MAX_BITS, longer than the
+ * prefix of net.  Returns NULL for other lengths or on allocation failure.
+ */
+ipaddr_heatmap_t *ipaddr_heatmap_new(const ipaddr_t *net, int prefix_len);
+
+/*
+ * Free a map.
+ */
+void ipaddr_heatmap_free(ipaddr_heatmap_t *map);
+
+/*
+ * Count an address in its cell.  Addresses outside the network are
+ * ignored.
+ */
+void ipaddr_heatmap_add(ipaddr_heatmap_t *map, const ipaddr_t *addr);
+
+/*
+ * Draw the map to fp in a format of IPADDR_HEATMAP_*, cells without
+ * addresses in black and the others from blue to red on a log scale.
+ * Returns 0 on success, IPADDR_ERR_INTERNAL (with errno set) on
+ * allocation or write errors.
+ */
+int ipaddr_heatmap_write(const ipaddr_heatmap_t *map, int format, FILE *fp);
+
+/* ========== ipaddr_random.c ========== */
+
+/* Rounds of the Feistel network behind random host orders */
+#define IPADDR_HOSTS_ROUNDS 6
+
+/*
+ * Enumeration of the hosts of a network, in address order or in a random
+ * order given by a seed, in constant memory.  The fields are private.
+ */
+typedef struct {
+    ipaddr_t  net;          /* network address, with its zone */
+    uint128_t next;         /* next position in the order */
+    uint128_t last;         /* last position in the order */
+    uint64_t  step;         /* number of shards */
+    uint64_t  keys[IPADDR_HOSTS_ROUNDS];
+    int       host_bits;
+    int       half_bits;    /* of the Feistel network */
+    bool      random;
+    bool      done;
+} ipaddr_hosts_t;
+
+/*
+ * Start enumerating every address of net (regardless of host bits), or
+ * only shard 0 to shards - 1 of them: every shards-th address of the order
+ * from the shard-th.  The shards of one order, in address order or random
+ * with one seed, cover the network exactly once.
+ */
+void ipaddr_hosts_init(ipaddr_hosts_t *it, const ipaddr_t *net, bool random,
+                       uint64_t seed, uint64_t shard, uint64_t shards);
+
+/*
+ * Get the next address of an enumeration.  Returns 0 on success,
+ * IPADDR_ERR_BOOL after the last one.
+ */
+int ipaddr_hosts_next(ipaddr_hosts_t *it, ipaddr_t *host);
+
+/*
+ * Get the number of integers ipaddr_sample() needs in values for a sample
+ * of n, or 0 if that is more than memory can hold.
+ */
+size_t ipaddr_sample_room(size_t n);
+
+/*
+ * Choose n distinct addresses of net uniformly at random, in random order,
+ * as integers into the first n of values, from the given seed.  values
+ * must have room for ipaddr_sample_room(n) integers; the rest is scratch
+ * space, so that repeated samples need not allocate.  Returns 0 on
+ * success, IPADDR_ERR_BOOL if net has fewer than n addresses.
+ */
+int ipaddr_sample(const ipaddr_t *net, size_t n, uint64_t seed,
+                  uint128_t *values);
+
+/*
+ * Uniform sample of k addresses of a stream, or of k addresses of each
+ * network of a prefix length in the stream.
+ */
+typedef struct ipaddr_reservoir ipaddr_reservoir_t;
+
+/*
+ * Create an empty reservoir keeping k > 0 addresses, of each network of
+ * prefix_len (or of each address, past its length), or of the whole
+ * stream if prefix_len is -1.  Returns NULL on allocation failure.
+ */
+ipaddr_reservoir_t *ipaddr_reservoir_new(size_t k, int prefix_len,
+                                         uint64_t seed);
+
+/*
+ * Free a reservoir.
+ */
+void ipaddr_reservoir_free(ipaddr_reservoir_t *r);
+
+/*
+ * Offer the next address of the stream.  Returns 0 on success,
+ * IPADDR_ERR_INTERNAL on allocation failure.
+ */
+int ipaddr_reservoir_add(ipaddr_reservoir_t *r, const ipaddr_t *addr);
+
+/*
+ * Call fn for each address kept, network by network in address order.
+ * Returns 0 on success, IPADDR_ERR_INTERNAL on allocation failure.
+ */
+int ipaddr_reservoir_walk(ipaddr_reservoir_t *r, ipaddr_net_fn fn, void *arg);
+
 /* ========== Utility functions ========== */
 
 /*
@@ -0,0 +1,160 @@
+/*
+ * ipaddr_arena.c - Bump allocator for short-lived batch objects
+ *
+ * An arena hands out memory from large blocks by bumping a pointer and
+ * frees it all at once.  Resetting keeps the blocks for reuse, so code that
+ * resets its arena once per chunk of input stops allocating after the first
+ * few chunks and uses a fixed amount of memory from then on.
+ */
+
+#include "ipaddr.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#define ARENA_BLOCK_SIZE ((size_t)64 << 10)   /* first block */
+#define ARENA_ALIGN      16                   /* max_align_t on common ABIs */
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t              size;   /* including this header */
+    size_t              used;
+} arena_block_t;
+
+struct ipaddr_arena {
+    arena_block_t *first;
+    arena_block_t *current;   /* blocks after it are free */
+    size_t         size;      /* total size of all blocks */
+};
+
+static pthread_once_t thread_arena_once = PTHREAD_ONCE_INIT;
+static pthread_key_t  thread_arena_key;
+
+/*
+ * Get the size of a block header, rounded up to keep allocations aligned.
+ */
+static size_t header_size(void)
+{
+    return (sizeof(arena_block_t) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+ipaddr_arena_t *ipaddr_arena_new(void)
+{
+    return calloc(1, sizeof(ipaddr_arena_t));
+}
+
+void ipaddr_arena_free(ipaddr_arena_t *arena)
+{
+    if (arena == NULL)
+        return;
+
+    arena_block_t *block = arena->first;
+    while (block != NULL) {
+        arena_block_t *next = block->next;
+        ipaddr_mem_free(block, block->size);
+        block = next;
+    }
+    free(arena);
+}
+
+/*
+ * Append a block with room for at least size bytes after the current one.
+ * Blocks double in size so that the number of blocks stays small.
+ */
+static arena_block_t *add_block(ipaddr_arena_t *arena, size_t size)
+{
+    size_t block_size = arena->size ? arena->size : ARENA_BLOCK_SIZE;
+    if (block_size < header_size() + size)
+        block_size = header_size() + size;
+
+    arena_block_t *block = ipaddr_mem_alloc(block_size);
+    if (block == NULL)
+        return NULL;
+    block->size = block_size;
+    block->used = header_size();
+
+    /* Insert after current, ahead of the free blocks */
+    if (arena->current == NULL) {
+        block->next = arena->first;
+        arena->first = block;
+    } else {
+        block->next = arena->current->next;
+        arena->current->next = block;
+    }
+    arena->current = block;
+    arena->size += block_size;
+    return block;
+}
+
+void *ipaddr_arena_alloc(ipaddr_arena_t *arena, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    arena_block_t *block = arena->current;
+    if (block != NULL && block->size - block->used < size) {
+        /* Move on to the next free block large enough */
+        block = block->next;
+        while (block != NULL && block->size - header_size() < size)
+            block = block->next;
+        if (block != NULL) {
+            block->used = header_size();
+            arena->current = block;
+        }
+    }
+    if (block == NULL) {
+        block = add_block(arena, size);
+        if (block == NULL)
+            return NULL;
+    }
+
+    void *p = (char *)block + block->used;
+    block->used += size;
+    return p;
+}
+
+char *ipaddr_arena_strdup(ipaddr_arena_t *arena, const char *s)
+{
+    size_t len = strlen(s) + 1;
+    char *copy = ipaddr_arena_alloc(arena, len);
+    if (copy != NULL)
+        memcpy(copy, s, len);
+    return copy;
+}
+
+void ipaddr_arena_reset(ipaddr_arena_t *arena)
+{
+    arena->current = arena->first;
+    if (arena->first != NULL)
+        arena->first->used = header_size();
+}
+
+size_t ipaddr_arena_size(const ipaddr_arena_t *arena)
+{
+    return arena->size;
+}
+
+static void destroy_thread_arena(void *arena)
+{
+    ipaddr_arena_free(arena);
+}
+
+static void create_thread_arena_key(void)
+{
+    pthread_key_create(&thread_arena_key, destroy_thread_arena);
+}
+
+ipaddr_arena_t *ipaddr_arena_thread(void)
+{
+    pthread_once(&thread_arena_once, create_thread_arena_key);
+
+    ipaddr_arena_t *arena = pthread_getspecific(thread_arena_key);
+    if (arena == NULL) {
+        arena = ipaddr_arena_new();
+        if (arena != NULL && pthread_setspecific(thread_arena_key, arena) != 0) {
+            ipaddr_arena_free(arena);
+            arena = NULL;
+        }
+    }
+    return arena;
+}
@@ -0,0 +1,552 @@
+/*
+ * ipaddr_arrow.c - Apache Arrow IPC stream output
+ *
+ * Addresses are collected into columns and written as record batches of
+ * up to ARROW_BATCH_ROWS rows in the Arrow IPC streaming format:
+ *
+ *   address        fixed_size_binary(16)  128-bit big-endian, as in records
+ *   version        uint8                  4 or 6
+ *   prefix_length  uint8                  null without a prefix
+ *   scope_id       uint32                 null without a zone
+ *   value          utf8                   lookup value, or null
+ *   is_*           bool                   classification flags
+ *
+ * The flatbuffer metadata of the messages is small and has a fixed shape,
+ * so it is built with the minimal builder below rather than a library.
+ */
+
+#include "ipaddr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ARROW_BATCH_ROWS   65536
+#define ARROW_FB_SIZE      4096   /* largest message metadata */
+#define ARROW_FB_FIELDS    8      /* most fields in a metadata table */
+#define ARROW_CONTINUATION 0xffffffffu
+#define ARROW_V5           4      /* MetadataVersion */
+
+/* MessageHeader union */
+#define ARROW_MSG_SCHEMA       1
+#define ARROW_MSG_RECORD_BATCH 3
+
+/* Type union */
+#define ARROW_TYPE_INT         2
+#define ARROW_TYPE_UTF8        5
+#define ARROW_TYPE_BOOL        6
+#define ARROW_TYPE_FIXED       15
+
+/*
+ * Classification flags, one bool column each.
+ */
+static const struct {
+    const char *name;
+    bool      (*test)(const ipaddr_t *addr);
+} arrow_flags[] = {
+    { "is_private",    ipaddr_is_private },
+    { "is_global",     ipaddr_is_global },
+    { "is_multicast",  ipaddr_is_multicast },
+    { "is_loopback",   ipaddr_is_loopback },
+    { "is_link_local", ipaddr_is_link_local },
+    { "is_reserved",   ipaddr_is_reserved },
+};
+
+#define ARROW_NFLAGS (sizeof(arrow_flags) / sizeof(arrow_flags[0]))
+
+/* Nullable columns */
+enum { NULL_PREFIX, NULL_SCOPE, NULL_VALUE, ARROW_NNULLABLE };
+
+struct ipaddr_arrow {
+    FILE     *fp;
+    bool      started;          /* schema written */
+    size_t    rows;             /* rows in the current batch */
+    uint8_t  *addr;             /* 16 bytes per row */
+    uint8_t  *version;
+    uint8_t  *prefix;
+    uint8_t  *scope;            /* 4 bytes per row, little-endian */
+    uint8_t  *value_offsets;    /* int32 per row + 1, little-endian */
+    char     *values;
+    size_t    values_len;
+    size_t    values_cap;
+    uint8_t  *valid[ARROW_NNULLABLE];   /* validity bitmaps */
+    size_t    nulls[ARROW_NNULLABLE];
+    uint8_t  *flags[ARROW_NFLAGS];      /* bitmaps */
+};
+
+/* ========== Flatbuffer builder ========== */
+
+/*
+ * Flatbuffers are built back to front: objects are prepended, and
+ * referred to by their distance from the end of the buffer.
+ */
+typedef struct {
+    uint8_t  buf[ARROW_FB_SIZE];
+    size_t   head;                      /* start of data in buf */
+    size_t   minalign;
+    bool     overflow;
+    size_t   table_start;               /* size when the table began */
+    uint32_t fields[ARROW_FB_FIELDS];   /* field positions, 0 if absent */
+    int      nfields;
+} fb_t;
+
+static size_t fb_size(const fb_t *fb)
+{
+    return ARROW_FB_SIZE - fb->head;
+}
+
+static void fb_push(fb_t *fb, const void *data, size_t n)
+{
+    if (n > fb->head) {
+        fb->overflow = true;
+        return;
+    }
+    fb->head -= n;
+    memcpy(fb->buf + fb->head, data, n);
+}
+
+/*
+ * Pad so that the buffer is aligned to align once extra bytes are pushed.
+ */
+static void fb_align(fb_t *fb, size_t align, size_t extra)
+{
+    static const uint8_t zeros[8];
+
+    if (align > fb->minalign)
+        fb->minalign = align;
+    fb_push(fb, zeros, (align - (fb_size(fb) + extra) % align) % align);
+}
+
+/*
+ * Push an aligned little-endian scalar of n bytes.
+ */
+static void fb_scalar(fb_t *fb, uint64_t v, size_t n)
+{
+    uint8_t le[8];
+    for (size_t i = 0; i < n; i++)
+        le[i] = (uint8_t)(v >> (8 * i));
+    fb_align(fb, n, 0);
+    fb_push(fb, le, n);
+}
+
+/*
+ * Push a reference to the object at off.
+ */
+static void fb_offset(fb_t *fb, uint32_t off)
+{
+    fb_align(fb, 4, 0);
+    fb_scalar(fb, fb_size(fb) + 4 - off, 4);
+}
+
+static uint32_t fb_string(fb_t *fb, const char *s)
+{
+    size_t len = strlen(s);
+    fb_align(fb, 4, len + 1);
+    fb_push(fb, "", 1);
+    fb_push(fb, s, len);
+    fb_scalar(fb, len, 4);
+    return fb_size(fb);
+}
+
+static uint32_t fb_offsets(fb_t *fb, const uint32_t *offs, size_t n)
+{
+    fb_align(fb, 4, 4 * n);
+    for (size_t i = n; i > 0; i--)
+        fb_offset(fb, offs[i - 1]);
+    fb_scalar(fb, n, 4);
+    return fb_size(fb);
+}
+
+/*
+ * Push a vector of structs made of n 64-bit fields in total.
+ */
+static uint32_t fb_structs(fb_t *fb, const int64_t *vals, size_t n, size_t count)
+{
+    fb_align(fb, 4, 8 * n);
+    fb_align(fb, 8, 8 * n);
+    for (size_t i = n; i > 0; i--)
+        fb_scalar(fb, (uint64_t)vals[i - 1], 8);
+    fb_scalar(fb, count, 4);
+    return fb_size(fb);
+}
+
+static void fb_start(fb_t *fb)
+{
+    memset(fb->fields, 0, sizeof(fb->fields));
+    fb->nfields = 0;
+    fb->table_start = fb_size(fb);
+}
+
+static void fb_set(fb_t *fb, int id)
+{
+    fb->fields[id] = fb_size(fb);
+    if (id >= fb->nfields)
+        fb->nfields = id + 1;
+}
+
+static void fb_add(fb_t *fb, int id, uint64_t v, size_t n)
+{
+    fb_scalar(fb, v, n);
+    fb_set(fb, id);
+}
+
+static void fb_add_offset(fb_t *fb, int id, uint32_t off)
+{
+    fb_offset(fb, off);
+    fb_set(fb, id);
+}
+
+/*
+ * End a table, prepending its vtable.
+ */
+static uint32_t fb_end(fb_t *fb)
+{
+    fb_scalar(fb, 0, 4);
+    uint32_t table = fb_size(fb);
+
+    for (int id = fb->nfields - 1; id >= 0; id--)
+        fb_scalar(fb, fb->fields[id] ? table - fb->fields[id] : 0, 2);
+    fb_scalar(fb, table - fb->table_start, 2);
+    fb_scalar(fb, 4 + 2 * fb->nfields, 2);
+
+    /* The table refers back to its vtable */
+    uint32_t vtable = fb_size(fb) - table;
+    if (!fb->overflow) {
+        uint8_t *p = fb->buf + ARROW_FB_SIZE - table;
+        for (int i = 0; i < 4; i++)
+            p[i] = (uint8_t)(vtable >> (8 * i));
+    }
+    return table;
+}
+
+static void fb_finish(fb_t *fb, uint32_t root)
+{
+    fb_align(fb, fb->minalign, 4);
+    fb_offset(fb, root);
+}
+
+/*
+ * Start a Message table around a header.
+ */
+static uint32_t fb_message(fb_t *fb, int type, uint32_t header, int64_t body_len)
+{
+    fb_start(fb);
+    fb_add(fb, 3, (uint64_t)body_len, 8);   /* bodyLength */
+    fb_add_offset(fb, 2, header);           /* header */
+    fb_add(fb, 0, ARROW_V5, 2);             /* version */
+    fb_add(fb, 1, (uint64_t)type, 1);       /* header_type */
+    return fb_end(fb);
+}
+
+/* ========== Messages ========== */
+
+/*
+ * Write an encapsulated message: metadata, then a body of body_len bytes
+ * from the given buffers, each padded to 8 bytes.
+ */
+static int write_message(ipaddr_arrow_t *w, fb_t *fb, const void *const *bufs,
+                         const int64_t *lens, size_t nbufs)
+{
+    static const uint8_t zeros[8];
+    uint8_t prefix[8];
+    uint32_t meta_len = fb_size(fb);
+
+    if (fb->overflow)
+        return IPADDR_ERR_INTERNAL;
+    for (int i = 0; i < 4; i++) {
+        prefix[i] = (uint8_t)(ARROW_CONTINUATION >> (8 * i));
+        prefix[4 + i] = (uint8_t)(meta_len >> (8 * i));
+    }
+    if (fwrite(prefix, 1, 8, w->fp) != 8 ||
+        fwrite(fb->buf + fb->head, 1, meta_len, w->fp) != meta_len)
+        return IPADDR_ERR_INTERNAL;
+
+    for (size_t i = 0; i < nbufs; i++) {
+        size_t len = (size_t)lens[i];
+        if (len > 0 && fwrite(bufs[i], 1, len, w->fp) != len)
+            return IPADDR_ERR_INTERNAL;
+        if (fwrite(zeros, 1, (8 - len % 8) % 8, w->fp) != (8 - len % 8) % 8)
+            return IPADDR_ERR_INTERNAL;
+    }
+    return IPADDR_OK;
+}
+
+/*
+ * Add a Field of the given type to the schema being built.
+ */
+static uint32_t schema_field(fb_t *fb, const char *name, bool nullable,
+                             int type, int bits)
+{
+    uint32_t children = fb_offsets(fb, NULL, 0);
+    uint32_t name_off = fb_string(fb, name);
+
+    fb_start(fb);
+    if (type == ARROW_TYPE_INT) {
+        fb_add(fb, 0, (uint64_t)bits, 4);   /* bitWidth */
+        fb_add(fb, 1, 0, 1);                /* is_signed */
+    } else if (type == ARROW_TYPE_FIXED) {
+        fb_add(fb, 0, (uint64_t)bits / 8, 4);   /* byteWidth */
+    }
+    uint32_t type_off = fb_end(fb);
+
+    fb_start(fb);
+    fb_add_offset(fb, 0, name_off);
+    fb_add_offset(fb, 3, type_off);
+    fb_add_offset(fb, 5, children);
+    fb_add(fb, 1, nullable, 1);
+    fb_add(fb, 2, (uint64_t)type, 1);
+    return fb_end(fb);
+}
+
+static int write_schema(ipaddr_arrow_t *w)
+{
+    fb_t fb = { .head = ARROW_FB_SIZE, .minalign = 1 };
+    uint32_t fields[5 + ARROW_NFLAGS];
+    size_t n = 0;
+
+    fields[n++] = schema_field(&fb, "address", false, ARROW_TYPE_FIXED, 128);
+    fields[n++] = schema_field(&fb, "version", false, ARROW_TYPE_INT, 8);
+    fields[n++] = schema_field(&fb, "prefix_length", true, ARROW_TYPE_INT, 8);
+    fields[n++] = schema_field(&fb, "scope_id", true, ARROW_TYPE_INT, 32);
+    fields[n++] = schema_field(&fb, "value", true, ARROW_TYPE_UTF8, 0);
+    for (size_t i = 0; i < ARROW_NFLAGS; i++)
+        fields[n++] = schema_field(&fb, arrow_flags[i].name, false, ARROW_TYPE_BOOL, 0);
+    uint32_t vec = fb_offsets(&fb, fields, n);
+
+    fb_start(&fb);
+    fb_add_offset(&fb, 1, vec);     /* fields */
+    fb_add(&fb, 0, 0, 2);           /* endianness: Little */
+    uint32_t schema = fb_end(&fb);
+
+    fb_finish(&fb, fb_message(&fb, ARROW_MSG_SCHEMA, schema, 0));
+    return write_message(w, &fb, NULL, NULL, 0);
+}
+
+/*
+ * Get the size of a bitmap for n rows.
+ */
+static size_t bitmap_size(size_t n)
+{
+    return (n + 7) / 8;
+}
+
+/*
+ * Write the rows collected so far as a record batch.
+ */
+static int write_batch(ipaddr_arrow_t *w)
+{
+    size_t n = w->rows;
+    const void *bufs[3 * (5 + ARROW_NFLAGS)];
+    int64_t lens[3 * (5 + ARROW_NFLAGS)];
+    int64_t nodes[2 * (5 + ARROW_NFLAGS)];
+    size_t nbufs = 0, nnodes = 0;
+
+/* Add a column: its node, validity bitmap (if it has nulls) and buffers */
+#define COLUMN(nulls, validity)                                 \
+    do {                                                        \
+        nodes[nnodes++] = (int64_t)n;                           \
+        nodes[nnodes++] = (int64_t)(nulls);                     \
+        bufs[nbufs] = (validity);                               \
+        lens[nbufs++] = (nulls) ? (int64_t)bitmap_size(n) : 0;  \
+    } while (0)
+#define BUFFER(p, len)                                          \
+    do {                                                        \
+        bufs[nbufs] = (p);                                      \
+        lens[nbufs++] = (int64_t)(len);                         \
+    } while (0)
+
+    COLUMN(0, NULL);
+    BUFFER(w->addr, 16 * n);
+    COLUMN(0, NULL);
+    BUFFER(w->version, n);
+    COLUMN(w->nulls[NULL_PREFIX], w->valid[NULL_PREFIX]);
+    BUFFER(w->prefix, n);
+    COLUMN(w->nulls[NULL_SCOPE], w->valid[NULL_SCOPE]);
+    BUFFER(w->scope, 4 * n);
+    COLUMN(w->nulls[NULL_VALUE], w->valid[NULL_VALUE]);
+    BUFFER(w->value_offsets, 4 * (n + 1));
+    BUFFER(w->values, w->values_len);
+    for (size_t i = 0; i < ARROW_NFLAGS; i++) {
+        COLUMN(0, NULL);
+        BUFFER(w->flags[i], bitmap_size(n));
+    }
+
+#undef COLUMN
+#undef BUFFER
+
+    /* Buffer offsets within the body */
+    int64_t spans[2 * 3 * (5 + ARROW_NFLAGS)];
+    int64_t body_len = 0;
+    for (size_t i = 0; i < nbufs; i++) {
+        spans[2 * i] = body_len;
+        spans[2 * i + 1] = lens[i];
+        body_len += (lens[i] + 7) & ~(int64_t)7;
+    }
+
+    fb_t fb = { .head = ARROW_FB_SIZE, .minalign = 1 };
+    uint32_t buffers = fb_structs(&fb, spans, 2 * nbufs, nbufs);
+    uint32_t node_vec = fb_structs(&fb, nodes, nnodes, nnodes / 2);
+
+    fb_start(&fb);
+    fb_add(&fb, 0, n, 8);               /* length */
+    fb_add_offset(&fb, 1, node_vec);    /* nodes */
+    fb_add_offset(&fb, 2, buffers);     /* buffers */
+    uint32_t batch = fb_end(&fb);
+
+    fb_finish(&fb, fb_message(&fb, ARROW_MSG_RECORD_BATCH, batch, body_len));
+    return write_message(w, &fb, bufs, lens, nbufs);
+}
+
+/*
+ * Write the schema if not done yet, and the current batch if not empty.
+ */
+static int flush_batch(ipaddr_arrow_t *w)
+{
+    int rc;
+
+    if (!w->started) {
+        rc = write_schema(w);
+        if (rc != IPADDR_OK)
+            return rc;
+        w->started = true;
+    }
+    if (w->rows == 0)
+        return IPADDR_OK;
+
+    rc = write_batch(w);
+    w->rows = 0;
+    w->values_len = 0;
+    for (int i = 0; i < ARROW_NNULLABLE; i++) {
+        memset(w->valid[i], 0, bitmap_size(ARROW_BATCH_ROWS));
+        w->nulls[i] = 0;
+    }
+    for (size_t i = 0; i < ARROW_NFLAGS; i++)
+        memset(w->flags[i], 0, bitmap_size(ARROW_BATCH_ROWS));
+    return rc;
+}
+
+/* ========== Public interface ========== */
+
+ipaddr_arrow_t *ipaddr_arrow_new(FILE *fp)
+{
+    ipaddr_arrow_t *w = calloc(1, sizeof(*w));
+    if (w == NULL)
+        return NULL;
+
+    size_t rows = ARROW_BATCH_ROWS;
+    bool ok = true;
+    w->fp = fp;
+    ok &= (w->addr = malloc(16 * rows)) != NULL;
+    ok &= (w->version = malloc(rows)) != NULL;
+    ok &= (w->prefix = malloc(rows)) != NULL;
+    ok &= (w->scope = malloc(4 * rows)) != NULL;
+    ok &= (w->value_offsets = calloc(rows + 1, 4)) != NULL;
+    for (int i = 0; i < ARROW_NNULLABLE; i++)
+        ok &= (w->valid[i] = calloc(1, bitmap_size(rows))) != NULL;
+    for (size_t i = 0; i < ARROW_NFLAGS; i++)
+        ok &= (w->flags[i] = calloc(1, bitmap_size(rows))) != NULL;
+
+    if (!ok) {
+        ipaddr_arrow_free(w);
+        return NULL;
+    }
+    return w;
+}
+
+void ipaddr_arrow_free(ipaddr_arrow_t *w)
+{
+    if (w == NULL)
+        return;
+    free(w->addr);
+    free(w->version);
+    free(w->prefix);
+    free(w->scope);
+    free(w->value_offsets);
+    free(w->values);
+    for (int i = 0; i < ARROW_NNULLABLE; i++)
+        free(w->valid[i]);
+    for (size_t i = 0; i < ARROW_NFLAGS; i++)
+        free(w->flags[i]);
+    free(w);
+}
+
+int ipaddr_arrow_add(ipaddr_arrow_t *w, const ipaddr_t *addr, const char *value)
+{
+    size_t len = (value != NULL) ? strlen(value) : 0;
+    int rc;
+
+    /* Value offsets are 32-bit */
+    if (len > INT32_MAX)
+        return IPADDR_ERR_USAGE;
+    if (w->rows == ARROW_BATCH_ROWS || w->values_len + len > INT32_MAX) {
+        rc = flush_batch(w);
+        if (rc != IPADDR_OK)
+            return rc;
+    }
+
+    if (w->values_len + len > w->values_cap) {
+        size_t cap = w->values_cap ? w->values_cap : 4096;
+        while (cap < w->values_len + len)
+            cap *= 2;
+        char *values = realloc(w->values, cap);
+        if (values == NULL)
+            return IPADDR_ERR_INTERNAL;
+        w->values = values;
+        w->values_cap = cap;
+    }
+
+    size_t row = w->rows++;
+    uint8_t bit = (uint8_t)(1 << (row % 8));
+
+    uint128_t val = ipaddr_to_uint128(addr);
+    for (int i = 15; i >= 0; i--) {
+        w->addr[16 * row + i] = (uint8_t)val;
+        val >>= 8;
+    }
+    w->version[row] = ipaddr_is_ipv4(addr) ? 4 : 6;
+
+    w->prefix[row] = (uint8_t)addr->prefix_len;
+    if (addr->has_prefix)
+        w->valid[NULL_PREFIX][row / 8] |= bit;
+    else
+        w->nulls[NULL_PREFIX]++;
+
+    uint32_t scope = ipaddr_scope_id(addr);
+    for (int i = 0; i < 4; i++)
+        w->scope[4 * row + i] = (uint8_t)(scope >> (8 * i));
+    if (scope != 0)
+        w->valid[NULL_SCOPE][row / 8] |= bit;
+    else
+        w->nulls[NULL_SCOPE]++;
+
+    if (value != NULL) {
+        memcpy(w->values + w->values_len, value, len);
+        w->values_len += len;
+        w->valid[NULL_VALUE][row / 8] |= bit;
+    } else {
+        w->nulls[NULL_VALUE]++;
+    }
+    for (int i = 0; i < 4; i++)
+        w->value_offsets[4 * (row + 1) + i] = (uint8_t)(w->values_len >> (8 * i));
+
+    for (size_t i = 0; i < ARROW_NFLAGS; i++) {
+        if (arrow_flags[i].test(addr))
+            w->flags[i][row / 8] |= bit;
+    }
+    return IPADDR_OK;
+}
+
+bool ipaddr_arrow_empty(const ipaddr_arrow_t *w)
+{
+    return !w->started && w->rows == 0;
+}
+
+int ipaddr_arrow_finish(ipaddr_arrow_t *w)
+{
+    static const uint8_t eos[8] = { 0xff, 0xff, 0xff, 0xff, 0, 0, 0, 0 };
+
+    int rc = flush_batch(w);
+    if (rc == IPADDR_OK && fwrite(eos, 1, sizeof(eos), w->fp) != sizeof(eos))
+        rc = IPADDR_ERR_INTERNAL;
+    return rc;
+}
@@ -0,0 +1,188 @@
+/*
+ * ipaddr_filter.c - Approximate membership prefilter for prefix tables
+ *
+ * A blocked Bloom filter keyed on the /24 (IPv4) or /48 (IPv6) bucket of an
+ * address.  All probes for a key fall into one 64-byte block, so rejecting an
+ * address costs a single cache miss.  Unlike xor filters, a Bloom filter can
+ * take new keys after it has been built, even while other threads probe it.
+ */
+
+#include "ipaddr.h"
+
+#include <stdlib.h>
+#include <stdatomic.h>
+
+#define FILTER_BUCKET4      24   /* IPv4 bucket prefix length */
+#define FILTER_BUCKET6      48   /* IPv6 bucket prefix length */
+#define FILTER_BLOCK_WORDS  8    /* 512-bit blocks, one cache line */
+#define FILTER_BITS_PER_KEY 12   /* about 0.5% false positives */
+#define FILTER_PROBES       6    /* bits set per key, 9 hash bits each */
+#define FILTER_MAX_EXPAND   16   /* a prefix may cover up to 2^16 buckets */
+
+struct ipaddr_filter {
+    _Atomic uint64_t *blocks;
+    size_t            nblocks;
+    atomic_bool       saturated[2];  /* IPv4, IPv6: family not filtered */
+};
+
+/*
+ * Get the bucket prefix length for an address family.
+ */
+static int bucket_bits(const ipaddr_t *addr)
+{
+    return ipaddr_is_ipv4(addr) ? FILTER_BUCKET4 : FILTER_BUCKET6;
+}
+
+/*
+ * 64-bit finalizer from MurmurHash3.
+ */
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+/*
+ * Hash a bucket number of the given family.
+ */
+static uint64_t bucket_hash(bool ipv6, uint128_t bucket)
+{
+    uint64_t hi = (uint64_t)(bucket >> 64);
+    uint64_t lo = (uint64_t)bucket;
+    return mix64(lo ^ mix64(hi + (ipv6 ? 1 : 0)));
+}
+
+/*
+ * Get the block for a hash value.
+ */
+static _Atomic uint64_t *filter_block(const ipaddr_filter_t *filter, uint64_t hash)
+{
+    size_t index = (size_t)(((uint128_t)hash * filter->nblocks) >> 64);
+    return filter->blocks + index * FILTER_BLOCK_WORDS;
+}
+
+/*
+ * Get the size of the bit array of a filter.
+ */
+static size_t filter_size(const ipaddr_filter_t *filter)
+{
+    return filter->nblocks * FILTER_BLOCK_WORDS * sizeof(*filter->blocks);
+}
+
+ipaddr_filter_t *ipaddr_filter_new(size_t nkeys)
+{
+    ipaddr_filter_t *filter = calloc(1, sizeof(*filter));
+    if (filter == NULL)
+        return NULL;
+
+    filter->nblocks = nkeys * FILTER_BITS_PER_KEY / (FILTER_BLOCK_WORDS * 64) + 1;
+    /* Zeroed and cache-line aligned, so each block is one line */
+    filter->blocks = ipaddr_mem_alloc(filter_size(filter));
+    if (filter->blocks == NULL) {
+        free(filter);
+        return NULL;
+    }
+    atomic_init(&filter->saturated[0], false);
+    atomic_init(&filter->saturated[1], false);
+
+    return filter;
+}
+
+void ipaddr_filter_free(ipaddr_filter_t *filter)
+{
+    if (filter == NULL)
+        return;
+    ipaddr_mem_free(filter->blocks, filter_size(filter));
+    free(filter);
+}
+
+/*
+ * Get the number of buckets a prefix expands into.
+ */
+size_t ipaddr_filter_keys(const ipaddr_t *prefix)
+{
+    int expand = bucket_bits(prefix) - prefix->prefix_len;
+
+    if (expand <= 0)
+        return 1;
+    if (expand > FILTER_MAX_EXPAND)
+        return 0;
+    return (size_t)1 << expand;
+}
+
+/*
+ * Add all buckets covered by a prefix.
+ */
+void ipaddr_filter_add(ipaddr_filter_t *filter, const ipaddr_t *prefix)
+{
+    bool ipv6 = ipaddr_is_ipv6(prefix);
+    int bits = bucket_bits(prefix);
+    int expand = bits - prefix->prefix_len;
+
+    if (expand > FILTER_MAX_EXPAND) {
+        atomic_store_explicit(&filter->saturated[ipv6], true, memory_order_relaxed);
+        return;
+    }
+    if (expand < 0)
+        expand = 0;
+
+    uint128_t first = ipaddr_to_uint128(prefix) >> (ipaddr_max_prefix(prefix) - bits);
+    first &= ~(((uint128_t)1 << expand) - 1);
+
+    for (uint128_t i = 0; i < ((uint128_t)1 << expand); i++) {
+        uint64_t hash = bucket_hash(ipv6, first + i);
+        _Atomic uint64_t *block = filter_block(filter, hash);
+        uint64_t probes = mix64(hash);
+        uint64_t mask[FILTER_BLOCK_WORDS] = { 0 };
+
+        for (int p = 0; p < FILTER_PROBES; p++) {
+            unsigned bit = probes & 511;
+            mask[bit >> 6] |= (uint64_t)1 << (bit & 63);
+            probes >>= 9;
+        }
+
+        /* Skip the locked update for words that already have the bits */
+        for (int w = 0; w < FILTER_BLOCK_WORDS; w++) {
+            if ((atomic_load_explicit(&block[w], memory_order_relaxed) & mask[w]) != mask[w])
+                atomic_fetch_or_explicit(&block[w], mask[w], memory_order_relaxed);
+        }
+    }
+}
+
+/*
+ * Start loading the block ipaddr_filter_maybe() probes for an address.
+ */
+void ipaddr_filter_prefetch(const ipaddr_filter_t *filter, const ipaddr_t *addr)
+{
+    uint128_t bucket = ipaddr_to_uint128(addr) >> (ipaddr_max_prefix(addr) - bucket_bits(addr));
+    __builtin_prefetch(filter_block(filter, bucket_hash(ipaddr_is_ipv6(addr), bucket)));
+}
+
+/*
+ * Check whether any added prefix may contain the address.
+ */
+bool ipaddr_filter_maybe(const ipaddr_filter_t *filter, const ipaddr_t *addr)
+{
+    bool ipv6 = ipaddr_is_ipv6(addr);
+
+    if (atomic_load_explicit(&filter->saturated[ipv6], memory_order_relaxed))
+        return true;
+
+    uint128_t bucket = ipaddr_to_uint128(addr) >> (ipaddr_max_prefix(addr) - bucket_bits(addr));
+    uint64_t hash = bucket_hash(ipv6, bucket);
+    _Atomic uint64_t *block = filter_block(filter, hash);
+    uint64_t probes = mix64(hash);
+
+    for (int p = 0; p < FILTER_PROBES; p++) {
+        unsigned bit = probes & 511;
+        uint64_t word = atomic_load_explicit(&block[bit >> 6], memory_order_relaxed);
+        if ((word & ((uint64_t)1 << (bit & 63))) == 0)
+            return false;
+        probes >>= 9;
+    }
+    return true;
+}
@@ -0,0 +1,631 @@
+/*
+ * ipaddr_flow.c - Reading addresses from NetFlow and IPFIX exports
+ *
+ * The file holds export datagrams back to back, as archived by a collector:
+ * NetFlow v5, NetFlow v9 (RFC 3954) and IPFIX (RFC 7011) messages may be
+ * mixed.  It is mapped into memory and walked record by record.
+ *
+ * v9 and IPFIX data records are laid out by templates sent earlier in the
+ * stream.  Templates are cached per observation domain (the v9 source ID)
+ * and compiled to the offsets of the address and prefix length fields, so
+ * a record is decoded with a few loads.  Data sets whose template has not
+ * been seen yet cannot be decoded and are skipped.
+ *
+ * A v9 header does not give the length of its message, only the number of
+ * records in it; the message ends when that many records have been read,
+ * or at a set ID that can only be the start of the next header.
+ */
+
+#include "ipaddr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define V5_HDR_SIZE     24
+#define V5_REC_SIZE     48
+#define V9_HDR_SIZE     20
+#define IPFIX_HDR_SIZE  16
+
+/* Set IDs */
+#define V9_TEMPLATE_SET     0
+#define V9_OPTIONS_SET      1
+#define IPFIX_TEMPLATE_SET  2
+#define IPFIX_OPTIONS_SET   3
+#define FIRST_DATA_SET      256
+
+/* Information elements */
+#define IE_SRC_IPV4         8
+#define IE_SRC_IPV4_PLEN    9
+#define IE_DST_IPV4         12
+#define IE_DST_IPV4_PLEN    13
+#define IE_SRC_IPV6         27
+#define IE_DST_IPV6         28
+#define IE_SRC_IPV6_PLEN    29
+#define IE_DST_IPV6_PLEN    30
+
+#define VARIABLE_LENGTH     65535
+
+/*
+ * Where the fields of interest are in a record, or -1 if absent.
+ */
+typedef struct {
+    size_t reclen;
+    long   src4, dst4, src6, dst6;
+    long   src_plen4, dst_plen4, src_plen6, dst_plen6;
+} flow_layout_t;
+
+typedef struct {
+    uint16_t ie;        /* 0 for fields that are never read */
+    uint16_t len;       /* VARIABLE_LENGTH for variable-length fields */
+} flow_field_t;
+
+typedef struct {
+    uint32_t      domain;
+    uint16_t      id;
+    uint8_t       version;
+    bool          variable;     /* has variable-length fields */
+    bool          useful;       /* has address fields */
+    size_t        minlen;       /* shortest record */
+    size_t        nfields;
+    flow_field_t *fields;
+    flow_layout_t layout;       /* unless variable */
+} flow_template_t;
+
+struct ipaddr_flow {
+    const uint8_t   *map;
+    size_t           size;
+    size_t           pos;           /* offset of the next set or message */
+    int              which;         /* IPADDR_FLOW_* */
+    size_t           message;       /* messages read so far */
+
+    /* Current message */
+    int              version;       /* 0 between messages */
+    size_t           msg_end;
+    uint32_t         domain;
+    size_t           records_left;  /* of a v9 message */
+
+    /* Current data set */
+    const flow_template_t *tmpl;
+    size_t           set_pos;
+    size_t           set_end;
+
+    flow_template_t *templates;
+    size_t           ntemplates;
+    size_t           cap_templates;
+
+    ipaddr_t         dst;           /* destination still to be returned */
+    bool             has_dst;
+};
+
+/* Records of a v5 message */
+static const flow_template_t v5_template = {
+    .version = 5,
+    .useful = true,
+    .minlen = V5_REC_SIZE,
+    .layout = {
+        .reclen = V5_REC_SIZE,
+        .src4 = 0, .dst4 = 4, .src6 = -1, .dst6 = -1,
+        .src_plen4 = 44, .dst_plen4 = 45, .src_plen6 = -1, .dst_plen6 = -1,
+    },
+};
+
+static uint16_t get16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+           (uint32_t)p[2] << 8 | p[3];
+}
+
+static void set_addr(ipaddr_t *addr, int family, const uint8_t *bytes)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->addr.sa.sa_family = (sa_family_t)family;
+    if (family == AF_INET) {
+        memcpy(&addr->addr.sin.sin_addr, bytes, 4);
+        addr->prefix_len = 32;
+    } else {
+        memcpy(&addr->addr.sin6.sin6_addr, bytes, 16);
+        addr->prefix_len = 128;
+    }
+}
+
+/* ========== Templates ========== */
+
+static flow_template_t *find_template(ipaddr_flow_t *fl, uint16_t id)
+{
+    for (size_t i = 0; i < fl->ntemplates; i++) {
+        flow_template_t *t = &fl->templates[i];
+        if (t->id == id && t->domain == fl->domain && t->version == fl->version)
+            return t;
+    }
+    return NULL;
+}
+
+static void remove_template(ipaddr_flow_t *fl, uint16_t id)
+{
+    flow_template_t *t = find_template(fl, id);
+    if (t == NULL)
+        return;
+    free(t->fields);
+    *t = fl->templates[--fl->ntemplates];
+}
+
+/*
+ * Record where field f, at offset off, is in layout if it is of interest.
+ */
+static void layout_field(flow_layout_t *l, const flow_field_t *f, size_t off)
+{
+    long o = (long)off;
+    switch (f->ie) {
+    case IE_SRC_IPV4:      if (f->len == 4)  l->src4 = o;      break;
+    case IE_DST_IPV4:      if (f->len == 4)  l->dst4 = o;      break;
+    case IE_SRC_IPV6:      if (f->len == 16) l->src6 = o;      break;
+    case IE_DST_IPV6:      if (f->len == 16) l->dst6 = o;      break;
+    case IE_SRC_IPV4_PLEN: if (f->len == 1)  l->src_plen4 = o; break;
+    case IE_DST_IPV4_PLEN: if (f->len == 1)  l->dst_plen4 = o; break;
+    case IE_SRC_IPV6_PLEN: if (f->len == 1)  l->src_plen6 = o; break;
+    case IE_DST_IPV6_PLEN: if (f->len == 1)  l->dst_plen6 = o; break;
+    default: break;
+    }
+}
+
+static void layout_init(flow_layout_t *l)
+{
+    l->reclen = 0;
+    l->src4 = l->dst4 = l->src6 = l->dst6 = -1;
+    l->src_plen4 = l->dst_plen4 = l->src_plen6 = l->dst_plen6 = -1;
+}
+
+/*
+ * Lay out the record at rec, of at most len bytes, by the template.
+ * Returns false if the record does not fit.
+ */
+static bool layout_record(const flow_template_t *t, const uint8_t *rec,
+                          size_t len, flow_layout_t *l)
+{
+    if (!t->variable) {
+        *l = t->layout;
+        return len >= l->reclen;
+    }
+
+    size_t off = 0;
+    layout_init(l);
+    for (size_t i = 0; i < t->nfields; i++) {
+        const flow_field_t *f = &t->fields[i];
+        size_t flen = f->len;
+        if (flen == VARIABLE_LENGTH) {
+            if (off + 1 > len)
+                return false;
+            flen = rec[off++];
+            if (flen == 255) {
+                if (off + 2 > len)
+                    return false;
+                flen = get16(rec + off);
+                off += 2;
+            }
+        } else {
+            layout_field(l, f, off);
+        }
+        if (flen > len - off)
+            return false;
+        off += flen;
+    }
+    l->reclen = off;
+    return true;
+}
+
+/*
+ * Add a template, replacing any with the same ID, from nfields field
+ * specifiers read from p, and store their length in used.  Options
+ * templates (options) are only kept to skip their records.
+ * Returns 0 on success, IPADDR_ERR_USAGE if the field specifiers do not fit
+ * in len bytes, IPADDR_ERR_INTERNAL if out of memory.
+ */
+static int add_template(ipaddr_flow_t *fl, uint16_t id, size_t nfields,
+                        bool options, const uint8_t *p, size_t len,
+                        size_t *used, const char **errmsg)
+{
+    flow_field_t *fields = malloc((nfields ? nfields : 1) * sizeof(*fields));
+    if (fields == NULL) {
+        *errmsg = "out of memory";
+        return IPADDR_ERR_INTERNAL;
+    }
+
+    flow_template_t t = {
+        .domain = fl->domain,
+        .id = id,
+        .version = (uint8_t)fl->version,
+        .nfields = nfields,
+        .fields = fields,
+    };
+    layout_init(&t.layout);
+
+    size_t off = 0;
+    for (size_t i = 0; i < nfields; i++) {
+        if (off + 4 > len) {
+            free(fields);
+            *errmsg = "truncated template";
+            return IPADDR_ERR_USAGE;
+        }
+        uint16_t ie = get16(p + off);
+        uint16_t flen = get16(p + off + 2);
+        off += 4;
+        if (fl->version == 10 && (ie & 0x8000)) {
+            /* Enterprise-specific */
+            if (off + 4 > len) {
+                free(fields);
+                *errmsg = "truncated template";
+                return IPADDR_ERR_USAGE;
+            }
+            off += 4;
+            ie = 0;
+        }
+        if (options)
+            ie = 0;
+        if (flen == VARIABLE_LENGTH && fl->version != 10)
+            flen = 0;
+
+        fields[i].ie = ie;
+        fields[i].len = flen;
+        if (flen == VARIABLE_LENGTH) {
+            t.variable = true;
+            t.minlen += 1;
+        } else {
+            layout_field(&t.layout, &fields[i], t.layout.reclen);
+            t.layout.reclen += flen;
+            t.minlen += flen;
+        }
+    }
+    t.useful = t.layout.src4 >= 0 || t.layout.dst4 >= 0 ||
+               t.layout.src6 >= 0 || t.layout.dst6 >= 0;
+
+    *used = off;
+    flow_template_t *old = find_template(fl, id);
+    if (old != NULL) {
+        free(old->fields);
+        *old = t;
+        return IPADDR_OK;
+    }
+    if (fl->ntemplates == fl->cap_templates) {
+        size_t cap = fl->cap_templates ? fl->cap_templates * 2 : 16;
+        flow_template_t *tmpls = realloc(fl->templates, cap * sizeof(*tmpls));
+        if (tmpls == NULL) {
+            free(fields);
+            *errmsg = "out of memory";
+            return IPADDR_ERR_INTERNAL;
+        }
+        fl->templates = tmpls;
+        fl->cap_templates = cap;
+    }
+    fl->templates[fl->ntemplates++] = t;
+    return IPADDR_OK;
+}
+
+/*
+ * Read the template records of a set.
+ * Returns 0 on success, IPADDR_ERR_USAGE if they are malformed,
+ * IPADDR_ERR_INTERNAL if out of memory.
+ */
+static int read_templates(ipaddr_flow_t *fl, uint16_t set_id,
+                          const uint8_t *p, size_t len, const char **errmsg)
+{
+    bool options = (set_id == V9_OPTIONS_SET || set_id == IPFIX_OPTIONS_SET);
+    size_t hdr = (set_id == V9_TEMPLATE_SET || set_id == IPFIX_TEMPLATE_SET) ? 4 : 6;
+    size_t off = 0;
+
+    /* Stop at the padding, which is shorter than a header or zero */
+    while (len - off >= hdr) {
+        uint16_t id = get16(p + off);
+        if (id < FIRST_DATA_SET)
+            break;
+
+        size_t nfields;
+        if (set_id == V9_OPTIONS_SET) {
+            /* Scope and option lengths, in bytes */
+            nfields = ((size_t)get16(p + off + 2) + get16(p + off + 4)) / 4;
+        } else {
+            nfields = get16(p + off + 2);
+        }
+        off += hdr;
+
+        if (nfields == 0 && fl->version == 10) {
+            /* Withdrawal */
+            remove_template(fl, id);
+        } else {
+            size_t used;
+            int rc = add_template(fl, id, nfields, options, p + off,
+                                  len - off, &used, errmsg);
+            if (rc != IPADDR_OK)
+                return rc;
+            off += used;
+        }
+        if (fl->records_left > 0)
+            fl->records_left--;
+    }
+    return IPADDR_OK;
+}
+
+/* ========== Messages ========== */
+
+/*
+ * Start the message at the current position.
+ * Returns 0 on success, IPADDR_ERR_BOOL at the end of the file,
+ * IPADDR_ERR_USAGE if the message is malformed.
+ */
+static int start_message(ipaddr_flow_t *fl, const char **errmsg)
+{
+    size_t left = fl->size - fl->pos;
+    const uint8_t *p = fl->map + fl->pos;
+
+    if (left == 0)
+        return IPADDR_ERR_BOOL;
+    fl->message++;
+    if (left < 4) {
+        *errmsg = "truncated header";
+        return IPADDR_ERR_USAGE;
+    }
+
+    fl->version = get16(p);
+    switch (fl->version) {
+    case 5: {
+        if (left < V5_HDR_SIZE) {
+            *errmsg = "truncated header";
+            return IPADDR_ERR_USAGE;
+        }
+        size_t len = V5_HDR_SIZE + (size_t)get16(p + 2) * V5_REC_SIZE;
+        if (len > left) {
+            *errmsg = "truncated message";
+            return IPADDR_ERR_USAGE;
+        }
+        fl->msg_end = fl->pos + len;
+        fl->tmpl = &v5_template;
+        fl->set_pos = fl->pos + V5_HDR_SIZE;
+        fl->set_end = fl->msg_end;
+        fl->pos = fl->msg_end;
+        return IPADDR_OK;
+    }
+    case 9:
+        if (left < V9_HDR_SIZE) {
+            *errmsg = "truncated header";
+            return IPADDR_ERR_USAGE;
+        }
+        fl->records_left = get16(p + 2);
+        fl->domain = get32(p + 16);
+        fl->msg_end = fl->size;
+        fl->pos += V9_HDR_SIZE;
+        return IPADDR_OK;
+    case 10: {
+        size_t len = get16(p + 2);
+        if (left < IPFIX_HDR_SIZE || len > left) {
+            *errmsg = "truncated message";
+            return IPADDR_ERR_USAGE;
+        }
+        if (len < IPFIX_HDR_SIZE) {
+            *errmsg = "invalid message length";
+            return IPADDR_ERR_USAGE;
+        }
+        fl->domain = get32(p + 12);
+        fl->msg_end = fl->pos + len;
+        fl->pos += IPFIX_HDR_SIZE;
+        return IPADDR_OK;
+    }
+    default:
+        fl->version = 0;
+        *errmsg = "not a NetFlow v5, v9 or IPFIX message";
+        return IPADDR_ERR_USAGE;
+    }
+}
+
+/*
+ * Read sets of the current message up to the next data set with a known
+ * template, or the end of the message.
+ * Returns 0 on success, IPADDR_ERR_USAGE or IPADDR_ERR_INTERNAL on error.
+ */
+static int next_set(ipaddr_flow_t *fl, const char **errmsg)
+{
+    for (;;) {
+        size_t left = fl->msg_end - fl->pos;
+        const uint8_t *p = fl->map + fl->pos;
+
+        if (left == 0 || (fl->version == 9 && fl->records_left == 0)) {
+            fl->version = 0;
+            return IPADDR_OK;
+        }
+
+        uint16_t id = left >= 2 ? get16(p) : 0;
+        if (fl->version == 9 && id > V9_OPTIONS_SET && id < FIRST_DATA_SET) {
+            /* The next header: the record count was too high */
+            fl->version = 0;
+            return IPADDR_OK;
+        }
+        if (left < 4) {
+            *errmsg = "truncated set";
+            return IPADDR_ERR_USAGE;
+        }
+
+        size_t len = get16(p + 2);
+        if (len < 4 || len > left) {
+            *errmsg = (len > left) ? "truncated set" : "invalid set length";
+            return IPADDR_ERR_USAGE;
+        }
+        fl->pos += len;
+
+        if (id >= FIRST_DATA_SET) {
+            const flow_template_t *t = find_template(fl, id);
+            if (t == NULL || t->minlen == 0)
+                continue;
+            fl->tmpl = t;
+            fl->set_pos = fl->pos - len + 4;
+            fl->set_end = fl->pos;
+            return IPADDR_OK;
+        }
+
+        bool template_set = (fl->version == 9) ? id <= V9_OPTIONS_SET
+            : (id == IPFIX_TEMPLATE_SET || id == IPFIX_OPTIONS_SET);
+        if (template_set) {
+            int rc = read_templates(fl, id, p + 4, len - 4, errmsg);
+            if (rc != IPADDR_OK)
+                return rc;
+        }
+    }
+}
+
+/*
+ * Get the addresses of a record laid out by l.
+ */
+static void record_addrs(const uint8_t *rec, const flow_layout_t *l, int which,
+                         ipaddr_t *src, ipaddr_t *dst, bool *has_src,
+                         bool *has_dst)
+{
+    bool v4 = (l->src4 >= 0 || l->dst4 >= 0);
+    long soff = v4 ? l->src4 : l->src6;
+    long doff = v4 ? l->dst4 : l->dst6;
+    long splen = v4 ? l->src_plen4 : l->src_plen6;
+    long dplen = v4 ? l->dst_plen4 : l->dst_plen6;
+    int family = v4 ? AF_INET : AF_INET6;
+    int max_bits = v4 ? 32 : 128;
+
+    *has_src = (which & IPADDR_FLOW_SRC) && soff >= 0;
+    *has_dst = (which & IPADDR_FLOW_DST) && doff >= 0;
+    if (*has_src) {
+        set_addr(src, family, rec + soff);
+        /* A prefix length of 0 means the exporter did not know it */
+        if ((which & IPADDR_FLOW_PREFIX) && splen >= 0 &&
+            rec[splen] > 0 && rec[splen] <= max_bits) {
+            src->prefix_len = rec[splen];
+            src->has_prefix = true;
+        }
+    }
+    if (*has_dst) {
+        set_addr(dst, family, rec + doff);
+        if ((which & IPADDR_FLOW_PREFIX) && dplen >= 0 &&
+            rec[dplen] > 0 && rec[dplen] <= max_bits) {
+            dst->prefix_len = rec[dplen];
+            dst->has_prefix = true;
+        }
+    }
+}
+
+int ipaddr_flow_open(const char *path, int which, ipaddr_flow_t **flp,
+                     const char **errmsg)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        *errmsg = strerror(errno);
+        return IPADDR_ERR_USAGE;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        *errmsg = "not a regular file";
+        close(fd);
+        return IPADDR_ERR_USAGE;
+    }
+
+    ipaddr_flow_t *fl = calloc(1, sizeof(*fl));
+    if (fl == NULL) {
+        close(fd);
+        *errmsg = "out of memory";
+        return IPADDR_ERR_INTERNAL;
+    }
+    fl->which = which;
+
+    fl->size = (size_t)st.st_size;
+    if (fl->size > 0) {
+        void *map = mmap(NULL, fl->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            fl->map = map;
+            madvise(map, fl->size, MADV_SEQUENTIAL);
+        }
+    }
+    close(fd);
+    if (fl->map == NULL && fl->size > 0) {
+        *errmsg = strerror(errno);
+        ipaddr_flow_close(fl);
+        return IPADDR_ERR_USAGE;
+    }
+
+    *flp = fl;
+    return IPADDR_OK;
+}
+
+int ipaddr_flow_next(ipaddr_flow_t *fl, ipaddr_t *addr, size_t *message,
+                     const char **errmsg)
+{
+    if (fl->has_dst) {
+        *addr = fl->dst;
+        *message = fl->message;
+        fl->has_dst = false;
+        return IPADDR_OK;
+    }
+
+    for (;;) {
+        const flow_template_t *t = fl->tmpl;
+        if (t != NULL && fl->set_end - fl->set_pos >= t->minlen) {
+            const uint8_t *rec = fl->map + fl->set_pos;
+            flow_layout_t l;
+            if (!layout_record(t, rec, fl->set_end - fl->set_pos, &l) ||
+                l.reclen == 0) {
+                fl->tmpl = NULL;    /* the rest is padding */
+                continue;
+            }
+            fl->set_pos += l.reclen;
+            if (fl->version == 9 && fl->records_left > 0)
+                fl->records_left--;
+            if (!t->useful)
+                continue;
+
+            ipaddr_t src;
+            bool has_src, has_dst;
+            record_addrs(rec, &l, fl->which, &src, &fl->dst, &has_src, &has_dst);
+            if (!has_src && !has_dst)
+                continue;
+            *message = fl->message;
+            if (has_src) {
+                *addr = src;
+                fl->has_dst = has_dst;
+            } else {
+                *addr = fl->dst;
+            }
+            return IPADDR_OK;
+        }
+        fl->tmpl = NULL;
+
+        int rc;
+        if (fl->version == 0) {
+            rc = start_message(fl, errmsg);
+        } else if (fl->version == 5) {
+            /* A v5 message is a single set of records */
+            fl->version = 0;
+            continue;
+        } else {
+            rc = next_set(fl, errmsg);
+        }
+        if (rc != IPADDR_OK) {
+            *message = fl->message;
+            return rc;
+        }
+    }
+}
+
+void ipaddr_flow_close(ipaddr_flow_t *fl)
+{
+    if (fl == NULL)
+        return;
+    for (size_t i = 0; i < fl->ntemplates; i++)
+        free(fl->templates[i].fields);
+    free(fl->templates);
+    if (fl->map != NULL)
+        munmap((void *)fl->map, fl->size);
+    free(fl);
+}
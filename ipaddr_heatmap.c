@@ -0,0 +1,544 @@
+/*
+ * ipaddr_heatmap.c - Address space maps on a Hilbert curve
+ *
+ * A map divides a network into 4^k cells of equal prefix length and counts
+ * the addresses in each, in an array indexed directly by the cell number
+ * (the address bits below the network prefix, down to the cell prefix).
+ * Adding an address is a range check, a shift and an increment.
+ *
+ * The cells are laid out along a Hilbert curve of order k, as in the
+ * classic maps of the IPv4 space: consecutive cells are adjacent pixels,
+ * and every aligned block of 4^j cells is a square.  The curve is that of
+ * the usual d2xy() construction, which builds the position from the lowest
+ * digit of the cell number up, rotating what is built so far at each level.
+ * A table applies four levels (one byte of the cell number) at a time: the
+ * position of a block of 16 x 16 sub-blocks and the rotation of the
+ * sub-block within it.  Rendering visits every cell once, and the cells are
+ * shared out among threads.
+ *
+ * Counts are drawn with a logarithmic color scale on black, written as a
+ * binary PPM, or as an indexed-color PNG compressed with runs of repeated
+ * bytes (deflate with the fixed Huffman codes), so that the empty space of
+ * a sparse map costs almost nothing.
+ */
+
+#include "ipaddr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#define HEATMAP_MAX_THREADS  16
+#define HEATMAP_MIN_SHARE    (1 << 16)   /* cells worth a thread */
+
+struct ipaddr_heatmap {
+    uint128_t  base;        /* first address of the network */
+    uint128_t  last;        /* last address of the network */
+    int        shift;       /* address bits below the cell prefix */
+    int        order;       /* levels of the curve; the side is 2^order */
+    bool       ipv6;
+    uint64_t  *counts;      /* by cell number */
+};
+
+ipaddr_heatmap_t *ipaddr_heatmap_new(const ipaddr_t *net, int prefix_len)
+{
+    int bits = prefix_len - net->prefix_len;
+    if (bits < 0 || bits % 2 != 0 || bits > IPADDR_HEATMAP_MAX_BITS ||
+        prefix_len > ipaddr_max_prefix(net))
+        return NULL;
+
+    ipaddr_heatmap_t *map = calloc(1, sizeof(*map));
+    if (map == NULL)
+        return NULL;
+    map->counts = calloc((size_t)1 << bits, sizeof(*map->counts));
+    if (map->counts == NULL) {
+        free(map);
+        return NULL;
+    }
+
+    int host_bits = ipaddr_max_prefix(net) - net->prefix_len;
+    uint128_t hostmask = host_bits >= 128 ? ~(uint128_t)0
+                                          : ((uint128_t)1 << host_bits) - 1;
+    map->base = ipaddr_to_uint128(net) & ~hostmask;
+    map->last = map->base | hostmask;
+    map->shift = ipaddr_max_prefix(net) - prefix_len;
+    map->order = bits / 2;
+    map->ipv6 = ipaddr_family(net) == AF_INET6;
+    return map;
+}
+
+void ipaddr_heatmap_free(ipaddr_heatmap_t *map)
+{
+    if (map == NULL)
+        return;
+    free(map->counts);
+    free(map);
+}
+
+void ipaddr_heatmap_add(ipaddr_heatmap_t *map, const ipaddr_t *addr)
+{
+    if ((ipaddr_family(addr) == AF_INET6) != map->ipv6)
+        return;
+    uint128_t val = ipaddr_to_uint128(addr);
+    if (val < map->base || val > map->last)
+        return;
+    map->counts[(size_t)((val - map->base) >> map->shift)]++;
+}
+
+/*
+ * Levels of the curve applied by one table entry, and an entry: the block
+ * of 2^levels x 2^levels sub-blocks the digits select, and how the
+ * sub-block is turned: transposed, then rotated by 180 degrees.
+ */
+#define HILBERT_STEP 4
+
+typedef struct {
+    uint8_t x, y;
+    uint8_t transpose;
+    uint8_t rotate;
+} hilbert_step_t;
+
+/* Entries for 1 to HILBERT_STEP levels, indexed by their digits */
+static hilbert_step_t hilbert_table[HILBERT_STEP][1 << (2 * HILBERT_STEP)];
+static pthread_once_t hilbert_once = PTHREAD_ONCE_INIT;
+
+/*
+ * Fill the table by following the levels of d2xy() on blocks: at a level
+ * of side m (in sub-blocks), the digit's low bit rx and ry = rx ^ its high
+ * bit choose the quadrant, and the lower quadrants (ry == 0) are
+ * transposed, or anti-transposed if on the right (rx == 1), before moving.
+ * Both turn the sub-block inside with them; anti-transposing is
+ * transposing and rotating by 180 degrees, and the two commute.
+ */
+static void hilbert_init(void)
+{
+    for (int levels = 1; levels <= HILBERT_STEP; levels++) {
+        for (unsigned d = 0; d < 1u << (2 * levels); d++) {
+            unsigned x = 0, y = 0, t = d;
+            uint8_t transpose = 0, rotate = 0;
+            for (unsigned m = 1; m < 1u << levels; m *= 2, t /= 4) {
+                unsigned rx = 1 & (t / 2);
+                unsigned ry = 1 & (t ^ rx);
+                if (ry == 0) {
+                    unsigned tmp = x;
+                    if (rx == 1) {
+                        x = m - 1 - y;
+                        y = m - 1 - tmp;
+                        rotate ^= 1;
+                    } else {
+                        x = y;
+                        y = tmp;
+                    }
+                    transpose ^= 1;
+                }
+                x += m * rx;
+                y += m * ry;
+            }
+            hilbert_table[levels - 1][d] =
+                (hilbert_step_t){ (uint8_t)x, (uint8_t)y, transpose, rotate };
+        }
+    }
+}
+
+/*
+ * Position of cell d on a Hilbert curve of the given order.
+ */
+static void hilbert_d2xy(int order, uint64_t d, uint32_t *px, uint32_t *py)
+{
+    uint32_t x = 0, y = 0, side = 1;
+
+    for (int level = 0; level < order; level += HILBERT_STEP) {
+        int levels = order - level < HILBERT_STEP ? order - level : HILBERT_STEP;
+        const hilbert_step_t *e =
+            &hilbert_table[levels - 1][d & ((1u << (2 * levels)) - 1)];
+        d >>= 2 * levels;
+
+        if (e->transpose) {
+            uint32_t tmp = x;
+            x = y;
+            y = tmp;
+        }
+        if (e->rotate) {
+            x = side - 1 - x;
+            y = side - 1 - y;
+        }
+        x += e->x * side;
+        y += e->y * side;
+        side <<= levels;
+    }
+    *px = x;
+    *py = y;
+}
+
+/*
+ * Fixed-point log2(n + 1), with 16 fractional bits interpolated linearly
+ * between powers of two: enough to pick one of 255 colors.
+ */
+static uint32_t log_scale(uint64_t n)
+{
+    n = n + 1 < n ? n : n + 1;
+    int bits = 63 - __builtin_clzll(n);
+    uint64_t frac = bits >= 16 ? (n >> (bits - 16)) & 0xffff
+                               : (n << (16 - bits)) & 0xffff;
+    return ((uint32_t)bits << 16) | (uint32_t)frac;
+}
+
+/* A share of the cells to render */
+typedef struct {
+    const ipaddr_heatmap_t *map;
+    uint8_t                *pixels;
+    uint64_t                first;
+    uint64_t                end;
+    uint32_t                log_max;
+} render_t;
+
+/*
+ * Set the color index of each cell of a share: 0 for no addresses, then
+ * 1 to 255 on a log scale up to the largest count.
+ */
+static void *render_share(void *arg)
+{
+    render_t *r = arg;
+    uint32_t side = 1u << r->map->order;
+
+    for (uint64_t d = r->first; d < r->end; d++) {
+        uint64_t n = r->map->counts[d];
+        uint8_t color = 0;
+        if (n > 0)
+            color = (uint8_t)(1 + (uint64_t)254 * log_scale(n) / r->log_max);
+        uint32_t x, y;
+        hilbert_d2xy(r->map->order, d, &x, &y);
+        r->pixels[(size_t)y * side + x] = color;
+    }
+    return NULL;
+}
+
+/*
+ * Render the map into side x side color indexes.
+ */
+static uint8_t *render(const ipaddr_heatmap_t *map)
+{
+    pthread_once(&hilbert_once, hilbert_init);
+
+    uint64_t cells = (uint64_t)1 << (2 * map->order);
+    uint8_t *pixels = malloc((size_t)cells);
+    if (pixels == NULL)
+        return NULL;
+
+    uint64_t max = 0;
+    for (uint64_t d = 0; d < cells; d++)
+        if (map->counts[d] > max)
+            max = map->counts[d];
+    uint32_t log_max = log_scale(max);
+
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    uint64_t most = cells / HEATMAP_MIN_SHARE;
+    if (ncpu > HEATMAP_MAX_THREADS)
+        ncpu = HEATMAP_MAX_THREADS;
+    if ((uint64_t)ncpu > most)
+        ncpu = (long)most;
+    int n = (ncpu < 1) ? 1 : (int)ncpu;
+
+    render_t shares[HEATMAP_MAX_THREADS];
+    pthread_t threads[HEATMAP_MAX_THREADS];
+    int started = 0;
+    for (int i = 0; i < n; i++) {
+        shares[i] = (render_t){ map, pixels, cells * i / n, cells * (i + 1) / n,
+                                log_max };
+        /* The last share, and any a thread cannot take, run here */
+        if (i < n - 1 &&
+            pthread_create(&threads[started], NULL, render_share, &shares[i]) == 0)
+            started++;
+        else
+            render_share(&shares[i]);
+    }
+    for (int i = 0; i < started; i++)
+        pthread_join(threads[i], NULL);
+    return pixels;
+}
+
+/*
+ * Color of each index: black, then blue through cyan, green and yellow to
+ * red.
+ */
+static void palette(uint8_t rgb[256][3])
+{
+    static const uint8_t stops[5][3] = {
+        { 0, 0, 255 }, { 0, 255, 255 }, { 0, 255, 0 }, { 255, 255, 0 },
+        { 255, 0, 0 }
+    };
+
+    memset(rgb[0], 0, 3);
+    for (int i = 1; i < 256; i++) {
+        /* 254 steps over 4 segments */
+        int pos = (i - 1) * 4 * 256 / 254;
+        int seg = pos / 256 < 4 ? pos / 256 : 3;
+        int frac = pos - seg * 256;
+        for (int c = 0; c < 3; c++) {
+            int a = stops[seg][c], b = stops[seg + 1][c];
+            rgb[i][c] = (uint8_t)(a + (b - a) * frac / 256);
+        }
+    }
+}
+
+static int write_ppm(const uint8_t *pixels, uint32_t side, FILE *fp)
+{
+    uint8_t rgb[256][3];
+    palette(rgb);
+
+    fprintf(fp, "P6\n%u %u\n255\n", side, side);
+    uint8_t *row = malloc((size_t)side * 3);
+    if (row == NULL)
+        return IPADDR_ERR_INTERNAL;
+    for (uint32_t y = 0; y < side; y++) {
+        for (uint32_t x = 0; x < side; x++)
+            memcpy(&row[x * 3], rgb[pixels[(size_t)y * side + x]], 3);
+        if (fwrite(row, 3, side, fp) != side)
+            break;
+    }
+    free(row);
+    return ferror(fp) ? IPADDR_ERR_INTERNAL : IPADDR_OK;
+}
+
+/* Growable output buffer with a deflate bit writer on top */
+typedef struct {
+    uint8_t *data;
+    size_t   len;
+    size_t   cap;
+    uint32_t bits;      /* pending bits, least significant first */
+    int      nbits;
+    bool     failed;
+} outbuf_t;
+
+static void put_byte(outbuf_t *b, uint8_t c)
+{
+    if (b->len == b->cap) {
+        size_t cap = b->cap ? b->cap * 2 : 1 << 16;
+        uint8_t *data = realloc(b->data, cap);
+        if (data == NULL) {
+            b->failed = true;
+            return;
+        }
+        b->data = data;
+        b->cap = cap;
+    }
+    b->data[b->len++] = c;
+}
+
+static void put_be32(outbuf_t *b, uint32_t v)
+{
+    for (int i = 24; i >= 0; i -= 8)
+        put_byte(b, (uint8_t)(v >> i));
+}
+
+static void put_bits(outbuf_t *b, uint32_t v, int n)
+{
+    b->bits |= v << b->nbits;
+    b->nbits += n;
+    while (b->nbits >= 8) {
+        put_byte(b, (uint8_t)b->bits);
+        b->bits >>= 8;
+        b->nbits -= 8;
+    }
+}
+
+/*
+ * Write a Huffman code, which deflate stores from its most significant bit.
+ */
+static void put_code(outbuf_t *b, uint32_t code, int n)
+{
+    uint32_t rev = 0;
+    for (int i = 0; i < n; i++)
+        rev |= ((code >> i) & 1) << (n - 1 - i);
+    put_bits(b, rev, n);
+}
+
+/* Fixed Huffman code of a literal or length symbol */
+static void put_symbol(outbuf_t *b, int sym)
+{
+    if (sym < 144)
+        put_code(b, 0x30 + sym, 8);
+    else if (sym < 256)
+        put_code(b, 0x190 + sym - 144, 9);
+    else if (sym < 280)
+        put_code(b, sym - 256, 7);
+    else
+        put_code(b, 0xc0 + sym - 280, 8);
+}
+
+/*
+ * Write a copy of the previous byte, len (3 to 258) times.
+ */
+static void put_repeat(outbuf_t *b, int len)
+{
+    static const uint16_t base[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51,
+        59, 67, 83, 99, 115, 131, 163, 195, 227, 258
+    };
+    static const uint8_t extra[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4,
+        4, 5, 5, 5, 5, 0
+    };
+
+    int code = 28;
+    while (base[code] > len)
+        code--;
+    put_symbol(b, 257 + code);
+    if (extra[code] > 0)
+        put_bits(b, (uint32_t)(len - base[code]), extra[code]);
+    put_code(b, 0, 5);   /* distance 1 */
+}
+
+/*
+ * Adler-32 of data, taking the modulus only as often as the sums could
+ * overflow.
+ */
+static uint32_t adler32(const uint8_t *data, size_t len)
+{
+    uint32_t s1 = 1, s2 = 0;
+    while (len > 0) {
+        size_t n = len < 5552 ? len : 5552;
+        len -= n;
+        while (n-- > 0) {
+            s1 += *data++;
+            s2 += s1;
+        }
+        s1 %= 65521;
+        s2 %= 65521;
+    }
+    return s2 << 16 | s1;
+}
+
+/*
+ * Compress data as a zlib stream of one deflate block with the fixed
+ * codes, as literals and repeats of the previous byte.
+ */
+static void deflate_runs(outbuf_t *b, const uint8_t *data, size_t len)
+{
+    put_byte(b, 0x78);
+    put_byte(b, 0x01);
+    put_bits(b, 1, 1);   /* final block */
+    put_bits(b, 1, 2);   /* fixed codes */
+
+    for (size_t i = 0; i < len; ) {
+        size_t run = 1;
+        while (i + run < len && data[i + run] == data[i])
+            run++;
+
+        put_symbol(b, data[i]);
+        size_t left = run - 1;
+        while (left >= 3) {
+            size_t n = left > 258 ? 258 : left;
+            if (left - n > 0 && left - n < 3)
+                n = left - 3;   /* leave a repeat rather than literals */
+            put_repeat(b, (int)n);
+            left -= n;
+        }
+        while (left-- > 0)
+            put_symbol(b, data[i]);
+        i += run;
+    }
+    put_symbol(b, 256);
+    if (b->nbits > 0)
+        put_bits(b, 0, 8 - b->nbits);
+    put_be32(b, adler32(data, len));
+}
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void)
+{
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t c = n;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crc_table[n] = c;
+    }
+}
+
+/*
+ * Write a PNG chunk of the given type and data.
+ */
+static void write_chunk(FILE *fp, const char *type, const uint8_t *data,
+                        size_t len)
+{
+    uint8_t head[8] = {
+        (uint8_t)(len >> 24), (uint8_t)(len >> 16), (uint8_t)(len >> 8),
+        (uint8_t)len, (uint8_t)type[0], (uint8_t)type[1], (uint8_t)type[2],
+        (uint8_t)type[3]
+    };
+    uint32_t crc = 0xffffffff;
+    for (size_t i = 4; i < 8; i++)
+        crc = crc_table[(crc ^ head[i]) & 0xff] ^ (crc >> 8);
+    for (size_t i = 0; i < len; i++)
+        crc = crc_table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+    crc ^= 0xffffffff;
+    uint8_t tail[4] = {
+        (uint8_t)(crc >> 24), (uint8_t)(crc >> 16), (uint8_t)(crc >> 8),
+        (uint8_t)crc
+    };
+
+    fwrite(head, 1, sizeof(head), fp);
+    if (len > 0)
+        fwrite(data, 1, len, fp);
+    fwrite(tail, 1, sizeof(tail), fp);
+}
+
+static int write_png(const uint8_t *pixels, uint32_t side, FILE *fp)
+{
+    static const uint8_t signature[8] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+    pthread_once(&crc_once, crc_init);
+
+    /* Scanlines, each after its filter type (none) */
+    size_t stride = (size_t)side + 1;
+    uint8_t *raw = malloc(stride * side);
+    if (raw == NULL)
+        return IPADDR_ERR_INTERNAL;
+    for (uint32_t y = 0; y < side; y++) {
+        raw[y * stride] = 0;
+        memcpy(&raw[y * stride + 1], &pixels[(size_t)y * side], side);
+    }
+
+    outbuf_t b = { 0 };
+    deflate_runs(&b, raw, stride * side);
+    free(raw);
+    if (b.failed) {
+        free(b.data);
+        return IPADDR_ERR_INTERNAL;
+    }
+
+    uint8_t ihdr[13] = {
+        (uint8_t)(side >> 24), (uint8_t)(side >> 16), (uint8_t)(side >> 8),
+        (uint8_t)side, (uint8_t)(side >> 24), (uint8_t)(side >> 16),
+        (uint8_t)(side >> 8), (uint8_t)side,
+        8,      /* bit depth */
+        3,      /* indexed color */
+        0, 0, 0
+    };
+    uint8_t rgb[256][3];
+    palette(rgb);
+
+    fwrite(signature, 1, sizeof(signature), fp);
+    write_chunk(fp, "IHDR", ihdr, sizeof(ihdr));
+    write_chunk(fp, "PLTE", &rgb[0][0], sizeof(rgb));
+    write_chunk(fp, "IDAT", b.data, b.len);
+    write_chunk(fp, "IEND", NULL, 0);
+    free(b.data);
+    return ferror(fp) ? IPADDR_ERR_INTERNAL : IPADDR_OK;
+}
+
+int ipaddr_heatmap_write(const ipaddr_heatmap_t *map, int format, FILE *fp)
+{
+    uint8_t *pixels = render(map);
+    if (pixels == NULL)
+        return IPADDR_ERR_INTERNAL;
+
+    uint32_t side = 1u << map->order;
+    int rc = (format == IPADDR_HEATMAP_PNG) ? write_png(pixels, side, fp)
+                                            : write_ppm(pixels, side, fp);
+    free(pixels);
+    return rc;
+}
@@ -0,0 +1,348 @@
+/*
+ * ipaddr_inventory.c - Inventories of labeled networks
+ *
+ * An inventory is a list of networks, each with an optional label, read
+ * from lines in the format of a prefix table (see ipaddr_lpm_read()).
+ * Unlike a table it keeps every line, so that a network listed twice is
+ * two records.
+ *
+ * Networks are aligned ranges: two of them overlap only if one contains
+ * the other.  Conflicts are found with a sweep over the networks sorted by
+ * start address, widest first, keeping a stack of the networks still open
+ * at the current start.  The stack holds a chain of nested networks, each
+ * of which contains the network being visited, so every entry is a
+ * conflict and the sweep costs O(n log n + k) for k conflicting pairs.
+ *
+ * Coverage of a supernet comes from the same sorted order: a single pass
+ * tracks the first address not yet covered, and each gap before the next
+ * network is a hole, summarized into the fewest CIDR blocks.  Only network
+ * boundaries are visited, never the addresses between them.
+ */
+
+#include "ipaddr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+
+typedef struct {
+    uint128_t   start;
+    uint128_t   end;
+    const char *label;   /* NULL for none */
+    size_t      seq;     /* input order, to keep sorting stable */
+    uint8_t     len;
+    bool        ipv6;
+} inv_record_t;
+
+struct ipaddr_inventory {
+    inv_record_t   *records;
+    size_t          count;
+    size_t          cap;
+    ipaddr_arena_t *labels;
+};
+
+ipaddr_inventory_t *ipaddr_inventory_new(void)
+{
+    ipaddr_inventory_t *inv = calloc(1, sizeof(*inv));
+    if (inv == NULL)
+        return NULL;
+    inv->labels = ipaddr_arena_new();
+    if (inv->labels == NULL) {
+        free(inv);
+        return NULL;
+    }
+    return inv;
+}
+
+void ipaddr_inventory_free(ipaddr_inventory_t *inv)
+{
+    if (inv == NULL)
+        return;
+    ipaddr_arena_free(inv->labels);
+    free(inv->records);
+    free(inv);
+}
+
+size_t ipaddr_inventory_count(const ipaddr_inventory_t *inv)
+{
+    return inv->count;
+}
+
+int ipaddr_inventory_add(ipaddr_inventory_t *inv, const ipaddr_t *net,
+                         const char *label)
+{
+    if (inv->count == inv->cap) {
+        size_t cap = inv->cap ? inv->cap * 2 : 1024;
+        inv_record_t *records = realloc(inv->records, cap * sizeof(*records));
+        if (records == NULL)
+            return IPADDR_ERR_INTERNAL;
+        inv->records = records;
+        inv->cap = cap;
+    }
+
+    inv_record_t *r = &inv->records[inv->count];
+    int max_bits = ipaddr_max_prefix(net);
+    int host_bits = max_bits - net->prefix_len;
+    uint128_t hostmask = host_bits >= 128 ? ~(uint128_t)0
+                                          : ((uint128_t)1 << host_bits) - 1;
+    r->start = ipaddr_to_uint128(net) & ~hostmask;
+    r->end = r->start | hostmask;
+    r->len = (uint8_t)net->prefix_len;
+    r->ipv6 = ipaddr_family(net) == AF_INET6;
+    r->seq = inv->count;
+    r->label = NULL;
+    if (label != NULL && *label != '\0') {
+        r->label = ipaddr_arena_strdup(inv->labels, label);
+        if (r->label == NULL)
+            return IPADDR_ERR_INTERNAL;
+    }
+    inv->count++;
+    return IPADDR_OK;
+}
+
+/*
+ * Split an inventory line into its network and label.
+ * Returns 0 on success, 1 for a line without a record, 2 on error.
+ */
+static int parse_line(char *line, ipaddr_t *net, const char **label,
+                      const char **errmsg)
+{
+    char *s = line;
+    while (isspace((unsigned char)*s))
+        s++;
+    if (*s == '\0' || *s == '#')
+        return IPADDR_ERR_BOOL;
+
+    /* The label runs to the end of the line */
+    char *v = s;
+    while (*v != '\0' && !isspace((unsigned char)*v))
+        v++;
+    if (*v != '\0') {
+        *v++ = '\0';
+        while (isspace((unsigned char)*v))
+            v++;
+        char *end = v + strlen(v);
+        while (end > v && isspace((unsigned char)end[-1]))
+            *--end = '\0';
+    }
+    *label = v;
+
+    return ipaddr_parse(s, net, errmsg);
+}
+
+int ipaddr_inventory_read(ipaddr_inventory_t *inv, FILE *fp, size_t *lineno,
+                          const char **errmsg)
+{
+    char *line = NULL;
+    size_t cap = 0;
+    int rc = IPADDR_OK;
+
+    *errmsg = NULL;
+
+    while (getline(&line, &cap, fp) != -1) {
+        ipaddr_t net;
+        const char *label;
+
+        (*lineno)++;
+        rc = parse_line(line, &net, &label, errmsg);
+        if (rc == IPADDR_ERR_BOOL) {
+            rc = IPADDR_OK;
+            continue;
+        }
+        if (rc != IPADDR_OK)
+            break;
+
+        rc = ipaddr_inventory_add(inv, &net, label);
+        if (rc != IPADDR_OK) {
+            *errmsg = "out of memory";
+            break;
+        }
+    }
+
+    if (rc == IPADDR_OK && ferror(fp)) {
+        *errmsg = strerror(errno);
+        rc = IPADDR_ERR_USAGE;
+    }
+
+    free(line);
+    return rc;
+}
+
+int ipaddr_inventory_load(ipaddr_inventory_t *inv, const char *path,
+                          size_t *lineno, const char **errmsg)
+{
+    *lineno = 0;
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        *errmsg = strerror(errno);
+        return IPADDR_ERR_USAGE;
+    }
+
+    int rc = ipaddr_inventory_read(inv, fp, lineno, errmsg);
+    fclose(fp);
+    return rc;
+}
+
+/*
+ * Order records by family and start address, containing networks first,
+ * then by input order.
+ */
+static int record_cmp(const void *pa, const void *pb)
+{
+    const inv_record_t *a = pa, *b = pb;
+    if (a->ipv6 != b->ipv6)
+        return a->ipv6 ? 1 : -1;
+    if (a->start != b->start)
+        return a->start < b->start ? -1 : 1;
+    if (a->len != b->len)
+        return a->len < b->len ? -1 : 1;
+    return a->seq < b->seq ? -1 : (a->seq > b->seq);
+}
+
+/*
+ * Set net to the network of a record.
+ */
+static void record_net(const inv_record_t *r, ipaddr_t *net)
+{
+    ipaddr_t tmpl;
+    memset(&tmpl, 0, sizeof(tmpl));
+    tmpl.addr.sa.sa_family = r->ipv6 ? AF_INET6 : AF_INET;
+    tmpl.prefix_len = r->len;
+    tmpl.has_prefix = true;
+    ipaddr_from_uint128(net, r->start, &tmpl);
+}
+
+static void sort_records(ipaddr_inventory_t *inv)
+{
+    if (inv->count > 0)
+        qsort(inv->records, inv->count, sizeof(*inv->records), record_cmp);
+}
+
+int ipaddr_inventory_conflicts(ipaddr_inventory_t *inv, ipaddr_conflict_fn fn,
+                               void *arg)
+{
+    size_t *stack = malloc((inv->count ? inv->count : 1) * sizeof(*stack));
+    if (stack == NULL)
+        return IPADDR_ERR_INTERNAL;
+    sort_records(inv);
+
+    /* The stack holds the nested networks open at the current start */
+    size_t depth = 0;
+    for (size_t i = 0; i < inv->count; i++) {
+        const inv_record_t *r = &inv->records[i];
+        while (depth > 0) {
+            const inv_record_t *top = &inv->records[stack[depth - 1]];
+            if (top->ipv6 == r->ipv6 && top->end >= r->start)
+                break;
+            depth--;
+        }
+
+        if (depth > 0) {
+            ipaddr_t inner;
+            record_net(r, &inner);
+            for (size_t j = 0; j < depth; j++) {
+                const inv_record_t *o = &inv->records[stack[j]];
+                ipaddr_t outer;
+                record_net(o, &outer);
+                fn(&outer, o->label, &inner, r->label, arg);
+            }
+        }
+        stack[depth++] = i;
+    }
+
+    free(stack);
+    return IPADDR_OK;
+}
+
+/* State of a coverage sweep */
+typedef struct {
+    ipaddr_coverage_t *cov;
+    ipaddr_net_fn      fn;
+    void              *arg;
+} coverage_t;
+
+static uint128_t add_sat(uint128_t a, uint128_t b)
+{
+    return a + b < a ? ~(uint128_t)0 : a + b;
+}
+
+static void count_hole(const ipaddr_t *net, void *arg)
+{
+    coverage_t *c = arg;
+    ipaddr_coverage_t *cov = c->cov;
+
+    cov->holes++;
+    cov->by_len[net->prefix_len]++;
+    if (cov->largest < 0 || net->prefix_len < cov->largest)
+        cov->largest = net->prefix_len;
+    c->fn(net, c->arg);
+}
+
+/*
+ * Report the addresses lo..hi of the supernet as holes.
+ */
+static void add_hole(coverage_t *c, const ipaddr_t *super, uint128_t lo,
+                     uint128_t hi)
+{
+    ipaddr_t first, last;
+    ipaddr_from_uint128(&first, lo, super);
+    ipaddr_from_uint128(&last, hi, super);
+    ipaddr_summarize(&first, &last, count_hole, c);
+}
+
+int ipaddr_inventory_coverage(ipaddr_inventory_t *inv, const ipaddr_t *super,
+                              ipaddr_net_fn fn, void *arg,
+                              ipaddr_coverage_t *cov)
+{
+    ipaddr_t net;
+    ipaddr_network(super, &net);
+    net.has_prefix = true;
+
+    memset(cov, 0, sizeof(*cov));
+    cov->largest = -1;
+    cov->total = ipaddr_num_addresses(&net);
+
+    coverage_t c = { cov, fn, arg };
+    bool ipv6 = ipaddr_family(&net) == AF_INET6;
+    int host_bits = ipaddr_max_prefix(&net) - net.prefix_len;
+    uint128_t lo = ipaddr_to_uint128(&net);
+    uint128_t hi = lo | (host_bits >= 128 ? ~(uint128_t)0
+                                          : ((uint128_t)1 << host_bits) - 1);
+
+    sort_records(inv);
+
+    /* next is the first address not yet covered, if any is left */
+    uint128_t next = lo;
+    bool done = false;
+    for (size_t i = 0; i < inv->count && !done; i++) {
+        const inv_record_t *r = &inv->records[i];
+        if (r->ipv6 != ipv6 || r->end < lo)
+            continue;
+        if (r->start > hi)
+            break;
+
+        uint128_t start = r->start > lo ? r->start : lo;
+        uint128_t end = r->end < hi ? r->end : hi;
+        if (end < next)
+            continue;   /* within networks seen before */
+        if (start > next)
+            add_hole(&c, &net, next, start - 1);
+        else
+            start = next;
+
+        /* end - start + 1 overflows only for all of ::/0 */
+        cov->covered = add_sat(cov->covered, end - start);
+        cov->covered = add_sat(cov->covered, 1);
+        if (end == hi)
+            done = true;
+        else
+            next = end + 1;
+    }
+    if (!done)
+        add_hole(&c, &net, next, hi);
+
+    return IPADDR_OK;
+}
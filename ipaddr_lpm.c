@@ -0,0 +1,1096 @@
+/*
+ * ipaddr_lpm.c - Longest-prefix-match prefix tables
+ *
+ * Prefixes are stored in a binary trie per address family.  A node at depth
+ * N stands for the prefix spelled by the N bits on the path from the root.
+ *
+ * One thread may update a table while others look up addresses in it.  New
+ * nodes are fully initialized before a release store links them in, and the
+ * entry of a node is a single pointer, so a reader sees either the old or the
+ * new state of every prefix.  Nodes unlinked by a delete may still be in use
+ * by readers; they are only reused after ipaddr_lpm_reclaim().
+ */
+
+#include "ipaddr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <ctype.h>
+#include <stdatomic.h>
+
+/*
+ * Number of trie nodes in the first slab.  Each further slab is twice as
+ * large as the one before, up to LPM_SLAB_MAX_NODES, so that the nodes of a
+ * large table end up in a few slabs big enough for huge pages.
+ */
+#define LPM_SLAB_NODES     4096
+#define LPM_SLAB_MAX_NODES (1 << 20)
+
+/*
+ * Rebuild the prefilter once this many keys past half its size have been
+ * added or deleted since it was built.
+ */
+#define LPM_FILTER_SLACK 1024
+
+/*
+ * Number of lookups interleaved by ipaddr_lpm_lookup_batch().  Enough to
+ * keep the memory system busy with one outstanding miss per lookup.
+ */
+#define LPM_BATCH 16
+
+typedef struct lpm_node {
+    _Atomic(struct lpm_node *) child[2];
+    _Atomic(const char *)      entry;  /* interned value, no_value, or NULL */
+} lpm_node_t;
+
+typedef struct lpm_slab {
+    struct lpm_slab *next;
+    size_t           used;
+    size_t           capacity;
+    lpm_node_t       nodes[];
+} lpm_slab_t;
+
+typedef struct lpm_retired_filter {
+    struct lpm_retired_filter *next;
+    ipaddr_filter_t           *filter;
+} lpm_retired_filter_t;
+
+struct ipaddr_lpm {
+    lpm_node_t              *root[2];      /* IPv4, IPv6 */
+    lpm_slab_t              *slabs;
+    lpm_node_t              *free_nodes;   /* linked through child[0] */
+    lpm_node_t             **retired;      /* unlinked, maybe still read */
+    size_t                   nretired;
+    size_t                   retired_cap;
+    size_t                   count;
+    ipaddr_arena_t          *strings;      /* storage of interned values */
+    char                   **values;       /* interned value strings */
+    uint32_t                 nvalues;
+    uint32_t                 values_cap;
+    uint32_t                *value_index;  /* open-addressing hash into values[] */
+    uint32_t                 index_cap;
+    _Atomic(ipaddr_filter_t *) filter;
+    size_t                   filter_keys;  /* keys when the filter was built */
+    size_t                   filter_dirty; /* keys added or deleted since */
+    lpm_retired_filter_t    *retired_filters;
+};
+
+/*
+ * Entry of a prefix without a value.
+ */
+static const char no_value[] = "";
+
+/*
+ * Get the bit of val at the given depth (0 = most significant).
+ */
+static int key_bit(uint128_t val, int max_bits, int depth)
+{
+    return (int)(val >> (max_bits - 1 - depth)) & 1;
+}
+
+static lpm_node_t *node_child(const lpm_node_t *node, int bit)
+{
+    return atomic_load_explicit(&node->child[bit], memory_order_acquire);
+}
+
+static const char *node_entry(const lpm_node_t *node)
+{
+    return atomic_load_explicit(&node->entry, memory_order_acquire);
+}
+
+/*
+ * Get the size of a slab of capacity nodes.
+ */
+static size_t slab_size(size_t capacity)
+{
+    return sizeof(lpm_slab_t) + capacity * sizeof(lpm_node_t);
+}
+
+/*
+ * Allocate an empty trie node.  It is not visible to readers until linked.
+ */
+static lpm_node_t *node_alloc(ipaddr_lpm_t *lpm)
+{
+    lpm_node_t *node = lpm->free_nodes;
+
+    if (node != NULL) {
+        lpm->free_nodes = atomic_load_explicit(&node->child[0], memory_order_relaxed);
+    } else {
+        lpm_slab_t *slab = lpm->slabs;
+        if (slab == NULL || slab->used == slab->capacity) {
+            size_t capacity = LPM_SLAB_NODES;
+            if (slab != NULL && slab->capacity < LPM_SLAB_MAX_NODES)
+                capacity = slab->capacity * 2;
+            else if (slab != NULL)
+                capacity = slab->capacity;
+
+            /* Fill whole huge pages */
+            size_t size = slab_size(capacity);
+            if (size >= IPADDR_MEM_HUGE) {
+                size = (size + IPADDR_MEM_HUGE - 1) / IPADDR_MEM_HUGE * IPADDR_MEM_HUGE;
+                capacity = (size - sizeof(lpm_slab_t)) / sizeof(lpm_node_t);
+            }
+
+            slab = ipaddr_mem_alloc(slab_size(capacity));
+            if (slab == NULL)
+                return NULL;
+            slab->next = lpm->slabs;
+            slab->capacity = capacity;
+            lpm->slabs = slab;
+        }
+        node = &slab->nodes[slab->used++];
+    }
+
+    atomic_init(&node->child[0], NULL);
+    atomic_init(&node->child[1], NULL);
+    atomic_init(&node->entry, NULL);
+    return node;
+}
+
+/*
+ * Set aside a node unlinked from the trie until readers are done with it.
+ */
+static int node_retire(ipaddr_lpm_t *lpm, lpm_node_t *node)
+{
+    if (lpm->nretired == lpm->retired_cap) {
+        size_t cap = lpm->retired_cap ? lpm->retired_cap * 2 : 64;
+        lpm_node_t **retired = realloc(lpm->retired, cap * sizeof(*retired));
+        if (retired == NULL)
+            return IPADDR_ERR_INTERNAL;
+        lpm->retired = retired;
+        lpm->retired_cap = cap;
+    }
+    lpm->retired[lpm->nretired++] = node;
+    return IPADDR_OK;
+}
+
+/*
+ * FNV-1a string hash.
+ */
+static uint32_t hash_string(const char *s)
+{
+    uint32_t h = 2166136261u;
+    while (*s) {
+        h ^= (uint8_t)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+/*
+ * Rebuild the value hash index with at least the given capacity.
+ */
+static int grow_index(ipaddr_lpm_t *lpm, uint32_t cap)
+{
+    uint32_t *index = calloc(cap, sizeof(*index));
+    if (index == NULL)
+        return IPADDR_ERR_INTERNAL;
+
+    for (uint32_t id = 1; id < lpm->nvalues; id++) {
+        uint32_t h = hash_string(lpm->values[id]) & (cap - 1);
+        while (index[h] != 0)
+            h = (h + 1) & (cap - 1);
+        index[h] = id;
+    }
+
+    free(lpm->value_index);
+    lpm->value_index = index;
+    lpm->index_cap = cap;
+    return IPADDR_OK;
+}
+
+/*
+ * Get the interned copy of a value string, adding it if not yet present.
+ * NULL or empty values are interned as no_value.  Interned strings live as
+ * long as the table, so readers may keep using them.
+ */
+static int intern_value(ipaddr_lpm_t *lpm, const char *value, const char **entry)
+{
+    if (value == NULL || *value == '\0') {
+        *entry = no_value;
+        return IPADDR_OK;
+    }
+
+    /* Keep the index at most half full */
+    if ((lpm->nvalues + 1) * 2 > lpm->index_cap) {
+        int rc = grow_index(lpm, lpm->index_cap ? lpm->index_cap * 2 : 64);
+        if (rc != IPADDR_OK)
+            return rc;
+    }
+
+    uint32_t mask = lpm->index_cap - 1;
+    uint32_t h = hash_string(value) & mask;
+    while (lpm->value_index[h] != 0) {
+        if (strcmp(lpm->values[lpm->value_index[h]], value) == 0) {
+            *entry = lpm->values[lpm->value_index[h]];
+            return IPADDR_OK;
+        }
+        h = (h + 1) & mask;
+    }
+
+    if (lpm->nvalues == lpm->values_cap) {
+        uint32_t cap = lpm->values_cap * 2;
+        char **values = realloc(lpm->values, cap * sizeof(*values));
+        if (values == NULL)
+            return IPADDR_ERR_INTERNAL;
+        lpm->values = values;
+        lpm->values_cap = cap;
+    }
+
+    char *copy = ipaddr_arena_strdup(lpm->strings, value);
+    if (copy == NULL)
+        return IPADDR_ERR_INTERNAL;
+
+    lpm->value_index[h] = lpm->nvalues;
+    lpm->values[lpm->nvalues++] = copy;
+    *entry = copy;
+    return IPADDR_OK;
+}
+
+ipaddr_lpm_t *ipaddr_lpm_new(void)
+{
+    ipaddr_lpm_t *lpm = calloc(1, sizeof(*lpm));
+    if (lpm == NULL)
+        return NULL;
+
+    lpm->strings = ipaddr_arena_new();
+    lpm->values_cap = 16;
+    lpm->values = calloc(lpm->values_cap, sizeof(*lpm->values));
+    lpm->nvalues = 1;  /* id 0 marks empty index slots */
+    atomic_init(&lpm->filter, NULL);
+    lpm->root[0] = node_alloc(lpm);
+    lpm->root[1] = node_alloc(lpm);
+
+    if (lpm->strings == NULL || lpm->values == NULL ||
+        lpm->root[0] == NULL || lpm->root[1] == NULL) {
+        ipaddr_lpm_free(lpm);
+        return NULL;
+    }
+
+    return lpm;
+}
+
+void ipaddr_lpm_free(ipaddr_lpm_t *lpm)
+{
+    if (lpm == NULL)
+        return;
+
+    ipaddr_lpm_reclaim(lpm);
+    while (lpm->slabs != NULL) {
+        lpm_slab_t *next = lpm->slabs->next;
+        ipaddr_mem_free(lpm->slabs, slab_size(lpm->slabs->capacity));
+        lpm->slabs = next;
+    }
+    ipaddr_arena_free(lpm->strings);
+    free(lpm->values);
+    free(lpm->value_index);
+    free(lpm->retired);
+    ipaddr_filter_free(atomic_load(&lpm->filter));
+    free(lpm);
+}
+
+/*
+ * Account for filter keys added or deleted, rebuilding the filter once it
+ * has drifted too far from the table.
+ */
+static int filter_changed(ipaddr_lpm_t *lpm, const ipaddr_t *prefix)
+{
+    lpm->filter_dirty += ipaddr_filter_keys(prefix);
+    if (lpm->filter_dirty > lpm->filter_keys / 2 + LPM_FILTER_SLACK)
+        return ipaddr_lpm_build_filter(lpm);
+    return IPADDR_OK;
+}
+
+/*
+ * Add a prefix with an optional value.
+ */
+int ipaddr_lpm_insert(ipaddr_lpm_t *lpm, const ipaddr_t *prefix,
+                      const char *value)
+{
+    int max_bits = ipaddr_max_prefix(prefix);
+    uint128_t val = ipaddr_to_uint128(prefix);
+    lpm_node_t *node = lpm->root[ipaddr_is_ipv6(prefix)];
+    const char *entry;
+
+    int rc = intern_value(lpm, value, &entry);
+    if (rc != IPADDR_OK)
+        return rc;
+
+    for (int depth = 0; depth < prefix->prefix_len; depth++) {
+        int bit = key_bit(val, max_bits, depth);
+        lpm_node_t *child = atomic_load_explicit(&node->child[bit], memory_order_relaxed);
+        if (child == NULL) {
+            child = node_alloc(lpm);
+            if (child == NULL)
+                return IPADDR_ERR_INTERNAL;
+            atomic_store_explicit(&node->child[bit], child, memory_order_release);
+        }
+        node = child;
+    }
+
+    /* Filter first, so that readers never see a prefix the filter rejects */
+    ipaddr_filter_t *filter = atomic_load_explicit(&lpm->filter, memory_order_relaxed);
+    bool is_new = atomic_load_explicit(&node->entry, memory_order_relaxed) == NULL;
+    if (filter != NULL && is_new)
+        ipaddr_filter_add(filter, prefix);
+
+    atomic_store_explicit(&node->entry, entry, memory_order_release);
+
+    if (is_new) {
+        lpm->count++;
+        if (filter != NULL)
+            return filter_changed(lpm, prefix);
+    }
+    return IPADDR_OK;
+}
+
+/*
+ * Remove a prefix.
+ */
+int ipaddr_lpm_delete(ipaddr_lpm_t *lpm, const ipaddr_t *prefix)
+{
+    lpm_node_t *path[129];
+    int max_bits = ipaddr_max_prefix(prefix);
+    uint128_t val = ipaddr_to_uint128(prefix);
+    int depth;
+
+    path[0] = lpm->root[ipaddr_is_ipv6(prefix)];
+    for (depth = 0; depth < prefix->prefix_len; depth++) {
+        path[depth + 1] = atomic_load_explicit(
+            &path[depth]->child[key_bit(val, max_bits, depth)], memory_order_relaxed);
+        if (path[depth + 1] == NULL)
+            return IPADDR_ERR_BOOL;
+    }
+    if (atomic_load_explicit(&path[depth]->entry, memory_order_relaxed) == NULL)
+        return IPADDR_ERR_BOOL;
+
+    atomic_store_explicit(&path[depth]->entry, NULL, memory_order_release);
+    lpm->count--;
+
+    /* Prune the branch that no longer leads to any prefix */
+    for (; depth > 0; depth--) {
+        lpm_node_t *node = path[depth];
+        if (atomic_load_explicit(&node->entry, memory_order_relaxed) != NULL ||
+            atomic_load_explicit(&node->child[0], memory_order_relaxed) != NULL ||
+            atomic_load_explicit(&node->child[1], memory_order_relaxed) != NULL)
+            break;
+        if (node_retire(lpm, node) != IPADDR_OK)
+            break;  /* leave it linked; it is harmless */
+        atomic_store_explicit(&path[depth - 1]->child[key_bit(val, max_bits, depth - 1)],
+                              NULL, memory_order_release);
+    }
+
+    /* Deleted keys stay in the filter as false positives until a rebuild */
+    if (atomic_load_explicit(&lpm->filter, memory_order_relaxed) != NULL)
+        return filter_changed(lpm, prefix);
+    return IPADDR_OK;
+}
+
+/*
+ * Make nodes and filters retired by updates available for reuse.
+ */
+void ipaddr_lpm_reclaim(ipaddr_lpm_t *lpm)
+{
+    for (size_t i = 0; i < lpm->nretired; i++) {
+        lpm_node_t *node = lpm->retired[i];
+        atomic_store_explicit(&node->child[0], lpm->free_nodes, memory_order_relaxed);
+        lpm->free_nodes = node;
+    }
+    lpm->nretired = 0;
+
+    while (lpm->retired_filters != NULL) {
+        lpm_retired_filter_t *next = lpm->retired_filters->next;
+        ipaddr_filter_free(lpm->retired_filters->filter);
+        free(lpm->retired_filters);
+        lpm->retired_filters = next;
+    }
+}
+
+/*
+ * Parse a table file line into its prefix and value, or a withdrawal.
+ */
+int ipaddr_lpm_parse_line(char *line, ipaddr_t *prefix, const char **value,
+                          bool *withdraw, const char **errmsg)
+{
+    char *s = line;
+    while (isspace((unsigned char)*s))
+        s++;
+    if (*s == '\0' || *s == '#')
+        return IPADDR_ERR_BOOL;
+
+    *withdraw = (*s == '-');
+    if (*withdraw)
+        s++;
+
+    /* Split "PREFIX [VALUE]"; the value runs to the end of the line */
+    char *v = s;
+    while (*v != '\0' && !isspace((unsigned char)*v))
+        v++;
+    if (*v != '\0') {
+        *v++ = '\0';
+        while (isspace((unsigned char)*v))
+            v++;
+        char *end = v + strlen(v);
+        while (end > v && isspace((unsigned char)end[-1]))
+            *--end = '\0';
+    }
+    *value = v;
+
+    ipaddr_t addr;
+    int rc = ipaddr_parse(s, &addr, errmsg);
+    if (rc != IPADDR_OK)
+        return rc;
+    ipaddr_network(&addr, prefix);
+    return IPADDR_OK;
+}
+
+/*
+ * Apply prefix table lines read from a stream.
+ */
+int ipaddr_lpm_read(ipaddr_lpm_t *lpm, FILE *fp, size_t *lineno,
+                    const char **errmsg)
+{
+    char *line = NULL;
+    size_t cap = 0;
+    int rc = IPADDR_OK;
+
+    *errmsg = NULL;
+
+    while (getline(&line, &cap, fp) != -1) {
+        ipaddr_t prefix;
+        const char *value;
+        bool withdraw;
+
+        (*lineno)++;
+        rc = ipaddr_lpm_parse_line(line, &prefix, &value, &withdraw, errmsg);
+        if (rc == IPADDR_ERR_BOOL) {
+            rc = IPADDR_OK;
+            continue;
+        }
+        if (rc != IPADDR_OK)
+            break;
+
+        if (withdraw) {
+            rc = ipaddr_lpm_delete(lpm, &prefix);
+            if (rc == IPADDR_ERR_BOOL)
+                rc = IPADDR_OK;  /* withdrawing an absent prefix is a no-op */
+        } else {
+            rc = ipaddr_lpm_insert(lpm, &prefix, value);
+        }
+        if (rc != IPADDR_OK) {
+            *errmsg = "out of memory";
+            break;
+        }
+    }
+
+    if (rc == IPADDR_OK && ferror(fp)) {
+        *errmsg = strerror(errno);
+        rc = IPADDR_ERR_USAGE;
+    }
+
+    free(line);
+    return rc;
+}
+
+/*
+ * Load prefixes from a text file or an MRT dump.
+ */
+int ipaddr_lpm_load(ipaddr_lpm_t *lpm, const char *path, size_t *lineno,
+                    const char **errmsg)
+{
+    if (ipaddr_mrt_detect(path))
+        return ipaddr_lpm_load_mrt(lpm, path, lineno, errmsg);
+
+    *lineno = 0;
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        *errmsg = strerror(errno);
+        return IPADDR_ERR_USAGE;
+    }
+
+    int rc = ipaddr_lpm_read(lpm, fp, lineno, errmsg);
+    fclose(fp);
+    return rc;
+}
+
+/*
+ * Find the longest prefix containing addr.
+ */
+int ipaddr_lpm_lookup(const ipaddr_lpm_t *lpm, const ipaddr_t *addr,
+                      ipaddr_t *match, const char **value)
+{
+    const ipaddr_filter_t *filter = atomic_load_explicit(&lpm->filter, memory_order_acquire);
+    if (filter != NULL && !ipaddr_filter_maybe(filter, addr))
+        return IPADDR_ERR_BOOL;
+
+    int max_bits = ipaddr_max_prefix(addr);
+    uint128_t val = ipaddr_to_uint128(addr);
+    const lpm_node_t *node = lpm->root[ipaddr_is_ipv6(addr)];
+    const char *best = NULL;
+    int best_len = 0;
+
+    for (int depth = 0; node != NULL; depth++) {
+        const char *entry = node_entry(node);
+        if (entry != NULL) {
+            best = entry;
+            best_len = depth;
+        }
+        if (depth == addr->prefix_len)
+            break;
+        node = node_child(node, key_bit(val, max_bits, depth));
+    }
+
+    if (best == NULL)
+        return IPADDR_ERR_BOOL;
+
+    ipaddr_super(addr, best_len, match);
+    *value = (best == no_value) ? NULL : best;
+    return IPADDR_OK;
+}
+
+/*
+ * In-progress lookup of ipaddr_lpm_lookup_batch().
+ */
+typedef struct {
+    const lpm_node_t *node;     /* next node to visit */
+    uint128_t         val;
+    int               max_bits;
+    int               depth;
+    const char       *best;
+    int               best_len;
+} lpm_cursor_t;
+
+/*
+ * Look up to LPM_BATCH keys, advancing each by one trie level per round and
+ * prefetching the node it visits next, so that the cache misses of all the
+ * lookups overlap instead of being taken one after another.
+ */
+static size_t lookup_group(const ipaddr_lpm_t *lpm, const ipaddr_filter_t *filter,
+                           const ipaddr_t *keys, size_t n, ipaddr_lpm_result_t *out)
+{
+    lpm_cursor_t cur[LPM_BATCH];
+    size_t active[LPM_BATCH];
+    size_t nactive = 0;
+    size_t matches = 0;
+
+    if (filter != NULL) {
+        for (size_t i = 0; i < n; i++)
+            ipaddr_filter_prefetch(filter, &keys[i]);
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        lpm_cursor_t *c = &cur[i];
+        c->best = NULL;
+        c->best_len = 0;
+        if (filter != NULL && !ipaddr_filter_maybe(filter, &keys[i]))
+            continue;
+
+        c->node = lpm->root[ipaddr_is_ipv6(&keys[i])];
+        c->val = ipaddr_to_uint128(&keys[i]);
+        c->max_bits = ipaddr_max_prefix(&keys[i]);
+        c->depth = 0;
+        if (c->node != NULL)
+            active[nactive++] = i;
+    }
+
+    while (nactive > 0) {
+        size_t still = 0;
+
+        for (size_t j = 0; j < nactive; j++) {
+            size_t i = active[j];
+            lpm_cursor_t *c = &cur[i];
+
+            const char *entry = node_entry(c->node);
+            if (entry != NULL) {
+                c->best = entry;
+                c->best_len = c->depth;
+            }
+            if (c->depth == keys[i].prefix_len)
+                continue;
+
+            c->node = node_child(c->node, key_bit(c->val, c->max_bits, c->depth));
+            c->depth++;
+            if (c->node == NULL)
+                continue;
+            __builtin_prefetch(c->node);
+            active[still++] = i;
+        }
+        nactive = still;
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if (cur[i].best == NULL) {
+            out[i].rc = IPADDR_ERR_BOOL;
+            out[i].value = NULL;
+            continue;
+        }
+        ipaddr_super(&keys[i], cur[i].best_len, &out[i].match);
+        out[i].value = (cur[i].best == no_value) ? NULL : cur[i].best;
+        out[i].rc = IPADDR_OK;
+        matches++;
+    }
+    return matches;
+}
+
+size_t ipaddr_lpm_lookup_batch(const ipaddr_lpm_t *lpm, const ipaddr_t *keys,
+                               size_t n, ipaddr_lpm_result_t *out)
+{
+    const ipaddr_filter_t *filter = atomic_load_explicit(&lpm->filter, memory_order_acquire);
+    size_t matches = 0;
+
+    for (size_t i = 0; i < n; i += LPM_BATCH) {
+        size_t group = (n - i < LPM_BATCH) ? n - i : LPM_BATCH;
+        matches += lookup_group(lpm, filter, keys + i, group, out + i);
+    }
+    return matches;
+}
+
+size_t ipaddr_lpm_count(const ipaddr_lpm_t *lpm)
+{
+    return lpm->count;
+}
+
+/*
+ * Walk a subtree in pre-order, lower branch first.
+ */
+static void walk_node(const lpm_node_t *node, ipaddr_t *tmpl, uint128_t val,
+                      int depth, ipaddr_lpm_walk_fn fn, void *arg)
+{
+    int max_bits = ipaddr_max_prefix(tmpl);
+    const char *entry = node_entry(node);
+
+    if (entry != NULL) {
+        ipaddr_t prefix;
+        tmpl->prefix_len = depth;
+        ipaddr_from_uint128(&prefix, val, tmpl);
+        fn(&prefix, (entry == no_value) ? NULL : entry, arg);
+    }
+
+    for (int bit = 0; bit < 2; bit++) {
+        const lpm_node_t *child = node_child(node, bit);
+        if (child != NULL)
+            walk_node(child, tmpl, val | ((uint128_t)bit << (max_bits - 1 - depth)),
+                      depth + 1, fn, arg);
+    }
+}
+
+/*
+ * Call fn for every prefix in the table, in ipaddr_cmp() order.
+ */
+void ipaddr_lpm_walk(const ipaddr_lpm_t *lpm, ipaddr_lpm_walk_fn fn, void *arg)
+{
+    static const int families[2] = { AF_INET, AF_INET6 };
+
+    for (int i = 0; i < 2; i++) {
+        ipaddr_t tmpl;
+        memset(&tmpl, 0, sizeof(tmpl));
+        tmpl.addr.sa.sa_family = families[i];
+        tmpl.has_prefix = true;
+        walk_node(lpm->root[i], &tmpl, 0, 0, fn, arg);
+    }
+}
+
+/*
+ * Node of the full binary trie of ORTC, with its set of candidate entries
+ * in ortc_t.pool.
+ */
+typedef struct {
+    uint32_t child[2];      /* both 0 for leaves */
+    uint32_t set;
+    uint32_t nset;
+} ortc_node_t;
+
+typedef struct {
+    ortc_node_t  *nodes;
+    size_t        nnodes;
+    size_t        nodes_cap;
+    const char  **pool;     /* entries (NULL for no match), sorted per set */
+    size_t        npool;
+    size_t        pool_cap;
+} ortc_t;
+
+static bool ortc_reserve(ortc_t *o, size_t nodes, size_t entries)
+{
+    if (o->nnodes + nodes > o->nodes_cap) {
+        size_t cap = o->nodes_cap ? o->nodes_cap * 2 : 4096;
+        while (cap < o->nnodes + nodes)
+            cap *= 2;
+        ortc_node_t *n = realloc(o->nodes, cap * sizeof(*n));
+        if (n == NULL)
+            return false;
+        o->nodes = n;
+        o->nodes_cap = cap;
+    }
+    if (o->npool + entries > o->pool_cap) {
+        size_t cap = o->pool_cap ? o->pool_cap * 2 : 4096;
+        while (cap < o->npool + entries)
+            cap *= 2;
+        const char **p = realloc(o->pool, cap * sizeof(*p));
+        if (p == NULL)
+            return false;
+        o->pool = p;
+        o->pool_cap = cap;
+    }
+    return true;
+}
+
+static uint32_t ortc_leaf(ortc_t *o, const char *entry)
+{
+    uint32_t i = (uint32_t)o->nnodes++;
+    o->nodes[i] = (ortc_node_t){ { 0, 0 }, (uint32_t)o->npool, 1 };
+    o->pool[o->npool++] = entry;
+    return i;
+}
+
+/*
+ * Set the candidates of node i from those of its children: their
+ * intersection if not empty, their union otherwise.  No entry can stand
+ * for no match, so above addresses without one, no match is the only
+ * candidate.
+ */
+static bool ortc_merge(ortc_t *o, uint32_t i)
+{
+    const ortc_node_t *a = &o->nodes[o->nodes[i].child[0]];
+    const ortc_node_t *b = &o->nodes[o->nodes[i].child[1]];
+    if (!ortc_reserve(o, 0, a->nset + b->nset))
+        return false;
+
+    const char **pa = o->pool + a->set, **pb = o->pool + b->set;
+    const char **out = o->pool + o->npool;
+    size_t na = a->nset, nb = b->nset, n = 0;
+
+    /* Sets are sorted, so no match comes first */
+    if (pa[0] == NULL || pb[0] == NULL) {
+        out[n++] = NULL;
+    } else {
+        for (size_t x = 0, y = 0; x < na && y < nb; ) {
+            if ((uintptr_t)pa[x] < (uintptr_t)pb[y])
+                x++;
+            else if ((uintptr_t)pa[x] > (uintptr_t)pb[y])
+                y++;
+            else {
+                out[n++] = pa[x];
+                x++, y++;
+            }
+        }
+    }
+    if (n == 0) {
+        size_t x = 0, y = 0;
+        while (x < na || y < nb) {
+            if (y == nb || (x < na && (uintptr_t)pa[x] < (uintptr_t)pb[y]))
+                out[n++] = pa[x++];
+            else if (x == na || (uintptr_t)pa[x] > (uintptr_t)pb[y])
+                out[n++] = pb[y++];
+            else {
+                out[n++] = pa[x++];
+                y++;
+            }
+        }
+    }
+
+    o->nodes[i].set = (uint32_t)o->npool;
+    o->nodes[i].nset = (uint32_t)n;
+    o->npool += n;
+    return true;
+}
+
+/*
+ * First two passes of ORTC: turn the subtree at node into a full binary
+ * trie, missing children becoming leaves with the entry they inherit, and
+ * compute the candidates of every node bottom-up.  Returns the index of
+ * the new node, or UINT32_MAX if out of memory.
+ */
+static uint32_t ortc_build(ortc_t *o, const lpm_node_t *node, const char *inherited)
+{
+    const char *entry = node_entry(node);
+    if (entry != NULL)
+        inherited = entry;
+
+    const lpm_node_t *child[2] = { node_child(node, 0), node_child(node, 1) };
+    if (!ortc_reserve(o, 1, 1))
+        return UINT32_MAX;
+    if (child[0] == NULL && child[1] == NULL)
+        return ortc_leaf(o, inherited);
+
+    uint32_t i = (uint32_t)o->nnodes++;
+    for (int bit = 0; bit < 2; bit++) {
+        uint32_t c;
+        if (child[bit] != NULL) {
+            c = ortc_build(o, child[bit], inherited);
+            if (c == UINT32_MAX)
+                return c;
+        } else {
+            if (!ortc_reserve(o, 1, 1))
+                return UINT32_MAX;
+            c = ortc_leaf(o, inherited);
+        }
+        o->nodes[i].child[bit] = c;
+    }
+    return ortc_merge(o, i) ? i : UINT32_MAX;
+}
+
+/*
+ * Last pass of ORTC: keep the inherited entry wherever it is a candidate,
+ * and add the least candidate as an entry elsewhere.  A node with no match
+ * as a candidate has it as its only one, as do all its ancestors, so no
+ * match is always inherited there and never needs an entry.
+ */
+static void ortc_emit(const ortc_t *o, uint32_t i, const char *inherited,
+                      ipaddr_t *tmpl, uint128_t val, int depth,
+                      ipaddr_lpm_walk_fn fn, void *arg)
+{
+    const ortc_node_t *node = &o->nodes[i];
+    const char *const *set = o->pool + node->set;
+    bool found = false;
+
+    for (uint32_t k = 0; k < node->nset && !found; k++)
+        found = (set[k] == inherited);
+    if (!found) {
+        /* Sets are in address order; pick by value for stable output */
+        ipaddr_t prefix;
+        inherited = set[0];
+        for (uint32_t k = 1; k < node->nset; k++) {
+            if (strcmp(set[k], inherited) < 0)
+                inherited = set[k];
+        }
+        tmpl->prefix_len = depth;
+        ipaddr_from_uint128(&prefix, val, tmpl);
+        fn(&prefix, (inherited == no_value) ? NULL : inherited, arg);
+    }
+
+    if (node->child[0] == 0)
+        return;
+    int max_bits = ipaddr_max_prefix(tmpl);
+    for (int bit = 0; bit < 2; bit++)
+        ortc_emit(o, node->child[bit], inherited, tmpl,
+                  val | ((uint128_t)bit << (max_bits - 1 - depth)),
+                  depth + 1, fn, arg);
+}
+
+/*
+ * Walk the smallest equivalent table, computed with ORTC (Draves et al.,
+ * "Constructing Optimal IP Routing Tables").
+ */
+int ipaddr_lpm_compress(const ipaddr_lpm_t *lpm, ipaddr_lpm_walk_fn fn, void *arg)
+{
+    static const int families[2] = { AF_INET, AF_INET6 };
+    int rc = IPADDR_OK;
+
+    for (int i = 0; i < 2 && rc == IPADDR_OK; i++) {
+        ortc_t o = { 0 };
+        uint32_t root = ortc_build(&o, lpm->root[i], NULL);
+        if (root == UINT32_MAX) {
+            rc = IPADDR_ERR_INTERNAL;
+        } else {
+            ipaddr_t tmpl;
+            memset(&tmpl, 0, sizeof(tmpl));
+            tmpl.addr.sa.sa_family = families[i];
+            tmpl.has_prefix = true;
+            ortc_emit(&o, root, NULL, &tmpl, 0, 0, fn, arg);
+        }
+        free(o.nodes);
+        free(o.pool);
+    }
+    return rc;
+}
+
+/*
+ * Walk two subtrees at the same position in pre-order, lower branch first,
+ * reporting where their entries differ.
+ */
+static void diff_node(const lpm_node_t *a, const lpm_node_t *b, ipaddr_t *tmpl,
+                      uint128_t val, int depth, ipaddr_lpm_diff_fn fn, void *arg)
+{
+    int max_bits = ipaddr_max_prefix(tmpl);
+    const char *ea = (a != NULL) ? node_entry(a) : NULL;
+    const char *eb = (b != NULL) ? node_entry(b) : NULL;
+    int kind = 0;
+
+    if (ea != NULL && eb == NULL)
+        kind = IPADDR_LPM_REMOVED;
+    else if (ea == NULL && eb != NULL)
+        kind = IPADDR_LPM_ADDED;
+    else if (ea != NULL && strcmp(ea, eb) != 0)
+        kind = IPADDR_LPM_CHANGED;
+    if (kind != 0) {
+        ipaddr_t prefix;
+        tmpl->prefix_len = depth;
+        ipaddr_from_uint128(&prefix, val, tmpl);
+        fn(&prefix, kind, (ea == no_value) ? NULL : ea,
+           (eb == no_value) ? NULL : eb, arg);
+    }
+
+    for (int bit = 0; bit < 2; bit++) {
+        const lpm_node_t *ca = (a != NULL) ? node_child(a, bit) : NULL;
+        const lpm_node_t *cb = (b != NULL) ? node_child(b, bit) : NULL;
+        if (ca != NULL || cb != NULL)
+            diff_node(ca, cb, tmpl, val | ((uint128_t)bit << (max_bits - 1 - depth)),
+                      depth + 1, fn, arg);
+    }
+}
+
+void ipaddr_lpm_diff(const ipaddr_lpm_t *old, const ipaddr_lpm_t *new,
+                     ipaddr_lpm_diff_fn fn, void *arg)
+{
+    static const int families[2] = { AF_INET, AF_INET6 };
+
+    for (int i = 0; i < 2; i++) {
+        ipaddr_t tmpl;
+        memset(&tmpl, 0, sizeof(tmpl));
+        tmpl.addr.sa.sa_family = families[i];
+        tmpl.has_prefix = true;
+        diff_node(old->root[i], new->root[i], &tmpl, 0, 0, fn, arg);
+    }
+}
+
+/* Longest match so far on one side of ipaddr_lpm_diff_matches() */
+typedef struct {
+    const char *entry;          /* NULL for no match */
+    int         depth;
+} lpm_match_t;
+
+/* Networks found by ipaddr_lpm_diff_matches(), in order */
+typedef struct {
+    struct { uint128_t val; int depth; } *nets;
+    size_t      count;
+    size_t      cap;
+    bool        failed;
+} lpm_nets_t;
+
+static void push_net(lpm_nets_t *nets, uint128_t val, int depth)
+{
+    if (nets->failed)
+        return;
+    if (nets->count == nets->cap) {
+        size_t cap = nets->cap ? nets->cap * 2 : 256;
+        void *n = realloc(nets->nets, cap * sizeof(*nets->nets));
+        if (n == NULL) {
+            nets->failed = true;
+            return;
+        }
+        nets->nets = n;
+        nets->cap = cap;
+    }
+    nets->nets[nets->count].val = val;
+    nets->nets[nets->count].depth = depth;
+    nets->count++;
+}
+
+/*
+ * Find the addresses under two subtrees at the same position whose
+ * longest matches differ.  Returns true if all of them do, leaving the
+ * caller to add the whole subtree, so that sibling networks merge.
+ */
+static bool diff_matches(const lpm_node_t *a, const lpm_node_t *b,
+                         lpm_match_t ma, lpm_match_t mb, int max_bits,
+                         uint128_t val, int depth, lpm_nets_t *nets)
+{
+    const char *e;
+    if (a != NULL && (e = node_entry(a)) != NULL)
+        ma = (lpm_match_t){ e, depth };
+    if (b != NULL && (e = node_entry(b)) != NULL)
+        mb = (lpm_match_t){ e, depth };
+
+    const lpm_node_t *ca[2] = { NULL, NULL }, *cb[2] = { NULL, NULL };
+    for (int bit = 0; bit < 2; bit++) {
+        ca[bit] = (a != NULL) ? node_child(a, bit) : NULL;
+        cb[bit] = (b != NULL) ? node_child(b, bit) : NULL;
+    }
+
+    /* Nothing deeper on either side: every address has the same matches */
+    if (ca[0] == NULL && ca[1] == NULL && cb[0] == NULL && cb[1] == NULL) {
+        if (ma.entry == NULL || mb.entry == NULL)
+            return ma.entry != mb.entry;
+        return ma.depth != mb.depth || strcmp(ma.entry, mb.entry) != 0;
+    }
+
+    uint128_t hi = val | ((uint128_t)1 << (max_bits - 1 - depth));
+    bool lo_all = diff_matches(ca[0], cb[0], ma, mb, max_bits, val, depth + 1, nets);
+    if (lo_all)
+        push_net(nets, val, depth + 1);
+    bool hi_all = diff_matches(ca[1], cb[1], ma, mb, max_bits, hi, depth + 1, nets);
+    if (lo_all && hi_all) {
+        if (!nets->failed)
+            nets->count--;
+        return true;
+    }
+    if (hi_all)
+        push_net(nets, hi, depth + 1);
+    return false;
+}
+
+int ipaddr_lpm_diff_matches(const ipaddr_lpm_t *old, const ipaddr_lpm_t *new,
+                            ipaddr_lpm_walk_fn fn, void *arg)
+{
+    static const int families[2] = { AF_INET, AF_INET6 };
+    int rc = IPADDR_OK;
+
+    for (int i = 0; i < 2 && rc == IPADDR_OK; i++) {
+        ipaddr_t tmpl;
+        memset(&tmpl, 0, sizeof(tmpl));
+        tmpl.addr.sa.sa_family = families[i];
+        tmpl.has_prefix = true;
+
+        lpm_nets_t nets = { 0 };
+        lpm_match_t none = { NULL, 0 };
+        int max_bits = ipaddr_max_prefix(&tmpl);
+        if (diff_matches(old->root[i], new->root[i], none, none, max_bits,
+                         0, 0, &nets))
+            push_net(&nets, 0, 0);
+
+        if (nets.failed) {
+            rc = IPADDR_ERR_INTERNAL;
+        } else {
+            for (size_t k = 0; k < nets.count; k++) {
+                ipaddr_t net;
+                tmpl.prefix_len = nets.nets[k].depth;
+                ipaddr_from_uint128(&net, nets.nets[k].val, &tmpl);
+                fn(&net, NULL, arg);
+            }
+        }
+        free(nets.nets);
+    }
+    return rc;
+}
+
+static void count_filter_keys(const ipaddr_t *prefix, const char *value, void *arg)
+{
+    (void)value;
+    *(size_t *)arg += ipaddr_filter_keys(prefix);
+}
+
+static void add_filter_keys(const ipaddr_t *prefix, const char *value, void *arg)
+{
+    (void)value;
+    ipaddr_filter_add(arg, prefix);
+}
+
+/*
+ * Build the lookup prefilter over the table's prefixes.
+ */
+int ipaddr_lpm_build_filter(ipaddr_lpm_t *lpm)
+{
+    size_t nkeys = 0;
+    ipaddr_lpm_walk(lpm, count_filter_keys, &nkeys);
+
+    lpm_retired_filter_t *retired = malloc(sizeof(*retired));
+    ipaddr_filter_t *filter = ipaddr_filter_new(nkeys);
+    if (retired == NULL || filter == NULL) {
+        free(retired);
+        ipaddr_filter_free(filter);
+        return IPADDR_ERR_INTERNAL;
+    }
+    ipaddr_lpm_walk(lpm, add_filter_keys, filter);
+
+    /* Readers may still be probing the old filter */
+    retired->filter = atomic_exchange(&lpm->filter, filter);
+    retired->next = lpm->retired_filters;
+    lpm->retired_filters = retired;
+
+    lpm->filter_keys = nkeys;
+    lpm->filter_dirty = 0;
+    return IPADDR_OK;
+}
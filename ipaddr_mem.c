@@ -0,0 +1,86 @@
+/*
+ * ipaddr_mem.c - Large table allocation
+ *
+ * Lookup structures are read at random addresses, so beyond a few megabytes
+ * every lookup tends to miss the TLB as well as the cache.  Allocations of
+ * at least IPADDR_MEM_HUGE bytes are therefore mapped on huge pages: from the
+ * reserved pool (MAP_HUGETLB) if there is one, else as transparent huge pages
+ * (MADV_HUGEPAGE).  Where neither is available they are ordinary anonymous
+ * mappings, and smaller allocations come from the heap.
+ */
+
+#include "ipaddr.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)   /* x86-64 and arm64 default */
+#define CACHE_LINE     64
+
+/*
+ * Round size up to a multiple of align (a power of two).
+ */
+static size_t round_up(size_t size, size_t align)
+{
+    return (size + align - 1) & ~(align - 1);
+}
+
+/*
+ * Map len bytes (a multiple of HUGE_PAGE_SIZE) aligned to a huge page, so
+ * that transparent huge pages can back all of it.
+ */
+static void *map_aligned(size_t len)
+{
+    size_t span = len + HUGE_PAGE_SIZE;
+    char *p = mmap(NULL, span, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+
+    /* Trim the unaligned head and the tail */
+    char *start = (char *)round_up((uintptr_t)p, HUGE_PAGE_SIZE);
+    if (start > p)
+        munmap(p, (size_t)(start - p));
+    if (start + len < p + span)
+        munmap(start + len, (size_t)(p + span - (start + len)));
+    return start;
+}
+
+void *ipaddr_mem_alloc(size_t size)
+{
+    if (size < IPADDR_MEM_HUGE) {
+        size = round_up(size, CACHE_LINE);
+        void *p = aligned_alloc(CACHE_LINE, size);
+        if (p != NULL)
+            memset(p, 0, size);
+        return p;
+    }
+
+    size_t len = round_up(size, HUGE_PAGE_SIZE);
+    void *p;
+
+#ifdef MAP_HUGETLB
+    p = mmap(NULL, len, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (p != MAP_FAILED)
+        return p;
+#endif
+
+    p = map_aligned(len);
+#ifdef MADV_HUGEPAGE
+    if (p != NULL)
+        madvise(p, len, MADV_HUGEPAGE);
+#endif
+    return p;
+}
+
+void ipaddr_mem_free(void *p, size_t size)
+{
+    if (p == NULL)
+        return;
+    if (size < IPADDR_MEM_HUGE)
+        free(p);
+    else
+        munmap(p, round_up(size, HUGE_PAGE_SIZE));
+}
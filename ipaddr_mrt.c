@@ -0,0 +1,351 @@
+/*
+ * ipaddr_mrt.c - Loading prefix tables from MRT routing table dumps
+ *
+ * TABLE_DUMP_V2 RIB records (RFC 6396, with the add-path subtypes of
+ * RFC 8050) are read in file order and each unicast prefix is added with
+ * the origin AS of its first RIB entry that has an AS path, as "AS64500".
+ * Values are interned by the table, so a full table holds each origin
+ * once however many prefixes it announces.
+ *
+ * Dumps compressed with gzip, bzip2 or xz, as route collectors publish
+ * them, are decompressed by a child process running the matching tool,
+ * which runs in parallel with the decoding.
+ */
+
+#include "ipaddr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define MRT_HDR_SIZE        12
+#define MRT_MAX_RECORD      (16 << 20)   /* refuse larger records */
+#define MRT_READ_BUFFER     (1 << 20)
+
+/* Types and subtypes */
+#define MRT_TABLE_DUMP_V2   13
+#define MRT_RIB_IPV4        2
+#define MRT_RIB_IPV6        4
+#define MRT_RIB_IPV4_ADDPATH 8
+#define MRT_RIB_IPV6_ADDPATH 10
+
+/* BGP path attributes */
+#define BGP_ATTR_EXTENDED   0x10
+#define BGP_ATTR_AS_PATH    2
+
+extern char **environ;
+
+static uint16_t get16(const uint8_t *p)
+{
+    return (uint16_t)(p[0] << 8 | p[1]);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+           (uint32_t)p[2] << 8 | p[3];
+}
+
+/*
+ * Get the decompressor for a file starting with hdr, or NULL if the file
+ * is not compressed.
+ */
+static const char *decompressor(const uint8_t *hdr, size_t len)
+{
+    if (len >= 2 && hdr[0] == 0x1f && hdr[1] == 0x8b)
+        return "gzip";
+    if (len >= 3 && memcmp(hdr, "BZh", 3) == 0)
+        return "bzip2";
+    if (len >= 6 && memcmp(hdr, "\xfd" "7zXZ\0", 6) == 0)
+        return "xz";
+    return NULL;
+}
+
+bool ipaddr_mrt_detect(const char *path)
+{
+    uint8_t hdr[MRT_HDR_SIZE];
+    size_t len = 0;
+
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL)
+        return false;
+    len = fread(hdr, 1, sizeof(hdr), fp);
+    fclose(fp);
+
+    if (decompressor(hdr, len) != NULL)
+        return true;
+    return len == MRT_HDR_SIZE && get16(hdr + 4) == MRT_TABLE_DUMP_V2;
+}
+
+/*
+ * Open path for reading, through its decompressor if it is compressed.
+ * pid is set to the decompressor's process ID, or 0.
+ */
+static FILE *open_dump(const char *path, pid_t *pid, const char **errmsg)
+{
+    *pid = 0;
+    FILE *fp = fopen(path, "rb");
+    if (fp == NULL) {
+        *errmsg = strerror(errno);
+        return NULL;
+    }
+
+    uint8_t hdr[6];
+    size_t len = fread(hdr, 1, sizeof(hdr), fp);
+    const char *tool = decompressor(hdr, len);
+    if (tool == NULL) {
+        rewind(fp);
+        setvbuf(fp, NULL, _IOFBF, MRT_READ_BUFFER);
+        return fp;
+    }
+    fclose(fp);
+
+    int fds[2];
+    if (pipe(fds) != 0) {
+        *errmsg = strerror(errno);
+        return NULL;
+    }
+
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[1], STDOUT_FILENO);
+    posix_spawn_file_actions_addclose(&actions, fds[0]);
+    posix_spawn_file_actions_addclose(&actions, fds[1]);
+
+    char *argv[] = { (char *)tool, "-dc", "--", (char *)path, NULL };
+    int err = posix_spawnp(pid, tool, &actions, NULL, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    close(fds[1]);
+    if (err != 0) {
+        close(fds[0]);
+        *pid = 0;
+        *errmsg = "cannot run decompressor";
+        return NULL;
+    }
+
+    fp = fdopen(fds[0], "rb");
+    if (fp == NULL) {
+        close(fds[0]);
+        kill(*pid, SIGTERM);
+        waitpid(*pid, NULL, 0);
+        *pid = 0;
+        *errmsg = strerror(errno);
+        return NULL;
+    }
+    setvbuf(fp, NULL, _IOFBF, MRT_READ_BUFFER);
+    return fp;
+}
+
+/*
+ * Close a dump opened by open_dump().  Returns false if its decompressor
+ * failed.
+ */
+static bool close_dump(FILE *fp, pid_t pid, bool complete)
+{
+    fclose(fp);
+    if (pid == 0)
+        return true;
+
+    /* A decompressor cut short dies of SIGPIPE, which is no failure */
+    int status;
+    if (!complete)
+        kill(pid, SIGTERM);
+    if (waitpid(pid, &status, 0) != pid)
+        return false;
+    return !complete || (WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+/*
+ * Find the origin AS in the path attributes of a RIB entry.
+ * Returns false if there is no AS path, or it is empty.
+ */
+static bool origin_as(const uint8_t *p, size_t len, uint32_t *asn)
+{
+    size_t off = 0;
+    while (len - off >= 3) {
+        uint8_t flags = p[off];
+        uint8_t type = p[off + 1];
+        size_t alen;
+        off += 2;
+        if (flags & BGP_ATTR_EXTENDED) {
+            if (len - off < 2)
+                return false;
+            alen = get16(p + off);
+            off += 2;
+        } else {
+            alen = p[off++];
+        }
+        if (alen > len - off)
+            return false;
+
+        if (type == BGP_ATTR_AS_PATH) {
+            /* Segments of 4-byte AS numbers; the origin ends the last one */
+            const uint8_t *seg = p + off;
+            bool found = false;
+            while (alen >= 2) {
+                size_t n = seg[1];
+                if (alen - 2 < n * 4)
+                    break;
+                if (n > 0) {
+                    *asn = get32(seg + 2 + (n - 1) * 4);
+                    found = true;
+                }
+                seg += 2 + n * 4;
+                alen -= 2 + n * 4;
+            }
+            return found;
+        }
+        off += alen;
+    }
+    return false;
+}
+
+/*
+ * Add the prefix of a RIB record to the table.
+ * Returns 0 on success, IPADDR_ERR_USAGE if the record is malformed,
+ * IPADDR_ERR_INTERNAL if out of memory.
+ */
+static int add_rib(ipaddr_lpm_t *lpm, const uint8_t *p, size_t len,
+                   bool ipv6, bool addpath, const char **errmsg)
+{
+    int max_bits = ipv6 ? 128 : 32;
+    if (len < 5 || p[4] > max_bits) {
+        *errmsg = "invalid RIB record";
+        return IPADDR_ERR_USAGE;
+    }
+
+    int plen = p[4];
+    size_t nbytes = ((size_t)plen + 7) / 8;
+    size_t off = 5 + nbytes;
+    if (len < off + 2) {
+        *errmsg = "invalid RIB record";
+        return IPADDR_ERR_USAGE;
+    }
+
+    ipaddr_t addr, prefix;
+    memset(&addr, 0, sizeof(addr));
+    if (ipv6) {
+        addr.addr.sa.sa_family = AF_INET6;
+        memcpy(&addr.addr.sin6.sin6_addr, p + 5, nbytes);
+    } else {
+        addr.addr.sa.sa_family = AF_INET;
+        memcpy(&addr.addr.sin.sin_addr, p + 5, nbytes);
+    }
+    addr.prefix_len = plen;
+    addr.has_prefix = true;
+    ipaddr_network(&addr, &prefix);
+
+    /* The first entry with an AS path gives the origin */
+    size_t nentries = get16(p + off);
+    size_t entry_hdr = addpath ? 12 : 8;
+    off += 2;
+    char value[16] = "";
+    for (size_t i = 0; i < nentries; i++) {
+        if (len - off < entry_hdr) {
+            *errmsg = "invalid RIB entry";
+            return IPADDR_ERR_USAGE;
+        }
+        size_t alen = get16(p + off + entry_hdr - 2);
+        off += entry_hdr;
+        if (alen > len - off) {
+            *errmsg = "invalid RIB entry";
+            return IPADDR_ERR_USAGE;
+        }
+        uint32_t asn;
+        if (origin_as(p + off, alen, &asn)) {
+            snprintf(value, sizeof(value), "AS%u", asn);
+            break;
+        }
+        off += alen;
+    }
+
+    if (ipaddr_lpm_insert(lpm, &prefix, value) != IPADDR_OK) {
+        *errmsg = "out of memory";
+        return IPADDR_ERR_INTERNAL;
+    }
+    return IPADDR_OK;
+}
+
+int ipaddr_lpm_load_mrt(ipaddr_lpm_t *lpm, const char *path, size_t *record,
+                        const char **errmsg)
+{
+    pid_t pid;
+    *record = 0;
+    FILE *fp = open_dump(path, &pid, errmsg);
+    if (fp == NULL)
+        return IPADDR_ERR_USAGE;
+
+    uint8_t *buf = NULL;
+    size_t cap = 0;
+    int rc = IPADDR_OK;
+
+    for (;;) {
+        uint8_t hdr[MRT_HDR_SIZE];
+        size_t got = fread(hdr, 1, sizeof(hdr), fp);
+        if (got == 0 && !ferror(fp))
+            break;
+        (*record)++;
+        if (got < sizeof(hdr)) {
+            *errmsg = ferror(fp) ? strerror(errno) : "truncated record";
+            rc = IPADDR_ERR_USAGE;
+            break;
+        }
+
+        size_t len = get32(hdr + 8);
+        if (len > MRT_MAX_RECORD) {
+            *errmsg = "record too long";
+            rc = IPADDR_ERR_USAGE;
+            break;
+        }
+        if (len > cap) {
+            uint8_t *nbuf = realloc(buf, len);
+            if (nbuf == NULL) {
+                *errmsg = "out of memory";
+                rc = IPADDR_ERR_INTERNAL;
+                break;
+            }
+            buf = nbuf;
+            cap = len;
+        }
+        if (fread(buf, 1, len, fp) != len) {
+            *errmsg = ferror(fp) ? strerror(errno) : "truncated record";
+            rc = IPADDR_ERR_USAGE;
+            break;
+        }
+
+        /* Other types and subtypes hold no unicast prefixes */
+        if (get16(hdr + 4) != MRT_TABLE_DUMP_V2)
+            continue;
+        switch (get16(hdr + 6)) {
+        case MRT_RIB_IPV4:
+            rc = add_rib(lpm, buf, len, false, false, errmsg);
+            break;
+        case MRT_RIB_IPV6:
+            rc = add_rib(lpm, buf, len, true, false, errmsg);
+            break;
+        case MRT_RIB_IPV4_ADDPATH:
+            rc = add_rib(lpm, buf, len, false, true, errmsg);
+            break;
+        case MRT_RIB_IPV6_ADDPATH:
+            rc = add_rib(lpm, buf, len, true, true, errmsg);
+            break;
+        default:
+            break;
+        }
+        if (rc != IPADDR_OK)
+            break;
+    }
+
+    free(buf);
+    if (!close_dump(fp, pid, rc == IPADDR_OK) && rc == IPADDR_OK) {
+        *errmsg = "decompression failed";
+        rc = IPADDR_ERR_USAGE;
+    }
+    return rc;
+}
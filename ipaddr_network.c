@@ -218,3 +218,55 @@ int ipaddr_super(const ipaddr_t *addr, int new_prefix, ipaddr_t *super)
 
     return IPADDR_OK;
 }
+
+/*
+ * Count the trailing zero bits of a non-zero value.
+ */
+static int ctz128(uint128_t val)
+{
+    uint64_t lo = (uint64_t)val;
+    if (lo != 0)
+        return __builtin_ctzll(lo);
+    return 64 + __builtin_ctzll((uint64_t)(val >> 64));
+}
+
+/*
+ * Cover a range of addresses with the fewest networks.
+ * Each step takes the largest network that starts at the first address not
+ * yet covered: as large as its alignment allows, but not past the end.
+ */
+int ipaddr_summarize(const ipaddr_t *first, const ipaddr_t *last,
+                     ipaddr_net_fn fn, void *arg)
+{
+    if (ipaddr_family(first) != ipaddr_family(last))
+        return IPADDR_ERR_USAGE;
+
+    int max_bits = ipaddr_max_prefix(first);
+    uint128_t lo = ipaddr_to_uint128(first);
+    uint128_t hi = ipaddr_to_uint128(last);
+    if (lo > hi)
+        return IPADDR_ERR_USAGE;
+
+    ipaddr_t net;
+    memcpy(&net, first, sizeof(net));
+    net.has_prefix = true;
+
+    for (;;) {
+        int bits = (lo == 0) ? max_bits : ctz128(lo);
+        if (bits > max_bits)
+            bits = max_bits;
+        while (bits > 0 && (lo | compute_hostmask(max_bits - bits, max_bits)) > hi)
+            bits--;
+
+        net.prefix_len = max_bits - bits;
+        ipaddr_from_uint128(&net, lo, &net);
+        fn(&net, arg);
+
+        uint128_t end = lo | compute_hostmask(max_bits - bits, max_bits);
+        if (end >= hi)
+            break;
+        lo = end + 1;
+    }
+
+    return IPADDR_OK;
+}
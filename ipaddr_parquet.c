@@ -0,0 +1,1376 @@
+/*
+ * ipaddr_parquet.c - Reading address columns from Parquet files
+ *
+ * The file is mapped into memory and its footer decoded to find the pages
+ * of one column.  A pool of worker threads decompresses, decodes and
+ * parses data pages a few pages ahead of the reader, which gets them in
+ * file order.  Dictionary entries are parsed once per column
+ * chunk, so a dictionary-encoded value costs a copy instead of a parse.
+ *
+ * Supported are flat columns of address strings (BYTE_ARRAY annotated as
+ * a string), binary addresses in network byte order (BYTE_ARRAY or
+ * FIXED_LEN_BYTE_ARRAY of 4 or 16 bytes) and IPv4 addresses as INT32;
+ * PLAIN and dictionary encodings; data pages of versions 1 and 2; and
+ * uncompressed or Snappy-compressed pages.
+ */
+
+#include "ipaddr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define PQ_MAX_THREADS  16
+#define PQ_WINDOW_PER_THREAD 2   /* pages decoded ahead per worker */
+#define PQ_MAX_TEXT     128      /* longest address string parsed */
+
+/* Physical types */
+#define PQ_INT32        1
+#define PQ_BYTE_ARRAY   6
+#define PQ_FIXED        7
+
+/* Repetition types */
+#define PQ_REQUIRED     0
+#define PQ_OPTIONAL     1
+
+/* Converted type annotating strings */
+#define PQ_UTF8         0
+
+/* Compression codecs */
+#define PQ_UNCOMPRESSED 0
+#define PQ_SNAPPY       1
+
+/* Page types */
+#define PQ_DATA_PAGE    0
+#define PQ_DICT_PAGE    2
+#define PQ_DATA_PAGE_V2 3
+
+/* Encodings */
+#define PQ_PLAIN        0
+#define PQ_PLAIN_DICT   2
+#define PQ_RLE_DICT     8
+
+/* ========== Thrift compact protocol ========== */
+
+/* Field types */
+#define TR_TRUE    1
+#define TR_FALSE   2
+#define TR_BYTE    3
+#define TR_I16     4
+#define TR_I32     5
+#define TR_I64     6
+#define TR_DOUBLE  7
+#define TR_BINARY  8
+#define TR_LIST    9
+#define TR_SET     10
+#define TR_MAP     11
+#define TR_STRUCT  12
+
+#define TR_MAX_DEPTH 32
+
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+    bool           error;
+} tr_t;
+
+static uint8_t tr_byte(tr_t *t)
+{
+    if (t->p >= t->end) {
+        t->error = true;
+        return 0;
+    }
+    return *t->p++;
+}
+
+static uint64_t tr_varint(tr_t *t)
+{
+    uint64_t v = 0;
+
+    for (int shift = 0; shift < 64; shift += 7) {
+        uint8_t b = tr_byte(t);
+        v |= (uint64_t)(b & 0x7f) << shift;
+        if (!(b & 0x80))
+            return v;
+    }
+    t->error = true;
+    return 0;
+}
+
+/*
+ * Read a zigzag-encoded integer (i16, i32 or i64).
+ */
+static int64_t tr_int(tr_t *t)
+{
+    uint64_t v = tr_varint(t);
+    return (int64_t)(v >> 1) ^ -(int64_t)(v & 1);
+}
+
+/*
+ * Read binary data or a string, returning its length in len.
+ */
+static const uint8_t *tr_binary(tr_t *t, size_t *len)
+{
+    uint64_t n = tr_varint(t);
+    if (n > (uint64_t)(t->end - t->p)) {
+        t->error = true;
+        n = 0;
+    }
+    const uint8_t *p = t->p;
+    t->p += n;
+    *len = (size_t)n;
+    return p;
+}
+
+/*
+ * Read the next field header of a struct.  Returns false at its end.
+ */
+static bool tr_field(tr_t *t, int *id, int *type)
+{
+    uint8_t b = tr_byte(t);
+    if (b == 0 || t->error)
+        return false;
+    *type = b & 0x0f;
+    if (b >> 4)
+        *id += b >> 4;
+    else
+        *id = (int)tr_int(t);
+    return !t->error;
+}
+
+/*
+ * Read a list header, returning its size.
+ */
+static size_t tr_list(tr_t *t, int *elem_type)
+{
+    uint8_t b = tr_byte(t);
+    uint64_t n = b >> 4;
+    if (n == 15)
+        n = tr_varint(t);
+    *elem_type = b & 0x0f;
+
+    /* Every element takes at least a byte */
+    if (n > (uint64_t)(t->end - t->p)) {
+        t->error = true;
+        n = 0;
+    }
+    return (size_t)n;
+}
+
+static void tr_skip(tr_t *t, int type, bool in_list, int depth);
+
+static void tr_skip_struct(tr_t *t, int depth)
+{
+    int id = 0, type;
+    while (tr_field(t, &id, &type))
+        tr_skip(t, type, false, depth + 1);
+}
+
+/*
+ * Skip a value.  Booleans are a byte in lists but part of the field
+ * header in structs.
+ */
+static void tr_skip(tr_t *t, int type, bool in_list, int depth)
+{
+    size_t n;
+    int elem;
+
+    if (depth > TR_MAX_DEPTH) {
+        t->error = true;
+        return;
+    }
+
+    switch (type) {
+    case TR_TRUE:
+    case TR_FALSE:
+        if (in_list)
+            tr_byte(t);
+        break;
+    case TR_BYTE:
+        tr_byte(t);
+        break;
+    case TR_I16:
+    case TR_I32:
+    case TR_I64:
+        tr_varint(t);
+        break;
+    case TR_DOUBLE:
+        for (int i = 0; i < 8; i++)
+            tr_byte(t);
+        break;
+    case TR_BINARY:
+        tr_binary(t, &n);
+        break;
+    case TR_LIST:
+    case TR_SET:
+        n = tr_list(t, &elem);
+        for (size_t i = 0; i < n && !t->error; i++)
+            tr_skip(t, elem, true, depth + 1);
+        break;
+    case TR_MAP:
+        n = (size_t)tr_varint(t);
+        if (n > 0) {
+            uint8_t kv = tr_byte(t);
+            for (size_t i = 0; i < n && !t->error; i++) {
+                tr_skip(t, kv >> 4, true, depth + 1);
+                tr_skip(t, kv & 0x0f, true, depth + 1);
+            }
+        }
+        break;
+    case TR_STRUCT:
+        tr_skip_struct(t, depth);
+        break;
+    default:
+        t->error = true;
+        break;
+    }
+}
+
+/* ========== File metadata ========== */
+
+/*
+ * A page of the column.
+ */
+typedef struct {
+    const uint8_t *data;        /* page contents as stored */
+    size_t         size;
+    size_t         raw_size;    /* size after decompression */
+    int            type;
+    int            encoding;
+    size_t         num_values;  /* including nulls */
+    size_t         levels_len;  /* v2: level bytes ahead of the values */
+    bool           compressed;
+    size_t         first_row;
+    size_t         chunk;
+} pq_page_t;
+
+/*
+ * A column chunk: the part of the column in one row group.
+ */
+typedef struct {
+    int             codec;
+    const pq_page_t *dict_page;     /* or NULL */
+    pthread_mutex_t lock;           /* guards dictionary decoding */
+    bool            dict_done;
+    int             dict_rc;
+    const char     *dict_errmsg;
+    size_t          dict_n;
+    ipaddr_t       *dict_addrs;
+    const char    **dict_errors;    /* NULL for entries that parsed */
+    char          **dict_text;      /* text of entries that did not */
+    size_t          pages_left;     /* data pages not yet consumed */
+} pq_chunk_t;
+
+/*
+ * Output slot of a page being decoded.
+ */
+typedef struct {
+    bool                   ready;
+    int                    rc;
+    const char            *errmsg;
+    ipaddr_parquet_batch_t batch;
+} pq_slot_t;
+
+struct ipaddr_parquet {
+    const uint8_t  *map;
+    size_t          map_size;
+
+    /* Column */
+    int             type;
+    int             type_length;
+    int             max_def;
+    bool            text;
+
+    pq_chunk_t     *chunks;
+    size_t          nchunks;
+    pq_page_t      *pages;         /* data and dictionary pages */
+    size_t          npages;
+    pq_page_t     **data_pages;    /* data pages in order */
+    size_t          ndata;
+
+    /* Workers */
+    pthread_mutex_t lock;
+    pthread_cond_t  work_cond;     /* a page may be claimed */
+    pthread_cond_t  ready_cond;    /* a page was decoded */
+    pthread_t       threads[PQ_MAX_THREADS];
+    int             nthreads;
+    bool            started;
+    bool            stop;
+    size_t          next_page;     /* next page for a worker */
+    size_t          consumed;      /* pages handed out and released */
+    bool            holding;       /* a batch is handed out */
+    pq_slot_t      *slots;
+    size_t          window;
+};
+
+typedef struct {
+    int         type;
+    int         type_length;
+    int         repetition;
+    const char *name;
+    size_t      name_len;
+    int         num_children;
+    bool        is_string;
+} pq_schema_t;
+
+static void parse_logical_type(tr_t *t, pq_schema_t *se)
+{
+    int id = 0, type;
+    while (tr_field(t, &id, &type)) {
+        if (id == 1)    /* STRING */
+            se->is_string = true;
+        tr_skip(t, type, false, 1);
+    }
+}
+
+static void parse_schema_element(tr_t *t, pq_schema_t *se)
+{
+    int id = 0, type;
+
+    memset(se, 0, sizeof(*se));
+    se->type = -1;
+    se->repetition = PQ_REQUIRED;
+    while (tr_field(t, &id, &type)) {
+        if (id == 1 && type == TR_I32)
+            se->type = (int)tr_int(t);
+        else if (id == 2 && type == TR_I32)
+            se->type_length = (int)tr_int(t);
+        else if (id == 3 && type == TR_I32)
+            se->repetition = (int)tr_int(t);
+        else if (id == 4 && type == TR_BINARY)
+            se->name = (const char *)tr_binary(t, &se->name_len);
+        else if (id == 5 && type == TR_I32)
+            se->num_children = (int)tr_int(t);
+        else if (id == 6 && type == TR_I32)
+            se->is_string |= (tr_int(t) == PQ_UTF8);
+        else if (id == 10 && type == TR_STRUCT)
+            parse_logical_type(t, se);
+        else
+            tr_skip(t, type, false, 1);
+    }
+}
+
+/*
+ * Find a top-level column by name in the schema, returning its leaf index.
+ */
+static int find_column(const pq_schema_t *schema, size_t n, const char *name,
+                       size_t *leaf, const pq_schema_t **se,
+                       const char **errmsg)
+{
+    size_t name_len = strlen(name);
+    size_t i = 1;
+    size_t leaves = 0;
+
+    if (n == 0) {
+        *errmsg = "invalid schema";
+        return IPADDR_ERR_USAGE;
+    }
+    for (int child = 0; child < schema[0].num_children && i < n; child++) {
+        const pq_schema_t *s = &schema[i];
+        bool match = (s->name_len == name_len && memcmp(s->name, name, name_len) == 0);
+
+        /* Skip the subtree, counting its leaves */
+        size_t pending = 1;
+        size_t subtree_leaves = 0;
+        while (pending > 0 && i < n) {
+            pending--;
+            if (schema[i].num_children > 0)
+                pending += (size_t)schema[i].num_children;
+            else
+                subtree_leaves++;
+            i++;
+        }
+
+        if (match) {
+            if (s->num_children > 0) {
+                *errmsg = "nested columns are not supported";
+                return IPADDR_ERR_USAGE;
+            }
+            *leaf = leaves;
+            *se = s;
+            return IPADDR_OK;
+        }
+        leaves += subtree_leaves;
+    }
+    *errmsg = "no such column";
+    return IPADDR_ERR_USAGE;
+}
+
+typedef struct {
+    int     codec;
+    int64_t num_values;
+    int64_t total_size;
+    int64_t data_offset;
+    int64_t dict_offset;
+    bool    external;
+} pq_chunk_meta_t;
+
+static void parse_column_meta(tr_t *t, pq_chunk_meta_t *m)
+{
+    int id = 0, type;
+    while (tr_field(t, &id, &type)) {
+        if (id == 4 && type == TR_I32)
+            m->codec = (int)tr_int(t);
+        else if (id == 5 && type == TR_I64)
+            m->num_values = tr_int(t);
+        else if (id == 7 && type == TR_I64)
+            m->total_size = tr_int(t);
+        else if (id == 9 && type == TR_I64)
+            m->data_offset = tr_int(t);
+        else if (id == 11 && type == TR_I64)
+            m->dict_offset = tr_int(t);
+        else
+            tr_skip(t, type, false, 1);
+    }
+}
+
+static void parse_column_chunk(tr_t *t, pq_chunk_meta_t *m)
+{
+    int id = 0, type;
+    while (tr_field(t, &id, &type)) {
+        if (id == 1 && type == TR_BINARY) {
+            size_t len;
+            tr_binary(t, &len);
+            m->external = true;
+        } else if (id == 3 && type == TR_STRUCT) {
+            parse_column_meta(t, m);
+        } else {
+            tr_skip(t, type, false, 1);
+        }
+    }
+}
+
+/*
+ * Parse a row group, getting the metadata of column leaf.
+ */
+static void parse_row_group(tr_t *t, size_t leaf, pq_chunk_meta_t *m)
+{
+    int id = 0, type;
+    bool found = false;
+
+    while (tr_field(t, &id, &type)) {
+        if (id == 1 && type == TR_LIST) {
+            int elem;
+            size_t n = tr_list(t, &elem);
+            for (size_t i = 0; i < n && !t->error; i++) {
+                if (i == leaf && elem == TR_STRUCT) {
+                    parse_column_chunk(t, m);
+                    found = true;
+                } else {
+                    tr_skip(t, elem, true, 1);
+                }
+            }
+        } else {
+            tr_skip(t, type, false, 1);
+        }
+    }
+    if (!found)
+        t->error = true;
+}
+
+typedef struct {
+    int     type;
+    int32_t raw_size;
+    int32_t size;
+    int32_t num_values;
+    int32_t encoding;
+    int32_t def_len;
+    int32_t rep_len;
+    bool    compressed;
+} pq_page_header_t;
+
+static void parse_data_header(tr_t *t, pq_page_header_t *h, bool v2)
+{
+    int id = 0, type;
+    while (tr_field(t, &id, &type)) {
+        if (id == 1 && type == TR_I32)
+            h->num_values = (int32_t)tr_int(t);
+        else if (id == (v2 ? 4 : 2) && type == TR_I32)
+            h->encoding = (int32_t)tr_int(t);
+        else if (v2 && id == 5 && type == TR_I32)
+            h->def_len = (int32_t)tr_int(t);
+        else if (v2 && id == 6 && type == TR_I32)
+            h->rep_len = (int32_t)tr_int(t);
+        else if (v2 && id == 7 && (type == TR_TRUE || type == TR_FALSE))
+            h->compressed = (type == TR_TRUE);
+        else
+            tr_skip(t, type, false, 1);
+    }
+}
+
+static void parse_page_header(tr_t *t, pq_page_header_t *h)
+{
+    int id = 0, type;
+
+    memset(h, 0, sizeof(*h));
+    h->type = -1;
+    h->compressed = true;
+    while (tr_field(t, &id, &type)) {
+        if (id == 1 && type == TR_I32)
+            h->type = (int)tr_int(t);
+        else if (id == 2 && type == TR_I32)
+            h->raw_size = (int32_t)tr_int(t);
+        else if (id == 3 && type == TR_I32)
+            h->size = (int32_t)tr_int(t);
+        else if ((id == 5 || id == 7) && type == TR_STRUCT)
+            parse_data_header(t, h, false);     /* data or dictionary */
+        else if (id == 8 && type == TR_STRUCT)
+            parse_data_header(t, h, true);
+        else
+            tr_skip(t, type, false, 1);
+    }
+}
+
+/*
+ * Add a page to the list of pages.
+ */
+static int add_page(ipaddr_parquet_t *pq, size_t *cap, const pq_page_t *page)
+{
+    if (pq->npages == *cap) {
+        size_t n = *cap ? *cap * 2 : 64;
+        pq_page_t *pages = realloc(pq->pages, n * sizeof(*pages));
+        if (pages == NULL)
+            return IPADDR_ERR_INTERNAL;
+        pq->pages = pages;
+        *cap = n;
+    }
+    pq->pages[pq->npages++] = *page;
+    return IPADDR_OK;
+}
+
+/*
+ * Index the pages of a column chunk.
+ */
+static int index_chunk(ipaddr_parquet_t *pq, size_t chunk, const pq_chunk_meta_t *m,
+                       size_t *first_row, size_t *cap, const char **errmsg)
+{
+    int64_t start = m->data_offset;
+    if (m->dict_offset > 0 && m->dict_offset < start)
+        start = m->dict_offset;
+    if (m->external || start < 4 || m->total_size < 0 ||
+        (uint64_t)start + (uint64_t)m->total_size > pq->map_size) {
+        *errmsg = "invalid column chunk";
+        return IPADDR_ERR_USAGE;
+    }
+
+    tr_t t = { pq->map + start, pq->map + start + m->total_size, false };
+    size_t values = 0;
+    while (t.p < t.end) {
+        pq_page_header_t h;
+        parse_page_header(&t, &h);
+        if (t.error || h.size < 0 || h.raw_size < 0 || h.num_values < 0 ||
+            h.size > t.end - t.p) {
+            *errmsg = "invalid page header";
+            return IPADDR_ERR_USAGE;
+        }
+
+        pq_page_t page = {
+            .data = t.p, .size = (size_t)h.size, .raw_size = (size_t)h.raw_size,
+            .type = h.type, .encoding = h.encoding,
+            .num_values = (size_t)h.num_values, .compressed = true,
+            .first_row = *first_row, .chunk = chunk,
+        };
+        t.p += h.size;
+
+        if (h.type == PQ_DATA_PAGE_V2) {
+            if (h.def_len < 0 || h.rep_len < 0 ||
+                (int64_t)h.def_len + h.rep_len > h.size ||
+                (int64_t)h.def_len + h.rep_len > h.raw_size) {
+                *errmsg = "invalid page header";
+                return IPADDR_ERR_USAGE;
+            }
+            page.levels_len = (size_t)h.def_len + (size_t)h.rep_len;
+            page.compressed = h.compressed;
+        } else if (h.type != PQ_DATA_PAGE && h.type != PQ_DICT_PAGE) {
+            continue;   /* index pages */
+        }
+
+        if (add_page(pq, cap, &page) != IPADDR_OK) {
+            *errmsg = "out of memory";
+            return IPADDR_ERR_INTERNAL;
+        }
+        if (h.type != PQ_DICT_PAGE) {
+            *first_row += page.num_values;
+            values += page.num_values;
+        }
+    }
+
+    if ((int64_t)values != m->num_values) {
+        *errmsg = "invalid column chunk";
+        return IPADDR_ERR_USAGE;
+    }
+    return IPADDR_OK;
+}
+
+/*
+ * Decode the file metadata and index the pages of the column.
+ */
+static int read_metadata(ipaddr_parquet_t *pq, const char *column, const char **errmsg)
+{
+    const uint8_t *map = pq->map;
+    size_t size = pq->map_size;
+
+    if (size < 12 || memcmp(map, "PAR1", 4) != 0 || memcmp(map + size - 4, "PAR1", 4) != 0) {
+        *errmsg = "not a Parquet file";
+        return IPADDR_ERR_USAGE;
+    }
+    const uint8_t *p = map + size - 8;
+    uint32_t footer_len = (uint32_t)p[0] | (uint32_t)p[1] << 8 |
+                          (uint32_t)p[2] << 16 | (uint32_t)p[3] << 24;
+    if (footer_len > size - 12) {
+        *errmsg = "invalid footer";
+        return IPADDR_ERR_USAGE;
+    }
+
+    tr_t t = { map + size - 8 - footer_len, map + size - 8, false };
+    pq_schema_t *schema = NULL;
+    size_t nschema = 0;
+    size_t leaf = 0;
+    size_t page_cap = 0;
+    size_t first_row = 0;
+    int rc = IPADDR_OK;
+    int id = 0, type;
+
+    *errmsg = "invalid file metadata";
+    while (rc == IPADDR_OK && tr_field(&t, &id, &type)) {
+        if (id == 2 && type == TR_LIST) {
+            int elem;
+            nschema = tr_list(&t, &elem);
+            if (schema != NULL || elem != TR_STRUCT) {
+                rc = IPADDR_ERR_USAGE;
+                break;
+            }
+            schema = calloc(nschema ? nschema : 1, sizeof(*schema));
+            if (schema == NULL) {
+                *errmsg = "out of memory";
+                rc = IPADDR_ERR_INTERNAL;
+                break;
+            }
+            for (size_t i = 0; i < nschema; i++)
+                parse_schema_element(&t, &schema[i]);
+            if (t.error)
+                break;
+
+            const pq_schema_t *se;
+            rc = find_column(schema, nschema, column, &leaf, &se, errmsg);
+            if (rc != IPADDR_OK)
+                break;
+            pq->type = se->type;
+            pq->type_length = se->type_length;
+            pq->text = se->is_string;
+            pq->max_def = (se->repetition == PQ_OPTIONAL) ? 1 : 0;
+            if (se->repetition != PQ_REQUIRED && se->repetition != PQ_OPTIONAL) {
+                *errmsg = "repeated columns are not supported";
+                rc = IPADDR_ERR_USAGE;
+            } else if (pq->type != PQ_BYTE_ARRAY && pq->type != PQ_INT32 &&
+                       !(pq->type == PQ_FIXED &&
+                         (pq->type_length == 4 || pq->type_length == 16))) {
+                *errmsg = "column type cannot hold addresses";
+                rc = IPADDR_ERR_USAGE;
+            }
+        } else if (id == 4 && type == TR_LIST) {
+            int elem;
+            size_t n = tr_list(&t, &elem);
+            if (schema == NULL || elem != TR_STRUCT) {
+                rc = IPADDR_ERR_USAGE;
+                break;
+            }
+            pq->chunks = calloc(n ? n : 1, sizeof(*pq->chunks));
+            if (pq->chunks == NULL) {
+                *errmsg = "out of memory";
+                rc = IPADDR_ERR_INTERNAL;
+                break;
+            }
+            for (size_t i = 0; i < n && rc == IPADDR_OK; i++) {
+                pq_chunk_meta_t m = { 0 };
+                parse_row_group(&t, leaf, &m);
+                if (t.error)
+                    break;
+                pq->chunks[i].codec = m.codec;
+                pthread_mutex_init(&pq->chunks[i].lock, NULL);
+                pq->nchunks++;
+                rc = index_chunk(pq, i, &m, &first_row, &page_cap, errmsg);
+            }
+        } else {
+            tr_skip(&t, type, false, 1);
+        }
+    }
+    free(schema);
+
+    if (rc == IPADDR_OK && (t.error || pq->chunks == NULL)) {
+        *errmsg = "invalid file metadata";
+        rc = IPADDR_ERR_USAGE;
+    }
+    return rc;
+}
+
+/*
+ * List the data pages, and link each chunk to its dictionary page.
+ */
+static int index_pages(ipaddr_parquet_t *pq, const char **errmsg)
+{
+    pq->data_pages = calloc(pq->npages ? pq->npages : 1, sizeof(*pq->data_pages));
+    if (pq->data_pages == NULL) {
+        *errmsg = "out of memory";
+        return IPADDR_ERR_INTERNAL;
+    }
+
+    for (size_t i = 0; i < pq->npages; i++) {
+        pq_page_t *page = &pq->pages[i];
+        pq_chunk_t *chunk = &pq->chunks[page->chunk];
+
+        if (page->type == PQ_DICT_PAGE) {
+            if (chunk->dict_page != NULL) {
+                *errmsg = "more than one dictionary page";
+                return IPADDR_ERR_USAGE;
+            }
+            chunk->dict_page = page;
+        } else {
+            pq->data_pages[pq->ndata++] = page;
+            chunk->pages_left++;
+        }
+    }
+    return IPADDR_OK;
+}
+
+/* ========== Decoding ========== */
+
+/*
+ * Decompress a Snappy block of exactly out_len bytes.
+ */
+static int snappy_decompress(const uint8_t *in, size_t in_len,
+                             uint8_t *out, size_t out_len)
+{
+    tr_t t = { in, in + in_len, false };
+    if (tr_varint(&t) != out_len || t.error)
+        return IPADDR_ERR_USAGE;
+
+    const uint8_t *p = t.p;
+    const uint8_t *end = in + in_len;
+    size_t pos = 0;
+
+    while (p < end) {
+        uint8_t tag = *p++;
+        size_t len, offset;
+
+        if ((tag & 3) == 0) {
+            /* Literal */
+            len = (tag >> 2) + 1;
+            if (len > 60) {
+                size_t nbytes = len - 60;
+                if ((size_t)(end - p) < nbytes)
+                    return IPADDR_ERR_USAGE;
+                len = 0;
+                for (size_t i = 0; i < nbytes; i++)
+                    len |= (size_t)p[i] << (8 * i);
+                len++;
+                p += nbytes;
+            }
+            if ((size_t)(end - p) < len || out_len - pos < len)
+                return IPADDR_ERR_USAGE;
+            memcpy(out + pos, p, len);
+            p += len;
+            pos += len;
+            continue;
+        }
+
+        /* Copy from earlier output */
+        if ((tag & 3) == 1) {
+            if (p >= end)
+                return IPADDR_ERR_USAGE;
+            len = ((tag >> 2) & 7) + 4;
+            offset = (size_t)(tag >> 5) << 8 | *p++;
+        } else {
+            size_t nbytes = ((tag & 3) == 2) ? 2 : 4;
+            if ((size_t)(end - p) < nbytes)
+                return IPADDR_ERR_USAGE;
+            len = (tag >> 2) + 1;
+            offset = 0;
+            for (size_t i = 0; i < nbytes; i++)
+                offset |= (size_t)p[i] << (8 * i);
+            p += nbytes;
+        }
+        if (offset == 0 || offset > pos || out_len - pos < len)
+            return IPADDR_ERR_USAGE;
+        for (size_t i = 0; i < len; i++, pos++)
+            out[pos] = out[pos - offset];     /* copies may overlap */
+    }
+    return (pos == out_len) ? IPADDR_OK : IPADDR_ERR_USAGE;
+}
+
+/*
+ * Get the uncompressed contents of a page.  *buf is set to memory to free
+ * afterwards, if any.
+ */
+static int page_contents(const ipaddr_parquet_t *pq, const pq_page_t *page,
+                         const uint8_t **data, size_t *len, uint8_t **buf,
+                         const char **errmsg)
+{
+    int codec = pq->chunks[page->chunk].codec;
+
+    *buf = NULL;
+    if (codec == PQ_UNCOMPRESSED || !page->compressed) {
+        *data = page->data;
+        *len = page->size;
+        return IPADDR_OK;
+    }
+    if (codec != PQ_SNAPPY) {
+        *errmsg = "unsupported compression codec";
+        return IPADDR_ERR_USAGE;
+    }
+
+    /* Levels of v2 pages are stored uncompressed ahead of the values */
+    size_t levels = page->levels_len;
+    *buf = malloc(page->raw_size ? page->raw_size : 1);
+    if (*buf == NULL) {
+        *errmsg = "out of memory";
+        return IPADDR_ERR_INTERNAL;
+    }
+    memcpy(*buf, page->data, levels);
+    if (snappy_decompress(page->data + levels, page->size - levels,
+                          *buf + levels, page->raw_size - levels) != IPADDR_OK) {
+        *errmsg = "invalid compressed page";
+        return IPADDR_ERR_USAGE;
+    }
+    *data = *buf;
+    *len = page->raw_size;
+    return IPADDR_OK;
+}
+
+/*
+ * Decoder of the RLE/bit-packing hybrid encoding.
+ */
+typedef struct {
+    const uint8_t *p;
+    const uint8_t *end;
+    int            width;
+    size_t         run;         /* values left in the current run */
+    bool           packed;
+    uint32_t       value;       /* of an RLE run */
+    const uint8_t *bits;        /* of a bit-packed run */
+    size_t         bits_len;
+    size_t         bit;
+} rle_t;
+
+static bool rle_next(rle_t *r, uint32_t *v)
+{
+    while (r->run == 0) {
+        tr_t t = { r->p, r->end, false };
+        uint64_t header = tr_varint(&t);
+        if (t.error)
+            return false;
+        r->p = t.p;
+
+        size_t nbytes;
+        if (header & 1) {
+            /* Groups of 8 bit-packed values */
+            if ((header >> 1) > (uint64_t)(r->end - r->p))
+                return false;
+            r->run = (size_t)(header >> 1) * 8;
+            nbytes = (size_t)(header >> 1) * (size_t)r->width;
+            if (nbytes > (size_t)(r->end - r->p))
+                nbytes = (size_t)(r->end - r->p);   /* padding may be cut */
+            r->packed = true;
+            r->bits = r->p;
+            r->bits_len = nbytes;
+            r->bit = 0;
+        } else {
+            nbytes = ((size_t)r->width + 7) / 8;
+            if (nbytes > (size_t)(r->end - r->p))
+                return false;
+            r->run = (size_t)(header >> 1);
+            r->packed = false;
+            r->value = 0;
+            for (size_t i = 0; i < nbytes; i++)
+                r->value |= (uint32_t)r->p[i] << (8 * i);
+        }
+        r->p += nbytes;
+    }
+
+    r->run--;
+    if (!r->packed) {
+        *v = r->value;
+        return true;
+    }
+
+    size_t byte = r->bit >> 3;
+    if (byte + ((r->bit & 7) + (size_t)r->width + 7) / 8 > r->bits_len && r->width > 0)
+        return false;
+    uint64_t w = 0;
+    for (size_t i = 0; i < 5 && byte + i < r->bits_len; i++)
+        w |= (uint64_t)r->bits[byte + i] << (8 * i);
+    *v = (uint32_t)((w >> (r->bit & 7)) & (((uint64_t)1 << r->width) - 1));
+    r->bit += (size_t)r->width;
+    return true;
+}
+
+/*
+ * Clear an address that could not be decoded, and copy the value for
+ * reporting.
+ */
+static void decode_error(ipaddr_t *addr, char **text, const char *value,
+                         size_t len)
+{
+    if (len >= PQ_MAX_TEXT)
+        len = PQ_MAX_TEXT - 1;
+    memset(addr, 0, sizeof(*addr));
+    *text = malloc(len + 1);
+    if (*text != NULL) {
+        memcpy(*text, value, len);
+        (*text)[len] = '\0';
+    }
+}
+
+/*
+ * Decode one value into an address.  On failure, errmsg is set and text
+ * gets an allocated copy of the value.
+ */
+static void decode_value(const ipaddr_parquet_t *pq, const uint8_t *p, size_t len,
+                         ipaddr_t *addr, const char **errmsg, char **text)
+{
+    *errmsg = NULL;
+    *text = NULL;
+
+    if (pq->text) {
+        char buf[PQ_MAX_TEXT];
+        if (len < sizeof(buf)) {
+            memcpy(buf, p, len);
+            buf[len] = '\0';
+            if (ipaddr_parse(buf, addr, errmsg) == IPADDR_OK)
+                return;
+        } else {
+            *errmsg = "address too long";
+        }
+        decode_error(addr, text, (const char *)p, len);
+        return;
+    }
+
+    ipaddr_t tmpl;
+    uint128_t val = 0;
+    memset(&tmpl, 0, sizeof(tmpl));
+    if (pq->type == PQ_INT32) {
+        tmpl.addr.sa.sa_family = AF_INET;
+        val = (uint32_t)p[0] | (uint32_t)p[1] << 8 | (uint32_t)p[2] << 16 |
+              (uint32_t)p[3] << 24;
+    } else if (len == 4 || len == 16) {
+        tmpl.addr.sa.sa_family = (len == 4) ? AF_INET : AF_INET6;
+        for (size_t i = 0; i < len; i++)
+            val = (val << 8) | p[i];
+    } else {
+        char desc[32];
+        *errmsg = "binary address is not 4 or 16 bytes";
+        decode_error(addr, text, desc, (size_t)snprintf(desc, sizeof(desc), "%zu bytes", len));
+        return;
+    }
+    tmpl.prefix_len = ipaddr_max_prefix(&tmpl);
+    ipaddr_from_uint128(addr, val, &tmpl);
+}
+
+/*
+ * Get the next PLAIN value of the column.
+ */
+static bool plain_next(const ipaddr_parquet_t *pq, const uint8_t **p,
+                       const uint8_t *end, const uint8_t **val, size_t *len)
+{
+    size_t avail = (size_t)(end - *p);
+
+    if (pq->type == PQ_BYTE_ARRAY) {
+        if (avail < 4)
+            return false;
+        *len = (size_t)(*p)[0] | (size_t)(*p)[1] << 8 |
+               (size_t)(*p)[2] << 16 | (size_t)(*p)[3] << 24;
+        *p += 4;
+        avail -= 4;
+    } else {
+        *len = (pq->type == PQ_INT32) ? 4 : (size_t)pq->type_length;
+    }
+    if (*len > avail)
+        return false;
+    *val = *p;
+    *p += *len;
+    return true;
+}
+
+/*
+ * Decode and parse the dictionary of a chunk, once.
+ */
+static int load_dictionary(const ipaddr_parquet_t *pq, pq_chunk_t *chunk,
+                           const char **errmsg)
+{
+    pthread_mutex_lock(&chunk->lock);
+    if (chunk->dict_done) {
+        pthread_mutex_unlock(&chunk->lock);
+        *errmsg = chunk->dict_errmsg;
+        return chunk->dict_rc;
+    }
+
+    const pq_page_t *page = chunk->dict_page;
+    const uint8_t *data;
+    size_t len;
+    uint8_t *buf = NULL;
+    int rc = IPADDR_OK;
+
+    *errmsg = NULL;
+    if (page == NULL) {
+        *errmsg = "dictionary page missing";
+        rc = IPADDR_ERR_USAGE;
+    } else if (page->encoding != PQ_PLAIN && page->encoding != PQ_PLAIN_DICT) {
+        *errmsg = "unsupported dictionary encoding";
+        rc = IPADDR_ERR_USAGE;
+    } else {
+        rc = page_contents(pq, page, &data, &len, &buf, errmsg);
+    }
+
+    if (rc == IPADDR_OK) {
+        size_t n = page->num_values;
+        chunk->dict_addrs = malloc((n ? n : 1) * sizeof(*chunk->dict_addrs));
+        chunk->dict_errors = calloc(n ? n : 1, sizeof(*chunk->dict_errors));
+        chunk->dict_text = calloc(n ? n : 1, sizeof(*chunk->dict_text));
+        if (chunk->dict_addrs == NULL || chunk->dict_errors == NULL ||
+            chunk->dict_text == NULL) {
+            *errmsg = "out of memory";
+            rc = IPADDR_ERR_INTERNAL;
+        }
+
+        const uint8_t *p = data, *end = data + len;
+        for (size_t i = 0; i < n && rc == IPADDR_OK; i++) {
+            const uint8_t *val;
+            size_t vlen;
+            if (!plain_next(pq, &p, end, &val, &vlen)) {
+                *errmsg = "invalid dictionary page";
+                rc = IPADDR_ERR_USAGE;
+                break;
+            }
+            decode_value(pq, val, vlen, &chunk->dict_addrs[i],
+                         &chunk->dict_errors[i], &chunk->dict_text[i]);
+            chunk->dict_n++;
+        }
+    }
+    free(buf);
+
+    chunk->dict_done = true;
+    chunk->dict_rc = rc;
+    chunk->dict_errmsg = *errmsg;
+    pthread_mutex_unlock(&chunk->lock);
+    return rc;
+}
+
+/*
+ * Free the dictionary of a chunk.
+ */
+static void free_dictionary(pq_chunk_t *chunk)
+{
+    for (size_t i = 0; i < chunk->dict_n; i++)
+        free(chunk->dict_text[i]);
+    free(chunk->dict_addrs);
+    free(chunk->dict_errors);
+    free(chunk->dict_text);
+    chunk->dict_addrs = NULL;
+    chunk->dict_errors = NULL;
+    chunk->dict_text = NULL;
+    chunk->dict_n = 0;
+}
+
+static void free_batch(ipaddr_parquet_batch_t *batch)
+{
+    if (batch->text != NULL) {
+        for (size_t i = 0; i < batch->n; i++)
+            free(batch->text[i]);
+    }
+    free(batch->addrs);
+    free(batch->errmsg);
+    free(batch->text);
+    memset(batch, 0, sizeof(*batch));
+}
+
+/*
+ * Decode and parse a data page into a batch.
+ */
+static int decode_page(const ipaddr_parquet_t *pq, const pq_page_t *page,
+                       ipaddr_parquet_batch_t *batch, const char **errmsg)
+{
+    pq_chunk_t *chunk = &pq->chunks[page->chunk];
+    size_t n = page->num_values;
+    bool dict = (page->encoding == PQ_PLAIN_DICT || page->encoding == PQ_RLE_DICT);
+    int rc;
+
+    if (!dict && page->encoding != PQ_PLAIN) {
+        *errmsg = "unsupported encoding";
+        return IPADDR_ERR_USAGE;
+    }
+    if (dict) {
+        rc = load_dictionary(pq, chunk, errmsg);
+        if (rc != IPADDR_OK)
+            return rc;
+    }
+
+    const uint8_t *data;
+    size_t len;
+    uint8_t *buf;
+    rc = page_contents(pq, page, &data, &len, &buf, errmsg);
+    if (rc != IPADDR_OK) {
+        free(buf);
+        return rc;
+    }
+
+    batch->first_row = page->first_row;
+    batch->n = n;
+    batch->addrs = malloc((n ? n : 1) * sizeof(*batch->addrs));
+    batch->errmsg = calloc(n ? n : 1, sizeof(*batch->errmsg));
+    batch->text = calloc(n ? n : 1, sizeof(*batch->text));
+    if (batch->addrs == NULL || batch->errmsg == NULL || batch->text == NULL) {
+        free(buf);
+        *errmsg = "out of memory";
+        return IPADDR_ERR_INTERNAL;
+    }
+
+    /* Definition levels: 0 for a null, 1 for a value */
+    const uint8_t *p = data, *end = data + len;
+    rle_t levels = { 0 };
+    if (pq->max_def > 0) {
+        size_t levels_len;
+        if (page->type == PQ_DATA_PAGE_V2) {
+            levels_len = page->levels_len;
+        } else {
+            if (len < 4)
+                goto invalid;
+            levels_len = (size_t)p[0] | (size_t)p[1] << 8 |
+                         (size_t)p[2] << 16 | (size_t)p[3] << 24;
+            p += 4;
+        }
+        if (levels_len > (size_t)(end - p))
+            goto invalid;
+        levels = (rle_t){ .p = p, .end = p + levels_len, .width = 1 };
+        p += levels_len;
+    } else if (page->type == PQ_DATA_PAGE_V2) {
+        p += page->levels_len;
+    }
+
+    rle_t indices = { 0 };
+    if (dict) {
+        if (p >= end || *p > 32)
+            goto invalid;
+        indices = (rle_t){ .p = p + 1, .end = end, .width = *p };
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        uint32_t level = 1;
+        if (pq->max_def > 0 && !rle_next(&levels, &level))
+            goto invalid;
+        if (level == 0) {
+            /* Null: no address */
+            memset(&batch->addrs[i], 0, sizeof(batch->addrs[i]));
+            batch->addrs[i].addr.sa.sa_family = AF_UNSPEC;
+            continue;
+        }
+
+        if (dict) {
+            uint32_t index;
+            if (!rle_next(&indices, &index) || index >= chunk->dict_n)
+                goto invalid;
+            batch->addrs[i] = chunk->dict_addrs[index];
+            batch->errmsg[i] = chunk->dict_errors[index];
+            if (chunk->dict_text[index] != NULL)
+                batch->text[i] = strdup(chunk->dict_text[index]);
+        } else {
+            const uint8_t *val;
+            size_t vlen;
+            if (!plain_next(pq, &p, end, &val, &vlen))
+                goto invalid;
+            decode_value(pq, val, vlen, &batch->addrs[i], &batch->errmsg[i],
+                         &batch->text[i]);
+        }
+    }
+    free(buf);
+    return IPADDR_OK;
+
+invalid:
+    free(buf);
+    *errmsg = "invalid data page";
+    return IPADDR_ERR_USAGE;
+}
+
+/* ========== Workers ========== */
+
+static void *worker(void *arg)
+{
+    ipaddr_parquet_t *pq = arg;
+
+    pthread_mutex_lock(&pq->lock);
+    for (;;) {
+        while (!pq->stop && pq->next_page < pq->ndata &&
+               pq->next_page >= pq->consumed + pq->window)
+            pthread_cond_wait(&pq->work_cond, &pq->lock);
+        if (pq->stop || pq->next_page >= pq->ndata)
+            break;
+
+        size_t index = pq->next_page++;
+        pq_slot_t *slot = &pq->slots[index % pq->window];
+        pthread_mutex_unlock(&pq->lock);
+
+        slot->rc = decode_page(pq, pq->data_pages[index], &slot->batch, &slot->errmsg);
+
+        pthread_mutex_lock(&pq->lock);
+        slot->ready = true;
+        pthread_cond_broadcast(&pq->ready_cond);
+    }
+    pthread_mutex_unlock(&pq->lock);
+    return NULL;
+}
+
+/*
+ * Start the workers.
+ */
+static int start_workers(ipaddr_parquet_t *pq)
+{
+    long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+    int n = (ncpu < 1) ? 1 : (ncpu > PQ_MAX_THREADS) ? PQ_MAX_THREADS : (int)ncpu;
+
+    if ((size_t)n > pq->ndata)
+        n = pq->ndata ? (int)pq->ndata : 1;
+    pq->window = (size_t)n * PQ_WINDOW_PER_THREAD;
+    pq->slots = calloc(pq->window, sizeof(*pq->slots));
+    if (pq->slots == NULL)
+        return IPADDR_ERR_INTERNAL;
+
+    for (int i = 0; i < n; i++) {
+        if (pthread_create(&pq->threads[i], NULL, worker, pq) != 0)
+            break;
+        pq->nthreads++;
+    }
+    pq->started = true;
+    return (pq->nthreads > 0) ? IPADDR_OK : IPADDR_ERR_INTERNAL;
+}
+
+/* ========== Public interface ========== */
+
+int ipaddr_parquet_open(const char *path, const char *column,
+                        ipaddr_parquet_t **pqp, const char **errmsg)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        *errmsg = strerror(errno);
+        return IPADDR_ERR_USAGE;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        *errmsg = "not a regular file";
+        close(fd);
+        return IPADDR_ERR_USAGE;
+    }
+
+    ipaddr_parquet_t *pq = calloc(1, sizeof(*pq));
+    if (pq == NULL) {
+        close(fd);
+        *errmsg = "out of memory";
+        return IPADDR_ERR_INTERNAL;
+    }
+    pthread_mutex_init(&pq->lock, NULL);
+    pthread_cond_init(&pq->work_cond, NULL);
+    pthread_cond_init(&pq->ready_cond, NULL);
+
+    pq->map_size = (size_t)st.st_size;
+    if (pq->map_size > 0) {
+        void *map = mmap(NULL, pq->map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            pq->map = map;
+            madvise(map, pq->map_size, MADV_WILLNEED);
+        }
+    }
+    close(fd);
+    if (pq->map == NULL && pq->map_size > 0) {
+        *errmsg = strerror(errno);
+        ipaddr_parquet_close(pq);
+        return IPADDR_ERR_USAGE;
+    }
+
+    int rc = read_metadata(pq, column, errmsg);
+    if (rc == IPADDR_OK)
+        rc = index_pages(pq, errmsg);
+    if (rc != IPADDR_OK) {
+        ipaddr_parquet_close(pq);
+        return rc;
+    }
+
+    *pqp = pq;
+    return IPADDR_OK;
+}
+
+int ipaddr_parquet_next(ipaddr_parquet_t *pq, const ipaddr_parquet_batch_t **batch,
+                        const char **errmsg)
+{
+    pthread_mutex_lock(&pq->lock);
+
+    /* Release the previous batch */
+    if (pq->holding) {
+        pq_slot_t *slot = &pq->slots[pq->consumed % pq->window];
+        pq_chunk_t *chunk = &pq->chunks[pq->data_pages[pq->consumed]->chunk];
+        free_batch(&slot->batch);
+        slot->ready = false;
+        if (--chunk->pages_left == 0)
+            free_dictionary(chunk);
+        pq->consumed++;
+        pq->holding = false;
+        pthread_cond_broadcast(&pq->work_cond);
+    }
+
+    if (pq->consumed >= pq->ndata) {
+        pthread_mutex_unlock(&pq->lock);
+        return IPADDR_ERR_BOOL;
+    }
+    if (!pq->started && start_workers(pq) != IPADDR_OK) {
+        pthread_mutex_unlock(&pq->lock);
+        *errmsg = "cannot start threads";
+        return IPADDR_ERR_INTERNAL;
+    }
+
+    pq_slot_t *slot = &pq->slots[pq->consumed % pq->window];
+    while (!slot->ready)
+        pthread_cond_wait(&pq->ready_cond, &pq->lock);
+    pq->holding = true;
+    pthread_mutex_unlock(&pq->lock);
+
+    if (slot->rc != IPADDR_OK) {
+        *errmsg = slot->errmsg;
+        return slot->rc;
+    }
+    *batch = &slot->batch;
+    return IPADDR_OK;
+}
+
+void ipaddr_parquet_close(ipaddr_parquet_t *pq)
+{
+    if (pq == NULL)
+        return;
+
+    pthread_mutex_lock(&pq->lock);
+    pq->stop = true;
+    pthread_cond_broadcast(&pq->work_cond);
+    pthread_mutex_unlock(&pq->lock);
+    for (int i = 0; i < pq->nthreads; i++)
+        pthread_join(pq->threads[i], NULL);
+
+    for (size_t i = 0; i < pq->window; i++)
+        free_batch(&pq->slots[i].batch);
+    free(pq->slots);
+    for (size_t i = 0; i < pq->nchunks; i++) {
+        free_dictionary(&pq->chunks[i]);
+        pthread_mutex_destroy(&pq->chunks[i].lock);
+    }
+    free(pq->chunks);
+    free(pq->pages);
+    free(pq->data_pages);
+    if (pq->map != NULL)
+        munmap((void *)pq->map, pq->map_size);
+    pthread_mutex_destroy(&pq->lock);
+    pthread_cond_destroy(&pq->work_cond);
+    pthread_cond_destroy(&pq->ready_cond);
+    free(pq);
+}
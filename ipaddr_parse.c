@@ -5,6 +5,7 @@
 #include "ipaddr.h"
 
 #include <string.h>
+#include <strings.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <ctype.h>
@@ -91,6 +92,19 @@ static int parse_netmask_prefix(const char *str, int family)
     return plen;
 }
 
+/*
+ * Check whether a string ends in ".arpa" or ".arpa.", as reverse DNS
+ * names do.
+ */
+static bool is_arpa_name(const char *str)
+{
+    size_t len = strlen(str);
+
+    if (len > 0 && str[len - 1] == '.')
+        len--;
+    return len >= 5 && strncasecmp(str + len - 5, ".arpa", 5) == 0;
+}
+
 /*
  * Parse an IP address string with optional prefix.
  */
@@ -110,6 +124,9 @@ int ipaddr_parse(const char *str, ipaddr_t *addr, const char **errmsg)
         return IPADDR_ERR_USAGE;
     }
 
+    if (is_arpa_name(str))
+        return ipaddr_parse_reverse(str, addr, errmsg);
+
     /* Copy to buffer for modification */
     if (strlen(str) >= sizeof(buf)) {
         *errmsg = "address string too long";
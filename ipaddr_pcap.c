@@ -0,0 +1,457 @@
+/*
+ * ipaddr_pcap.c - Reading addresses from packet captures
+ *
+ * The capture file is mapped into memory and walked packet by packet.  The
+ * IPv4 or IPv6 header of each packet is found behind its link-layer header
+ * (Ethernet with any number of VLAN tags, Linux cooked capture, BSD
+ * loopback or raw IP) and its addresses are copied straight into ipaddr_t,
+ * so nothing is formatted or parsed.
+ *
+ * Both the classic pcap format, in either byte order and with microsecond
+ * or nanosecond timestamps, and pcapng are read.  Packets that do not
+ * carry IP, or are captured too short to hold its header, are skipped.
+ */
+
+#include "ipaddr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* Classic pcap magic numbers, as read in the file's byte order */
+#define PCAP_MAGIC_US   0xa1b2c3d4
+#define PCAP_MAGIC_NS   0xa1b23c4d
+#define PCAP_HDR_SIZE   24
+#define PCAP_REC_SIZE   16
+
+/* pcapng block types */
+#define PCAPNG_SHB      0x0a0d0d0a   /* section header */
+#define PCAPNG_IDB      0x00000001   /* interface description */
+#define PCAPNG_OPB      0x00000002   /* obsolete packet */
+#define PCAPNG_SPB      0x00000003   /* simple packet */
+#define PCAPNG_EPB      0x00000006   /* enhanced packet */
+#define PCAPNG_BOM      0x1a2b3c4d   /* byte-order magic */
+
+/* Link types */
+#define LINKTYPE_NULL       0
+#define LINKTYPE_ETHERNET   1
+#define LINKTYPE_RAW        101
+#define LINKTYPE_LOOP       108
+#define LINKTYPE_LINUX_SLL  113
+#define LINKTYPE_IPV4       228
+#define LINKTYPE_IPV6       229
+#define LINKTYPE_LINUX_SLL2 276
+
+/* EtherTypes */
+#define ETHERTYPE_IPV4  0x0800
+#define ETHERTYPE_IPV6  0x86dd
+#define ETHERTYPE_VLAN  0x8100
+#define ETHERTYPE_QINQ  0x88a8
+#define ETHERTYPE_QINQ1 0x9100
+
+struct ipaddr_pcap {
+    const uint8_t *map;
+    size_t         size;
+    size_t         pos;        /* offset of the next record or block */
+    int            which;      /* IPADDR_PCAP_* */
+    bool           ng;         /* pcapng rather than classic pcap */
+    bool           big;        /* file (or section) is big-endian */
+    uint32_t       linktype;   /* of a classic file */
+    uint32_t      *linktypes;  /* of the interfaces of a pcapng section */
+    size_t         nifaces;
+    size_t         cap_ifaces;
+    size_t         packet;     /* packets read so far */
+    ipaddr_t       dst;        /* destination still to be returned */
+    bool           has_dst;
+};
+
+static uint16_t get16(const uint8_t *p, bool big)
+{
+    return big ? (uint16_t)(p[0] << 8 | p[1]) : (uint16_t)(p[1] << 8 | p[0]);
+}
+
+static uint32_t get32(const uint8_t *p, bool big)
+{
+    if (big)
+        return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+               (uint32_t)p[2] << 8 | p[3];
+    return (uint32_t)p[3] << 24 | (uint32_t)p[2] << 16 |
+           (uint32_t)p[1] << 8 | p[0];
+}
+
+static bool supported_linktype(uint32_t linktype)
+{
+    switch (linktype) {
+    case LINKTYPE_NULL:
+    case LINKTYPE_ETHERNET:
+    case LINKTYPE_RAW:
+    case LINKTYPE_LOOP:
+    case LINKTYPE_LINUX_SLL:
+    case LINKTYPE_IPV4:
+    case LINKTYPE_IPV6:
+    case LINKTYPE_LINUX_SLL2:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static void set_addr(ipaddr_t *addr, int family, const uint8_t *bytes)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->addr.sa.sa_family = (sa_family_t)family;
+    if (family == AF_INET) {
+        memcpy(&addr->addr.sin.sin_addr, bytes, 4);
+        addr->prefix_len = 32;
+    } else {
+        memcpy(&addr->addr.sin6.sin6_addr, bytes, 16);
+        addr->prefix_len = 128;
+    }
+}
+
+/*
+ * Find the IP header of a packet and get its addresses.
+ * Returns false if the packet does not hold a whole IPv4 or IPv6 header.
+ */
+static bool decode_packet(const uint8_t *p, size_t len, uint32_t linktype,
+                          ipaddr_t *src, ipaddr_t *dst)
+{
+    size_t off;
+    unsigned ethertype = 0;     /* 0: tell IPv4 from IPv6 by the version */
+
+    switch (linktype) {
+    case LINKTYPE_ETHERNET:
+        if (len < 14)
+            return false;
+        ethertype = (unsigned)p[12] << 8 | p[13];
+        off = 14;
+        while ((ethertype == ETHERTYPE_VLAN || ethertype == ETHERTYPE_QINQ ||
+                ethertype == ETHERTYPE_QINQ1) && len - off >= 4) {
+            ethertype = (unsigned)p[off + 2] << 8 | p[off + 3];
+            off += 4;
+        }
+        break;
+    case LINKTYPE_LINUX_SLL:
+        if (len < 16)
+            return false;
+        ethertype = (unsigned)p[14] << 8 | p[15];
+        off = 16;
+        break;
+    case LINKTYPE_LINUX_SLL2:
+        if (len < 20)
+            return false;
+        ethertype = (unsigned)p[0] << 8 | p[1];
+        off = 20;
+        break;
+    case LINKTYPE_NULL:
+    case LINKTYPE_LOOP:
+        /* The address family is in the capturing host's byte order */
+        off = 4;
+        break;
+    case LINKTYPE_RAW:
+    case LINKTYPE_IPV4:
+    case LINKTYPE_IPV6:
+        off = 0;
+        break;
+    default:
+        return false;
+    }
+
+    if (off >= len)
+        return false;
+    p += off;
+    len -= off;
+
+    unsigned version = p[0] >> 4;
+    if ((ethertype == ETHERTYPE_IPV4 || ethertype == 0) && version == 4) {
+        if (len < 20 || (p[0] & 0x0f) < 5)
+            return false;
+        set_addr(src, AF_INET, p + 12);
+        set_addr(dst, AF_INET, p + 16);
+        return true;
+    }
+    if ((ethertype == ETHERTYPE_IPV6 || ethertype == 0) && version == 6) {
+        if (len < 40)
+            return false;
+        set_addr(src, AF_INET6, p + 8);
+        set_addr(dst, AF_INET6, p + 24);
+        return true;
+    }
+    return false;
+}
+
+/*
+ * Get the next packet of a classic pcap file.
+ * Returns 0 on success, IPADDR_ERR_BOOL at the end of the file,
+ * IPADDR_ERR_USAGE if it is truncated.
+ */
+static int next_classic(ipaddr_pcap_t *pc, const uint8_t **data, size_t *len,
+                        uint32_t *linktype, const char **errmsg)
+{
+    size_t left = pc->size - pc->pos;
+    if (left == 0)
+        return IPADDR_ERR_BOOL;
+    if (left < PCAP_REC_SIZE) {
+        *errmsg = "truncated packet header";
+        return IPADDR_ERR_USAGE;
+    }
+
+    const uint8_t *rec = pc->map + pc->pos;
+    size_t caplen = get32(rec + 8, pc->big);
+    if (caplen > left - PCAP_REC_SIZE) {
+        *errmsg = "truncated packet";
+        return IPADDR_ERR_USAGE;
+    }
+
+    *data = rec + PCAP_REC_SIZE;
+    *len = caplen;
+    *linktype = pc->linktype;
+    pc->pos += PCAP_REC_SIZE + caplen;
+    return IPADDR_OK;
+}
+
+/*
+ * Start a pcapng section at the current position.
+ */
+static int read_section_header(ipaddr_pcap_t *pc, const char **errmsg)
+{
+    const uint8_t *blk = pc->map + pc->pos;
+    if (pc->size - pc->pos < 28) {
+        *errmsg = "truncated section header";
+        return IPADDR_ERR_USAGE;
+    }
+    if (get32(blk + 8, true) == PCAPNG_BOM) {
+        pc->big = true;
+    } else if (get32(blk + 8, false) == PCAPNG_BOM) {
+        pc->big = false;
+    } else {
+        *errmsg = "invalid section header";
+        return IPADDR_ERR_USAGE;
+    }
+    if (get16(blk + 12, pc->big) != 1) {
+        *errmsg = "unsupported pcapng version";
+        return IPADDR_ERR_USAGE;
+    }
+    pc->nifaces = 0;
+    return IPADDR_OK;
+}
+
+/*
+ * Get the next packet of a pcapng file, reading the blocks before it.
+ * Returns 0 on success, IPADDR_ERR_BOOL at the end of the file,
+ * IPADDR_ERR_USAGE if it is malformed, IPADDR_ERR_INTERNAL if out of memory.
+ */
+static int next_ng(ipaddr_pcap_t *pc, const uint8_t **data, size_t *len,
+                   uint32_t *linktype, const char **errmsg)
+{
+    for (;;) {
+        size_t left = pc->size - pc->pos;
+        if (left == 0)
+            return IPADDR_ERR_BOOL;
+        if (left < 12) {
+            *errmsg = "truncated block";
+            return IPADDR_ERR_USAGE;
+        }
+
+        const uint8_t *blk = pc->map + pc->pos;
+        uint32_t type = get32(blk, pc->big);
+        if (type == PCAPNG_SHB) {
+            int rc = read_section_header(pc, errmsg);
+            if (rc != IPADDR_OK)
+                return rc;
+        }
+
+        size_t blen = get32(blk + 4, pc->big);
+        if (blen < 12 || blen % 4 != 0 || blen > left) {
+            *errmsg = (blen > left) ? "truncated block" : "invalid block length";
+            return IPADDR_ERR_USAGE;
+        }
+        pc->pos += blen;
+
+        size_t iface = 0;
+        size_t caplen;
+        size_t hdr;
+        switch (type) {
+        case PCAPNG_IDB:
+            if (blen < 20) {
+                *errmsg = "invalid interface description";
+                return IPADDR_ERR_USAGE;
+            }
+            if (pc->nifaces == pc->cap_ifaces) {
+                size_t cap = pc->cap_ifaces ? pc->cap_ifaces * 2 : 4;
+                uint32_t *types = realloc(pc->linktypes, cap * sizeof(*types));
+                if (types == NULL) {
+                    *errmsg = "out of memory";
+                    return IPADDR_ERR_INTERNAL;
+                }
+                pc->linktypes = types;
+                pc->cap_ifaces = cap;
+            }
+            pc->linktypes[pc->nifaces++] = get16(blk + 8, pc->big);
+            continue;
+        case PCAPNG_EPB:
+        case PCAPNG_OPB:
+            hdr = 28;
+            if (blen < hdr + 4) {
+                *errmsg = "invalid packet block";
+                return IPADDR_ERR_USAGE;
+            }
+            iface = (type == PCAPNG_EPB) ? get32(blk + 8, pc->big)
+                                         : get16(blk + 8, pc->big);
+            caplen = get32(blk + 20, pc->big);
+            if (caplen > blen - hdr - 4) {
+                *errmsg = "invalid packet block";
+                return IPADDR_ERR_USAGE;
+            }
+            break;
+        case PCAPNG_SPB:
+            hdr = 12;
+            if (blen < hdr + 4) {
+                *errmsg = "invalid packet block";
+                return IPADDR_ERR_USAGE;
+            }
+            /* Captured as much of the packet as fits the block */
+            caplen = get32(blk + 8, pc->big);
+            if (caplen > blen - hdr - 4)
+                caplen = blen - hdr - 4;
+            break;
+        default:
+            continue;
+        }
+
+        if (iface >= pc->nifaces) {
+            *errmsg = "packet on an undescribed interface";
+            return IPADDR_ERR_USAGE;
+        }
+        *data = blk + hdr;
+        *len = caplen;
+        *linktype = pc->linktypes[iface];
+        return IPADDR_OK;
+    }
+}
+
+int ipaddr_pcap_open(const char *path, int which, ipaddr_pcap_t **pcp,
+                     const char **errmsg)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        *errmsg = strerror(errno);
+        return IPADDR_ERR_USAGE;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        *errmsg = "not a regular file";
+        close(fd);
+        return IPADDR_ERR_USAGE;
+    }
+
+    ipaddr_pcap_t *pc = calloc(1, sizeof(*pc));
+    if (pc == NULL) {
+        close(fd);
+        *errmsg = "out of memory";
+        return IPADDR_ERR_INTERNAL;
+    }
+    pc->which = which;
+
+    pc->size = (size_t)st.st_size;
+    if (pc->size > 0) {
+        void *map = mmap(NULL, pc->size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED) {
+            pc->map = map;
+            madvise(map, pc->size, MADV_SEQUENTIAL);
+        }
+    }
+    close(fd);
+    if (pc->map == NULL && pc->size > 0) {
+        *errmsg = strerror(errno);
+        ipaddr_pcap_close(pc);
+        return IPADDR_ERR_USAGE;
+    }
+
+    int rc = IPADDR_OK;
+    if (pc->size >= 4 && get32(pc->map, true) == PCAPNG_SHB) {
+        pc->ng = true;
+        rc = read_section_header(pc, errmsg);
+    } else if (pc->size >= PCAP_HDR_SIZE) {
+        uint32_t magic = get32(pc->map, true);
+        if (magic == PCAP_MAGIC_US || magic == PCAP_MAGIC_NS) {
+            pc->big = true;
+        } else {
+            magic = get32(pc->map, false);
+            if (magic != PCAP_MAGIC_US && magic != PCAP_MAGIC_NS) {
+                *errmsg = "not a pcap or pcapng file";
+                rc = IPADDR_ERR_USAGE;
+            }
+        }
+        /* The upper bits hold FCS information */
+        pc->linktype = get32(pc->map + 20, pc->big) & 0xffff;
+        pc->pos = PCAP_HDR_SIZE;
+        if (rc == IPADDR_OK && !supported_linktype(pc->linktype)) {
+            *errmsg = "unsupported link type";
+            rc = IPADDR_ERR_USAGE;
+        }
+    } else {
+        *errmsg = "not a pcap or pcapng file";
+        rc = IPADDR_ERR_USAGE;
+    }
+    if (rc != IPADDR_OK) {
+        ipaddr_pcap_close(pc);
+        return rc;
+    }
+
+    *pcp = pc;
+    return IPADDR_OK;
+}
+
+int ipaddr_pcap_next(ipaddr_pcap_t *pc, ipaddr_t *addr, size_t *packet,
+                     const char **errmsg)
+{
+    if (pc->has_dst) {
+        *addr = pc->dst;
+        *packet = pc->packet;
+        pc->has_dst = false;
+        return IPADDR_OK;
+    }
+
+    for (;;) {
+        const uint8_t *data;
+        size_t len;
+        uint32_t linktype;
+        int rc = pc->ng ? next_ng(pc, &data, &len, &linktype, errmsg)
+                        : next_classic(pc, &data, &len, &linktype, errmsg);
+        if (rc != IPADDR_OK) {
+            *packet = pc->packet + 1;
+            return rc;
+        }
+        pc->packet++;
+
+        ipaddr_t src;
+        if (!decode_packet(data, len, linktype, &src, &pc->dst))
+            continue;
+
+        *packet = pc->packet;
+        if (pc->which & IPADDR_PCAP_SRC) {
+            *addr = src;
+            pc->has_dst = (pc->which & IPADDR_PCAP_DST) != 0;
+        } else {
+            *addr = pc->dst;
+        }
+        return IPADDR_OK;
+    }
+}
+
+void ipaddr_pcap_close(ipaddr_pcap_t *pc)
+{
+    if (pc == NULL)
+        return;
+    if (pc->map != NULL)
+        munmap((void *)pc->map, pc->size);
+    free(pc->linktypes);
+    free(pc);
+}
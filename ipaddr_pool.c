@@ -0,0 +1,1421 @@
+/*
+ * ipaddr_pool.c - Subnet allocation with buddy-system free lists
+ *
+ * A pool hands out aligned subnets of a network.  Its free space is kept in
+ * free lists per prefix length, as in a buddy allocator: a /N is taken from
+ * the list of the longest prefix length up to N that has a block, and the
+ * block is split in halves down to /N, the unused halves going on the lists
+ * below.  A released block is merged with its buddy, the other half of its
+ * supernet, for as long as the buddy is free as well.  Each free list is a
+ * heap ordered by address, so allocation is lowest-address first among the
+ * smallest blocks that fit, and a hash table tells which blocks are free or
+ * allocated.  Allocating or releasing a block costs O(log n) for n blocks.
+ *
+ * A state file records the allocations of any number of pools as a prefix
+ * table (see ipaddr_lpm_read()) mapping each allocation to its pool.  It is
+ * a journal: an allocation appends its line and a release appends a
+ * withdrawal, and the file is only rewritten once withdrawals make up most
+ * of it.  The file is locked while in use, so concurrent allocations never
+ * hand out the same block.
+ *
+ * Next to it, a snapshot (the state file name plus ".snap") holds the
+ * allocator itself as laid out in memory: the hash table of allocations
+ * and, for each pool, its block table and free lists.  A run maps the
+ * snapshot and applies only the lines appended since it was taken, so it
+ * costs O(log n) rather than a read of all n allocations; a new snapshot is
+ * taken every POOL_SNAPSHOT_LINES lines.  The snapshot is only a cache of
+ * the table: one taken of another version of the file is ignored, and the
+ * whole table is read instead.
+ */
+
+#include "ipaddr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define POOL_SLOTS_MIN  64      /* first hash table size */
+
+/* Rewrite a state file once it has this many lines beyond twice its entries */
+#define POOL_JOURNAL_SLACK 1024
+
+/* Take a new snapshot once this many lines were appended since the last */
+#define POOL_SNAPSHOT_LINES 128
+
+#define POOL_SNAP_MAGIC "ipaddrP1"  /* 8 bytes, changed with the layout */
+#define POOL_SNAP_TAIL  64          /* state file bytes checked before offset */
+
+/* Hash table slot states */
+#define SLOT_EMPTY 0
+#define SLOT_FREE  1
+#define SLOT_USED  2
+
+typedef struct {
+    uint128_t base;
+    int32_t   tag;        /* table of allocations: index of the pool */
+    uint8_t   len;
+    uint8_t   ipv6;
+    uint8_t   state;
+} pool_slot_t;
+
+/* Hash table of blocks, with linear probing */
+typedef struct {
+    pool_slot_t *slots;
+    size_t       nslots;      /* power of two */
+    size_t       used;        /* non-empty slots */
+    bool         mapped;      /* slots are in a snapshot */
+} pool_table_t;
+
+/* Free list: min-heap of block addresses, with stale entries skipped lazily */
+typedef struct {
+    uint128_t *items;
+    size_t     count;
+    size_t     cap;
+    bool       mapped;        /* items are in a snapshot */
+} pool_heap_t;
+
+struct ipaddr_pool {
+    ipaddr_t     net;
+    int          max_bits;
+    bool         ipv6;
+    pool_table_t blocks;
+    pool_heap_t  free[129];   /* by prefix length */
+};
+
+/*
+ * Get the host mask of a block of prefix length len.
+ */
+static uint128_t host_mask(const ipaddr_pool_t *pool, int len)
+{
+    int bits = pool->max_bits - len;
+    return bits >= 128 ? ~(uint128_t)0 : ((uint128_t)1 << bits) - 1;
+}
+
+/*
+ * Set block to the /len at base within net.
+ */
+static void set_block(ipaddr_t *block, uint128_t base, int len, const ipaddr_t *net)
+{
+    ipaddr_from_uint128(block, base, net);
+    block->prefix_len = len;
+}
+
+/*
+ * Set block to the /len at base of a family.
+ */
+static void make_block(ipaddr_t *block, bool ipv6, uint128_t base, int len)
+{
+    memset(block, 0, sizeof(*block));
+    block->addr.sa.sa_family = ipv6 ? AF_INET6 : AF_INET;
+    ipaddr_from_uint128(block, base, block);
+    block->prefix_len = len;
+    block->has_prefix = true;
+}
+
+static size_t slot_hash(bool ipv6, uint128_t base, int len)
+{
+    uint64_t h = (uint64_t)base ^ (uint64_t)(base >> 64) * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ (uint64_t)len ^ (uint64_t)ipv6 << 8) * 0xff51afd7ed558ccdULL;
+    return (size_t)(h ^ (h >> 32));
+}
+
+/*
+ * Find the slot of a block, or the empty slot where it would go.
+ */
+static pool_slot_t *table_find(const pool_table_t *t, bool ipv6, uint128_t base,
+                               int len)
+{
+    size_t mask = t->nslots - 1;
+    size_t i = slot_hash(ipv6, base, len) & mask;
+    while (t->slots[i].state != SLOT_EMPTY &&
+           (t->slots[i].base != base || t->slots[i].len != len ||
+            t->slots[i].ipv6 != ipv6))
+        i = (i + 1) & mask;
+    return &t->slots[i];
+}
+
+static bool table_grow(pool_table_t *t)
+{
+    size_t nslots = t->nslots ? t->nslots * 2 : POOL_SLOTS_MIN;
+    pool_slot_t *slots = calloc(nslots, sizeof(*slots));
+    if (slots == NULL)
+        return false;
+
+    pool_slot_t *old = t->slots;
+    size_t nold = t->nslots;
+    t->slots = slots;
+    t->nslots = nslots;
+    for (size_t i = 0; i < nold; i++) {
+        if (old[i].state != SLOT_EMPTY)
+            *table_find(t, old[i].ipv6, old[i].base, old[i].len) = old[i];
+    }
+    if (!t->mapped)
+        free(old);
+    t->mapped = false;
+    return true;
+}
+
+/*
+ * Set the state of a block, adding it if it is not in the table.
+ * Returns its slot, or NULL on allocation failure.
+ */
+static pool_slot_t *table_set(pool_table_t *t, bool ipv6, uint128_t base,
+                              int len, int state)
+{
+    if ((t->used + 1) * 2 > t->nslots && !table_grow(t))
+        return NULL;
+
+    pool_slot_t *slot = table_find(t, ipv6, base, len);
+    if (slot->state == SLOT_EMPTY) {
+        slot->base = base;
+        slot->tag = -1;
+        slot->len = (uint8_t)len;
+        slot->ipv6 = ipv6;
+        t->used++;
+    }
+    slot->state = (uint8_t)state;
+    return slot;
+}
+
+/*
+ * Remove a block from the table, moving later slots of its probe run back
+ * into the hole so that no tombstones are needed.
+ */
+static void table_remove(pool_table_t *t, bool ipv6, uint128_t base, int len)
+{
+    size_t mask = t->nslots - 1;
+    pool_slot_t *slot = table_find(t, ipv6, base, len);
+    if (slot->state == SLOT_EMPTY)
+        return;
+
+    size_t hole = (size_t)(slot - t->slots);
+    size_t i = hole;
+    for (;;) {
+        i = (i + 1) & mask;
+        pool_slot_t *next = &t->slots[i];
+        if (next->state == SLOT_EMPTY)
+            break;
+        /* Move next into the hole unless its home lies after the hole */
+        size_t home = slot_hash(next->ipv6, next->base, next->len) & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask)) {
+            t->slots[hole] = *next;
+            hole = i;
+        }
+    }
+    t->slots[hole].state = SLOT_EMPTY;
+    t->used--;
+}
+
+static void table_free(pool_table_t *t)
+{
+    if (!t->mapped)
+        free(t->slots);
+}
+
+static int slot_state(const ipaddr_pool_t *pool, uint128_t base, int len)
+{
+    return table_find(&pool->blocks, pool->ipv6, base, len)->state;
+}
+
+static bool slot_set(ipaddr_pool_t *pool, uint128_t base, int len, int state)
+{
+    return table_set(&pool->blocks, pool->ipv6, base, len, state) != NULL;
+}
+
+static void slot_remove(ipaddr_pool_t *pool, uint128_t base, int len)
+{
+    table_remove(&pool->blocks, pool->ipv6, base, len);
+}
+
+static bool heap_push(pool_heap_t *heap, uint128_t base)
+{
+    if (heap->count == heap->cap) {
+        size_t cap = heap->cap ? heap->cap * 2 : 16;
+        uint128_t *items = heap->mapped ? malloc(cap * sizeof(*items))
+                                        : realloc(heap->items, cap * sizeof(*items));
+        if (items == NULL)
+            return false;
+        if (heap->mapped)
+            memcpy(items, heap->items, heap->count * sizeof(*items));
+        heap->items = items;
+        heap->cap = cap;
+        heap->mapped = false;
+    }
+
+    size_t i = heap->count++;
+    while (i > 0 && heap->items[(i - 1) / 2] > base) {
+        heap->items[i] = heap->items[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    heap->items[i] = base;
+    return true;
+}
+
+static void heap_pop(pool_heap_t *heap)
+{
+    uint128_t last = heap->items[--heap->count];
+    size_t i = 0;
+    for (;;) {
+        size_t c = 2 * i + 1;
+        if (c >= heap->count)
+            break;
+        if (c + 1 < heap->count && heap->items[c + 1] < heap->items[c])
+            c++;
+        if (heap->items[c] >= last)
+            break;
+        heap->items[i] = heap->items[c];
+        i = c;
+    }
+    if (heap->count > 0)
+        heap->items[i] = last;
+}
+
+/*
+ * Get the lowest free block of prefix length len.  Returns false if there
+ * is none.  Entries for blocks that were merged or taken since they were
+ * pushed are dropped on the way.
+ */
+static bool free_first(ipaddr_pool_t *pool, int len, uint128_t *base)
+{
+    pool_heap_t *heap = &pool->free[len];
+    while (heap->count > 0) {
+        if (slot_state(pool, heap->items[0], len) == SLOT_FREE) {
+            *base = heap->items[0];
+            return true;
+        }
+        heap_pop(heap);
+    }
+    return false;
+}
+
+static bool free_add(ipaddr_pool_t *pool, uint128_t base, int len)
+{
+    return slot_set(pool, base, len, SLOT_FREE) &&
+           heap_push(&pool->free[len], base);
+}
+
+/*
+ * Split the free block base/from down to the /to holding target, putting
+ * the halves not holding it on the free lists, and mark the /to allocated.
+ */
+static int split_block(ipaddr_pool_t *pool, uint128_t base, int from,
+                       uint128_t target, int to)
+{
+    slot_remove(pool, base, from);
+    for (int len = from + 1; len <= to; len++) {
+        uint128_t half = host_mask(pool, len) + 1;
+        uint128_t lower = target & ~host_mask(pool, len - 1);
+        uint128_t other = (target & half) ? lower : lower + half;
+        if (!free_add(pool, other, len))
+            return IPADDR_ERR_INTERNAL;
+    }
+    if (!slot_set(pool, target, to, SLOT_USED))
+        return IPADDR_ERR_INTERNAL;
+    return IPADDR_OK;
+}
+
+ipaddr_pool_t *ipaddr_pool_new(const ipaddr_t *net)
+{
+    ipaddr_pool_t *pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+        return NULL;
+
+    ipaddr_network(net, &pool->net);
+    pool->net.has_prefix = true;
+    pool->max_bits = ipaddr_max_prefix(net);
+    pool->ipv6 = ipaddr_is_ipv6(net);
+    if (!table_grow(&pool->blocks) ||
+        !free_add(pool, ipaddr_to_uint128(&pool->net), pool->net.prefix_len)) {
+        ipaddr_pool_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+void ipaddr_pool_free(ipaddr_pool_t *pool)
+{
+    if (pool == NULL)
+        return;
+    for (size_t i = 0; i < sizeof(pool->free) / sizeof(pool->free[0]); i++) {
+        if (!pool->free[i].mapped)
+            free(pool->free[i].items);
+    }
+    table_free(&pool->blocks);
+    free(pool);
+}
+
+/*
+ * Check that block is a subnet of the pool.
+ */
+static bool in_pool(const ipaddr_pool_t *pool, const ipaddr_t *block)
+{
+    return ipaddr_family(block) == ipaddr_family(&pool->net) &&
+           block->prefix_len >= pool->net.prefix_len &&
+           (ipaddr_to_uint128(block) & ~host_mask(pool, pool->net.prefix_len)) ==
+               ipaddr_to_uint128(&pool->net);
+}
+
+int ipaddr_pool_reserve(ipaddr_pool_t *pool, const ipaddr_t *block)
+{
+    if (!in_pool(pool, block))
+        return IPADDR_ERR_USAGE;
+
+    /* Find the free block holding it; an allocated one means overlap */
+    uint128_t target = ipaddr_to_uint128(block) & ~host_mask(pool, block->prefix_len);
+    for (int len = block->prefix_len; len >= pool->net.prefix_len; len--) {
+        uint128_t base = target & ~host_mask(pool, len);
+        int state = slot_state(pool, base, len);
+        if (state == SLOT_FREE)
+            return split_block(pool, base, len, target, block->prefix_len);
+        if (state == SLOT_USED)
+            return IPADDR_ERR_BOOL;
+    }
+    return IPADDR_ERR_BOOL;   /* an allocation lies within it */
+}
+
+int ipaddr_pool_alloc(ipaddr_pool_t *pool, int prefix_len, ipaddr_t *block)
+{
+    if (prefix_len < pool->net.prefix_len || prefix_len > pool->max_bits)
+        return IPADDR_ERR_USAGE;
+
+    /* The smallest free block that fits, splitting it from the bottom */
+    for (int len = prefix_len; len >= pool->net.prefix_len; len--) {
+        uint128_t base;
+        if (!free_first(pool, len, &base))
+            continue;
+        heap_pop(&pool->free[len]);
+        int rc = split_block(pool, base, len, base, prefix_len);
+        if (rc != IPADDR_OK)
+            return rc;
+        set_block(block, base, prefix_len, &pool->net);
+        return IPADDR_OK;
+    }
+    return IPADDR_ERR_BOOL;
+}
+
+int ipaddr_pool_release(ipaddr_pool_t *pool, const ipaddr_t *block,
+                        ipaddr_t *merged)
+{
+    if (!in_pool(pool, block))
+        return IPADDR_ERR_BOOL;
+
+    int len = block->prefix_len;
+    uint128_t base = ipaddr_to_uint128(block) & ~host_mask(pool, len);
+    if (slot_state(pool, base, len) != SLOT_USED)
+        return IPADDR_ERR_BOOL;
+    slot_remove(pool, base, len);
+
+    /* Merge with the buddy while it is free, moving up to the supernet */
+    while (len > pool->net.prefix_len) {
+        uint128_t buddy = base ^ (host_mask(pool, len) + 1);
+        if (slot_state(pool, buddy, len) != SLOT_FREE)
+            break;
+        slot_remove(pool, buddy, len);
+        len--;
+        base &= ~host_mask(pool, len);
+    }
+    if (!free_add(pool, base, len))
+        return IPADDR_ERR_INTERNAL;
+
+    if (merged != NULL) {
+        set_block(merged, base, len, &pool->net);
+    }
+    return IPADDR_OK;
+}
+
+/* ---------- State files ---------- */
+
+/*
+ * Open and lock a state file, creating it if needed.  A file replaced by a
+ * rewrite while waiting for the lock is reopened.
+ */
+static FILE *open_state(const char *path, const char **errmsg)
+{
+    for (;;) {
+        int fd = open(path, O_RDWR | O_CREAT | O_APPEND, 0666);
+        if (fd < 0) {
+            *errmsg = strerror(errno);
+            return NULL;
+        }
+        if (flock(fd, LOCK_EX) != 0) {
+            *errmsg = strerror(errno);
+            close(fd);
+            return NULL;
+        }
+
+        struct stat locked, current;
+        if (fstat(fd, &locked) == 0 && stat(path, &current) == 0 &&
+            locked.st_dev == current.st_dev && locked.st_ino == current.st_ino) {
+            FILE *fp = fdopen(fd, "a+");
+            if (fp == NULL) {
+                *errmsg = strerror(errno);
+                close(fd);
+            }
+            return fp;
+        }
+        close(fd);
+    }
+}
+
+/*
+ * Write one state file line: an allocation, with its pool name if not
+ * NULL, or a withdrawal.
+ */
+static int write_entry(FILE *fp, const ipaddr_t *block, bool withdraw,
+                       const char *name)
+{
+    char buf[IPADDR_MAX_ADDRSTRLEN + 5];
+    ipaddr_format(block, buf, sizeof(buf), false);
+    int n;
+    if (withdraw)
+        n = fprintf(fp, "-%s\n", buf);
+    else
+        n = fprintf(fp, "%s%s%s\n", buf, name ? " " : "", name ? name : "");
+    return n < 0 ? IPADDR_ERR_INTERNAL : IPADDR_OK;
+}
+
+/*
+ * The part of a state file a snapshot was taken of: its first offset
+ * bytes, ending with tail.
+ */
+typedef struct {
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t offset;
+    uint32_t tail_len;
+    uint8_t  tail[POOL_SNAP_TAIL];
+} snap_cover_t;
+
+/*
+ * Snapshot file header.  It is followed, each part aligned to 16 bytes, by
+ * the slots of the table of allocations, then for each pool a snap_pool_t,
+ * its name and, for a network, the slots of its block table and its free
+ * lists, sorted by address.
+ */
+typedef struct {
+    char         magic[8];
+    uint32_t     order;       /* 0x01020304 in the writer's byte order */
+    uint32_t     npools;
+    uint64_t     size;        /* of the snapshot file */
+    uint64_t     lines;       /* of the state file up to the offset */
+    uint64_t     nslots;      /* of the table of allocations */
+    uint64_t     used;
+    snap_cover_t cover;
+} snap_header_t;
+
+typedef struct {
+    uint128_t base;           /* of the network */
+    uint64_t  nslots;         /* of the block table */
+    uint64_t  used;
+    uint64_t  free[129];      /* free list lengths */
+    uint32_t  name_len;
+    uint8_t   prefix_len;
+    uint8_t   ipv6;
+    uint8_t   is_net;
+} snap_pool_t;
+
+/* A pool named by the allocations of a state file */
+typedef struct {
+    char          *name;
+    ipaddr_pool_t *pool;      /* NULL if the name is not a network */
+} state_pool_t;
+
+/*
+ * A state file open for an update, with the allocator of its pools.
+ */
+typedef struct {
+    const char   *path;
+    FILE         *fp;         /* locked */
+    size_t        lines;      /* of the file */
+    size_t        journal;    /* lines since the snapshot */
+    bool          snapshot;   /* the snapshot is of this file */
+    bool          overlap;    /* allocations overlap: take no snapshot */
+    pool_table_t  allocs;     /* tag: index in pools, -1 without a name */
+    state_pool_t *pools;
+    size_t        npools;
+    void         *map;        /* of the snapshot, or NULL */
+    size_t        map_len;
+} pool_state_t;
+
+/*
+ * Check whether block holds all of the pool.
+ */
+static bool holds_pool(const ipaddr_pool_t *pool, const ipaddr_t *block)
+{
+    return ipaddr_family(block) == ipaddr_family(&pool->net) &&
+           block->prefix_len < pool->net.prefix_len &&
+           (ipaddr_to_uint128(&pool->net) & ~host_mask(pool, block->prefix_len)) ==
+               ipaddr_to_uint128(block);
+}
+
+/*
+ * Reserve an allocation of a state file in a pool it overlaps, if any: the
+ * block itself if within the pool, or the whole pool if the block holds it.
+ * Returns IPADDR_ERR_BOOL if it overlaps an allocation of the pool.
+ */
+static int reserve_in(ipaddr_pool_t *pool, const ipaddr_t *block)
+{
+    if (in_pool(pool, block))
+        return ipaddr_pool_reserve(pool, block);
+    if (holds_pool(pool, block))
+        return ipaddr_pool_reserve(pool, &pool->net);
+    return IPADDR_OK;
+}
+
+/*
+ * Release an allocation of a state file reserved by reserve_in().
+ * Returns IPADDR_ERR_BOOL if it was not reserved.
+ */
+static int release_in(ipaddr_pool_t *pool, const ipaddr_t *block,
+                      ipaddr_t *merged)
+{
+    if (in_pool(pool, block))
+        return ipaddr_pool_release(pool, block, merged);
+    if (holds_pool(pool, block))
+        return ipaddr_pool_release(pool, &pool->net, NULL);
+    return IPADDR_OK;
+}
+
+static int alloc_cmp(const void *pa, const void *pb)
+{
+    const pool_slot_t *a = *(const pool_slot_t *const *)pa;
+    const pool_slot_t *b = *(const pool_slot_t *const *)pb;
+    if (a->ipv6 != b->ipv6)
+        return a->ipv6 < b->ipv6 ? -1 : 1;
+    if (a->base != b->base)
+        return a->base < b->base ? -1 : 1;
+    return a->len < b->len ? -1 : (a->len > b->len);
+}
+
+/*
+ * Get the slots of the allocations in ipaddr_cmp() order, which puts each
+ * block before those within it.  Returns NULL on allocation failure.
+ */
+static const pool_slot_t **sorted_allocs(const pool_state_t *s)
+{
+    size_t n = 0;
+    const pool_slot_t **sorted = malloc((s->allocs.used + 1) * sizeof(*sorted));
+    if (sorted == NULL)
+        return NULL;
+    for (size_t i = 0; i < s->allocs.nslots; i++) {
+        if (s->allocs.slots[i].state == SLOT_USED)
+            sorted[n++] = &s->allocs.slots[i];
+    }
+    qsort(sorted, n, sizeof(*sorted), alloc_cmp);
+    return sorted;
+}
+
+/*
+ * Find the pool a state file names, adding it if it is new.  A network gets
+ * an allocator, with all allocations overlapping it reserved.
+ */
+static int state_pool(pool_state_t *s, const char *name, int *idx)
+{
+    for (size_t i = 0; i < s->npools; i++) {
+        if (strcmp(s->pools[i].name, name) == 0) {
+            *idx = (int)i;
+            return IPADDR_OK;
+        }
+    }
+
+    state_pool_t *pools = realloc(s->pools, (s->npools + 1) * sizeof(*pools));
+    if (pools == NULL)
+        return IPADDR_ERR_INTERNAL;
+    s->pools = pools;
+    state_pool_t *p = &pools[s->npools];
+    p->pool = NULL;
+    p->name = strdup(name);
+    if (p->name == NULL)
+        return IPADDR_ERR_INTERNAL;
+    *idx = (int)s->npools++;
+
+    ipaddr_t net;
+    const char *errmsg;
+    if (ipaddr_parse(name, &net, &errmsg) != IPADDR_OK)
+        return IPADDR_OK;
+    p->pool = ipaddr_pool_new(&net);
+    const pool_slot_t **sorted = p->pool ? sorted_allocs(s) : NULL;
+    if (sorted == NULL)
+        return IPADDR_ERR_INTERNAL;
+
+    /* In the order of a full read, for the same outcome if blocks overlap */
+    int rc = IPADDR_OK;
+    for (size_t i = 0; i < s->allocs.used && rc != IPADDR_ERR_INTERNAL; i++) {
+        ipaddr_t block;
+        make_block(&block, sorted[i]->ipv6, sorted[i]->base, sorted[i]->len);
+        rc = reserve_in(p->pool, &block);
+        s->overlap |= (rc == IPADDR_ERR_BOOL);
+    }
+    free(sorted);
+    return rc == IPADDR_ERR_INTERNAL ? rc : IPADDR_OK;
+}
+
+/*
+ * Record an allocation of pool tag (-1 for none) and reserve it in every
+ * pool but the one numbered reserved, where it already is.
+ */
+static int state_insert(pool_state_t *s, const ipaddr_t *block, int tag,
+                        int reserved)
+{
+    bool ipv6 = ipaddr_is_ipv6(block);
+    uint128_t base = ipaddr_to_uint128(block);
+    pool_slot_t *slot = table_find(&s->allocs, ipv6, base, block->prefix_len);
+    if (slot->state == SLOT_USED) {
+        slot->tag = tag;   /* same block, other pool name */
+        return IPADDR_OK;
+    }
+
+    slot = table_set(&s->allocs, ipv6, base, block->prefix_len, SLOT_USED);
+    if (slot == NULL)
+        return IPADDR_ERR_INTERNAL;
+    slot->tag = tag;
+
+    for (size_t i = 0; i < s->npools; i++) {
+        if (s->pools[i].pool == NULL || (int)i == reserved)
+            continue;
+        int rc = reserve_in(s->pools[i].pool, block);
+        if (rc == IPADDR_ERR_INTERNAL)
+            return rc;
+        s->overlap |= (rc != IPADDR_OK);
+    }
+    return IPADDR_OK;
+}
+
+/*
+ * Record an allocation of a state file line.
+ */
+static int state_add(pool_state_t *s, const ipaddr_t *block, const char *name)
+{
+    int tag = -1;
+    if (name != NULL && *name != '\0') {
+        int rc = state_pool(s, name, &tag);
+        if (rc != IPADDR_OK)
+            return rc;
+    }
+    return state_insert(s, block, tag, -1);
+}
+
+/*
+ * Remove an allocation, releasing it in every pool.  merged, if not NULL,
+ * is set to the free block of its own pool it ended up in, or to block
+ * if it is not within that pool.
+ * Returns: 0 on success, IPADDR_ERR_BOOL if block is not allocated,
+ * IPADDR_ERR_INTERNAL on allocation failure.
+ */
+static int state_remove(pool_state_t *s, const ipaddr_t *block, ipaddr_t *merged)
+{
+    bool ipv6 = ipaddr_is_ipv6(block);
+    uint128_t base = ipaddr_to_uint128(block);
+    pool_slot_t *slot = table_find(&s->allocs, ipv6, base, block->prefix_len);
+    if (slot->state != SLOT_USED)
+        return IPADDR_ERR_BOOL;
+    int tag = slot->tag;
+    table_remove(&s->allocs, ipv6, base, block->prefix_len);
+
+    if (merged != NULL)
+        memcpy(merged, block, sizeof(*merged));
+    for (size_t i = 0; i < s->npools; i++) {
+        if (s->pools[i].pool == NULL)
+            continue;
+        int rc = release_in(s->pools[i].pool, block, (int)i == tag ? merged : NULL);
+        if (rc == IPADDR_ERR_INTERNAL)
+            return rc;
+        s->overlap |= (rc != IPADDR_OK);
+    }
+    return IPADDR_OK;
+}
+
+typedef struct {
+    pool_state_t *s;
+    int           rc;
+} state_load_t;
+
+static void add_walk(const ipaddr_t *prefix, const char *value, void *arg)
+{
+    state_load_t *l = arg;
+    if (l->rc == IPADDR_OK)
+        l->rc = state_add(l->s, prefix, value);
+}
+
+/*
+ * Read the whole state file and set up its allocator.
+ */
+static int read_state(pool_state_t *s, size_t *lineno, const char **errmsg)
+{
+    *lineno = 0;
+    rewind(s->fp);
+
+    ipaddr_lpm_t *lpm = ipaddr_lpm_new();
+    if (lpm == NULL || !table_grow(&s->allocs)) {
+        ipaddr_lpm_free(lpm);
+        *errmsg = "out of memory";
+        return IPADDR_ERR_INTERNAL;
+    }
+
+    int rc = ipaddr_lpm_read(lpm, s->fp, lineno, errmsg);
+    if (rc == IPADDR_OK) {
+        state_load_t l = { s, IPADDR_OK };
+        ipaddr_lpm_walk(lpm, add_walk, &l);
+        rc = l.rc;
+        if (rc != IPADDR_OK)
+            *errmsg = "out of memory";
+    }
+    ipaddr_lpm_free(lpm);
+    s->lines = *lineno;
+    return rc;
+}
+
+/*
+ * Apply the lines of the state file added since the snapshot.
+ */
+static int read_journal(pool_state_t *s, size_t *lineno, const char **errmsg)
+{
+    char *line = NULL;
+    size_t cap = 0;
+    int rc = IPADDR_OK;
+
+    while (getline(&line, &cap, s->fp) != -1) {
+        ipaddr_t prefix;
+        const char *value;
+        bool withdraw;
+
+        (*lineno)++;
+        s->journal++;
+        rc = ipaddr_lpm_parse_line(line, &prefix, &value, &withdraw, errmsg);
+        if (rc == IPADDR_ERR_BOOL) {
+            rc = IPADDR_OK;
+            continue;
+        }
+        if (rc != IPADDR_OK)
+            break;
+
+        if (withdraw) {
+            rc = state_remove(s, &prefix, NULL);
+            if (rc == IPADDR_ERR_BOOL)
+                rc = IPADDR_OK;   /* withdrawing an absent prefix is a no-op */
+        } else {
+            rc = state_add(s, &prefix, value);
+        }
+        if (rc != IPADDR_OK) {
+            *errmsg = "out of memory";
+            break;
+        }
+    }
+
+    if (rc == IPADDR_OK && ferror(s->fp)) {
+        *errmsg = strerror(errno);
+        rc = IPADDR_ERR_USAGE;
+    }
+    free(line);
+    s->lines = *lineno;
+    return rc;
+}
+
+static char *snap_path(const char *path)
+{
+    size_t len = strlen(path);
+    char *snap = malloc(len + sizeof(".snap"));
+    if (snap != NULL) {
+        memcpy(snap, path, len);
+        memcpy(snap + len, ".snap", sizeof(".snap"));
+    }
+    return snap;
+}
+
+/*
+ * Describe the state file open as fd, as far as it has been written.
+ */
+static int cover_file(int fd, snap_cover_t *cover)
+{
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+        return IPADDR_ERR_INTERNAL;
+
+    memset(cover, 0, sizeof(*cover));
+    cover->dev = st.st_dev;
+    cover->ino = st.st_ino;
+    cover->offset = st.st_size;
+    cover->tail_len = st.st_size < POOL_SNAP_TAIL ? st.st_size : POOL_SNAP_TAIL;
+    off_t at = st.st_size - cover->tail_len;
+    if (pread(fd, cover->tail, cover->tail_len, at) != (ssize_t)cover->tail_len)
+        return IPADDR_ERR_INTERNAL;
+    return IPADDR_OK;
+}
+
+/*
+ * Check that the state file open as fd still starts with what a snapshot
+ * was taken of.
+ */
+static bool cover_matches(int fd, const snap_cover_t *cover)
+{
+    struct stat st;
+    uint8_t tail[POOL_SNAP_TAIL];
+
+    return fstat(fd, &st) == 0 &&
+           (uint64_t)st.st_dev == cover->dev && (uint64_t)st.st_ino == cover->ino &&
+           (uint64_t)st.st_size >= cover->offset &&
+           cover->tail_len <= POOL_SNAP_TAIL && cover->tail_len <= cover->offset &&
+           pread(fd, tail, cover->tail_len, cover->offset - cover->tail_len) ==
+               (ssize_t)cover->tail_len &&
+           memcmp(tail, cover->tail, cover->tail_len) == 0;
+}
+
+/* Reader of a mapped snapshot */
+typedef struct {
+    uint8_t *base;
+    size_t   off;
+    size_t   len;
+} snap_cursor_t;
+
+/*
+ * Take the next n elements of size bytes from a snapshot.
+ */
+static void *snap_take(snap_cursor_t *c, uint64_t n, size_t size)
+{
+    size_t off = (c->off + 15) & ~(size_t)15;
+    if (off > c->len || n > (c->len - off) / size)
+        return NULL;
+    c->off = off + n * size;
+    return c->base + off;
+}
+
+static bool table_map(pool_table_t *t, snap_cursor_t *c, uint64_t nslots,
+                      uint64_t used)
+{
+    /* A power of two, and never full, so that probing ends */
+    if (nslots == 0 || (nslots & (nslots - 1)) != 0 || used * 2 > nslots)
+        return false;
+    t->slots = snap_take(c, nslots, sizeof(pool_slot_t));
+    t->nslots = nslots;
+    t->used = used;
+    t->mapped = true;
+    return t->slots != NULL;
+}
+
+/*
+ * Set up a pool from its part of a snapshot.
+ */
+static ipaddr_pool_t *pool_map(snap_cursor_t *c, const snap_pool_t *sp)
+{
+    int max_bits = sp->ipv6 ? 128 : 32;
+    if (sp->prefix_len > max_bits)
+        return NULL;
+
+    ipaddr_pool_t *pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+        return NULL;
+    make_block(&pool->net, sp->ipv6, sp->base, sp->prefix_len);
+    pool->max_bits = max_bits;
+    pool->ipv6 = sp->ipv6;
+
+    bool ok = table_map(&pool->blocks, c, sp->nslots, sp->used);
+    for (int len = 0; len <= 128 && ok; len++) {
+        pool_heap_t *heap = &pool->free[len];
+        heap->items = snap_take(c, sp->free[len], sizeof(uint128_t));
+        heap->count = heap->cap = sp->free[len];
+        heap->mapped = true;
+        ok = (heap->items != NULL);
+    }
+    if (!ok) {
+        ipaddr_pool_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+static void state_clear(pool_state_t *s)
+{
+    for (size_t i = 0; i < s->npools; i++) {
+        free(s->pools[i].name);
+        ipaddr_pool_free(s->pools[i].pool);
+    }
+    free(s->pools);
+    s->pools = NULL;
+    s->npools = 0;
+    table_free(&s->allocs);
+    memset(&s->allocs, 0, sizeof(s->allocs));
+    if (s->map != NULL)
+        munmap(s->map, s->map_len);
+    s->map = NULL;
+    s->lines = 0;
+    s->journal = 0;
+    s->snapshot = false;
+    s->overlap = false;
+}
+
+/*
+ * Set up the allocator from the snapshot, if there is one of this state
+ * file, and position the file at the lines added since.
+ */
+static bool load_snapshot(pool_state_t *s)
+{
+    char *path = snap_path(s->path);
+    int fd = path != NULL ? open(path, O_RDONLY) : -1;
+    free(path);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(snap_header_t))
+        map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return false;
+    s->map = map;
+    s->map_len = st.st_size;
+
+    snap_header_t h;
+    memcpy(&h, map, sizeof(h));
+    if (memcmp(h.magic, POOL_SNAP_MAGIC, sizeof(h.magic)) != 0 ||
+        h.order != 0x01020304 || h.size != (uint64_t)st.st_size ||
+        !cover_matches(fileno(s->fp), &h.cover))
+        goto fail;
+
+    snap_cursor_t c = { map, sizeof(h), st.st_size };
+    if (!table_map(&s->allocs, &c, h.nslots, h.used))
+        goto fail;
+    for (uint32_t i = 0; i < h.npools; i++) {
+        const snap_pool_t *sp = snap_take(&c, 1, sizeof(*sp));
+        const char *name = sp ? snap_take(&c, sp->name_len, 1) : NULL;
+        state_pool_t *pools = name ? realloc(s->pools, (i + 1) * sizeof(*pools)) : NULL;
+        if (pools == NULL)
+            goto fail;
+        s->pools = pools;
+        pools[i].name = strndup(name, sp->name_len);
+        pools[i].pool = sp->is_net ? pool_map(&c, sp) : NULL;
+        s->npools++;
+        if (pools[i].name == NULL || (sp->is_net && pools[i].pool == NULL))
+            goto fail;
+    }
+
+    if (fseek(s->fp, h.cover.offset, SEEK_SET) != 0)
+        goto fail;
+    s->lines = h.lines;
+    s->snapshot = true;
+    return true;
+
+fail:
+    state_clear(s);
+    return false;
+}
+
+/*
+ * Open, lock and read a state file, from its snapshot if it has one.
+ */
+static int open_pools(const char *path, pool_state_t *s, size_t *lineno,
+                      const char **errmsg)
+{
+    memset(s, 0, sizeof(*s));
+    s->path = path;
+    *lineno = 0;
+    s->fp = open_state(path, errmsg);
+    if (s->fp == NULL)
+        return IPADDR_ERR_USAGE;
+
+    if (load_snapshot(s)) {
+        *lineno = s->lines;
+        int rc = read_journal(s, lineno, errmsg);
+        if (rc != IPADDR_OK || !s->overlap)
+            return rc;
+        state_clear(s);   /* the lines since overlap: start over */
+    }
+    return read_state(s, lineno, errmsg);
+}
+
+static void close_pools(pool_state_t *s)
+{
+    state_clear(s);
+    if (s->fp != NULL)
+        fclose(s->fp);   /* drops the lock */
+}
+
+/*
+ * Create a temporary file to replace target with, with the mode and owner
+ * of the state file st, so that a state file shared between users stays
+ * shared.  *tmp is set to its name, to be freed.
+ */
+static FILE *open_replacement(const char *target, const struct stat *st,
+                              char **tmp)
+{
+    size_t len = strlen(target);
+    *tmp = malloc(len + 8);
+    if (*tmp == NULL)
+        return NULL;
+    memcpy(*tmp, target, len);
+    memcpy(*tmp + len, ".XXXXXX", 8);
+
+    int fd = mkstemp(*tmp);
+    FILE *fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (fp != NULL &&
+        (fchmod(fd, st->st_mode & 07777) != 0 ||
+         (geteuid() == 0 && fchown(fd, st->st_uid, st->st_gid) != 0))) {
+        fclose(fp);
+        fp = NULL;
+        fd = -1;
+    }
+    if (fp == NULL) {
+        if (fd >= 0)
+            close(fd);
+        unlink(*tmp);
+    }
+    return fp;
+}
+
+/*
+ * Replace the state file with its allocations, in ipaddr_cmp() order.
+ * cover is set to what was written.
+ */
+static int rewrite_state(pool_state_t *s, snap_cover_t *cover,
+                         const char **errmsg)
+{
+    struct stat st;
+    if (fstat(fileno(s->fp), &st) != 0) {
+        *errmsg = strerror(errno);
+        return IPADDR_ERR_INTERNAL;
+    }
+
+    size_t n = s->allocs.used;
+    const pool_slot_t **sorted = sorted_allocs(s);
+    if (sorted == NULL) {
+        *errmsg = "out of memory";
+        return IPADDR_ERR_INTERNAL;
+    }
+
+    char *tmp;
+    FILE *fp = open_replacement(s->path, &st, &tmp);
+    int rc = (fp != NULL) ? IPADDR_OK : IPADDR_ERR_INTERNAL;
+    for (size_t i = 0; i < n && rc == IPADDR_OK; i++) {
+        ipaddr_t block;
+        make_block(&block, sorted[i]->ipv6, sorted[i]->base, sorted[i]->len);
+        int tag = sorted[i]->tag;
+        rc = write_entry(fp, &block, false, tag >= 0 ? s->pools[tag].name : NULL);
+    }
+    free(sorted);
+    if (fp != NULL) {
+        if (rc == IPADDR_OK &&
+            (fflush(fp) != 0 || fsync(fileno(fp)) != 0 ||
+             cover_file(fileno(fp), cover) != IPADDR_OK))
+            rc = IPADDR_ERR_INTERNAL;
+        if (fclose(fp) != 0)
+            rc = IPADDR_ERR_INTERNAL;
+        if (rc == IPADDR_OK && rename(tmp, s->path) != 0)
+            rc = IPADDR_ERR_INTERNAL;
+        if (rc != IPADDR_OK)
+            unlink(tmp);
+    }
+    if (rc != IPADDR_OK)
+        *errmsg = strerror(errno);
+    free(tmp);
+
+    s->lines = n;
+    s->journal = 0;
+    s->snapshot = false;   /* of the replaced file */
+    return rc;
+}
+
+/*
+ * Append the lines written to a state file, making them durable.
+ */
+static int sync_state(pool_state_t *s, size_t lines, const char **errmsg)
+{
+    if (fflush(s->fp) != 0 || fsync(fileno(s->fp)) != 0) {
+        *errmsg = strerror(errno);
+        return IPADDR_ERR_INTERNAL;
+    }
+    s->lines += lines;
+    s->journal += lines;
+    return IPADDR_OK;
+}
+
+/*
+ * Check whether a state file should be rewritten from its allocations
+ * instead of appended this many lines to.
+ */
+static bool journal_full(const pool_state_t *s, size_t lines)
+{
+    return s->lines + lines > 2 * s->allocs.used + POOL_JOURNAL_SLACK;
+}
+
+/*
+ * Write part of a snapshot at offset *off, aligned to 16 bytes.
+ */
+static bool snap_put(FILE *fp, size_t *off, const void *data, size_t size)
+{
+    static const char pad[16];
+    size_t n = (16 - *off % 16) % 16;
+    if ((n > 0 && fwrite(pad, 1, n, fp) != n) ||
+        (size > 0 && fwrite(data, 1, size, fp) != size))
+        return false;
+    *off += n + size;
+    return true;
+}
+
+static int base_cmp(const void *pa, const void *pb)
+{
+    uint128_t a = *(const uint128_t *)pa, b = *(const uint128_t *)pb;
+    return a < b ? -1 : (a > b);
+}
+
+/*
+ * Write a pool to a snapshot, its free lists rebuilt from its block table
+ * as sorted arrays without stale entries.
+ */
+static bool snap_put_pool(FILE *fp, size_t *off, const state_pool_t *p)
+{
+    const ipaddr_pool_t *pool = p->pool;
+    snap_pool_t sp;
+    memset(&sp, 0, sizeof(sp));
+    sp.name_len = (uint32_t)strlen(p->name);
+    sp.is_net = (pool != NULL);
+    if (pool == NULL)
+        return snap_put(fp, off, &sp, sizeof(sp)) &&
+               snap_put(fp, off, p->name, sp.name_len);
+
+    sp.base = ipaddr_to_uint128(&pool->net);
+    sp.prefix_len = (uint8_t)pool->net.prefix_len;
+    sp.ipv6 = pool->ipv6;
+    sp.nslots = pool->blocks.nslots;
+    sp.used = pool->blocks.used;
+
+    size_t nfree = 0;
+    for (size_t i = 0; i < pool->blocks.nslots; i++) {
+        const pool_slot_t *slot = &pool->blocks.slots[i];
+        if (slot->state == SLOT_FREE) {
+            sp.free[slot->len]++;
+            nfree++;
+        }
+    }
+    uint128_t *bases = malloc((nfree + 1) * sizeof(*bases));
+    if (bases == NULL)
+        return false;
+    size_t at[129];
+    for (size_t len = 0, sum = 0; len <= 128; sum += sp.free[len], len++)
+        at[len] = sum;
+    for (size_t i = 0; i < pool->blocks.nslots; i++) {
+        const pool_slot_t *slot = &pool->blocks.slots[i];
+        if (slot->state == SLOT_FREE)
+            bases[at[slot->len]++] = slot->base;
+    }
+
+    bool ok = snap_put(fp, off, &sp, sizeof(sp)) &&
+              snap_put(fp, off, p->name, sp.name_len) &&
+              snap_put(fp, off, pool->blocks.slots,
+                       pool->blocks.nslots * sizeof(pool_slot_t));
+    for (size_t len = 0, first = 0; len <= 128 && ok; first += sp.free[len], len++) {
+        qsort(bases + first, sp.free[len], sizeof(*bases), base_cmp);
+        ok = snap_put(fp, off, bases + first, sp.free[len] * sizeof(*bases));
+    }
+    free(bases);
+    return ok;
+}
+
+/*
+ * Take a snapshot of the allocator for the state file described by cover.
+ * Failing to is not an error: the next run reads the whole file instead.
+ */
+static void write_snapshot(const pool_state_t *s, const snap_cover_t *cover)
+{
+    struct stat st;
+    char *path = snap_path(s->path);
+    char *tmp = NULL;
+    FILE *fp = NULL;
+    if (path != NULL && fstat(fileno(s->fp), &st) == 0)
+        fp = open_replacement(path, &st, &tmp);
+    if (fp == NULL) {
+        free(tmp);
+        free(path);
+        return;
+    }
+
+    snap_header_t h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, POOL_SNAP_MAGIC, sizeof(h.magic));
+    h.order = 0x01020304;
+    h.npools = (uint32_t)s->npools;
+    h.lines = s->lines;
+    h.nslots = s->allocs.nslots;
+    h.used = s->allocs.used;
+    h.cover = *cover;
+
+    size_t off = 0;
+    bool ok = snap_put(fp, &off, &h, sizeof(h)) &&
+              snap_put(fp, &off, s->allocs.slots,
+                       s->allocs.nslots * sizeof(pool_slot_t));
+    for (size_t i = 0; i < s->npools && ok; i++)
+        ok = snap_put_pool(fp, &off, &s->pools[i]);
+
+    /* The size goes in last, so that a short file is never taken for one */
+    h.size = off;
+    ok = ok && fseek(fp, 0, SEEK_SET) == 0 && fwrite(&h, sizeof(h), 1, fp) == 1 &&
+         fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+    if (fclose(fp) != 0 || !ok || rename(tmp, path) != 0)
+        unlink(tmp);
+    free(tmp);
+    free(path);
+}
+
+/*
+ * Write the state file lines of an update, appending them or rewriting the
+ * file, and take a snapshot if it is due.
+ */
+static int commit_state(pool_state_t *s, const ipaddr_t *blocks, size_t count,
+                        bool withdraw, const char *name, const char **errmsg)
+{
+    snap_cover_t cover;
+    int rc = IPADDR_OK;
+
+    if (journal_full(s, count)) {
+        rc = rewrite_state(s, &cover, errmsg);
+    } else {
+        fseek(s->fp, 0, SEEK_END);
+        for (size_t i = 0; i < count && rc == IPADDR_OK; i++)
+            rc = write_entry(s->fp, &blocks[i], withdraw, name);
+        if (rc == IPADDR_OK)
+            rc = sync_state(s, count, errmsg);
+        else
+            *errmsg = strerror(errno);
+        if (rc == IPADDR_OK && cover_file(fileno(s->fp), &cover) != IPADDR_OK)
+            return rc;   /* appended; just no snapshot */
+    }
+    if (rc != IPADDR_OK)
+        return rc;
+
+    if (!s->overlap && (!s->snapshot || s->journal >= POOL_SNAPSHOT_LINES))
+        write_snapshot(s, &cover);
+    return IPADDR_OK;
+}
+
+int ipaddr_pool_state_alloc(const char *path, const ipaddr_t *net,
+                            int prefix_len, size_t count, ipaddr_net_fn fn,
+                            void *arg, size_t *lineno, const char **errmsg)
+{
+    pool_state_t s;
+    ipaddr_t *blocks = NULL;
+
+    *errmsg = NULL;
+    int rc = open_pools(path, &s, lineno, errmsg);
+    if (rc != IPADDR_OK)
+        goto out;
+
+    ipaddr_t pnet;
+    ipaddr_network(net, &pnet);
+    pnet.has_prefix = true;
+    char name[IPADDR_MAX_ADDRSTRLEN + 5];
+    ipaddr_format(&pnet, name, sizeof(name), false);
+
+    int tag;
+    rc = state_pool(&s, name, &tag);
+    blocks = malloc((count ? count : 1) * sizeof(*blocks));
+    if (rc != IPADDR_OK || blocks == NULL) {
+        *errmsg = "out of memory";
+        rc = IPADDR_ERR_INTERNAL;
+        goto out;
+    }
+
+    /* All blocks or none: nothing is kept unless the file is written */
+    ipaddr_pool_t *pool = s.pools[tag].pool;
+    for (size_t i = 0; i < count; i++) {
+        rc = ipaddr_pool_alloc(pool, prefix_len, &blocks[i]);
+        if (rc == IPADDR_OK)
+            rc = state_insert(&s, &blocks[i], tag, tag);
+        if (rc == IPADDR_ERR_INTERNAL)
+            *errmsg = "out of memory";
+        if (rc != IPADDR_OK)
+            goto out;
+    }
+
+    rc = commit_state(&s, blocks, count, false, name, errmsg);
+    if (rc != IPADDR_OK)
+        goto out;
+
+    for (size_t i = 0; i < count; i++)
+        fn(&blocks[i], arg);
+
+out:
+    free(blocks);
+    close_pools(&s);
+    return rc;
+}
+
+int ipaddr_pool_state_release(const char *path, const ipaddr_t *block,
+                              ipaddr_t *merged, size_t *lineno,
+                              const char **errmsg)
+{
+    pool_state_t s;
+
+    *errmsg = NULL;
+    int rc = open_pools(path, &s, lineno, errmsg);
+    if (rc != IPADDR_OK)
+        goto out;
+
+    /* Merge with the free space around it in its pool, if it has one */
+    rc = state_remove(&s, block, merged);
+    if (rc == IPADDR_ERR_BOOL)
+        *errmsg = "not allocated";
+    else if (rc != IPADDR_OK)
+        *errmsg = "out of memory";
+    else
+        rc = commit_state(&s, block, 1, true, NULL, errmsg);
+
+out:
+    close_pools(&s);
+    return rc;
+}
+
+/* A request of a plan, in the order it is served */
+typedef struct {
+    int    prefix_len;
+    size_t index;
+} plan_order_t;
+
+static int plan_cmp(const void *pa, const void *pb)
+{
+    const plan_order_t *a = pa, *b = pb;
+    if (a->prefix_len != b->prefix_len)
+        return a->prefix_len < b->prefix_len ? -1 : 1;
+    return a->index < b->index ? -1 : (a->index > b->index);
+}
+
+int ipaddr_pool_plan(const ipaddr_t *net, ipaddr_plan_request_t *reqs,
+                     size_t n, size_t *failed)
+{
+    plan_order_t *order = malloc((n ? n : 1) * sizeof(*order));
+    ipaddr_pool_t *pool = ipaddr_pool_new(net);
+    int rc = IPADDR_OK;
+    if (order == NULL || pool == NULL) {
+        rc = IPADDR_ERR_INTERNAL;
+        goto out;
+    }
+
+    /*
+     * Largest first: each block is then carved from what larger blocks
+     * left, so the requests fit whenever their sizes add up to no more
+     * than the pool, and the free space left over stays in large blocks.
+     */
+    for (size_t i = 0; i < n; i++) {
+        order[i].prefix_len = reqs[i].prefix_len;
+        order[i].index = i;
+    }
+    qsort(order, n, sizeof(*order), plan_cmp);
+
+    for (size_t i = 0; i < n; i++) {
+        ipaddr_plan_request_t *req = &reqs[order[i].index];
+        rc = ipaddr_pool_alloc(pool, req->prefix_len, &req->net);
+        if (rc != IPADDR_OK) {
+            *failed = order[i].index;
+            break;
+        }
+    }
+
+out:
+    ipaddr_pool_free(pool);
+    free(order);
+    return rc;
+}
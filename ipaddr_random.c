@@ -0,0 +1,459 @@
+/*
+ * ipaddr_random.c - Pseudo-random orders of addresses
+ *
+ * The hosts of a network are enumerated in a random order by a keyed
+ * permutation of their indexes, so that no order is ever stored: each
+ * position of the order is mapped to a host index by a balanced Feistel
+ * network over the host bits.  A Feistel network needs an even number of
+ * bits, so for an odd number it works over one bit more, and the positions
+ * that map past the last host are skipped (cycle walking spread over the
+ * enumeration): at most half of them, and never two in a row on average.
+ *
+ * Shards of an enumeration take every n-th position of the same order, so
+ * n machines with the same seed cover the network exactly once between
+ * them, each in O(1) memory.
+ *
+ * Samples of distinct addresses are chosen with Floyd's algorithm, which
+ * takes exactly one random draw per address however close the sample is
+ * to the whole network, and then shuffled, since Floyd's order is not
+ * random.  Draws come from wyrand, and are made uniform below any 128-bit
+ * bound by rejecting the values past it under a mask.
+ *
+ * Reservoirs keep a uniform sample of a stream of unknown length with
+ * Algorithm L (Li, 1994): once a reservoir is full, the number of records
+ * to skip before the next one is taken is drawn directly, so a record that
+ * is not taken only bumps a counter.  Stratified reservoirs keep one per
+ * network of the stream, found in a hash table.  Reservoirs and the table
+ * are allocated from an arena freed with them, never one by one.
+ */
+
+#include "ipaddr.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+/*
+ * Next value of the SplitMix64 generator, which spreads a seed into
+ * independent round keys and generator states.
+ */
+static uint64_t splitmix64(uint64_t *state)
+{
+    uint64_t z = (*state += 0x9e3779b97f4a7c15);
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+/*
+ * Round function of the Feistel network: the SplitMix64 finalizer of the
+ * half block and the round key.
+ */
+static uint64_t feistel_round(uint64_t half, uint64_t key)
+{
+    uint64_t z = half + key;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+static uint128_t permute(const ipaddr_hosts_t *it, uint128_t pos)
+{
+    int bits = it->half_bits;
+    uint64_t mask = bits >= 64 ? ~(uint64_t)0 : ((uint64_t)1 << bits) - 1;
+    uint64_t left = (uint64_t)(pos >> bits) & mask;
+    uint64_t right = (uint64_t)pos & mask;
+
+    for (int r = 0; r < IPADDR_HOSTS_ROUNDS; r++) {
+        uint64_t tmp = right;
+        right = left ^ (feistel_round(right, it->keys[r]) & mask);
+        left = tmp;
+    }
+    return ((uint128_t)left << bits) | right;
+}
+
+void ipaddr_hosts_init(ipaddr_hosts_t *it, const ipaddr_t *net, bool random,
+                       uint64_t seed, uint64_t shard, uint64_t shards)
+{
+    memset(it, 0, sizeof(*it));
+    ipaddr_network(net, &it->net);
+    it->net.has_prefix = false;
+    it->host_bits = ipaddr_max_prefix(net) - net->prefix_len;
+    it->random = random;
+
+    int bits = it->host_bits;
+    if (random) {
+        it->half_bits = (bits + 1) / 2;
+        bits = 2 * it->half_bits;
+        for (int r = 0; r < IPADDR_HOSTS_ROUNDS; r++)
+            it->keys[r] = splitmix64(&seed);
+    }
+    it->last = bits >= 128 ? ~(uint128_t)0 : ((uint128_t)1 << bits) - 1;
+
+    it->step = shards;
+    it->next = shard;
+    it->done = (uint128_t)shard > it->last;
+}
+
+int ipaddr_hosts_next(ipaddr_hosts_t *it, ipaddr_t *host)
+{
+    int bits = it->host_bits;
+    uint128_t hostmask = bits >= 128 ? ~(uint128_t)0 : ((uint128_t)1 << bits) - 1;
+    uint128_t base = ipaddr_to_uint128(&it->net);
+
+    while (!it->done) {
+        uint128_t pos = it->next;
+        if (it->last - pos < it->step)
+            it->done = true;
+        else
+            it->next = pos + it->step;
+
+        uint128_t index = it->random ? permute(it, pos) : pos;
+        if (index > hostmask)
+            continue;
+        ipaddr_from_uint128(host, base | index, &it->net);
+        host->prefix_len = ipaddr_max_prefix(&it->net);
+        return IPADDR_OK;
+    }
+    return IPADDR_ERR_BOOL;
+}
+
+/*
+ * Next value of the wyrand generator.
+ */
+static uint64_t wyrand(uint64_t *state)
+{
+    *state += 0xa0761d6478bd642f;
+    uint128_t t = (uint128_t)*state * (*state ^ 0xe7037ed1a0b428db);
+    return (uint64_t)(t >> 64) ^ (uint64_t)t;
+}
+
+/*
+ * Uniform random value from 0 to max, both included.
+ */
+static uint128_t rand_upto(uint64_t *state, uint128_t max)
+{
+    uint128_t mask = max;
+    for (int shift = 1; shift < 128; shift *= 2)
+        mask |= mask >> shift;
+
+    for (;;) {
+        uint128_t r = wyrand(state);
+        if (mask >> 64)
+            r |= (uint128_t)wyrand(state) << 64;
+        r &= mask;
+        if (r <= max)
+            return r;
+    }
+}
+
+/* Set of 128-bit values, with open addressing; 0 stands for an empty slot */
+typedef struct {
+    uint128_t *slots;
+    size_t     mask;
+    bool       has_zero;
+} value_set_t;
+
+/*
+ * Add a value unless present.  Returns true if it was added.
+ */
+static bool set_add(value_set_t *set, uint128_t v)
+{
+    if (v == 0) {
+        bool added = !set->has_zero;
+        set->has_zero = true;
+        return added;
+    }
+
+    uint64_t h = (uint64_t)v ^ (uint64_t)(v >> 64);
+    size_t i = (size_t)((h * 0x9e3779b97f4a7c15) >> 32) & set->mask;
+    while (set->slots[i] != 0) {
+        if (set->slots[i] == v)
+            return false;
+        i = (i + 1) & set->mask;
+    }
+    set->slots[i] = v;
+    return true;
+}
+
+/*
+ * Get the size of the set of a sample of n, at most half full.
+ */
+static size_t set_cap(size_t n)
+{
+    size_t cap = 16;
+    while (cap / 2 < n)
+        cap *= 2;
+    return cap;
+}
+
+size_t ipaddr_sample_room(size_t n)
+{
+    if (n > SIZE_MAX / 4 / sizeof(uint128_t))
+        return 0;
+    return n + set_cap(n);
+}
+
+int ipaddr_sample(const ipaddr_t *net, size_t n, uint64_t seed,
+                  uint128_t *values)
+{
+    int bits = ipaddr_max_prefix(net) - net->prefix_len;
+    uint128_t hostmask = bits >= 128 ? ~(uint128_t)0 : ((uint128_t)1 << bits) - 1;
+    uint128_t base = ipaddr_to_uint128(net) & ~hostmask;
+
+    if (n == 0)
+        return IPADDR_OK;
+    if ((uint128_t)(n - 1) > hostmask)
+        return IPADDR_ERR_BOOL;
+
+    /* The set is kept past the sample */
+    size_t cap = set_cap(n);
+    value_set_t set = { values + n, cap - 1, false };
+    memset(set.slots, 0, cap * sizeof(*set.slots));
+
+    /*
+     * Floyd: for each j of the last n indexes, take a random index up to j,
+     * or j itself if that one is taken already
+     */
+    /* Nearby seeds would start wyrand on correlated values */
+    uint64_t state = splitmix64(&seed);
+    uint128_t j = hostmask - (n - 1);
+    for (size_t k = 0; k < n; k++, j++) {
+        uint128_t t = rand_upto(&state, j);
+        if (!set_add(&set, t)) {
+            set_add(&set, j);
+            t = j;
+        }
+        values[k] = t;
+    }
+
+    /* Fisher-Yates */
+    for (size_t k = n - 1; k > 0; k--) {
+        size_t r = (size_t)rand_upto(&state, k);
+        uint128_t tmp = values[k];
+        values[k] = values[r];
+        values[r] = tmp;
+    }
+    for (size_t k = 0; k < n; k++)
+        values[k] |= base;
+    return IPADDR_OK;
+}
+
+/* Reservoir of one network of the stream, or of the whole stream */
+typedef struct {
+    uint128_t key;      /* network address, as an integer */
+    bool      ipv6;
+    uint64_t  seen;     /* records so far */
+    uint64_t  next;     /* record to take next, once full */
+    double    w;        /* Algorithm L's largest kept key */
+    size_t    cap;
+    ipaddr_t *slots;    /* min(seen, k) of them */
+} bucket_t;
+
+struct ipaddr_reservoir {
+    size_t          k;
+    int             prefix_len;  /* of the networks, -1 for one reservoir */
+    uint64_t        state;       /* of wyrand */
+    bucket_t      **table;       /* open addressing, by network */
+    size_t          mask;
+    size_t          count;
+    bucket_t       *all;         /* without networks */
+    ipaddr_arena_t *arena;       /* of the buckets, their slots and tables */
+};
+
+/*
+ * Uniform random double in (0, 1), never 0 for log().
+ */
+static double rand_unit(uint64_t *state)
+{
+    return ((double)(wyrand(state) >> 12) + 0.5) * 0x1p-52;
+}
+
+/*
+ * Draw the next record to take, from the current one.
+ */
+static void draw_next(ipaddr_reservoir_t *r, bucket_t *b)
+{
+    double skip = floor(log(rand_unit(&r->state)) / log1p(-b->w));
+    b->next = skip >= 0x1p63 ? UINT64_MAX : b->seen + (uint64_t)skip + 1;
+}
+
+ipaddr_reservoir_t *ipaddr_reservoir_new(size_t k, int prefix_len,
+                                         uint64_t seed)
+{
+    ipaddr_reservoir_t *r = calloc(1, sizeof(*r));
+    if (r == NULL)
+        return NULL;
+    r->arena = ipaddr_arena_new();
+    if (r->arena == NULL) {
+        free(r);
+        return NULL;
+    }
+    r->k = k;
+    r->prefix_len = prefix_len;
+    r->state = splitmix64(&seed);
+    return r;
+}
+
+void ipaddr_reservoir_free(ipaddr_reservoir_t *r)
+{
+    if (r == NULL)
+        return;
+    ipaddr_arena_free(r->arena);
+    free(r);
+}
+
+/*
+ * Allocate zeroed memory from the arena of a reservoir.
+ */
+static void *reservoir_calloc(ipaddr_reservoir_t *r, size_t n, size_t size)
+{
+    if (n > SIZE_MAX / size)
+        return NULL;
+    void *p = ipaddr_arena_alloc(r->arena, n * size);
+    if (p != NULL)
+        memset(p, 0, n * size);
+    return p;
+}
+
+static size_t bucket_hash(uint128_t key, bool ipv6, size_t mask)
+{
+    uint64_t h = ((uint64_t)key ^ (uint64_t)(key >> 64)) + ipv6;
+    return (size_t)((h * 0x9e3779b97f4a7c15) >> 32) & mask;
+}
+
+/*
+ * Double the bucket table.  The old table stays in the arena, which at
+ * most doubles the memory of the tables.
+ */
+static int grow_table(ipaddr_reservoir_t *r)
+{
+    size_t cap = r->table ? (r->mask + 1) * 2 : 1024;
+    bucket_t **table = reservoir_calloc(r, cap, sizeof(*table));
+    if (table == NULL)
+        return IPADDR_ERR_INTERNAL;
+
+    for (size_t i = 0; r->table != NULL && i <= r->mask; i++) {
+        bucket_t *b = r->table[i];
+        if (b == NULL)
+            continue;
+        size_t j = bucket_hash(b->key, b->ipv6, cap - 1);
+        while (table[j] != NULL)
+            j = (j + 1) & (cap - 1);
+        table[j] = b;
+    }
+    r->table = table;
+    r->mask = cap - 1;
+    return IPADDR_OK;
+}
+
+/*
+ * Find the reservoir of the network of addr, creating it if new.
+ */
+static bucket_t *find_bucket(ipaddr_reservoir_t *r, const ipaddr_t *addr)
+{
+    if (r->prefix_len < 0) {
+        if (r->all == NULL)
+            r->all = reservoir_calloc(r, 1, sizeof(*r->all));
+        return r->all;
+    }
+
+    int max_bits = ipaddr_max_prefix(addr);
+    int host_bits = r->prefix_len < max_bits ? max_bits - r->prefix_len : 0;
+    uint128_t key = ipaddr_to_uint128(addr);
+    key = host_bits >= 128 ? 0 : key >> host_bits << host_bits;
+    bool ipv6 = ipaddr_family(addr) == AF_INET6;
+
+    if (r->table == NULL || r->count * 2 >= r->mask + 1) {
+        if (grow_table(r) != IPADDR_OK)
+            return NULL;
+    }
+    size_t i = bucket_hash(key, ipv6, r->mask);
+    while (r->table[i] != NULL) {
+        bucket_t *b = r->table[i];
+        if (b->key == key && b->ipv6 == ipv6)
+            return b;
+        i = (i + 1) & r->mask;
+    }
+
+    bucket_t *b = reservoir_calloc(r, 1, sizeof(*b));
+    if (b == NULL)
+        return NULL;
+    b->key = key;
+    b->ipv6 = ipv6;
+    r->table[i] = b;
+    r->count++;
+    return b;
+}
+
+int ipaddr_reservoir_add(ipaddr_reservoir_t *r, const ipaddr_t *addr)
+{
+    bucket_t *b = find_bucket(r, addr);
+    if (b == NULL)
+        return IPADDR_ERR_INTERNAL;
+
+    b->seen++;
+    if (b->seen <= r->k) {
+        /* Filling up: take every record, moving to slots twice as many */
+        if (b->seen > b->cap) {
+            size_t cap = b->cap ? b->cap * 2 : 4;
+            if (cap > r->k)
+                cap = r->k;
+            ipaddr_t *slots = reservoir_calloc(r, cap, sizeof(*slots));
+            if (slots == NULL)
+                return IPADDR_ERR_INTERNAL;
+            if (b->cap > 0)
+                memcpy(slots, b->slots, b->cap * sizeof(*slots));
+            b->slots = slots;
+            b->cap = cap;
+        }
+        b->slots[b->seen - 1] = *addr;
+        if (b->seen == r->k) {
+            b->w = exp(log(rand_unit(&r->state)) / (double)r->k);
+            draw_next(r, b);
+        }
+        return IPADDR_OK;
+    }
+
+    if (b->seen < b->next)
+        return IPADDR_OK;
+    b->slots[(size_t)rand_upto(&r->state, r->k - 1)] = *addr;
+    b->w *= exp(log(rand_unit(&r->state)) / (double)r->k);
+    draw_next(r, b);
+    return IPADDR_OK;
+}
+
+/*
+ * Order reservoirs by family and network.
+ */
+static int bucket_cmp(const void *pa, const void *pb)
+{
+    const bucket_t *a = *(bucket_t *const *)pa, *b = *(bucket_t *const *)pb;
+    if (a->ipv6 != b->ipv6)
+        return a->ipv6 ? 1 : -1;
+    return a->key < b->key ? -1 : (a->key > b->key);
+}
+
+int ipaddr_reservoir_walk(ipaddr_reservoir_t *r, ipaddr_net_fn fn, void *arg)
+{
+    if (r->prefix_len < 0) {
+        for (size_t i = 0; r->all != NULL && i < r->all->seen && i < r->k; i++)
+            fn(&r->all->slots[i], arg);
+        return IPADDR_OK;
+    }
+
+    size_t size = (r->count ? r->count : 1) * sizeof(bucket_t *);
+    bucket_t **sorted = ipaddr_arena_alloc(r->arena, size);
+    if (sorted == NULL)
+        return IPADDR_ERR_INTERNAL;
+    size_t n = 0;
+    for (size_t i = 0; r->table != NULL && i <= r->mask; i++)
+        if (r->table[i] != NULL)
+            sorted[n++] = r->table[i];
+    qsort(sorted, n, sizeof(*sorted), bucket_cmp);
+
+    for (size_t i = 0; i < n; i++)
+        for (size_t j = 0; j < sorted[i]->seen && j < r->k; j++)
+            fn(&sorted[i]->slots[j], arg);
+    return IPADDR_OK;
+}
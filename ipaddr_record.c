@@ -0,0 +1,151 @@
+/*
+ * ipaddr_record.c - Binary address records
+ *
+ * A record is 18 bytes, optionally followed by extensions:
+ *
+ *   16 bytes  address as a 128-bit big-endian integer (IPv4 in the low 32)
+ *    1 byte   family (4 or 6), ORed with IPADDR_RECORD_SCOPE and
+ *             IPADDR_RECORD_PAYLOAD when those extensions follow
+ *    1 byte   prefix length, or 255 for an address without one
+ *    4 bytes  scope ID, big-endian (IPADDR_RECORD_SCOPE)
+ *    2 bytes  payload length, big-endian, then the payload
+ *             (IPADDR_RECORD_PAYLOAD)
+ *
+ * Streams of records let chained ipaddr invocations, and the temporary
+ * files of external sorts, pass addresses on without formatting and
+ * parsing them again.
+ */
+
+#include "ipaddr.h"
+
+#include <string.h>
+
+#define RECORD_NO_PREFIX 255
+
+int ipaddr_record_write(FILE *fp, const ipaddr_t *addr, const void *payload,
+                        size_t len)
+{
+    uint8_t out[IPADDR_RECORD_SIZE + 6];
+    uint128_t val = ipaddr_to_uint128(addr);
+    uint32_t scope = ipaddr_scope_id(addr);
+    size_t n = IPADDR_RECORD_SIZE;
+
+    if (len > IPADDR_RECORD_MAX_PAYLOAD)
+        return IPADDR_ERR_USAGE;
+
+    for (int i = 15; i >= 0; i--) {
+        out[i] = (uint8_t)val;
+        val >>= 8;
+    }
+    out[16] = ipaddr_is_ipv4(addr) ? 4 : 6;
+    out[17] = addr->has_prefix ? (uint8_t)addr->prefix_len : RECORD_NO_PREFIX;
+
+    if (scope != 0) {
+        out[16] |= IPADDR_RECORD_SCOPE;
+        for (int i = 0; i < 4; i++)
+            out[n++] = (uint8_t)(scope >> (24 - 8 * i));
+    }
+    if (payload != NULL) {
+        out[16] |= IPADDR_RECORD_PAYLOAD;
+        out[n++] = (uint8_t)(len >> 8);
+        out[n++] = (uint8_t)len;
+    }
+
+    if (fwrite(out, 1, n, fp) != n)
+        return IPADDR_ERR_INTERNAL;
+    if (len > 0 && fwrite(payload, 1, len, fp) != len)
+        return IPADDR_ERR_INTERNAL;
+    return IPADDR_OK;
+}
+
+/*
+ * Read exactly n bytes.  A clean end of input before the first byte is
+ * IPADDR_ERR_BOOL; anywhere else it means a truncated record.
+ */
+static int read_bytes(FILE *fp, void *buf, size_t n, bool first,
+                      const char **errmsg)
+{
+    size_t got = fread(buf, 1, n, fp);
+    if (got == n)
+        return IPADDR_OK;
+    if (ferror(fp)) {
+        *errmsg = "read error";
+        return IPADDR_ERR_INTERNAL;
+    }
+    if (got == 0 && first)
+        return IPADDR_ERR_BOOL;
+    *errmsg = "truncated record";
+    return IPADDR_ERR_USAGE;
+}
+
+int ipaddr_record_read(FILE *fp, ipaddr_t *addr, char *payload, size_t *len,
+                       const char **errmsg)
+{
+    uint8_t in[IPADDR_RECORD_SIZE];
+    int rc = read_bytes(fp, in, sizeof(in), true, errmsg);
+    if (rc != IPADDR_OK)
+        return rc;
+
+    uint8_t family = in[16] & ~(IPADDR_RECORD_SCOPE | IPADDR_RECORD_PAYLOAD);
+    if (family != 4 && family != 6) {
+        *errmsg = "invalid record family";
+        return IPADDR_ERR_USAGE;
+    }
+
+    uint128_t val = 0;
+    for (int i = 0; i < 16; i++)
+        val = (val << 8) | in[i];
+
+    int max_bits = (family == 4) ? 32 : 128;
+    if ((family == 4 && (val >> 32) != 0) ||
+        (in[17] != RECORD_NO_PREFIX && in[17] > max_bits)) {
+        *errmsg = "invalid record";
+        return IPADDR_ERR_USAGE;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->addr.sa.sa_family = (family == 4) ? AF_INET : AF_INET6;
+    addr->has_prefix = (in[17] != RECORD_NO_PREFIX);
+    addr->prefix_len = addr->has_prefix ? in[17] : max_bits;
+    ipaddr_from_uint128(addr, val, addr);
+
+    if (in[16] & IPADDR_RECORD_SCOPE) {
+        uint8_t scope[4];
+        rc = read_bytes(fp, scope, sizeof(scope), false, errmsg);
+        if (rc != IPADDR_OK)
+            return rc;
+        if (family == 6) {
+            addr->addr.sin6.sin6_scope_id = (uint32_t)scope[0] << 24 |
+                (uint32_t)scope[1] << 16 | (uint32_t)scope[2] << 8 | scope[3];
+        }
+    }
+
+    size_t n = 0;
+    if (in[16] & IPADDR_RECORD_PAYLOAD) {
+        uint8_t hdr[2];
+        rc = read_bytes(fp, hdr, sizeof(hdr), false, errmsg);
+        if (rc != IPADDR_OK)
+            return rc;
+        n = (size_t)hdr[0] << 8 | hdr[1];
+
+        if (payload != NULL) {
+            rc = read_bytes(fp, payload, n, false, errmsg);
+        } else {
+            /* Skip it */
+            char skip[256];
+            for (size_t left = n; left > 0 && rc == IPADDR_OK; ) {
+                size_t chunk = left < sizeof(skip) ? left : sizeof(skip);
+                rc = read_bytes(fp, skip, chunk, false, errmsg);
+                left -= chunk;
+            }
+        }
+        if (rc != IPADDR_OK)
+            return rc;
+    }
+
+    if (payload != NULL)
+        payload[n] = '\0';
+    if (len != NULL)
+        *len = (in[16] & IPADDR_RECORD_PAYLOAD) ? n : 0;
+    return IPADDR_OK;
+}
@@ -0,0 +1,437 @@
+/*
+ * ipaddr_reload.c - Prefix table handles with hot reload
+ *
+ * A handle owns the current table of a prefix file.  Readers pin it by
+ * bumping the reader count of the current grace period, which never blocks.
+ * A replacement publishes the new table, then flips the period twice, each
+ * time waiting for the readers of the period just closed to leave, before
+ * freeing the old table.  Only the replacing thread ever waits.
+ *
+ * Updates may also be applied to the current table in place (see
+ * ipaddr_lpm.c); the same grace periods tell when memory they unlinked can
+ * be reused.  A source file that only grew since the last load is treated as
+ * an update log: just the new lines are read and applied in place.
+ */
+
+#include "ipaddr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+
+#define RELOAD_INTERVAL 1   /* seconds between checks of the source file */
+#define RELOAD_TAIL     64  /* bytes before offset checked for appends */
+
+struct ipaddr_lpm_handle {
+    _Atomic(ipaddr_lpm_t *) current;
+    atomic_uint             period;
+    atomic_ulong            readers[2];   /* by period parity */
+    pthread_mutex_t         replace_lock; /* one writer at a time */
+
+    /* Source file watching */
+    char                   *path;
+    int                     flags;
+    struct stat             st;           /* source file when last loaded */
+    off_t                   offset;       /* end of last complete line read,
+                                             -1 if the file ended mid-line */
+    size_t                  lineno;       /* lines up to offset */
+    char                    tail[RELOAD_TAIL]; /* file bytes before offset */
+    size_t                  tail_len;
+    bool                    watching;
+    bool                    stop;
+    pthread_t               thread;
+    pthread_mutex_t         lock;
+    pthread_cond_t          cond;
+};
+
+/*
+ * Load a table from path, with a prefilter if requested.
+ */
+static int load_table(const char *path, int flags, ipaddr_lpm_t **lpm,
+                      size_t *lineno, const char **errmsg)
+{
+    ipaddr_lpm_t *table = ipaddr_lpm_new();
+    if (table == NULL) {
+        *lineno = 0;
+        *errmsg = "out of memory";
+        return IPADDR_ERR_INTERNAL;
+    }
+
+    int rc = ipaddr_lpm_load(table, path, lineno, errmsg);
+    if (rc == IPADDR_OK && (flags & IPADDR_LPM_FILTER)) {
+        rc = ipaddr_lpm_build_filter(table);
+        if (rc != IPADDR_OK)
+            *errmsg = "out of memory";
+    }
+    if (rc != IPADDR_OK) {
+        ipaddr_lpm_free(table);
+        return rc;
+    }
+
+    *lpm = table;
+    return IPADDR_OK;
+}
+
+/*
+ * Read up to RELOAD_TAIL bytes of the source file just before offset into
+ * buf.  Returns the number of bytes read.
+ */
+static size_t read_tail(const char *path, off_t offset, char *buf)
+{
+    off_t start = offset > RELOAD_TAIL ? offset - RELOAD_TAIL : 0;
+    size_t got = 0;
+
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL)
+        return 0;
+    if (fseeko(fp, start, SEEK_SET) == 0)
+        got = fread(buf, 1, (size_t)(offset - start), fp);
+    fclose(fp);
+    return got;
+}
+
+/*
+ * Remember how far a full load of the source file of the given size went:
+ * to its end if it is empty or ends with a newline, so that lines appended
+ * later can be applied as updates, or nowhere otherwise.
+ */
+static void set_offset(ipaddr_lpm_handle_t *handle, off_t size)
+{
+    handle->offset = -1;
+    handle->tail_len = 0;
+    if (ipaddr_mrt_detect(handle->path))
+        return;     /* dumps are replaced, never appended to */
+    handle->tail_len = read_tail(handle->path, size, handle->tail);
+    if (size == 0 ||
+        (handle->tail_len == (size_t)(size < RELOAD_TAIL ? size : RELOAD_TAIL) &&
+         handle->tail[handle->tail_len - 1] == '\n'))
+        handle->offset = size;
+}
+
+/*
+ * Check whether the source file has only been appended to since offset.
+ * The bytes just before offset must be unchanged; this catches a file that
+ * was truncated and rewritten in place with longer contents.
+ */
+static bool only_appended(ipaddr_lpm_handle_t *handle, const struct stat *st)
+{
+    char buf[RELOAD_TAIL];
+
+    if (st->st_dev != handle->st.st_dev || st->st_ino != handle->st.st_ino ||
+        handle->offset < 0 || st->st_size < handle->st.st_size)
+        return false;
+    return read_tail(handle->path, handle->offset, buf) == handle->tail_len &&
+           memcmp(buf, handle->tail, handle->tail_len) == 0;
+}
+
+/*
+ * Count the newlines in a buffer.
+ */
+static size_t count_lines(const char *buf, size_t len)
+{
+    size_t n = 0;
+    for (const char *p = buf; (p = memchr(p, '\n', len - (size_t)(p - buf))) != NULL; p++)
+        n++;
+    return n;
+}
+
+/*
+ * Apply the complete lines appended to the source file since offset to the
+ * current table in place.  Returns 0 on success; on error nothing past the
+ * last successfully applied line is remembered as read, so the lines are
+ * applied again (harmlessly) once the file changes.
+ */
+static int apply_appended(ipaddr_lpm_handle_t *handle, const struct stat *st)
+{
+    size_t len = (size_t)(st->st_size - handle->offset);
+    char *buf = malloc(len);
+    if (buf == NULL)
+        return IPADDR_ERR_INTERNAL;
+
+    FILE *fp = fopen(handle->path, "r");
+    size_t got = 0;
+    if (fp != NULL) {
+        if (fseeko(fp, handle->offset, SEEK_SET) == 0)
+            got = fread(buf, 1, len, fp);
+        fclose(fp);
+    }
+
+    /* A partial last line is left for the next check */
+    while (got > 0 && buf[got - 1] != '\n')
+        got--;
+    if (got == 0) {
+        free(buf);
+        return IPADDR_OK;
+    }
+
+    int rc = IPADDR_ERR_INTERNAL;
+    fp = fmemopen(buf, got, "r");
+    if (fp != NULL) {
+        size_t lineno = handle->lineno;
+        const char *errmsg;
+
+        pthread_mutex_lock(&handle->replace_lock);
+        rc = ipaddr_lpm_read(atomic_load(&handle->current), fp, &lineno, &errmsg);
+        pthread_mutex_unlock(&handle->replace_lock);
+        fclose(fp);
+
+        if (rc != IPADDR_OK) {
+            fprintf(stderr, "ipaddr: %s:%zu: %s (keeping previous entries)\n",
+                    handle->path, lineno, errmsg);
+        } else {
+            handle->offset += (off_t)got;
+            handle->tail_len = read_tail(handle->path, handle->offset, handle->tail);
+            handle->lineno += count_lines(buf, got);
+        }
+        ipaddr_lpm_synchronize(handle);
+    }
+
+    free(buf);
+    return rc;
+}
+
+/*
+ * Check whether two stat results describe the same version of a file.
+ */
+static bool same_version(const struct stat *a, const struct stat *b)
+{
+    return a->st_dev == b->st_dev && a->st_ino == b->st_ino &&
+           a->st_size == b->st_size &&
+           a->st_mtim.tv_sec == b->st_mtim.tv_sec &&
+           a->st_mtim.tv_nsec == b->st_mtim.tv_nsec;
+}
+
+/*
+ * Reload the table if its source file has changed since the last load.
+ * A file that fails to load is reported once and the old table is kept.
+ */
+static void reload_if_changed(ipaddr_lpm_handle_t *handle)
+{
+    struct stat st, after;
+
+    if (stat(handle->path, &st) != 0 || same_version(&st, &handle->st))
+        return;
+
+    /* Same file, only grown: apply the new lines as updates */
+    if (only_appended(handle, &st)) {
+        apply_appended(handle, &st);
+        handle->st = st;
+        return;
+    }
+
+    ipaddr_lpm_t *lpm = NULL;
+    size_t lineno;
+    const char *errmsg;
+    int rc = load_table(handle->path, handle->flags, &lpm, &lineno, &errmsg);
+
+    /* Changed again while loading: pick it up on the next check */
+    if (stat(handle->path, &after) != 0 || !same_version(&st, &after)) {
+        if (rc == IPADDR_OK)
+            ipaddr_lpm_free(lpm);
+        return;
+    }
+
+    handle->st = st;
+    if (rc != IPADDR_OK) {
+        fprintf(stderr, "ipaddr: %s:%zu: %s (keeping previous table)\n",
+                handle->path, lineno, errmsg);
+        return;
+    }
+
+    set_offset(handle, st.st_size);
+    handle->lineno = lineno;
+    ipaddr_lpm_replace(handle, lpm);
+}
+
+/*
+ * Watcher thread: check the source file every RELOAD_INTERVAL seconds.
+ */
+static void *watch_thread(void *arg)
+{
+    ipaddr_lpm_handle_t *handle = arg;
+
+    pthread_mutex_lock(&handle->lock);
+    while (!handle->stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += RELOAD_INTERVAL;
+        pthread_cond_timedwait(&handle->cond, &handle->lock, &deadline);
+        if (handle->stop)
+            break;
+
+        pthread_mutex_unlock(&handle->lock);
+        reload_if_changed(handle);
+        pthread_mutex_lock(&handle->lock);
+    }
+    pthread_mutex_unlock(&handle->lock);
+
+    return NULL;
+}
+
+/*
+ * Open a handle on the prefix table loaded from path.
+ */
+int ipaddr_lpm_open(const char *path, int flags, ipaddr_lpm_handle_t **handle,
+                    size_t *lineno, const char **errmsg)
+{
+    ipaddr_lpm_handle_t *h = calloc(1, sizeof(*h));
+    if (h == NULL) {
+        *lineno = 0;
+        *errmsg = "out of memory";
+        return IPADDR_ERR_INTERNAL;
+    }
+
+    h->path = strdup(path);
+    h->flags = flags;
+    pthread_mutex_init(&h->replace_lock, NULL);
+    pthread_mutex_init(&h->lock, NULL);
+    pthread_cond_init(&h->cond, NULL);
+
+    /* Stat before loading so that a change during the load is noticed */
+    if (stat(path, &h->st) != 0)
+        memset(&h->st, 0, sizeof(h->st));
+
+    ipaddr_lpm_t *lpm = NULL;
+    int rc = IPADDR_ERR_INTERNAL;
+    if (h->path != NULL)
+        rc = load_table(path, flags, &lpm, lineno, errmsg);
+    else {
+        *lineno = 0;
+        *errmsg = "out of memory";
+    }
+    if (rc != IPADDR_OK) {
+        ipaddr_lpm_close(h);
+        return rc;
+    }
+    atomic_init(&h->current, lpm);
+    h->lineno = *lineno;
+    set_offset(h, h->st.st_size);
+
+    if ((flags & IPADDR_LPM_WATCH) &&
+        pthread_create(&h->thread, NULL, watch_thread, h) == 0)
+        h->watching = true;
+
+    *handle = h;
+    return IPADDR_OK;
+}
+
+/*
+ * Stop watching and free the handle and its table.
+ */
+void ipaddr_lpm_close(ipaddr_lpm_handle_t *handle)
+{
+    if (handle == NULL)
+        return;
+
+    if (handle->watching) {
+        pthread_mutex_lock(&handle->lock);
+        handle->stop = true;
+        pthread_cond_signal(&handle->cond);
+        pthread_mutex_unlock(&handle->lock);
+        pthread_join(handle->thread, NULL);
+    }
+
+    ipaddr_lpm_free(atomic_load(&handle->current));
+    pthread_cond_destroy(&handle->cond);
+    pthread_mutex_destroy(&handle->lock);
+    pthread_mutex_destroy(&handle->replace_lock);
+    free(handle->path);
+    free(handle);
+}
+
+/*
+ * Pin the current table for reading.
+ */
+const ipaddr_lpm_t *ipaddr_lpm_acquire(ipaddr_lpm_handle_t *handle,
+                                       unsigned *token)
+{
+    *token = atomic_load(&handle->period) & 1;
+    atomic_fetch_add(&handle->readers[*token], 1);
+    return atomic_load(&handle->current);
+}
+
+/*
+ * Unpin a table pinned by ipaddr_lpm_acquire().
+ */
+void ipaddr_lpm_release(ipaddr_lpm_handle_t *handle, unsigned token)
+{
+    atomic_fetch_sub(&handle->readers[token], 1);
+}
+
+/*
+ * Close the current grace period and wait for its readers to leave.
+ */
+static void wait_readers(ipaddr_lpm_handle_t *handle)
+{
+    static const struct timespec pause = { 0, 100000 }; /* 100us */
+    unsigned closed = atomic_fetch_add(&handle->period, 1) & 1;
+
+    while (atomic_load(&handle->readers[closed]) != 0)
+        nanosleep(&pause, NULL);
+}
+
+/*
+ * Wait until every reader that might have seen the state before the caller's
+ * last change has left.  A reader may have picked up the period just before
+ * a flip and only registered after the wait saw its counter drained, so both
+ * periods are waited out; such late readers always see the new state.
+ */
+static void wait_grace_period(ipaddr_lpm_handle_t *handle)
+{
+    wait_readers(handle);
+    wait_readers(handle);
+}
+
+/*
+ * Replace the table of a handle, freeing the old one once no reader can
+ * still be using it.
+ */
+void ipaddr_lpm_replace(ipaddr_lpm_handle_t *handle, ipaddr_lpm_t *lpm)
+{
+    pthread_mutex_lock(&handle->replace_lock);
+
+    ipaddr_lpm_t *old = atomic_exchange(&handle->current, lpm);
+    wait_grace_period(handle);
+
+    pthread_mutex_unlock(&handle->replace_lock);
+    ipaddr_lpm_free(old);
+}
+
+/*
+ * Add or replace a prefix in the table of a handle, in place.
+ */
+int ipaddr_lpm_update(ipaddr_lpm_handle_t *handle, const ipaddr_t *prefix,
+                      const char *value)
+{
+    pthread_mutex_lock(&handle->replace_lock);
+    int rc = ipaddr_lpm_insert(atomic_load(&handle->current), prefix, value);
+    pthread_mutex_unlock(&handle->replace_lock);
+    return rc;
+}
+
+/*
+ * Withdraw a prefix from the table of a handle, in place.
+ */
+int ipaddr_lpm_withdraw(ipaddr_lpm_handle_t *handle, const ipaddr_t *prefix)
+{
+    pthread_mutex_lock(&handle->replace_lock);
+    int rc = ipaddr_lpm_delete(atomic_load(&handle->current), prefix);
+    pthread_mutex_unlock(&handle->replace_lock);
+    return rc;
+}
+
+/*
+ * Wait until no reader can hold memory retired by earlier updates and
+ * reclaim it.
+ */
+void ipaddr_lpm_synchronize(ipaddr_lpm_handle_t *handle)
+{
+    pthread_mutex_lock(&handle->replace_lock);
+    wait_grace_period(handle);
+    ipaddr_lpm_reclaim(atomic_load(&handle->current));
+    pthread_mutex_unlock(&handle->replace_lock);
+}
@@ -0,0 +1,407 @@
+/*
+ * ipaddr_reverse.c - Reverse DNS names (in-addr.arpa and ip6.arpa)
+ *
+ * Names are written from tables of the text of every byte value: its
+ * decimal octet for in-addr.arpa, its two nibble labels for ip6.arpa, and
+ * its hex digits for zone file targets.  Zone skeletons step through the
+ * hosts of a network with an in-place carry on the address bytes and, for
+ * IPv6, rewrite only the parts of the line for the bytes that changed.
+ */
+
+#include "ipaddr.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <strings.h>
+#include <pthread.h>
+
+#define ZONE_DOMAIN_MAX 253         /* longest domain name */
+#define ZONE_LINE_MAX   512
+#define ZONE_BUFFER     (64 << 10)  /* output written in blocks this big */
+#define MIDDLE_MAX      40          /* see zone_ipv4() */
+
+static const char hex_digits[] = "0123456789abcdef";
+
+/* Text of byte values: "DDD" octets, "l.h." nibble labels, "hh" digits */
+static struct {
+    char    octet[256][4];
+    uint8_t octet_len[256];
+    char    nibbles[256][4];
+    char    hex[256][2];
+} text;
+
+static pthread_once_t text_once = PTHREAD_ONCE_INIT;
+
+static void fill_text(void)
+{
+    for (int b = 0; b < 256; b++) {
+        text.octet_len[b] = (uint8_t)snprintf(text.octet[b], sizeof(text.octet[b]), "%d", b);
+        text.nibbles[b][0] = hex_digits[b & 0xf];
+        text.nibbles[b][1] = '.';
+        text.nibbles[b][2] = hex_digits[b >> 4];
+        text.nibbles[b][3] = '.';
+        text.hex[b][0] = hex_digits[b >> 4];
+        text.hex[b][1] = hex_digits[b & 0xf];
+    }
+}
+
+static void init_text(void)
+{
+    pthread_once(&text_once, fill_text);
+}
+
+/*
+ * Write the labels of bytes [from, to) of an address, least significant
+ * first, each followed by a dot.  Returns the length written.
+ */
+static size_t write_labels(char *out, const uint8_t *bytes, size_t from, size_t to,
+                           bool ipv6)
+{
+    char *p = out;
+
+    for (size_t i = to; i-- > from; ) {
+        if (ipv6) {
+            memcpy(p, text.nibbles[bytes[i]], 4);
+            p += 4;
+        } else {
+            memcpy(p, text.octet[bytes[i]], text.octet_len[bytes[i]]);
+            p += text.octet_len[bytes[i]];
+            *p++ = '.';
+        }
+    }
+    return (size_t)(p - out);
+}
+
+int ipaddr_reverse_pointer(const ipaddr_t *addr, char *buf, size_t buflen)
+{
+    const uint8_t *bytes = ipaddr_bytes(addr);
+    size_t len = ipaddr_bytes_len(addr);
+    bool ipv6 = ipaddr_is_ipv6(addr);
+    const char *suffix = ipv6 ? "ip6.arpa" : "in-addr.arpa";
+
+    if (buflen < IPADDR_REVERSE_STRLEN)
+        return IPADDR_ERR_INTERNAL;
+
+    init_text();
+    size_t n = write_labels(buf, bytes, 0, len, ipv6);
+    strcpy(buf + n, suffix);
+    return IPADDR_OK;
+}
+
+int ipaddr_parse_reverse(const char *str, ipaddr_t *addr, const char **errmsg)
+{
+    size_t len = strlen(str);
+    bool ipv6;
+
+    memset(addr, 0, sizeof(*addr));
+    if (len > 0 && str[len - 1] == '.')
+        len--;
+
+    /* The zone apex has no labels before the suffix */
+    if (len >= 12 && strncasecmp(str + len - 12, "in-addr.arpa", 12) == 0 &&
+        (len == 12 || str[len - 13] == '.')) {
+        ipv6 = false;
+        len = (len == 12) ? 0 : len - 12;
+    } else if (len >= 8 && strncasecmp(str + len - 8, "ip6.arpa", 8) == 0 &&
+               (len == 8 || str[len - 9] == '.')) {
+        ipv6 = true;
+        len = (len == 8) ? 0 : len - 8;
+    } else {
+        *errmsg = "invalid reverse DNS name";
+        return IPADDR_ERR_USAGE;
+    }
+
+    /* Labels, each followed by a dot, least significant first */
+    uint8_t vals[32];
+    int unit = ipv6 ? 4 : 8;
+    int max_labels = ipv6 ? 32 : 4;
+    int nlabels = 0;
+    const char *p = str, *end = str + len;
+
+    while (p < end) {
+        const char *dot = memchr(p, '.', (size_t)(end - p));
+        size_t n = (size_t)(dot - p);
+        unsigned v = 0;
+
+        if (nlabels == max_labels || n == 0)
+            goto invalid;
+        if (ipv6) {
+            const char *d = (n == 1) ? strchr(hex_digits, p[0] | 0x20) : NULL;
+            if (d == NULL || *d == '\0')
+                goto invalid;
+            v = (unsigned)(d - hex_digits);
+        } else {
+            if (n > 3 || (n > 1 && p[0] == '0'))
+                goto invalid;
+            for (size_t i = 0; i < n; i++) {
+                if (p[i] < '0' || p[i] > '9')
+                    goto invalid;
+                v = v * 10 + (unsigned)(p[i] - '0');
+            }
+            if (v > 255)
+                goto invalid;
+        }
+        vals[nlabels++] = (uint8_t)v;
+        p = dot + 1;
+    }
+
+    /* A name with fewer labels than an address names a network */
+    uint8_t *bytes;
+    if (ipv6) {
+        addr->addr.sin6.sin6_family = AF_INET6;
+        bytes = addr->addr.sin6.sin6_addr.s6_addr;
+        for (int i = 0; i < nlabels; i++) {
+            uint8_t v = vals[nlabels - 1 - i];
+            bytes[i / 2] |= (i % 2 == 0) ? (uint8_t)(v << 4) : v;
+        }
+    } else {
+        addr->addr.sin.sin_family = AF_INET;
+        bytes = (uint8_t *)&addr->addr.sin.sin_addr;
+        for (int i = 0; i < nlabels; i++)
+            bytes[i] = vals[nlabels - 1 - i];
+    }
+    addr->prefix_len = nlabels * unit;
+    addr->has_prefix = (nlabels < max_labels);
+    *errmsg = NULL;
+    return IPADDR_OK;
+
+invalid:
+    *errmsg = "invalid reverse DNS name";
+    return IPADDR_ERR_USAGE;
+}
+
+/*
+ * Write the labels of nibbles [from, to) of an IPv6 address, least
+ * significant first, each followed by a dot.  Returns the length written.
+ */
+static size_t write_nibble_labels(char *out, const uint8_t *bytes, int from, int to)
+{
+    char *p = out;
+
+    for (int i = to; i-- > from; ) {
+        uint8_t b = bytes[i / 2];
+        *p++ = hex_digits[(i % 2 == 0) ? b >> 4 : b & 0xf];
+        *p++ = '.';
+    }
+    return (size_t)(p - out);
+}
+
+/* Output buffer of a zone */
+typedef struct {
+    FILE   *fp;
+    char   *buf;
+    size_t  len;
+    bool    failed;
+} zone_out_t;
+
+/*
+ * Get room for a line at the end of the buffer, writing it out first if
+ * it is full.
+ */
+static char *zone_reserve(zone_out_t *out)
+{
+    if (out->len + ZONE_LINE_MAX > ZONE_BUFFER) {
+        if (fwrite(out->buf, 1, out->len, out->fp) != out->len)
+            out->failed = true;
+        out->len = 0;
+    }
+    return out->buf + out->len;
+}
+
+/*
+ * Append a line held in a buffer of ZONE_LINE_MAX bytes.
+ */
+static void zone_write(zone_out_t *out, const char *line, size_t len)
+{
+    char *p = zone_reserve(out);
+
+    /* Whole blocks are cheaper than a copy of the exact size */
+    for (size_t k = 0; k < len; k += 16)
+        memcpy(p + k, line + k, 16);
+    out->len += len;
+}
+
+/*
+ * Step bytes to the next address.  Returns the index of the most
+ * significant byte that changed.
+ */
+static int next_address(uint8_t *bytes, int len)
+{
+    int i = len - 1;
+    while (i > 0 && ++bytes[i] == 0)
+        i--;
+    if (i == 0)
+        bytes[0]++;
+    return i;
+}
+
+/*
+ * Write the PTR records of IPv4 hosts.  Only the last byte changes from
+ * one line to the next but every 256th, so the text between its two
+ * appearances in the line is kept and rebuilt on carries only.
+ */
+static void zone_ipv4(zone_out_t *out, uint8_t *bytes, uint128_t count,
+                      int owner_from, const char *domain)
+{
+    char middle[MIDDLE_MAX];
+    char tail[ZONE_DOMAIN_MAX + 19];
+    size_t middle_len = 0;
+    size_t tail_len = (size_t)sprintf(tail, ".%s.\n", domain);
+    int changed = 0;
+
+    for (;;) {
+        if (changed < 3) {
+            char *p = middle;
+            for (int i = 2; i >= owner_from; i--) {
+                *p++ = '.';
+                memcpy(p, text.octet[bytes[i]], text.octet_len[bytes[i]]);
+                p += text.octet_len[bytes[i]];
+            }
+            memcpy(p, "\tIN\tPTR\tip-", 11);
+            p += 11;
+            for (int i = 0; i < 3; i++) {
+                memcpy(p, text.octet[bytes[i]], text.octet_len[bytes[i]]);
+                p += text.octet_len[bytes[i]];
+                *p++ = '-';
+            }
+            middle_len = (size_t)(p - middle);
+        }
+
+        const char *last = text.octet[bytes[3]];
+        size_t last_len = text.octet_len[bytes[3]];
+        /* Copies of fixed sizes run over into what follows, but cost
+         * less than short copies of variable size */
+        char *line = zone_reserve(out), *p = line;
+        memcpy(p, last, 4);
+        p += last_len;
+        memcpy(p, middle, MIDDLE_MAX);
+        p += middle_len;
+        memcpy(p, last, 4);
+        p += last_len;
+        for (size_t k = 0; k < tail_len; k += 16)
+            memcpy(p + k, tail + k, 16);
+        out->len += (size_t)(p - line) + tail_len;
+
+        if (--count == 0 || out->failed)
+            break;
+        changed = next_address(bytes, 4);
+    }
+}
+
+/*
+ * Write the PTR records of IPv6 hosts.  Every line has the same layout,
+ * so only the text of the bytes that changed is rewritten.
+ */
+static void zone_ipv6(zone_out_t *out, uint8_t *bytes, uint128_t count,
+                      int owner_from, const char *domain)
+{
+    char line[ZONE_LINE_MAX];
+
+    /* Owner labels, then the full address in groups as the target */
+    size_t owner_len = write_nibble_labels(line, bytes, owner_from, 32);
+    char *p = line + owner_len - 1;
+    memcpy(p, "\tIN\tPTR\tip", 10);
+    p += 10;
+    char *target = p + 1;
+    for (int i = 0; i < 16; i++) {
+        if (i % 2 == 0)
+            *p++ = '-';
+        memcpy(p, text.hex[bytes[i]], 2);
+        p += 2;
+    }
+    p += sprintf(p, ".%s.\n", domain);
+    size_t len = (size_t)(p - line);
+
+    int changed = 0;
+    for (;;) {
+        for (int i = changed; i < 16; i++) {
+            /* Nibble n is the label at (31 - n) * 2 */
+            if (2 * i + 1 >= owner_from)
+                line[(30 - 2 * i) * 2] = hex_digits[bytes[i] & 0xf];
+            if (2 * i >= owner_from)
+                line[(31 - 2 * i) * 2] = hex_digits[bytes[i] >> 4];
+            memcpy(target + 2 * i + i / 2, text.hex[bytes[i]], 2);
+        }
+        zone_write(out, line, len);
+
+        if (--count == 0 || out->failed)
+            break;
+        changed = next_address(bytes, 16);
+    }
+}
+
+int ipaddr_reverse_zone(const ipaddr_t *net, const char *domain, FILE *fp)
+{
+    bool ipv6 = ipaddr_is_ipv6(net);
+    int max_bits = ipaddr_max_prefix(net);
+    int unit = ipv6 ? 4 : 8;
+    int plen = net->prefix_len;
+
+    if (domain == NULL)
+        domain = "invalid";
+    size_t dlen = strlen(domain);
+    if (dlen > 0 && domain[dlen - 1] == '.')
+        dlen--;
+    if (dlen == 0 || dlen > ZONE_DOMAIN_MAX)
+        return IPADDR_ERR_USAGE;
+    char dname[ZONE_DOMAIN_MAX + 1];
+    memcpy(dname, domain, dlen);
+    dname[dlen] = '\0';
+
+    /* Hosts as in Python: no network or broadcast address unless /31 or
+     * /32, no Subnet-Router anycast address unless /127 or /128 */
+    uint128_t first, last;
+    ipaddr_t tmp;
+    ipaddr_network(net, &tmp);
+    first = ipaddr_to_uint128(&tmp);
+    ipaddr_broadcast(net, &tmp);
+    last = ipaddr_to_uint128(&tmp);
+    if (plen < max_bits - 1) {
+        first++;
+        if (!ipv6)
+            last--;
+    }
+    uint128_t count = last - first + 1;   /* 0 for all of IPv6 */
+
+    uint8_t bytes[16];
+    ipaddr_t host;
+    ipaddr_from_uint128(&host, first, net);
+    memcpy(bytes, ipaddr_bytes(&host), ipaddr_bytes_len(&host));
+
+    /* The origin is the longest whole-label zone holding the network, and
+     * leaves at least one label to the owners */
+    int origin_bits = plen - plen % unit;
+    if (origin_bits > max_bits - unit)
+        origin_bits = max_bits - unit;
+
+    char buf[ZONE_LINE_MAX];
+    char netbuf[IPADDR_MAX_ADDRSTRLEN + 33];
+    ipaddr_network(net, &tmp);
+    tmp.has_prefix = true;
+    if (ipaddr_format(&tmp, netbuf, sizeof(netbuf), false) != IPADDR_OK)
+        return IPADDR_ERR_INTERNAL;
+
+    init_text();
+    int n = sprintf(buf, "; PTR records for %s\n$ORIGIN ", netbuf);
+    if (ipv6)
+        n += (int)write_nibble_labels(buf + n, bytes, 0, origin_bits / 4);
+    else
+        n += (int)write_labels(buf + n, bytes, 0, (size_t)origin_bits / 8, false);
+    n += sprintf(buf + n, "%s.\n", ipv6 ? "ip6.arpa" : "in-addr.arpa");
+
+    zone_out_t out = { fp, NULL, 0, false };
+    out.buf = malloc(ZONE_BUFFER);
+    if (out.buf == NULL)
+        return IPADDR_ERR_INTERNAL;
+    zone_write(&out, buf, (size_t)n);
+    if (ipv6)
+        zone_ipv6(&out, bytes, count, origin_bits / 4, dname);
+    else
+        zone_ipv4(&out, bytes, count, origin_bits / 8, dname);
+    if (!out.failed && fwrite(out.buf, 1, out.len, fp) != out.len)
+        out.failed = true;
+    free(out.buf);
+
+    return out.failed ? IPADDR_ERR_INTERNAL : IPADDR_OK;
+}
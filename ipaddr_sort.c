@@ -0,0 +1,480 @@
+/*
+ * ipaddr_sort.c - External sort of address streams
+ *
+ * Addresses are collected as compact records in a buffer of bounded size.
+ * When the buffer fills, it is sorted and spilled to a temporary file as a
+ * run of binary records (see ipaddr_record.c).  Reading back merges the
+ * runs and the final buffer with a loser tree, so each record costs
+ * log2(runs) comparisons.  Runs are merged in levels: when SORT_FANIN
+ * runs of one level pile up, they are merged into one run of the next, so
+ * each record is rewritten once per level and only a bounded number of
+ * files are ever open.  Runs of different levels only meet in the final
+ * merge.
+ */
+
+#include "ipaddr.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SORT_DEFAULT_LIMIT ((size_t)256 << 20)  /* without a memory limit */
+#define SORT_MIN_RECORDS   1024      /* buffer floor for tiny limits */
+#define SORT_FANIN         64        /* runs merged at a time */
+#define SORT_LEVELS        8         /* SORT_FANIN^8 runs before the top
+                                        level merges into itself */
+#define SORT_IO_BUFFER     (1 << 16) /* stdio buffer per run */
+
+/*
+ * An address in sortable form.
+ */
+typedef struct {
+    uint128_t value;
+    uint32_t  scope_id;
+    uint8_t   ipv6;
+    uint8_t   prefix_len;
+    uint8_t   has_prefix;
+} sort_rec_t;
+
+/*
+ * Input of a merge: a spilled run or the sorted buffer.
+ */
+typedef struct {
+    sort_rec_t        head;   /* smallest record not yet merged */
+    bool              done;
+    FILE             *fp;     /* NULL for the buffer */
+    const sort_rec_t *next;   /* rest of the buffer */
+    const sort_rec_t *end;
+} merge_src_t;
+
+/*
+ * K-way merge state.  tree[0] is the source holding the smallest head;
+ * tree[1..k-1] hold the losers of the matches at each internal node of a
+ * tournament over the k sources.
+ */
+typedef struct {
+    merge_src_t *src;
+    int         *tree;
+    int          k;
+} merge_t;
+
+struct ipaddr_sorter {
+    ipaddr_arena_t *arena;
+    sort_rec_t     *buf;
+    size_t          cap;
+    size_t          n;
+    int             flags;
+    FILE           *runs[SORT_LEVELS][SORT_FANIN];
+    int             nruns[SORT_LEVELS];
+    bool            reading;
+    merge_t         merge;
+    bool            have_last;  /* for IPADDR_SORT_UNIQ */
+    sort_rec_t      last;
+};
+
+static int rec_cmp(const sort_rec_t *a, const sort_rec_t *b)
+{
+    /* ipaddr_cmp() order, then the remaining fields to make it total */
+    if (a->ipv6 != b->ipv6)
+        return a->ipv6 < b->ipv6 ? -1 : 1;
+    if (a->value != b->value)
+        return a->value < b->value ? -1 : 1;
+    if (a->prefix_len != b->prefix_len)
+        return a->prefix_len < b->prefix_len ? -1 : 1;
+    if (a->has_prefix != b->has_prefix)
+        return a->has_prefix < b->has_prefix ? -1 : 1;
+    if (a->scope_id != b->scope_id)
+        return a->scope_id < b->scope_id ? -1 : 1;
+    return 0;
+}
+
+static int rec_qsort_cmp(const void *a, const void *b)
+{
+    return rec_cmp(a, b);
+}
+
+static void rec_from_addr(sort_rec_t *rec, const ipaddr_t *addr)
+{
+    memset(rec, 0, sizeof(*rec));
+    rec->value = ipaddr_to_uint128(addr);
+    rec->scope_id = ipaddr_scope_id(addr);
+    rec->ipv6 = ipaddr_is_ipv6(addr);
+    rec->prefix_len = (uint8_t)addr->prefix_len;
+    rec->has_prefix = addr->has_prefix;
+}
+
+static void rec_to_addr(const sort_rec_t *rec, ipaddr_t *addr)
+{
+    memset(addr, 0, sizeof(*addr));
+    addr->addr.sa.sa_family = rec->ipv6 ? AF_INET6 : AF_INET;
+    addr->prefix_len = rec->prefix_len;
+    addr->has_prefix = rec->has_prefix;
+    ipaddr_from_uint128(addr, rec->value, addr);
+    if (rec->ipv6)
+        addr->addr.sin6.sin6_scope_id = rec->scope_id;
+}
+
+/*
+ * Write a record to a run.
+ */
+static int rec_write(FILE *fp, const sort_rec_t *rec)
+{
+    ipaddr_t addr;
+    rec_to_addr(rec, &addr);
+    return ipaddr_record_write(fp, &addr, NULL, 0);
+}
+
+/*
+ * Read a record from a run.  Returns IPADDR_ERR_BOOL at the end of the run.
+ */
+static int rec_read(FILE *fp, sort_rec_t *rec)
+{
+    ipaddr_t addr;
+    const char *errmsg;
+
+    int rc = ipaddr_record_read(fp, &addr, NULL, NULL, &errmsg);
+    if (rc == IPADDR_OK)
+        rec_from_addr(rec, &addr);
+    else if (rc == IPADDR_ERR_USAGE)
+        rc = IPADDR_ERR_INTERNAL;   /* we wrote it, so the file is damaged */
+    return rc;
+}
+
+/*
+ * Create an anonymous temporary file in $TMPDIR (default /tmp).
+ */
+static FILE *spill_open(void)
+{
+    const char *dir = getenv("TMPDIR");
+    if (dir == NULL || *dir == '\0')
+        dir = "/tmp";
+
+    size_t len = strlen(dir) + sizeof("/ipaddr.XXXXXX");
+    char *path = malloc(len);
+    if (path == NULL)
+        return NULL;
+    snprintf(path, len, "%s/ipaddr.XXXXXX", dir);
+
+    FILE *fp = NULL;
+    int fd = mkstemp(path);
+    if (fd >= 0) {
+        unlink(path);
+        fp = fdopen(fd, "w+");
+        if (fp == NULL)
+            close(fd);
+        else
+            setvbuf(fp, NULL, _IOFBF, SORT_IO_BUFFER);
+    }
+    free(path);
+    return fp;
+}
+
+/*
+ * Advance a merge source to its next record.
+ */
+static int src_advance(merge_src_t *s)
+{
+    if (s->fp == NULL) {
+        if (s->next == s->end) {
+            s->done = true;
+            return IPADDR_OK;
+        }
+        s->head = *s->next++;
+        return IPADDR_OK;
+    }
+
+    int rc = rec_read(s->fp, &s->head);
+    if (rc == IPADDR_ERR_BOOL) {
+        s->done = true;
+        return IPADDR_OK;
+    }
+    return rc;
+}
+
+/*
+ * Check whether source a should come out of the merge before source b.
+ */
+static bool src_before(const merge_t *m, int a, int b)
+{
+    if (m->src[a].done)
+        return false;
+    if (m->src[b].done)
+        return true;
+    return rec_cmp(&m->src[a].head, &m->src[b].head) < 0;
+}
+
+/*
+ * Play the matches of the subtree at node, returning its winner.  Node
+ * numbers at or above k stand for source node - k.
+ */
+static int merge_build(merge_t *m, int node)
+{
+    if (node >= m->k)
+        return node - m->k;
+
+    int a = merge_build(m, 2 * node);
+    int b = merge_build(m, 2 * node + 1);
+    if (src_before(m, b, a)) {
+        int t = a;
+        a = b;
+        b = t;
+    }
+    m->tree[node] = b;
+    return a;
+}
+
+/*
+ * Set up a merge of k sources, reading the first record of each.
+ */
+static int merge_start(merge_t *m, merge_src_t *src, int k)
+{
+    m->src = src;
+    m->k = k;
+    m->tree = malloc(k * sizeof(*m->tree));
+    if (m->tree == NULL)
+        return IPADDR_ERR_INTERNAL;
+
+    for (int i = 0; i < k; i++) {
+        if (src[i].fp != NULL && fseek(src[i].fp, 0, SEEK_SET) != 0)
+            return IPADDR_ERR_INTERNAL;
+        int rc = src_advance(&src[i]);
+        if (rc != IPADDR_OK)
+            return rc;
+    }
+    m->tree[0] = (k > 1) ? merge_build(m, 1) : 0;
+    return IPADDR_OK;
+}
+
+/*
+ * Take the smallest record from a merge.  Returns IPADDR_ERR_BOOL once all
+ * sources are exhausted.
+ */
+static int merge_next(merge_t *m, sort_rec_t *rec)
+{
+    int w = m->tree[0];
+    if (m->src[w].done)
+        return IPADDR_ERR_BOOL;
+
+    *rec = m->src[w].head;
+    int rc = src_advance(&m->src[w]);
+    if (rc != IPADDR_OK)
+        return rc;
+
+    /* Replay the matches on the path from the winner's leaf to the root */
+    for (int t = (w + m->k) / 2; t > 0; t /= 2) {
+        if (src_before(m, m->tree[t], w)) {
+            int loser = w;
+            w = m->tree[t];
+            m->tree[t] = loser;
+        }
+    }
+    m->tree[0] = w;
+    return IPADDR_OK;
+}
+
+static void merge_end(merge_t *m)
+{
+    free(m->tree);
+    m->tree = NULL;
+}
+
+/*
+ * Write the records of a merge to fp, dropping duplicates if asked.
+ */
+static int merge_to_file(merge_t *m, FILE *fp, bool uniq)
+{
+    sort_rec_t rec, last = { 0 };
+    bool have_last = false;
+    int rc;
+
+    while ((rc = merge_next(m, &rec)) == IPADDR_OK) {
+        if (uniq && have_last && rec_cmp(&rec, &last) == 0)
+            continue;
+        rc = rec_write(fp, &rec);
+        if (rc != IPADDR_OK)
+            return rc;
+        last = rec;
+        have_last = true;
+    }
+    if (rc != IPADDR_ERR_BOOL)
+        return rc;
+    return fflush(fp) == 0 ? IPADDR_OK : IPADDR_ERR_INTERNAL;
+}
+
+/*
+ * Merge the runs of a level into one run of the next level (of the same
+ * level, at the top).
+ */
+static int merge_level(ipaddr_sorter_t *sorter, int level)
+{
+    merge_src_t src[SORT_FANIN] = { { .done = false } };
+    int n = sorter->nruns[level];
+    int rc = IPADDR_ERR_INTERNAL;
+
+    FILE *out = spill_open();
+    if (out == NULL)
+        return rc;
+
+    for (int i = 0; i < n; i++)
+        src[i].fp = sorter->runs[level][i];
+
+    merge_t m;
+    rc = merge_start(&m, src, n);
+    if (rc == IPADDR_OK)
+        rc = merge_to_file(&m, out, sorter->flags & IPADDR_SORT_UNIQ);
+    merge_end(&m);
+    if (rc != IPADDR_OK) {
+        fclose(out);
+        return rc;
+    }
+
+    for (int i = 0; i < n; i++)
+        fclose(sorter->runs[level][i]);
+    sorter->nruns[level] = 0;
+    if (level + 1 < SORT_LEVELS)
+        level++;
+    sorter->runs[level][sorter->nruns[level]++] = out;
+    return IPADDR_OK;
+}
+
+/*
+ * Sort the buffer and write it out as a new run.
+ */
+static int spill(ipaddr_sorter_t *sorter)
+{
+    FILE *fp = spill_open();
+    if (fp == NULL)
+        return IPADDR_ERR_INTERNAL;
+
+    qsort(sorter->buf, sorter->n, sizeof(*sorter->buf), rec_qsort_cmp);
+    bool uniq = sorter->flags & IPADDR_SORT_UNIQ;
+    for (size_t i = 0; i < sorter->n; i++) {
+        if (uniq && i > 0 && rec_cmp(&sorter->buf[i], &sorter->buf[i - 1]) == 0)
+            continue;
+        if (rec_write(fp, &sorter->buf[i]) != IPADDR_OK) {
+            fclose(fp);
+            return IPADDR_ERR_INTERNAL;
+        }
+    }
+    if (fflush(fp) != 0) {
+        fclose(fp);
+        return IPADDR_ERR_INTERNAL;
+    }
+
+    sorter->runs[0][sorter->nruns[0]++] = fp;
+    sorter->n = 0;
+
+    /* Carry full levels upward */
+    for (int level = 0; level < SORT_LEVELS; level++) {
+        if (sorter->nruns[level] < SORT_FANIN)
+            break;
+        int rc = merge_level(sorter, level);
+        if (rc != IPADDR_OK)
+            return rc;
+    }
+    return IPADDR_OK;
+}
+
+ipaddr_sorter_t *ipaddr_sorter_new(size_t memory_limit, int flags)
+{
+    ipaddr_sorter_t *sorter = calloc(1, sizeof(*sorter));
+    if (sorter == NULL)
+        return NULL;
+
+    if (memory_limit == 0)
+        memory_limit = SORT_DEFAULT_LIMIT;
+    sorter->cap = memory_limit / sizeof(sort_rec_t);
+    if (sorter->cap < SORT_MIN_RECORDS)
+        sorter->cap = SORT_MIN_RECORDS;
+    sorter->flags = flags;
+
+    /* Pages of the buffer are only committed as it fills */
+    sorter->arena = ipaddr_arena_new();
+    if (sorter->arena != NULL)
+        sorter->buf = ipaddr_arena_alloc(sorter->arena, sorter->cap * sizeof(sort_rec_t));
+    if (sorter->buf == NULL) {
+        ipaddr_sorter_free(sorter);
+        return NULL;
+    }
+    return sorter;
+}
+
+void ipaddr_sorter_free(ipaddr_sorter_t *sorter)
+{
+    if (sorter == NULL)
+        return;
+
+    merge_end(&sorter->merge);
+    free(sorter->merge.src);
+    for (int level = 0; level < SORT_LEVELS; level++) {
+        for (int i = 0; i < sorter->nruns[level]; i++)
+            fclose(sorter->runs[level][i]);
+    }
+    ipaddr_arena_free(sorter->arena);
+    free(sorter);
+}
+
+int ipaddr_sorter_add(ipaddr_sorter_t *sorter, const ipaddr_t *addr)
+{
+    if (sorter->reading)
+        return IPADDR_ERR_USAGE;
+
+    if (sorter->n == sorter->cap) {
+        int rc = spill(sorter);
+        if (rc != IPADDR_OK)
+            return rc;
+    }
+    rec_from_addr(&sorter->buf[sorter->n++], addr);
+    return IPADDR_OK;
+}
+
+/*
+ * Switch to reading: merge the runs of all levels with the sorted buffer.
+ */
+static int start_reading(ipaddr_sorter_t *sorter)
+{
+    sorter->reading = true;
+    qsort(sorter->buf, sorter->n, sizeof(*sorter->buf), rec_qsort_cmp);
+
+    int k = 1;
+    for (int level = 0; level < SORT_LEVELS; level++)
+        k += sorter->nruns[level];
+    merge_src_t *src = calloc(k, sizeof(*src));
+    if (src == NULL)
+        return IPADDR_ERR_INTERNAL;
+    int i = 0;
+    for (int level = 0; level < SORT_LEVELS; level++) {
+        for (int j = 0; j < sorter->nruns[level]; j++)
+            src[i++].fp = sorter->runs[level][j];
+    }
+    src[k - 1].next = sorter->buf;
+    src[k - 1].end = sorter->buf + sorter->n;
+
+    sorter->merge.src = src;
+    return merge_start(&sorter->merge, src, k);
+}
+
+int ipaddr_sorter_next(ipaddr_sorter_t *sorter, ipaddr_t *addr)
+{
+    if (!sorter->reading) {
+        int rc = start_reading(sorter);
+        if (rc != IPADDR_OK)
+            return (rc == IPADDR_ERR_BOOL) ? IPADDR_ERR_INTERNAL : rc;
+    }
+
+    sort_rec_t rec;
+    for (;;) {
+        int rc = merge_next(&sorter->merge, &rec);
+        if (rc != IPADDR_OK)
+            return rc;
+        if (!(sorter->flags & IPADDR_SORT_UNIQ) || !sorter->have_last ||
+            rec_cmp(&rec, &sorter->last) != 0)
+            break;
+    }
+
+    sorter->last = rec;
+    sorter->have_last = true;
+    rec_to_addr(&rec, addr);
+    return IPADDR_OK;
+}
@@ -52,6 +52,48 @@ void ipaddr_from_uint128(ipaddr_t *addr, uint128_t val, const ipaddr_t *tmpl)
     }
 }
 
+/*
+ * Add n to an address, or subtract it.
+ * The largest address of the family bounds the sum; wrapping past 0 or
+ * past it is an overflow.
+ */
+int ipaddr_add(const ipaddr_t *addr, uint128_t n, bool negative,
+               ipaddr_t *result)
+{
+    uint128_t val = ipaddr_to_uint128(addr);
+    uint128_t max = (uint128_t)-1 >> (128 - ipaddr_bytes_len(addr) * 8);
+
+    if (negative) {
+        if (n > val)
+            return IPADDR_ERR_USAGE;
+        val -= n;
+    } else {
+        if (n > max - val)
+            return IPADDR_ERR_USAGE;
+        val += n;
+    }
+
+    ipaddr_from_uint128(result, val, addr);
+    return IPADDR_OK;
+}
+
+/*
+ * Get the signed distance between two addresses of the same family, as a
+ * magnitude and a sign, since it can take 129 bits.
+ */
+int ipaddr_distance(const ipaddr_t *from, const ipaddr_t *to, uint128_t *dist,
+                    bool *negative)
+{
+    if (ipaddr_family(from) != ipaddr_family(to))
+        return IPADDR_ERR_USAGE;
+
+    uint128_t a = ipaddr_to_uint128(from);
+    uint128_t b = ipaddr_to_uint128(to);
+    *negative = b < a;
+    *dist = b < a ? a - b : b - a;
+    return IPADDR_OK;
+}
+
 /*
  * Convert a 128-bit unsigned integer to a decimal string.
  * Uses repeated division by 10, collecting remainders.
@@ -2,6 +2,8 @@
  * main.c - IP address manipulation command-line tool
  *
  * Usage: ipaddr [-M] ADDRESS [COMMAND [ARGS...]] ...
+ *        ipaddr [-M] [-r] -f FILE [COMMAND [ARGS...]] ...
+ *        ipaddr [-M] TABLE-COMMAND [ARGS...]
  */
 
 #include "ipaddr.h"
@@ -9,8 +11,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <getopt.h>
 #include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <time.h>
 
 /*
  * Print usage information.
@@ -18,16 +27,47 @@
 static void usage(const char *prog)
 {
     fprintf(stderr,
-        "Usage: %s [-M] ADDRESS [COMMAND [ARGS...]] ...\n"
+        "Usage: %s [-M] [-m SIZE] [-O FORMAT] ADDRESS [COMMAND [ARGS...]] ...\n"
+        "       %s [-M] [-m SIZE] [-I FORMAT] [-O FORMAT] [-r] -f FILE\n"
+        "                 [COMMAND [ARGS...]] ...\n"
+        "       %s [-M] [-O FORMAT] [--state FILE] TABLE-COMMAND [ARGS...]\n"
         "\n"
         "Options:\n"
         "  -M        Output prefix as netmask (e.g., /255.255.255.0)\n"
+        "  -f FILE   Read addresses from FILE, one per line ('-' for stdin)\n"
+        "  -r        With -f, reload lookup tables when their files change\n"
+        "  -m SIZE, --memory-limit SIZE\n"
+        "            Memory for sort, uniq and collapse (K, M, G suffixes);\n"
+        "            beyond it they spill to temporary files\n"
+        "  -I FORMAT, --input-format FORMAT\n"
+        "            With -f, read FILE as 'text' (default), 'bin' records,\n"
+        "            a 'parquet' file, a 'pcap' (or pcapng) capture or a\n"
+        "            'flow' export of NetFlow v5/v9 or IPFIX messages\n"
+        "  --column NAME\n"
+        "            Read addresses from column NAME of a Parquet file\n"
+        "            (implies -I parquet)\n"
+        "  --pcap src|dst|both\n"
+        "            Read source, destination or both addresses of the\n"
+        "            packets of a capture (implies -I pcap; default both)\n"
+        "  --flow src|dst|both\n"
+        "            Read source, destination or both addresses of the\n"
+        "            records of a flow export (implies -I flow; default both)\n"
+        "  --flow-prefix\n"
+        "            Give flow addresses the prefix length exported with them\n"
+        "  -O FORMAT, --output-format FORMAT\n"
+        "            Print addresses as 'text' (default), 'bin' records or\n"
+        "            an 'arrow' IPC stream\n"
+        "  --state FILE\n"
+        "            State file of alloc and free (default ipaddr.state)\n",
+        prog, prog, prog);
+    fprintf(stderr,
         "\n"
         "Commands:\n"
         "  (none)           Print normalized address\n"
         "  version          Print IP version (4 or 6)\n"
         "  packed           Print address as hex bytes\n"
         "  to-int           Print address as decimal integer\n"
+        "  reverse-pointer  Print reverse DNS name (in-addr.arpa/ip6.arpa)\n"
         "  prefix-length    Print prefix length\n"
         "  prefixlen        Alias for prefix-length\n"
         "  netmask          Print network mask\n"
@@ -38,6 +78,18 @@ static void usage(const char *prog)
         "  num-addresses    Print number of addresses in network\n"
         "  host INDEX       Print host at index (negative from end)\n"
         "  host-index       Print index of address in network\n"
+        "  add N            Print address N higher (negative N: lower)\n"
+        "  sub N            Print address N lower (negative N: higher)\n"
+        "  next             Print next address (add 1)\n"
+        "  prev             Print previous address (sub 1)\n"
+        "  distance ADDR    Print ADDR minus address, as a signed integer\n"
+        "  hosts [--random [--seed S]] [--shard I/N]\n"
+        "                   Run the rest of the chain for every address of\n"
+        "                   the network, in order or in a random order\n"
+        "                   (shard I of N of it)\n"
+        "  sample N [--seed S]\n"
+        "                   Run the rest of the chain for N distinct random\n"
+        "                   addresses of the network\n"
         "  subnet PLEN IDX  Print subnet (PLEN: prefix or +N relative)\n"
         "  super PLEN       Print supernet (PLEN: prefix or -N relative)\n"
         "  is-loopback      Exit 0 if loopback, 1 otherwise\n"
@@ -53,6 +105,7 @@ static void usage(const char *prog)
         "  6to4             Extract IPv4 from 6to4 address\n"
         "  teredo server    Extract Teredo server address\n"
         "  teredo client    Extract Teredo client address\n"
+        "  lookup FILE      Print longest prefix in FILE containing address\n"
         "  in ADDR          Exit 0 if in network ADDR, 1 otherwise\n"
         "  contains ADDR    Exit 0 if contains network ADDR, 1 otherwise\n"
         "  overlaps ADDR    Exit 0 if overlaps network ADDR, 1 otherwise\n"
@@ -61,10 +114,48 @@ static void usage(const char *prog)
         "  lt ADDR          Exit 0 if less than ADDR, 1 otherwise\n"
         "  le ADDR          Exit 0 if less than or equal to ADDR, 1 otherwise\n"
         "  gt ADDR          Exit 0 if greater than ADDR, 1 otherwise\n"
-        "  ge ADDR          Exit 0 if greater than or equal to ADDR, 1 otherwise\n"
+        "  ge ADDR          Exit 0 if greater than or equal to ADDR, 1 otherwise\n");
+    fprintf(stderr,
+        "\n"
+        "Aggregate commands (last in the chain, print once all input is read):\n"
+        "  sort             Print addresses in order\n"
+        "  uniq             Print addresses in order, without duplicates\n"
+        "  collapse         Print the fewest networks covering all networks\n"
+        "  heatmap --out FILE [--prefix /N] [--net NET]\n"
+        "                   Draw the addresses in each /N of NET (default\n"
+        "                   0.0.0.0/0, /N 16 bits longer) along a Hilbert\n"
+        "                   curve as a .png or .ppm image\n"
+        "  reservoir K [--by-prefix N] [--seed S]\n"
+        "                   Print a uniform random sample of K addresses, or\n"
+        "                   of K in each /N network\n"
+        "\n"
+        "Table commands (instead of ADDRESS; FILE as for lookup, '-' for stdin):\n"
+        "  fib-compress FILE\n"
+        "                   Print the smallest table giving every address the\n"
+        "                   same lookup value as FILE\n"
+        "  table-diff OLD NEW\n"
+        "                   Print prefixes added (+), removed (-) and with a\n"
+        "                   changed value (~) from OLD to NEW, then the fewest\n"
+        "                   networks whose lookups changed (!); exit 1 if any\n"
+        "  reverse-zone NET [DOMAIN]\n"
+        "                   Print a PTR zone skeleton for the hosts of NET,\n"
+        "                   pointing to ip-ADDRESS.DOMAIN (default invalid)\n"
+        "  alloc POOL --size /N [--count N]\n"
+        "                   Allocate the lowest /N in the smallest free block\n"
+        "                   of POOL that fits; exit 1 if none\n"
+        "  free NET         Free an allocation; print the free block it\n"
+        "                   merged into\n"
+        "  conflicts FILE   Print each pair of overlapping networks among the\n"
+        "                   NETWORK [LABEL] lines of FILE; exit 1 if any\n"
+        "  coverage NET FILE\n"
+        "                   Print the holes in NET left by the networks of\n"
+        "                   FILE, then its coverage and hole counts\n"
+        "  plan POOL FILE   Assign subnets of POOL to the /N or HOSTS [LABEL]\n"
+        "                   lines of FILE, largest first; exit 1 if they\n"
+        "                   do not fit\n"
         "\n"
-        "Commands can be chained; chainable commands update the current address.\n",
-        prog);
+        "Commands can be chained; chainable commands update the current address.\n"
+        "With -f, the chain runs for each address and tests act as filters.\n");
 }
 
 /* Forward declarations for command handlers */
@@ -72,6 +163,7 @@ static int cmd_default(ipaddr_ctx_t *ctx);
 static int cmd_version(ipaddr_ctx_t *ctx);
 static int cmd_packed(ipaddr_ctx_t *ctx);
 static int cmd_to_int(ipaddr_ctx_t *ctx);
+static int cmd_reverse_pointer(ipaddr_ctx_t *ctx);
 static int cmd_prefix_length(ipaddr_ctx_t *ctx);
 static int cmd_netmask(ipaddr_ctx_t *ctx);
 static int cmd_hostmask(ipaddr_ctx_t *ctx);
@@ -81,6 +173,13 @@ static int cmd_broadcast(ipaddr_ctx_t *ctx);
 static int cmd_num_addresses(ipaddr_ctx_t *ctx);
 static int cmd_host(ipaddr_ctx_t *ctx);
 static int cmd_host_index(ipaddr_ctx_t *ctx);
+static int cmd_add(ipaddr_ctx_t *ctx);
+static int cmd_sub(ipaddr_ctx_t *ctx);
+static int cmd_next(ipaddr_ctx_t *ctx);
+static int cmd_prev(ipaddr_ctx_t *ctx);
+static int cmd_distance(ipaddr_ctx_t *ctx);
+static int cmd_hosts(ipaddr_ctx_t *ctx);
+static int cmd_sample(ipaddr_ctx_t *ctx);
 static int cmd_subnet(ipaddr_ctx_t *ctx);
 static int cmd_super(ipaddr_ctx_t *ctx);
 static int cmd_is_loopback(ipaddr_ctx_t *ctx);
@@ -95,6 +194,7 @@ static int cmd_scope_id(ipaddr_ctx_t *ctx);
 static int cmd_ipv4(ipaddr_ctx_t *ctx);
 static int cmd_6to4(ipaddr_ctx_t *ctx);
 static int cmd_teredo(ipaddr_ctx_t *ctx);
+static int cmd_lookup(ipaddr_ctx_t *ctx);
 static int cmd_in(ipaddr_ctx_t *ctx);
 static int cmd_contains(ipaddr_ctx_t *ctx);
 static int cmd_overlaps(ipaddr_ctx_t *ctx);
@@ -104,6 +204,17 @@ static int cmd_lt(ipaddr_ctx_t *ctx);
 static int cmd_le(ipaddr_ctx_t *ctx);
 static int cmd_gt(ipaddr_ctx_t *ctx);
 static int cmd_ge(ipaddr_ctx_t *ctx);
+static int cmd_sort(ipaddr_ctx_t *ctx);
+static int cmd_uniq(ipaddr_ctx_t *ctx);
+static int cmd_collapse(ipaddr_ctx_t *ctx);
+static int cmd_heatmap(ipaddr_ctx_t *ctx);
+static int cmd_reservoir(ipaddr_ctx_t *ctx);
+static int cmd_fib_compress(ipaddr_ctx_t *ctx);
+static int cmd_conflicts(ipaddr_ctx_t *ctx);
+static int cmd_coverage(ipaddr_ctx_t *ctx);
+static int cmd_table_diff(ipaddr_ctx_t *ctx);
+static int cmd_reverse_zone(ipaddr_ctx_t *ctx);
+static int run_chain(ipaddr_ctx_t *ctx);
 
 /*
  * Command table.
@@ -113,6 +224,7 @@ static const cmd_t commands[] = {
     { "version",      NULL,          0,  0,  false, false, cmd_version },
     { "packed",       NULL,          0,  0,  false, false, cmd_packed },
     { "to-int",       NULL,          0,  0,  false, false, cmd_to_int },
+    { "reverse-pointer", NULL,       0,  0,  false, false, cmd_reverse_pointer },
     { "prefix-length", "prefixlen",  0,  0,  false, false, cmd_prefix_length },
     { "netmask",      NULL,          0,  0,  false, false, cmd_netmask },
     { "hostmask",     NULL,          0,  0,  false, false, cmd_hostmask },
@@ -122,6 +234,13 @@ static const cmd_t commands[] = {
     { "num-addresses", NULL,         0,  0,  false, false, cmd_num_addresses },
     { "host",         NULL,          1,  1,  true,  false, cmd_host },
     { "host-index",   NULL,          0,  0,  false, false, cmd_host_index },
+    { "add",          NULL,          1,  1,  true,  false, cmd_add },
+    { "sub",          NULL,          1,  1,  true,  false, cmd_sub },
+    { "next",         NULL,          0,  0,  true,  false, cmd_next },
+    { "prev",         NULL,          0,  0,  true,  false, cmd_prev },
+    { "distance",     NULL,          1,  1,  false, false, cmd_distance },
+    { "hosts",        NULL,          0,  5,  false, false, cmd_hosts },
+    { "sample",       NULL,          1,  3,  false, false, cmd_sample },
     { "subnet",       NULL,          2,  2,  true,  true,  cmd_subnet },
     { "super",        NULL,          1,  1,  true,  true,  cmd_super },
     { "is-loopback",  NULL,          0,  0,  false, false, cmd_is_loopback },
@@ -136,6 +255,7 @@ static const cmd_t commands[] = {
     { "ipv4",         NULL,          0,  0,  true,  false, cmd_ipv4 },
     { "6to4",         NULL,          0,  0,  true,  false, cmd_6to4 },
     { "teredo",       NULL,          1,  1,  true,  false, cmd_teredo },
+    { "lookup",       NULL,          1,  1,  true,  false, cmd_lookup },
     { "in",           NULL,          1,  1,  false, false, cmd_in },
     { "contains",     NULL,          1,  1,  false, false, cmd_contains },
     { "overlaps",     NULL,          1,  1,  false, false, cmd_overlaps },
@@ -145,6 +265,11 @@ static const cmd_t commands[] = {
     { "le",           NULL,          1,  1,  false, false, cmd_le },
     { "gt",           NULL,          1,  1,  false, false, cmd_gt },
     { "ge",           NULL,          1,  1,  false, false, cmd_ge },
+    { "sort",         NULL,          0,  0,  false, false, cmd_sort },
+    { "uniq",         NULL,          0,  0,  false, false, cmd_uniq },
+    { "collapse",     NULL,          0,  0,  false, false, cmd_collapse },
+    { "heatmap",      NULL,          2,  6,  false, false, cmd_heatmap },
+    { "reservoir",    NULL,          1,  5,  false, false, cmd_reservoir },
     { NULL, NULL, 0, 0, false, false, NULL }
 };
 
@@ -173,18 +298,51 @@ static const char *next_arg(ipaddr_ctx_t *ctx)
     return *ctx->argv++;
 }
 
-/* ========== Command Handlers ========== */
+/* Writer of -O arrow output */
+static ipaddr_arrow_t *arrow;
 
-static int cmd_default(ipaddr_ctx_t *ctx)
+/*
+ * Print an address, with its prefix if prefix is true, followed by value
+ * if not NULL.  With -O bin, the address is written as a binary record
+ * instead, with value as its payload; with -O arrow, it becomes a row.
+ */
+static int print_addr(const ipaddr_ctx_t *ctx, const ipaddr_t *addr,
+                      bool prefix, const char *value)
 {
+    if (ctx->output_format != IPADDR_FORMAT_TEXT) {
+        ipaddr_t out = *addr;
+        if (!prefix) {
+            out.has_prefix = false;
+            out.prefix_len = ipaddr_max_prefix(&out);
+        }
+        if (ctx->output_format == IPADDR_FORMAT_ARROW)
+            return ipaddr_arrow_add(arrow, &out, value);
+        return ipaddr_record_write(stdout, &out, value,
+                                   value != NULL ? strlen(value) : 0);
+    }
+
     char buf[IPADDR_MAX_ADDRSTRLEN + 33];
-    int rc = ipaddr_format(&ctx->current, buf, sizeof(buf), ctx->netmask_mode);
+    int rc;
+    if (prefix)
+        rc = ipaddr_format(addr, buf, sizeof(buf), ctx->netmask_mode);
+    else
+        rc = ipaddr_format_addr(addr, buf, sizeof(buf));
     if (rc != IPADDR_OK)
         return rc;
-    printf("%s\n", buf);
+    if (value != NULL)
+        printf("%s %s\n", buf, value);
+    else
+        printf("%s\n", buf);
     return IPADDR_OK;
 }
 
+/* ========== Command Handlers ========== */
+
+static int cmd_default(ipaddr_ctx_t *ctx)
+{
+    return print_addr(ctx, &ctx->current, true, NULL);
+}
+
 static int cmd_version(ipaddr_ctx_t *ctx)
 {
     printf("%d\n", ipaddr_is_ipv4(&ctx->current) ? 4 : 6);
@@ -210,6 +368,16 @@ static int cmd_to_int(ipaddr_ctx_t *ctx)
     return IPADDR_OK;
 }
 
+static int cmd_reverse_pointer(ipaddr_ctx_t *ctx)
+{
+    char buf[IPADDR_REVERSE_STRLEN];
+    int rc = ipaddr_reverse_pointer(&ctx->current, buf, sizeof(buf));
+    if (rc != IPADDR_OK)
+        return rc;
+    printf("%s\n", buf);
+    return IPADDR_OK;
+}
+
 static int cmd_prefix_length(ipaddr_ctx_t *ctx)
 {
     printf("%d\n", ctx->current.prefix_len);
@@ -219,37 +387,26 @@ static int cmd_prefix_length(ipaddr_ctx_t *ctx)
 static int cmd_netmask(ipaddr_ctx_t *ctx)
 {
     ipaddr_t mask;
-    char buf[IPADDR_INET6_ADDRSTRLEN];
 
     ipaddr_netmask(&ctx->current, &mask);
-    int rc = ipaddr_format_addr(&mask, buf, sizeof(buf));
-    if (rc != IPADDR_OK)
-        return rc;
-    printf("%s\n", buf);
-    return IPADDR_OK;
+    return print_addr(ctx, &mask, false, NULL);
 }
 
 static int cmd_hostmask(ipaddr_ctx_t *ctx)
 {
     ipaddr_t mask;
-    char buf[IPADDR_INET6_ADDRSTRLEN];
 
     ipaddr_hostmask(&ctx->current, &mask);
-    int rc = ipaddr_format_addr(&mask, buf, sizeof(buf));
-    if (rc != IPADDR_OK)
-        return rc;
-    printf("%s\n", buf);
-    return IPADDR_OK;
+    return print_addr(ctx, &mask, false, NULL);
 }
 
 static int cmd_address(ipaddr_ctx_t *ctx)
 {
-    char buf[IPADDR_INET6_ADDRSTRLEN];
-    int rc = ipaddr_format_addr(&ctx->current, buf, sizeof(buf));
-    if (rc != IPADDR_OK)
-        return rc;
-    if (!ctx->silent)
-        printf("%s\n", buf);
+    if (!ctx->silent) {
+        int rc = print_addr(ctx, &ctx->current, false, NULL);
+        if (rc != IPADDR_OK)
+            return rc;
+    }
 
     /* Update current to be address-only for chaining */
     ctx->current.has_prefix = false;
@@ -261,14 +418,13 @@ static int cmd_address(ipaddr_ctx_t *ctx)
 static int cmd_network(ipaddr_ctx_t *ctx)
 {
     ipaddr_t net;
-    char buf[IPADDR_MAX_ADDRSTRLEN + 8];
 
     ipaddr_network(&ctx->current, &net);
-    int rc = ipaddr_format(&net, buf, sizeof(buf), ctx->netmask_mode);
-    if (rc != IPADDR_OK)
-        return rc;
-    if (!ctx->silent)
-        printf("%s\n", buf);
+    if (!ctx->silent) {
+        int rc = print_addr(ctx, &net, true, NULL);
+        if (rc != IPADDR_OK)
+            return rc;
+    }
 
     /* Update current for chaining */
     ctx->current = net;
@@ -279,14 +435,9 @@ static int cmd_network(ipaddr_ctx_t *ctx)
 static int cmd_broadcast(ipaddr_ctx_t *ctx)
 {
     ipaddr_t bcast;
-    char buf[IPADDR_INET6_ADDRSTRLEN];
 
     ipaddr_broadcast(&ctx->current, &bcast);
-    int rc = ipaddr_format_addr(&bcast, buf, sizeof(buf));
-    if (rc != IPADDR_OK)
-        return rc;
-    printf("%s\n", buf);
-    return IPADDR_OK;
+    return print_addr(ctx, &bcast, false, NULL);
 }
 
 static int cmd_num_addresses(ipaddr_ctx_t *ctx)
@@ -320,12 +471,11 @@ static int cmd_host(ipaddr_ctx_t *ctx)
         return rc;
     }
 
-    char buf[IPADDR_INET6_ADDRSTRLEN];
-    rc = ipaddr_format_addr(&host, buf, sizeof(buf));
-    if (rc != IPADDR_OK)
-        return rc;
-    if (!ctx->silent)
-        printf("%s\n", buf);
+    if (!ctx->silent) {
+        rc = print_addr(ctx, &host, false, NULL);
+        if (rc != IPADDR_OK)
+            return rc;
+    }
 
     /* Update current for chaining (as host address, no prefix) */
     ctx->current = host;
@@ -342,6 +492,359 @@ static int cmd_host_index(ipaddr_ctx_t *ctx)
     return IPADDR_OK;
 }
 
+/*
+ * Move the current address by n, or by -n if negative, and print it.
+ */
+static int step_addr(ipaddr_ctx_t *ctx, const char *cmd, uint128_t n,
+                     bool negative)
+{
+    ipaddr_t result;
+    if (ipaddr_add(&ctx->current, n, negative, &result) != IPADDR_OK) {
+        fprintf(stderr, "%s: result out of the IPv%d range\n", cmd,
+                ipaddr_is_ipv4(&ctx->current) ? 4 : 6);
+        return IPADDR_ERR_USAGE;
+    }
+
+    if (!ctx->silent) {
+        int rc = print_addr(ctx, &result, true, NULL);
+        if (rc != IPADDR_OK)
+            return rc;
+    }
+
+    /* Update current for chaining, keeping its prefix length */
+    ctx->current = result;
+
+    return IPADDR_OK;
+}
+
+/*
+ * Parse the operand of add or sub: a decimal integer of up to 128 bits,
+ * with an optional sign.
+ */
+static int parse_offset(ipaddr_ctx_t *ctx, const char *cmd, uint128_t *n,
+                        bool *negative)
+{
+    const char *arg = next_arg(ctx);
+    if (arg == NULL) {
+        fprintf(stderr, "%s: missing count argument\n", cmd);
+        return IPADDR_ERR_USAGE;
+    }
+
+    const char *digits = arg + (arg[0] == '-' || arg[0] == '+');
+    if (!isdigit((unsigned char)*digits) ||
+        str_to_uint128(digits, n) != IPADDR_OK) {
+        fprintf(stderr, "%s: invalid count '%s'\n", cmd, arg);
+        return IPADDR_ERR_USAGE;
+    }
+    *negative = arg[0] == '-';
+    return IPADDR_OK;
+}
+
+static int cmd_add(ipaddr_ctx_t *ctx)
+{
+    uint128_t n;
+    bool negative;
+    int rc = parse_offset(ctx, "add", &n, &negative);
+    if (rc != IPADDR_OK)
+        return rc;
+    return step_addr(ctx, "add", n, negative);
+}
+
+static int cmd_sub(ipaddr_ctx_t *ctx)
+{
+    uint128_t n;
+    bool negative;
+    int rc = parse_offset(ctx, "sub", &n, &negative);
+    if (rc != IPADDR_OK)
+        return rc;
+    return step_addr(ctx, "sub", n, !negative);
+}
+
+static int cmd_next(ipaddr_ctx_t *ctx)
+{
+    return step_addr(ctx, "next", 1, false);
+}
+
+static int cmd_prev(ipaddr_ctx_t *ctx)
+{
+    return step_addr(ctx, "prev", 1, true);
+}
+
+/*
+ * A generator command runs the rest of the chain for each address it
+ * generates, as batch mode does for each line, with tests as filters.
+ */
+typedef struct {
+    ipaddr_ctx_t *ctx;
+    int           argc;    /* the rest of the chain */
+    char        **argv;
+    bool          batch;
+    int           result;
+} generator_t;
+
+static void generator_begin(generator_t *g, ipaddr_ctx_t *ctx)
+{
+    g->ctx = ctx;
+    g->argc = ctx->argc;
+    g->argv = ctx->argv;
+    g->batch = ctx->batch;
+    g->result = IPADDR_ERR_BOOL;
+    ctx->batch = true;
+}
+
+/*
+ * Run the rest of the chain for addr.  Returns false once it has failed
+ * with an error, which ends the generator.
+ */
+static bool generator_run(generator_t *g, const ipaddr_t *addr)
+{
+    ipaddr_ctx_t *ctx = g->ctx;
+
+    ctx->current = *addr;
+    ctx->argc = g->argc;
+    ctx->argv = g->argv;
+    int rc = run_chain(ctx);
+    if (rc == IPADDR_OK) {
+        g->result = IPADDR_OK;
+    } else if (rc != IPADDR_ERR_BOOL) {
+        g->result = rc;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * End a generator.  Returns 0 if the chain passed for any address, 1 if
+ * it passed for none, or the error that ended it.
+ */
+static int generator_end(generator_t *g)
+{
+    ipaddr_ctx_t *ctx = g->ctx;
+
+    ctx->batch = g->batch;
+    ctx->argc = 0;
+    ctx->argv = g->argv + g->argc;
+    return g->result;
+}
+
+/*
+ * Parse the --seed of cmd.
+ */
+static int parse_seed(const char *cmd, const char *val, uint64_t *seed)
+{
+    char *end;
+    errno = 0;
+    unsigned long long n = strtoull(val, &end, 10);
+    if (!isdigit((unsigned char)*val) || *end != '\0' || errno != 0) {
+        fprintf(stderr, "%s: invalid seed '%s'\n", cmd, val);
+        return IPADDR_ERR_USAGE;
+    }
+    *seed = n;
+    return IPADDR_OK;
+}
+
+/*
+ * Seed for runs without --seed.
+ */
+static uint64_t time_seed(void)
+{
+    return (uint64_t)time(NULL) ^ ((uint64_t)getpid() << 32);
+}
+
+/* Options of hosts */
+typedef struct {
+    bool     random;
+    bool     seeded;
+    uint64_t seed;
+    uint64_t shard;     /* from 0 */
+    uint64_t shards;
+} hosts_opts_t;
+
+/*
+ * Parse the options of hosts at the start of argv.  Returns the number of
+ * arguments taken, or -1 after printing an error.
+ */
+static int parse_hosts_opts(int argc, char **argv, hosts_opts_t *o)
+{
+    int i = 0;
+
+    memset(o, 0, sizeof(*o));
+    o->shards = 1;
+    while (i < argc && strncmp(argv[i], "--", 2) == 0) {
+        const char *opt = argv[i++];
+        if (strcmp(opt, "--random") == 0) {
+            o->random = true;
+            continue;
+        }
+        if (strcmp(opt, "--seed") != 0 && strcmp(opt, "--shard") != 0) {
+            fprintf(stderr, "hosts: unknown option '%s'\n", opt);
+            return -1;
+        }
+        if (i == argc) {
+            fprintf(stderr, "hosts: %s requires an argument\n", opt);
+            return -1;
+        }
+
+        const char *val = argv[i++];
+        if (strcmp(opt, "--seed") == 0) {
+            if (parse_seed("hosts", val, &o->seed) != IPADDR_OK)
+                return -1;
+            o->seeded = true;
+            continue;
+        }
+
+        /* Both I and N are required: a bare I would quietly be I of I */
+        char *end;
+        errno = 0;
+        unsigned long long k = strtoull(val, &end, 10), n = 0;
+        bool valid = isdigit((unsigned char)*val) && *end == '/' &&
+                     isdigit((unsigned char)end[1]);
+        if (valid)
+            n = strtoull(end + 1, &end, 10);
+        if (!valid || *end != '\0' || errno != 0 || k < 1 || k > n) {
+            fprintf(stderr, "hosts: invalid shard '%s' (I/N, 1 <= I <= N)\n", val);
+            return -1;
+        }
+        o->shard = k - 1;
+        o->shards = n;
+    }
+
+    if (o->seeded && !o->random) {
+        fprintf(stderr, "hosts: --seed requires --random\n");
+        return -1;
+    }
+    if (o->random && o->shards > 1 && !o->seeded) {
+        fprintf(stderr, "hosts: shards of a random order require --seed\n");
+        return -1;
+    }
+    if (o->random && !o->seeded)
+        o->seed = time_seed();
+    return i;
+}
+
+static int cmd_hosts(ipaddr_ctx_t *ctx)
+{
+    hosts_opts_t o;
+    int n = parse_hosts_opts(ctx->argc, ctx->argv, &o);
+    if (n < 0)
+        return IPADDR_ERR_USAGE;
+    ctx->argc -= n;
+    ctx->argv += n;
+
+    generator_t g;
+    ipaddr_hosts_t it;
+    ipaddr_t host;
+
+    ipaddr_hosts_init(&it, &ctx->current, o.random, o.seed, o.shard, o.shards);
+    generator_begin(&g, ctx);
+    while (ipaddr_hosts_next(&it, &host) == IPADDR_OK)
+        if (!generator_run(&g, &host))
+            break;
+    return generator_end(&g);
+}
+
+/*
+ * Parse the arguments of sample: N [--seed S].  Returns the number taken,
+ * or -1 after printing an error.
+ */
+static int parse_sample_args(int argc, char **argv, size_t *n, uint64_t *seed)
+{
+    const char *arg = argv[0];
+    char *end;
+    errno = 0;
+    unsigned long long val = strtoull(arg, &end, 10);
+    if (!isdigit((unsigned char)*arg) || *end != '\0' || errno != 0 ||
+        val > SIZE_MAX / sizeof(uint128_t)) {
+        fprintf(stderr, "sample: invalid count '%s'\n", arg);
+        return -1;
+    }
+    *n = (size_t)val;
+
+    if (argc > 1 && strcmp(argv[1], "--seed") == 0) {
+        if (argc < 3) {
+            fprintf(stderr, "sample: --seed requires an argument\n");
+            return -1;
+        }
+        if (parse_seed("sample", argv[2], seed) != IPADDR_OK)
+            return -1;
+        return 3;
+    }
+    *seed = time_seed();
+    return 1;
+}
+
+/*
+ * Values of the samples being run, kept for the whole run so that batch
+ * mode does not allocate per address.  It is a stack: a sample in the
+ * chain of another takes the values past those of its caller.
+ */
+static struct {
+    uint128_t *values;
+    size_t     cap;
+    size_t     used;
+} samples;
+
+static int cmd_sample(ipaddr_ctx_t *ctx)
+{
+    size_t n;
+    uint64_t seed;
+    int nargs = parse_sample_args(ctx->argc, ctx->argv, &n, &seed);
+    if (nargs < 0)
+        return IPADDR_ERR_USAGE;
+    ctx->argc -= nargs;
+    ctx->argv += nargs;
+
+    size_t base = samples.used;
+    size_t room = ipaddr_sample_room(n);
+    if (room == 0 || room > SIZE_MAX / sizeof(uint128_t) - base) {
+        fprintf(stderr, "Error: out of memory\n");
+        return IPADDR_ERR_INTERNAL;
+    }
+    if (base + room > samples.cap) {
+        size_t cap = base + room;
+        if (samples.cap <= SIZE_MAX / 2 / sizeof(uint128_t) &&
+            samples.cap * 2 > cap)
+            cap = samples.cap * 2;
+        uint128_t *values = realloc(samples.values, cap * sizeof(*values));
+        if (values == NULL) {
+            fprintf(stderr, "Error: out of memory\n");
+            return IPADDR_ERR_INTERNAL;
+        }
+        samples.values = values;
+        samples.cap = cap;
+    }
+
+    if (ipaddr_sample(&ctx->current, n, seed,
+                      samples.values + base) != IPADDR_OK) {
+        char buf[IPADDR_MAX_ADDRSTRLEN + 5];
+        ipaddr_t net;
+        ipaddr_network(&ctx->current, &net);
+        ipaddr_format(&net, buf, sizeof(buf), false);
+        fprintf(stderr, "sample: %s has fewer than %zu addresses\n", buf, n);
+        return IPADDR_ERR_USAGE;
+    }
+
+    /* Addresses keep the zone of the network, as with host */
+    ipaddr_t tmpl = ctx->current, addr;
+    tmpl.has_prefix = false;
+    tmpl.prefix_len = ipaddr_max_prefix(&tmpl);
+
+    /*
+     * Past the sample is only scratch space now.  The values may move while
+     * the chain runs, if it samples again.
+     */
+    generator_t g;
+    samples.used = base + n;
+    generator_begin(&g, ctx);
+    for (size_t i = 0; i < n; i++) {
+        ipaddr_from_uint128(&addr, samples.values[base + i], &tmpl);
+        if (!generator_run(&g, &addr))
+            break;
+    }
+    samples.used = base;
+    return generator_end(&g);
+}
+
 static int cmd_subnet(ipaddr_ctx_t *ctx)
 {
     const char *plen_arg = next_arg(ctx);
@@ -391,12 +894,11 @@ static int cmd_subnet(ipaddr_ctx_t *ctx)
         return rc;
     }
 
-    char buf[IPADDR_MAX_ADDRSTRLEN + 8];
-    rc = ipaddr_format(&subnet, buf, sizeof(buf), ctx->netmask_mode);
-    if (rc != IPADDR_OK)
-        return rc;
-    if (!ctx->silent)
-        printf("%s\n", buf);
+    if (!ctx->silent) {
+        rc = print_addr(ctx, &subnet, true, NULL);
+        if (rc != IPADDR_OK)
+            return rc;
+    }
 
     /* Update current for chaining */
     ctx->current = subnet;
@@ -441,12 +943,11 @@ static int cmd_super(ipaddr_ctx_t *ctx)
         return rc;
     }
 
-    char buf[IPADDR_MAX_ADDRSTRLEN + 8];
-    rc = ipaddr_format(&super, buf, sizeof(buf), ctx->netmask_mode);
-    if (rc != IPADDR_OK)
-        return rc;
-    if (!ctx->silent)
-        printf("%s\n", buf);
+    if (!ctx->silent) {
+        rc = print_addr(ctx, &super, true, NULL);
+        if (rc != IPADDR_OK)
+            return rc;
+    }
 
     /* Update current for chaining */
     ctx->current = super;
@@ -454,41 +955,54 @@ static int cmd_super(ipaddr_ctx_t *ctx)
     return IPADDR_OK;
 }
 
+/*
+ * Result of a test command: 0 for true, 1 for false.  In batch mode, a test
+ * ending the chain acts as a filter and prints the addresses that pass.
+ */
+static int bool_result(ipaddr_ctx_t *ctx, bool result)
+{
+    if (!result)
+        return IPADDR_ERR_BOOL;
+    if (ctx->batch && ctx->argc == 0)
+        return cmd_default(ctx);
+    return IPADDR_OK;
+}
+
 /* is-* commands return 0 for true, 1 for false */
 
 static int cmd_is_loopback(ipaddr_ctx_t *ctx)
 {
-    return ipaddr_is_loopback(&ctx->current) ? IPADDR_OK : IPADDR_ERR_BOOL;
+    return bool_result(ctx, ipaddr_is_loopback(&ctx->current));
 }
 
 static int cmd_is_private(ipaddr_ctx_t *ctx)
 {
-    return ipaddr_is_private(&ctx->current) ? IPADDR_OK : IPADDR_ERR_BOOL;
+    return bool_result(ctx, ipaddr_is_private(&ctx->current));
 }
 
 static int cmd_is_global(ipaddr_ctx_t *ctx)
 {
-    return ipaddr_is_global(&ctx->current) ? IPADDR_OK : IPADDR_ERR_BOOL;
+    return bool_result(ctx, ipaddr_is_global(&ctx->current));
 }
 
 static int cmd_is_multicast(ipaddr_ctx_t *ctx)
 {
-    return ipaddr_is_multicast(&ctx->current) ? IPADDR_OK : IPADDR_ERR_BOOL;
+    return bool_result(ctx, ipaddr_is_multicast(&ctx->current));
 }
 
 static int cmd_is_link_local(ipaddr_ctx_t *ctx)
 {
-    return ipaddr_is_link_local(&ctx->current) ? IPADDR_OK : IPADDR_ERR_BOOL;
+    return bool_result(ctx, ipaddr_is_link_local(&ctx->current));
 }
 
 static int cmd_is_unspecified(ipaddr_ctx_t *ctx)
 {
-    return ipaddr_is_unspecified(&ctx->current) ? IPADDR_OK : IPADDR_ERR_BOOL;
+    return bool_result(ctx, ipaddr_is_unspecified(&ctx->current));
 }
 
 static int cmd_is_reserved(ipaddr_ctx_t *ctx)
 {
-    return ipaddr_is_reserved(&ctx->current) ? IPADDR_OK : IPADDR_ERR_BOOL;
+    return bool_result(ctx, ipaddr_is_reserved(&ctx->current));
 }
 
 static int cmd_zone_id(ipaddr_ctx_t *ctx)
@@ -517,12 +1031,11 @@ static int cmd_ipv4(ipaddr_ctx_t *ctx)
         return rc;
     }
 
-    char buf[IPADDR_INET_ADDRSTRLEN];
-    rc = ipaddr_format_addr(&v4, buf, sizeof(buf));
-    if (rc != IPADDR_OK)
-        return rc;
-    if (!ctx->silent)
-        printf("%s\n", buf);
+    if (!ctx->silent) {
+        rc = print_addr(ctx, &v4, false, NULL);
+        if (rc != IPADDR_OK)
+            return rc;
+    }
 
     /* Update current for chaining */
     ctx->current = v4;
@@ -539,12 +1052,11 @@ static int cmd_6to4(ipaddr_ctx_t *ctx)
         return rc;
     }
 
-    char buf[IPADDR_INET_ADDRSTRLEN];
-    rc = ipaddr_format_addr(&v4, buf, sizeof(buf));
-    if (rc != IPADDR_OK)
-        return rc;
-    if (!ctx->silent)
-        printf("%s\n", buf);
+    if (!ctx->silent) {
+        rc = print_addr(ctx, &v4, false, NULL);
+        if (rc != IPADDR_OK)
+            return rc;
+    }
 
     /* Update current for chaining */
     ctx->current = v4;
@@ -578,15 +1090,133 @@ static int cmd_teredo(ipaddr_ctx_t *ctx)
         return rc;
     }
 
-    char buf[IPADDR_INET_ADDRSTRLEN];
-    rc = ipaddr_format_addr(&result, buf, sizeof(buf));
+    if (!ctx->silent) {
+        rc = print_addr(ctx, &result, false, NULL);
+        if (rc != IPADDR_OK)
+            return rc;
+    }
+
+    /* Update current for chaining */
+    ctx->current = result;
+
+    return IPADDR_OK;
+}
+
+/*
+ * Prefix tables loaded by lookup, kept for the rest of the run so that
+ * batch mode reads each file only once.
+ */
+typedef struct table_cache {
+    struct table_cache  *next;
+    const char          *path;    /* points into argv */
+    ipaddr_lpm_handle_t *handle;  /* NULL if loading failed */
+} table_cache_t;
+
+static table_cache_t *tables;
+
+/*
+ * Number of addresses batch mode reads and looks up at a time.
+ */
+#define BATCH_CHUNK 16
+
+/*
+ * Result of a leading lookup, computed by run_batch() for the current
+ * address together with the rest of its chunk.  Consumed by cmd_lookup().
+ */
+static const ipaddr_lpm_result_t *prelookup;
+
+/*
+ * Get the handle on the prefix table loaded from path, loading it on first
+ * use.
+ */
+static int get_table(ipaddr_ctx_t *ctx, const char *path,
+                     ipaddr_lpm_handle_t **handle)
+{
+    table_cache_t *t;
+
+    for (t = tables; t != NULL; t = t->next) {
+        if (strcmp(t->path, path) == 0)
+            break;
+    }
+
+    if (t == NULL) {
+        t = calloc(1, sizeof(*t));
+        if (t == NULL)
+            return IPADDR_ERR_INTERNAL;
+        t->path = path;
+        t->next = tables;
+        tables = t;
+
+        /* Most addresses in a stream miss; reject them before the trie */
+        int flags = 0;
+        if (ctx->batch)
+            flags |= IPADDR_LPM_FILTER;
+        if (ctx->batch && ctx->reload)
+            flags |= IPADDR_LPM_WATCH;
+
+        size_t lineno;
+        const char *errmsg;
+        int rc = ipaddr_lpm_open(path, flags, &t->handle, &lineno, &errmsg);
+        if (rc != IPADDR_OK) {
+            if (lineno > 0)
+                fprintf(stderr, "lookup: %s:%zu: %s\n", path, lineno, errmsg);
+            else
+                fprintf(stderr, "lookup: %s: %s\n", path, errmsg);
+            return rc;
+        }
+    }
+
+    if (t->handle == NULL)
+        return IPADDR_ERR_USAGE;
+    *handle = t->handle;
+    return IPADDR_OK;
+}
+
+/*
+ * Close all prefix tables.
+ */
+static void free_tables(void)
+{
+    while (tables != NULL) {
+        table_cache_t *next = tables->next;
+        ipaddr_lpm_close(tables->handle);
+        free(tables);
+        tables = next;
+    }
+}
+
+static int cmd_lookup(ipaddr_ctx_t *ctx)
+{
+    const char *path = next_arg(ctx);
+    if (path == NULL) {
+        fprintf(stderr, "lookup: requires FILE argument\n");
+        return IPADDR_ERR_USAGE;
+    }
+
+    ipaddr_lpm_handle_t *handle;
+    int rc = get_table(ctx, path, &handle);
+    if (rc != IPADDR_OK)
+        return rc;
+
+    unsigned token;
+    const ipaddr_lpm_t *lpm = ipaddr_lpm_acquire(handle, &token);
+    ipaddr_lpm_result_t res;
+
+    if (prelookup != NULL)
+        res = *prelookup;
+    else
+        res.rc = ipaddr_lpm_lookup(lpm, &ctx->current, &res.match, &res.value);
+    prelookup = NULL;
+
+    rc = res.rc;
+    if (rc == IPADDR_OK && !ctx->silent)
+        rc = print_addr(ctx, &res.match, true, res.value);
+    ipaddr_lpm_release(handle, token);
     if (rc != IPADDR_OK)
         return rc;
-    if (!ctx->silent)
-        printf("%s\n", buf);
 
     /* Update current for chaining */
-    ctx->current = result;
+    ctx->current = res.match;
 
     return IPADDR_OK;
 }
@@ -616,7 +1246,7 @@ static int cmd_in(ipaddr_ctx_t *ctx)
     int rc = parse_second_addr(ctx, &other);
     if (rc != IPADDR_OK)
         return rc;
-    return ipaddr_in(&ctx->current, &other) ? IPADDR_OK : IPADDR_ERR_BOOL;
+    return bool_result(ctx, ipaddr_in(&ctx->current, &other));
 }
 
 static int cmd_contains(ipaddr_ctx_t *ctx)
@@ -625,7 +1255,7 @@ static int cmd_contains(ipaddr_ctx_t *ctx)
     int rc = parse_second_addr(ctx, &other);
     if (rc != IPADDR_OK)
         return rc;
-    return ipaddr_contains(&ctx->current, &other) ? IPADDR_OK : IPADDR_ERR_BOOL;
+    return bool_result(ctx, ipaddr_contains(&ctx->current, &other));
 }
 
 static int cmd_overlaps(ipaddr_ctx_t *ctx)
@@ -634,7 +1264,7 @@ static int cmd_overlaps(ipaddr_ctx_t *ctx)
     int rc = parse_second_addr(ctx, &other);
     if (rc != IPADDR_OK)
         return rc;
-    return ipaddr_overlaps(&ctx->current, &other) ? IPADDR_OK : IPADDR_ERR_BOOL;
+    return bool_result(ctx, ipaddr_overlaps(&ctx->current, &other));
 }
 
 static int cmd_eq(ipaddr_ctx_t *ctx)
@@ -643,7 +1273,7 @@ static int cmd_eq(ipaddr_ctx_t *ctx)
     int rc = parse_second_addr(ctx, &other);
     if (rc != IPADDR_OK)
         return rc;
-    return (ipaddr_cmp(&ctx->current, &other) == 0) ? IPADDR_OK : IPADDR_ERR_BOOL;
+    return bool_result(ctx, ipaddr_cmp(&ctx->current, &other) == 0);
 }
 
 static int cmd_ne(ipaddr_ctx_t *ctx)
@@ -652,7 +1282,7 @@ static int cmd_ne(ipaddr_ctx_t *ctx)
     int rc = parse_second_addr(ctx, &other);
     if (rc != IPADDR_OK)
         return rc;
-    return (ipaddr_cmp(&ctx->current, &other) != 0) ? IPADDR_OK : IPADDR_ERR_BOOL;
+    return bool_result(ctx, ipaddr_cmp(&ctx->current, &other) != 0);
 }
 
 static int cmd_lt(ipaddr_ctx_t *ctx)
@@ -661,7 +1291,7 @@ static int cmd_lt(ipaddr_ctx_t *ctx)
     int rc = parse_second_addr(ctx, &other);
     if (rc != IPADDR_OK)
         return rc;
-    return (ipaddr_cmp(&ctx->current, &other) < 0) ? IPADDR_OK : IPADDR_ERR_BOOL;
+    return bool_result(ctx, ipaddr_cmp(&ctx->current, &other) < 0);
 }
 
 static int cmd_le(ipaddr_ctx_t *ctx)
@@ -670,7 +1300,7 @@ static int cmd_le(ipaddr_ctx_t *ctx)
     int rc = parse_second_addr(ctx, &other);
     if (rc != IPADDR_OK)
         return rc;
-    return (ipaddr_cmp(&ctx->current, &other) <= 0) ? IPADDR_OK : IPADDR_ERR_BOOL;
+    return bool_result(ctx, ipaddr_cmp(&ctx->current, &other) <= 0);
 }
 
 static int cmd_gt(ipaddr_ctx_t *ctx)
@@ -679,7 +1309,7 @@ static int cmd_gt(ipaddr_ctx_t *ctx)
     int rc = parse_second_addr(ctx, &other);
     if (rc != IPADDR_OK)
         return rc;
-    return (ipaddr_cmp(&ctx->current, &other) > 0) ? IPADDR_OK : IPADDR_ERR_BOOL;
+    return bool_result(ctx, ipaddr_cmp(&ctx->current, &other) > 0);
 }
 
 static int cmd_ge(ipaddr_ctx_t *ctx)
@@ -688,62 +1318,422 @@ static int cmd_ge(ipaddr_ctx_t *ctx)
     int rc = parse_second_addr(ctx, &other);
     if (rc != IPADDR_OK)
         return rc;
-    return (ipaddr_cmp(&ctx->current, &other) >= 0) ? IPADDR_OK : IPADDR_ERR_BOOL;
+    return bool_result(ctx, ipaddr_cmp(&ctx->current, &other) >= 0);
 }
 
+static int cmd_distance(ipaddr_ctx_t *ctx)
+{
+    ipaddr_t other;
+    int rc = parse_second_addr(ctx, &other);
+    if (rc != IPADDR_OK)
+        return rc;
+
+    uint128_t dist;
+    bool negative;
+    if (ipaddr_distance(&ctx->current, &other, &dist, &negative) != IPADDR_OK) {
+        fprintf(stderr, "distance: address families differ\n");
+        return IPADDR_ERR_USAGE;
+    }
+
+    char buf[IPADDR_UINT128_STRLEN];
+    uint128_to_str(dist, buf, sizeof(buf));
+    printf("%s%s\n", negative ? "-" : "", buf);
+    return IPADDR_OK;
+}
+
+/* ========== Aggregate Commands ========== */
+
 /*
- * Main entry point.
+ * Aggregate commands end a chain.  Instead of printing each address, they
+ * collect the addresses of the whole run and print the result once all
+ * input has been read (see finish_aggregate()).
  */
-int main(int argc, char **argv)
+static struct {
+    ipaddr_sorter_t  *sorter;
+    bool              collapse;
+    ipaddr_heatmap_t *heatmap;
+    const char       *heatmap_path;
+    FILE             *heatmap_fp;
+    int               heatmap_format;
+    ipaddr_reservoir_t *reservoir;
+} aggregate;
+
+/*
+ * Check whether a command is an aggregate command.
+ */
+static bool is_aggregate(const cmd_t *cmd)
 {
-    ipaddr_ctx_t ctx = { 0 };
-    int opt;
-    int rc;
+    return cmd->handler == cmd_sort || cmd->handler == cmd_uniq ||
+           cmd->handler == cmd_collapse || cmd->handler == cmd_heatmap ||
+           cmd->handler == cmd_reservoir;
+}
 
-    /* Parse options ('+' forces POSIX behavior: stop at first non-option) */
-    while ((opt = getopt(argc, argv, "+Mh")) != -1) {
-        switch (opt) {
-        case 'M':
-            ctx.netmask_mode = true;
-            break;
-        case 'h':
-            usage(argv[0]);
-            return 0;
-        default:
-            usage(argv[0]);
-            return IPADDR_ERR_USAGE;
+/*
+ * Add the current address to the aggregate, creating it on first use.
+ */
+static int aggregate_add(ipaddr_ctx_t *ctx, int flags, bool collapse)
+{
+    if (aggregate.sorter == NULL) {
+        aggregate.sorter = ipaddr_sorter_new(ctx->memory_limit, flags);
+        if (aggregate.sorter == NULL) {
+            fprintf(stderr, "Error: out of memory\n");
+            return IPADDR_ERR_INTERNAL;
         }
+        aggregate.collapse = collapse;
     }
 
-    argc -= optind;
-    argv += optind;
+    ipaddr_t addr = ctx->current;
+    if (collapse) {
+        /* Networks are merged regardless of zone */
+        ipaddr_network(&ctx->current, &addr);
+        if (ipaddr_is_ipv6(&addr))
+            addr.addr.sin6.sin6_scope_id = 0;
+    }
 
-    if (argc < 1) {
-        fprintf(stderr, "Error: address required\n");
-        usage(argv[0] ? argv[0] : "ipaddr");
+    int rc = ipaddr_sorter_add(aggregate.sorter, &addr);
+    if (rc != IPADDR_OK)
+        fprintf(stderr, "Error: spilling to temporary file: %s\n", strerror(errno));
+    return rc;
+}
+
+static int cmd_sort(ipaddr_ctx_t *ctx)
+{
+    return aggregate_add(ctx, 0, false);
+}
+
+static int cmd_uniq(ipaddr_ctx_t *ctx)
+{
+    return aggregate_add(ctx, IPADDR_SORT_UNIQ, false);
+}
+
+static int cmd_collapse(ipaddr_ctx_t *ctx)
+{
+    return aggregate_add(ctx, IPADDR_SORT_UNIQ, true);
+}
+
+/*
+ * Parse the options of heatmap and create the map of the run, with its
+ * image file open so that a bad path shows before any input is read.
+ */
+static int heatmap_open(int argc, char **argv)
+{
+    const char *out = NULL, *net_arg = "0.0.0.0/0", *prefix_arg = NULL;
+    const char *errmsg;
+
+    /* --out FILE [--prefix /N] [--net NET], in any order */
+    for (; argc > 0; argc -= 2, argv += 2) {
+        const char **val;
+        if (strcmp(argv[0], "--out") == 0) {
+            val = &out;
+        } else if (strcmp(argv[0], "--prefix") == 0) {
+            val = &prefix_arg;
+        } else if (strcmp(argv[0], "--net") == 0) {
+            val = &net_arg;
+        } else {
+            fprintf(stderr, "heatmap: unknown option '%s'\n", argv[0]);
+            return IPADDR_ERR_USAGE;
+        }
+        if (argc < 2) {
+            fprintf(stderr, "heatmap: %s requires an argument\n", argv[0]);
+            return IPADDR_ERR_USAGE;
+        }
+        *val = argv[1];
+    }
+    if (out == NULL) {
+        fprintf(stderr, "heatmap: --out required\n");
         return IPADDR_ERR_USAGE;
     }
 
-    /* Parse initial address */
-    const char *errmsg;
-    rc = ipaddr_parse(argv[0], &ctx.current, &errmsg);
+    const char *ext = strrchr(out, '.');
+    if (ext != NULL && strcasecmp(ext, ".png") == 0) {
+        aggregate.heatmap_format = IPADDR_HEATMAP_PNG;
+    } else if (ext != NULL && strcasecmp(ext, ".ppm") == 0) {
+        aggregate.heatmap_format = IPADDR_HEATMAP_PPM;
+    } else {
+        fprintf(stderr, "heatmap: %s: unknown image type, use .png or .ppm\n", out);
+        return IPADDR_ERR_USAGE;
+    }
+
+    ipaddr_t net;
+    int rc = ipaddr_parse(net_arg, &net, &errmsg);
     if (rc != IPADDR_OK) {
-        fprintf(stderr, "Error: %s: %s\n", argv[0], errmsg);
+        fprintf(stderr, "heatmap: invalid network '%s': %s\n", net_arg, errmsg);
         return rc;
     }
+    ipaddr_network(&net, &net);
+    int max_bits = ipaddr_max_prefix(&net);
+
+    /* By default 256 x 256 cells, or as many as fit */
+    long len = net.prefix_len + 16;
+    if (len > max_bits)
+        len = net.prefix_len + ((max_bits - net.prefix_len) & ~1);
+    if (prefix_arg != NULL) {
+        char *end;
+        const char *digits = prefix_arg + (*prefix_arg == '/');
+        len = strtol(digits, &end, 10);
+        if (!isdigit((unsigned char)*digits) || *end != '\0' ||
+            len > max_bits) {
+            fprintf(stderr, "heatmap: invalid prefix '%s'\n", prefix_arg);
+            return IPADDR_ERR_USAGE;
+        }
+    }
+    if (len < net.prefix_len || (len - net.prefix_len) % 2 != 0 ||
+        len - net.prefix_len > IPADDR_HEATMAP_MAX_BITS) {
+        fprintf(stderr, "heatmap: /%ld cells need an even number of bits, "
+                "at most %d, past /%d\n", len, IPADDR_HEATMAP_MAX_BITS,
+                net.prefix_len);
+        return IPADDR_ERR_USAGE;
+    }
 
-    /* Set up remaining args for command processing */
-    ctx.argc = argc - 1;
-    ctx.argv = argv + 1;
+    aggregate.heatmap = ipaddr_heatmap_new(&net, (int)len);
+    if (aggregate.heatmap == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        return IPADDR_ERR_INTERNAL;
+    }
+    aggregate.heatmap_fp = fopen(out, "wb");
+    if (aggregate.heatmap_fp == NULL) {
+        fprintf(stderr, "heatmap: %s: %s\n", out, strerror(errno));
+        ipaddr_heatmap_free(aggregate.heatmap);
+        aggregate.heatmap = NULL;
+        return IPADDR_ERR_USAGE;
+    }
+    aggregate.heatmap_path = out;
+    return IPADDR_OK;
+}
+
+static int cmd_heatmap(ipaddr_ctx_t *ctx)
+{
+    if (aggregate.heatmap == NULL) {
+        int rc = heatmap_open(ctx->argc, ctx->argv);
+        if (rc != IPADDR_OK)
+            return rc;
+    }
+
+    /* The options were taken by heatmap_open() */
+    ctx->argv += ctx->argc;
+    ctx->argc = 0;
+    ipaddr_heatmap_add(aggregate.heatmap, &ctx->current);
+    return IPADDR_OK;
+}
+
+/*
+ * Draw the map of the run to its image file.
+ */
+static int finish_heatmap(void)
+{
+    int rc = ipaddr_heatmap_write(aggregate.heatmap, aggregate.heatmap_format,
+                                  aggregate.heatmap_fp);
+    if (fclose(aggregate.heatmap_fp) != 0)
+        rc = IPADDR_ERR_INTERNAL;
+    if (rc != IPADDR_OK)
+        fprintf(stderr, "Error: writing %s: %s\n", aggregate.heatmap_path,
+                strerror(errno));
+    ipaddr_heatmap_free(aggregate.heatmap);
+    aggregate.heatmap = NULL;
+    return rc;
+}
+
+/*
+ * Parse the arguments of reservoir and create the reservoir of the run.
+ */
+static int reservoir_open(int argc, char **argv)
+{
+    const char *arg = argv[0];
+    char *end;
+    errno = 0;
+    unsigned long long k = strtoull(arg, &end, 10);
+    if (!isdigit((unsigned char)*arg) || *end != '\0' || errno != 0 ||
+        k == 0 || k > SIZE_MAX / sizeof(ipaddr_t)) {
+        fprintf(stderr, "reservoir: invalid count '%s'\n", arg);
+        return IPADDR_ERR_USAGE;
+    }
+
+    /* [--by-prefix N] [--seed S], in any order */
+    int prefix_len = -1;
+    uint64_t seed = time_seed();
+    for (argc--, argv++; argc > 0; argc -= 2, argv += 2) {
+        bool by_prefix = strcmp(argv[0], "--by-prefix") == 0;
+        if (!by_prefix && strcmp(argv[0], "--seed") != 0) {
+            fprintf(stderr, "reservoir: unknown option '%s'\n", argv[0]);
+            return IPADDR_ERR_USAGE;
+        }
+        if (argc < 2) {
+            fprintf(stderr, "reservoir: %s requires an argument\n", argv[0]);
+            return IPADDR_ERR_USAGE;
+        }
+        if (!by_prefix) {
+            if (parse_seed("reservoir", argv[1], &seed) != IPADDR_OK)
+                return IPADDR_ERR_USAGE;
+            continue;
+        }
+        const char *digits = argv[1] + (argv[1][0] == '/');
+        long len = strtol(digits, &end, 10);
+        if (!isdigit((unsigned char)*digits) || *end != '\0' || len > 128) {
+            fprintf(stderr, "reservoir: invalid prefix '%s'\n", argv[1]);
+            return IPADDR_ERR_USAGE;
+        }
+        prefix_len = (int)len;
+    }
+
+    aggregate.reservoir = ipaddr_reservoir_new((size_t)k, prefix_len, seed);
+    if (aggregate.reservoir == NULL) {
+        fprintf(stderr, "Error: out of memory\n");
+        return IPADDR_ERR_INTERNAL;
+    }
+    return IPADDR_OK;
+}
+
+static int cmd_reservoir(ipaddr_ctx_t *ctx)
+{
+    if (aggregate.reservoir == NULL) {
+        int rc = reservoir_open(ctx->argc, ctx->argv);
+        if (rc != IPADDR_OK)
+            return rc;
+    }
+
+    /* The arguments were taken by reservoir_open() */
+    ctx->argv += ctx->argc;
+    ctx->argc = 0;
+    if (ipaddr_reservoir_add(aggregate.reservoir, &ctx->current) != IPADDR_OK) {
+        fprintf(stderr, "Error: out of memory\n");
+        return IPADDR_ERR_INTERNAL;
+    }
+    return IPADDR_OK;
+}
 
+/*
+ * Print an address kept by the reservoir.
+ */
+static void print_kept(const ipaddr_t *addr, void *arg)
+{
+    ipaddr_ctx_t *ctx = arg;
+
+    ctx->current = *addr;
+    cmd_default(ctx);
+}
+
+/*
+ * Print the sample of the run.
+ */
+static int finish_reservoir(ipaddr_ctx_t *ctx)
+{
+    int rc = ipaddr_reservoir_walk(aggregate.reservoir, print_kept, ctx);
+    if (rc != IPADDR_OK)
+        fprintf(stderr, "Error: out of memory\n");
+    ipaddr_reservoir_free(aggregate.reservoir);
+    aggregate.reservoir = NULL;
+    return rc;
+}
+
+/*
+ * Print one network of a collapsed range.
+ */
+static void print_net(const ipaddr_t *net, void *arg)
+{
+    const ipaddr_ctx_t *ctx = arg;
+
+    print_addr(ctx, net, true, NULL);
+}
+
+/*
+ * Print the sorted networks of the aggregate as the fewest networks that
+ * cover them: overlapping and adjacent networks are merged into ranges,
+ * and each range is split back into networks.
+ */
+static int print_collapsed(ipaddr_ctx_t *ctx)
+{
+    ipaddr_t net, first, last, end;
+    bool have_range = false;
+    int rc;
+
+    while ((rc = ipaddr_sorter_next(aggregate.sorter, &net)) == IPADDR_OK) {
+        ipaddr_broadcast(&net, &end);
+
+        if (have_range && ipaddr_family(&net) == ipaddr_family(&last)) {
+            uint128_t hi = ipaddr_to_uint128(&last);
+            uint128_t all_ones = (uint128_t)-1 >> (128 - ipaddr_max_prefix(&last));
+            if (hi == all_ones || ipaddr_to_uint128(&net) <= hi + 1) {
+                if (ipaddr_to_uint128(&end) > hi)
+                    last = end;
+                continue;
+            }
+        }
+
+        if (have_range)
+            ipaddr_summarize(&first, &last, print_net, ctx);
+        first = net;
+        last = end;
+        have_range = true;
+    }
+
+    if (have_range)
+        ipaddr_summarize(&first, &last, print_net, ctx);
+    return rc;
+}
+
+/*
+ * Print the result of the aggregate command of the run, if any.
+ */
+static int finish_aggregate(ipaddr_ctx_t *ctx)
+{
+    if (aggregate.heatmap != NULL)
+        return finish_heatmap();
+    if (aggregate.reservoir != NULL)
+        return finish_reservoir(ctx);
+    if (aggregate.sorter == NULL)
+        return IPADDR_OK;
+
+    int rc;
+    if (aggregate.collapse) {
+        rc = print_collapsed(ctx);
+    } else {
+        ipaddr_t addr;
+        while ((rc = ipaddr_sorter_next(aggregate.sorter, &addr)) == IPADDR_OK) {
+            ctx->current = addr;
+            cmd_default(ctx);
+        }
+    }
+
+    if (rc == IPADDR_ERR_BOOL) {
+        rc = IPADDR_OK;
+    } else {
+        fprintf(stderr, "Error: reading temporary file: %s\n", strerror(errno));
+    }
+    ipaddr_sorter_free(aggregate.sorter);
+    aggregate.sorter = NULL;
+    return rc;
+}
+
+/*
+ * Check whether a command prints something other than addresses, which
+ * cannot be written as binary records.
+ */
+static bool prints_text(const cmd_t *cmd)
+{
+    return cmd->handler == cmd_version || cmd->handler == cmd_packed ||
+           cmd->handler == cmd_to_int || cmd->handler == cmd_reverse_pointer ||
+           cmd->handler == cmd_prefix_length ||
+           cmd->handler == cmd_num_addresses ||
+           cmd->handler == cmd_host_index || cmd->handler == cmd_distance ||
+           cmd->handler == cmd_zone_id ||
+           cmd->handler == cmd_scope_id || cmd->handler == cmd_table_diff ||
+           cmd->handler == cmd_reverse_zone || cmd->handler == cmd_conflicts ||
+           cmd->handler == cmd_coverage || cmd->handler == cmd_heatmap;
+}
+
+/*
+ * Run the remaining commands in ctx against ctx->current.
+ */
+static int run_chain(ipaddr_ctx_t *ctx)
+{
     /* If no commands, just print normalized address */
-    if (ctx.argc == 0) {
-        return cmd_default(&ctx);
+    if (ctx->argc == 0) {
+        return cmd_default(ctx);
     }
 
     /* Process commands */
-    while (ctx.argc > 0) {
-        const char *cmd_name = next_arg(&ctx);
+    while (ctx->argc > 0) {
+        const char *cmd_name = next_arg(ctx);
         const cmd_t *cmd = find_command(cmd_name);
 
         if (cmd == NULL) {
@@ -752,32 +1742,40 @@ int main(int argc, char **argv)
         }
 
         /* Check for required prefix */
-        if (cmd->needs_prefix && !ctx.current.has_prefix) {
+        if (cmd->needs_prefix && !ctx->current.has_prefix) {
             fprintf(stderr, "Error: %s requires an address with prefix (e.g., /24)\n",
                     cmd_name);
             return IPADDR_ERR_USAGE;
         }
 
         /* Check argument count */
-        if (ctx.argc < cmd->min_args) {
+        if (ctx->argc < cmd->min_args) {
             fprintf(stderr, "Error: %s requires %d argument(s)\n",
                     cmd_name, cmd->min_args);
             return IPADDR_ERR_USAGE;
         }
+        if (is_aggregate(cmd) && ctx->argc > cmd->max_args) {
+            fprintf(stderr, "Error: %s must be the last command\n", cmd_name);
+            return IPADDR_ERR_USAGE;
+        }
+        if (ctx->output_format != IPADDR_FORMAT_TEXT && prints_text(cmd)) {
+            fprintf(stderr, "Error: %s does not print addresses\n", cmd_name);
+            return IPADDR_ERR_USAGE;
+        }
 
         /*
          * For chainable commands, suppress output if there are more commands
          * after this one's arguments. We peek ahead to check.
          */
         if (cmd->chainable) {
-            int args_remaining = ctx.argc - cmd->min_args;
-            ctx.silent = (args_remaining > 0);
+            int args_remaining = ctx->argc - cmd->min_args;
+            ctx->silent = (args_remaining > 0);
         } else {
-            ctx.silent = false;
+            ctx->silent = false;
         }
 
         /* Execute command */
-        rc = cmd->handler(&ctx);
+        int rc = cmd->handler(ctx);
         if (rc != IPADDR_OK) {
             return rc;
         }
@@ -785,3 +1783,1441 @@ int main(int argc, char **argv)
 
     return IPADDR_OK;
 }
+
+/*
+ * Check command names and argument counts of a chain before running it
+ * for every address of a batch.
+ */
+static int check_chain(const ipaddr_ctx_t *ctx, int argc, char **argv)
+{
+    while (argc > 0) {
+        const cmd_t *cmd = find_command(argv[0]);
+        if (cmd == NULL) {
+            fprintf(stderr, "Error: unknown command '%s'\n", argv[0]);
+            return IPADDR_ERR_USAGE;
+        }
+        if (argc - 1 < cmd->min_args) {
+            fprintf(stderr, "Error: %s requires %d argument(s)\n",
+                    argv[0], cmd->min_args);
+            return IPADDR_ERR_USAGE;
+        }
+        if (is_aggregate(cmd) && argc - 1 > cmd->max_args) {
+            fprintf(stderr, "Error: %s must be the last command\n", argv[0]);
+            return IPADDR_ERR_USAGE;
+        }
+        if (ctx->output_format != IPADDR_FORMAT_TEXT && prints_text(cmd)) {
+            fprintf(stderr, "Error: %s does not print addresses\n", argv[0]);
+            return IPADDR_ERR_USAGE;
+        }
+        /*
+         * The rest are the options of heatmap or reservoir, which are set up
+         * here, so that an empty input still draws a map
+         */
+        if (cmd->handler == cmd_heatmap)
+            return heatmap_open(argc - 1, argv + 1);
+        if (cmd->handler == cmd_reservoir)
+            return reservoir_open(argc - 1, argv + 1);
+        int nargs = cmd->min_args;
+        if (cmd->handler == cmd_hosts) {
+            hosts_opts_t o;
+            nargs = parse_hosts_opts(argc - 1, argv + 1, &o);
+        } else if (cmd->handler == cmd_sample) {
+            size_t n;
+            uint64_t seed;
+            nargs = parse_sample_args(argc - 1, argv + 1, &n, &seed);
+        }
+        if (nargs < 0)
+            return IPADDR_ERR_USAGE;
+        argc -= 1 + nargs;
+        argv += 1 + nargs;
+    }
+    return IPADDR_OK;
+}
+
+/*
+ * A line of a batch, read ahead of running the chain for it.
+ */
+typedef struct {
+    const char *text;     /* trimmed address text, in the chunk's arena */
+    size_t      lineno;
+    const char *errmsg;   /* parse error, or NULL if parsed into keys */
+} batch_line_t;
+
+/*
+ * Read the next address line (skipping blank lines and comments) into l,
+ * with its text copied into arena.
+ *
+ * Returns: 0 on success, 1 at the end of input, 3 if out of memory.
+ */
+static int read_batch_line(FILE *fp, char **buf, size_t *cap,
+                            ipaddr_arena_t *arena, batch_line_t *l,
+                            size_t *lineno)
+{
+    while (getline(buf, cap, fp) != -1) {
+        (*lineno)++;
+
+        /* Trim whitespace; skip blank lines and comments */
+        char *s = *buf;
+        while (isspace((unsigned char)*s))
+            s++;
+        char *end = s + strlen(s);
+        while (end > s && isspace((unsigned char)end[-1]))
+            *--end = '\0';
+        if (*s == '\0' || *s == '#')
+            continue;
+
+        l->text = ipaddr_arena_strdup(arena, s);
+        l->lineno = *lineno;
+        return (l->text != NULL) ? IPADDR_OK : IPADDR_ERR_INTERNAL;
+    }
+    return IPADDR_ERR_BOOL;
+}
+
+/*
+ * Whether the next line (or, with records, the next binary record) can be
+ * read from fp without waiting for the writer: stdio already holds all of
+ * it, or the descriptor has data or is at end of file.  Where the stdio
+ * buffer cannot be inspected only the descriptor is polled, which may end
+ * a chunk early but never makes it wait.
+ */
+static bool batch_input_ready(FILE *fp, bool records)
+{
+    const char *p = NULL;
+    size_t len = 0;
+#if defined(__GLIBC__)
+    p = fp->_IO_read_ptr;
+    len = (size_t)(fp->_IO_read_end - fp->_IO_read_ptr);
+#elif defined(__APPLE__) || defined(__FreeBSD__)
+    p = (const char *)fp->_p;
+    len = (fp->_r > 0) ? (size_t)fp->_r : 0;
+#endif
+    if (records ? len >= IPADDR_RECORD_SIZE
+                : len > 0 && memchr(p, '\n', len) != NULL)
+        return true;
+
+    struct pollfd pfd = { .fd = fileno(fp), .events = POLLIN };
+    return poll(&pfd, 1, 0) > 0;
+}
+
+/*
+ * Read the next binary record into key.  Payloads are ignored.
+ *
+ * Returns: 0 on success, 1 at the end of input, 2 or 3 on error.
+ */
+static int read_batch_record(FILE *fp, const char *path, ipaddr_t *key,
+                             batch_line_t *l, size_t *lineno)
+{
+    const char *errmsg;
+    int rc = ipaddr_record_read(fp, key, NULL, NULL, &errmsg);
+
+    (*lineno)++;
+    if (rc == IPADDR_OK) {
+        l->text = NULL;
+        l->lineno = *lineno;
+    } else if (rc == IPADDR_ERR_USAGE) {
+        /* Records have no separators to resynchronize on */
+        fprintf(stderr, "Error: %s: record %zu: %s\n", path, *lineno, errmsg);
+    }
+    return rc;
+}
+
+/*
+ * Read the next non-null value of a Parquet column into key.  batch and
+ * pos track the position in the column; text for errors is copied into
+ * arena.
+ *
+ * Returns: 0 on success, 1 at the end of the column, 2 or 3 on error.
+ */
+static int read_batch_value(ipaddr_parquet_t *pq, const char *path,
+                            const ipaddr_parquet_batch_t **batch, size_t *pos,
+                            ipaddr_arena_t *arena, ipaddr_t *key,
+                            batch_line_t *l)
+{
+    for (;;) {
+        const ipaddr_parquet_batch_t *b = *batch;
+        if (b == NULL || *pos == b->n) {
+            const char *errmsg;
+            int rc = ipaddr_parquet_next(pq, batch, &errmsg);
+            *pos = 0;
+            if (rc != IPADDR_OK) {
+                *batch = NULL;
+                if (rc != IPADDR_ERR_BOOL)
+                    fprintf(stderr, "Error: %s: %s\n", path, errmsg);
+                return rc;
+            }
+            continue;
+        }
+
+        size_t i = (*pos)++;
+        if (b->errmsg[i] == NULL && b->addrs[i].addr.sa.sa_family == AF_UNSPEC)
+            continue;   /* null */
+
+        l->lineno = b->first_row + i + 1;
+        l->errmsg = b->errmsg[i];
+        l->text = NULL;
+        if (l->errmsg == NULL) {
+            *key = b->addrs[i];
+        } else {
+            l->text = ipaddr_arena_strdup(arena, b->text[i] ? b->text[i] : "");
+            if (l->text == NULL) {
+                fprintf(stderr, "Error: %s: out of memory\n", path);
+                return IPADDR_ERR_INTERNAL;
+            }
+        }
+        return IPADDR_OK;
+    }
+}
+
+/*
+ * Read the next address of a packet capture into key.
+ *
+ * Returns: 0 on success, 1 at the end of the capture, 2 or 3 on error.
+ */
+static int read_batch_packet(ipaddr_pcap_t *pc, const char *path,
+                             ipaddr_t *key, batch_line_t *l)
+{
+    const char *errmsg;
+    size_t packet;
+    int rc = ipaddr_pcap_next(pc, key, &packet, &errmsg);
+
+    if (rc == IPADDR_OK) {
+        l->text = NULL;
+        l->lineno = packet;
+        l->errmsg = NULL;
+    } else if (rc != IPADDR_ERR_BOOL) {
+        fprintf(stderr, "Error: %s: packet %zu: %s\n", path, packet, errmsg);
+    }
+    return rc;
+}
+
+/*
+ * Read the next address of a flow export into key.
+ *
+ * Returns: 0 on success, 1 at the end of the export, 2 or 3 on error.
+ */
+static int read_batch_flow(ipaddr_flow_t *fl, const char *path,
+                           ipaddr_t *key, batch_line_t *l)
+{
+    const char *errmsg;
+    size_t message;
+    int rc = ipaddr_flow_next(fl, key, &message, &errmsg);
+
+    if (rc == IPADDR_OK) {
+        l->text = NULL;
+        l->lineno = message;
+        l->errmsg = NULL;
+    } else if (rc != IPADDR_ERR_BOOL) {
+        fprintf(stderr, "Error: %s: message %zu: %s\n", path, message, errmsg);
+    }
+    return rc;
+}
+
+/*
+ * Run the command chain for every address read from path ("-" for stdin).
+ *
+ * Addresses are read BATCH_CHUNK at a time.  If the chain starts with
+ * lookup, the whole chunk is looked up at once with
+ * ipaddr_lpm_lookup_batch() before the chain runs for each address.  From
+ * a pipe or terminal, a chunk takes only what can be read without waiting,
+ * so that results are never held back waiting for more input.
+ *
+ * With -I bin, the input is a stream of binary records rather than lines;
+ * with -I parquet, it is a column of a Parquet file; with -I pcap, the
+ * packets of a capture; with -I flow, the records of a flow export.
+ *
+ * Returns 0 if the chain succeeded for at least one address, 1 if it
+ * failed a test for all of them, 2 if any line could not be processed.
+ */
+static int run_batch(ipaddr_ctx_t *ctx, const char *path)
+{
+    int argc = ctx->argc;
+    char **argv = ctx->argv;
+    int rc = check_chain(ctx, argc, argv);
+    if (rc != IPADDR_OK)
+        return rc;
+
+    ipaddr_lpm_handle_t *handle = NULL;
+    if (argc > 1 && find_command(argv[0])->handler == cmd_lookup) {
+        rc = get_table(ctx, argv[1], &handle);
+        if (rc != IPADDR_OK)
+            return rc;
+    }
+
+    FILE *fp = stdin;
+    ipaddr_parquet_t *pq = NULL;
+    ipaddr_pcap_t *pc = NULL;
+    ipaddr_flow_t *fl = NULL;
+    if (ctx->input_format == IPADDR_FORMAT_PARQUET) {
+        const char *errmsg;
+        rc = ipaddr_parquet_open(path, ctx->column, &pq, &errmsg);
+        if (rc != IPADDR_OK) {
+            fprintf(stderr, "Error: %s: %s\n", path, errmsg);
+            return rc;
+        }
+        fp = NULL;
+    } else if (ctx->input_format == IPADDR_FORMAT_PCAP) {
+        const char *errmsg;
+        rc = ipaddr_pcap_open(path, ctx->pcap, &pc, &errmsg);
+        if (rc != IPADDR_OK) {
+            fprintf(stderr, "Error: %s: %s\n", path, errmsg);
+            return rc;
+        }
+        fp = NULL;
+    } else if (ctx->input_format == IPADDR_FORMAT_FLOW) {
+        const char *errmsg;
+        rc = ipaddr_flow_open(path, ctx->flow, &fl, &errmsg);
+        if (rc != IPADDR_OK) {
+            fprintf(stderr, "Error: %s: %s\n", path, errmsg);
+            return rc;
+        }
+        fp = NULL;
+    } else if (strcmp(path, "-") != 0) {
+        fp = fopen(path, "r");
+        if (fp == NULL) {
+            fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+            return IPADDR_ERR_USAGE;
+        }
+    }
+
+    struct stat st;
+    bool follow = (fp != NULL &&
+                   !(fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode)));
+
+    ipaddr_arena_t *arena = ipaddr_arena_thread();
+    if (arena == NULL) {
+        if (fp != NULL && fp != stdin)
+            fclose(fp);
+        ipaddr_parquet_close(pq);
+        ipaddr_pcap_close(pc);
+        ipaddr_flow_close(fl);
+        return IPADDR_ERR_INTERNAL;
+    }
+
+    char *buf = NULL;
+    size_t cap = 0;
+    batch_line_t lines[BATCH_CHUNK];
+    ipaddr_t keys[BATCH_CHUNK];
+    ipaddr_lpm_result_t results[BATCH_CHUNK];
+    const ipaddr_parquet_batch_t *pq_batch = NULL;
+    size_t pq_pos = 0;
+    size_t lineno = 0;
+    bool matched = false;
+    bool failed = false;
+    bool eof = false;
+
+    while (!eof) {
+        size_t n = 0;
+        size_t nkeys = 0;
+
+        ipaddr_arena_reset(arena);
+        while (n < BATCH_CHUNK && !eof) {
+            /* Run what we have rather than wait for more */
+            if (n > 0 && follow &&
+                !batch_input_ready(fp, ctx->input_format == IPADDR_FORMAT_BIN))
+                break;
+
+            batch_line_t *l = &lines[n];
+            if (pq != NULL) {
+                rc = read_batch_value(pq, path, &pq_batch, &pq_pos, arena,
+                                      &keys[nkeys], l);
+                if (rc != IPADDR_OK) {
+                    failed |= (rc != IPADDR_ERR_BOOL);
+                    eof = true;
+                    break;
+                }
+                if (l->errmsg == NULL)
+                    nkeys++;
+                n++;
+                continue;
+            }
+            if (pc != NULL || fl != NULL) {
+                rc = (pc != NULL) ? read_batch_packet(pc, path, &keys[nkeys], l)
+                                  : read_batch_flow(fl, path, &keys[nkeys], l);
+                if (rc != IPADDR_OK) {
+                    failed |= (rc != IPADDR_ERR_BOOL);
+                    eof = true;
+                    break;
+                }
+                nkeys++;
+                n++;
+                continue;
+            }
+            if (ctx->input_format == IPADDR_FORMAT_BIN) {
+                rc = read_batch_record(fp, path, &keys[nkeys], l, &lineno);
+                if (rc != IPADDR_OK) {
+                    failed |= (rc == IPADDR_ERR_USAGE);
+                    eof = true;
+                    break;
+                }
+                l->errmsg = NULL;
+                nkeys++;
+                n++;
+                continue;
+            }
+
+            rc = read_batch_line(fp, &buf, &cap, arena, l, &lineno);
+            if (rc != IPADDR_OK) {
+                if (rc == IPADDR_ERR_INTERNAL) {
+                    fprintf(stderr, "Error: %s:%zu: out of memory\n", path, lineno);
+                    failed = true;
+                }
+                eof = true;
+                break;
+            }
+            l->errmsg = NULL;
+            if (ipaddr_parse(l->text, &keys[nkeys], &l->errmsg) == IPADDR_OK)
+                nkeys++;
+            n++;
+        }
+
+        unsigned token = 0;
+        if (handle != NULL && nkeys > 0) {
+            const ipaddr_lpm_t *lpm = ipaddr_lpm_acquire(handle, &token);
+            ipaddr_lpm_lookup_batch(lpm, keys, nkeys, results);
+        }
+
+        for (size_t i = 0, k = 0; i < n; i++) {
+            batch_line_t *l = &lines[i];
+            if (l->errmsg != NULL) {
+                if (pq != NULL)
+                    fprintf(stderr, "Error: %s: row %zu: %s: %s\n",
+                            path, l->lineno, l->text, l->errmsg);
+                else
+                    fprintf(stderr, "Error: %s:%zu: %s: %s\n",
+                            path, l->lineno, l->text, l->errmsg);
+                failed = true;
+                continue;
+            }
+
+            ctx->current = keys[k];
+            ctx->argc = argc;
+            ctx->argv = argv;
+            prelookup = (handle != NULL) ? &results[k] : NULL;
+            k++;
+
+            rc = run_chain(ctx);
+            prelookup = NULL;
+            if (rc == IPADDR_OK)
+                matched = true;
+            else if (rc != IPADDR_ERR_BOOL)
+                failed = true;
+        }
+
+        if (handle != NULL && nkeys > 0)
+            ipaddr_lpm_release(handle, token);
+    }
+
+    if (fp != NULL && ferror(fp)) {
+        fprintf(stderr, "Error: %s: %s\n", path, strerror(errno));
+        failed = true;
+    }
+
+    free(buf);
+    ipaddr_arena_reset(arena);
+    if (fp != NULL && fp != stdin)
+        fclose(fp);
+    ipaddr_parquet_close(pq);
+    ipaddr_pcap_close(pc);
+    ipaddr_flow_close(fl);
+
+    if (failed)
+        return IPADDR_ERR_USAGE;
+    return matched ? IPADDR_OK : IPADDR_ERR_BOOL;
+}
+
+/* ========== Table Commands ========== */
+
+/*
+ * Load a prefix table for a table command from path ('-' for stdin).
+ */
+static int load_table(const char *cmd, const char *path, ipaddr_lpm_t **lpm)
+{
+    *lpm = ipaddr_lpm_new();
+    if (*lpm == NULL) {
+        fprintf(stderr, "%s: out of memory\n", cmd);
+        return IPADDR_ERR_INTERNAL;
+    }
+
+    size_t lineno;
+    const char *errmsg;
+    int rc;
+    if (strcmp(path, "-") == 0) {
+        lineno = 0;
+        rc = ipaddr_lpm_read(*lpm, stdin, &lineno, &errmsg);
+    } else {
+        rc = ipaddr_lpm_load(*lpm, path, &lineno, &errmsg);
+    }
+    if (rc != IPADDR_OK) {
+        if (lineno > 0)
+            fprintf(stderr, "%s: %s:%zu: %s\n", cmd, path, lineno, errmsg);
+        else
+            fprintf(stderr, "%s: %s: %s\n", cmd, path, errmsg);
+        ipaddr_lpm_free(*lpm);
+        *lpm = NULL;
+    }
+    return rc;
+}
+
+/* State of a walk printing table entries */
+typedef struct {
+    const ipaddr_ctx_t *ctx;
+    int                 rc;
+} print_walk_t;
+
+/*
+ * Print one entry of a table, as a prefix followed by its value.
+ */
+static void print_entry(const ipaddr_t *prefix, const char *value, void *arg)
+{
+    print_walk_t *w = arg;
+
+    if (w->rc == IPADDR_OK)
+        w->rc = print_addr(w->ctx, prefix, true, value);
+}
+
+/* A table loaded by a thread of its own */
+typedef struct {
+    const char   *cmd;
+    const char   *path;
+    ipaddr_lpm_t *lpm;
+    int           rc;
+} table_load_t;
+
+static void *load_table_thread(void *arg)
+{
+    table_load_t *t = arg;
+
+    t->rc = load_table(t->cmd, t->path, &t->lpm);
+    return NULL;
+}
+
+/*
+ * Load two tables at once, one on another thread.
+ */
+static int load_table_pair(table_load_t *a, table_load_t *b)
+{
+    pthread_t thread;
+    bool threaded = (pthread_create(&thread, NULL, load_table_thread, a) == 0);
+
+    if (!threaded)
+        load_table_thread(a);
+    load_table_thread(b);
+    if (threaded)
+        pthread_join(thread, NULL);
+
+    if (a->rc != IPADDR_OK || b->rc != IPADDR_OK) {
+        ipaddr_lpm_free(a->lpm);
+        ipaddr_lpm_free(b->lpm);
+        a->lpm = b->lpm = NULL;
+        return (a->rc != IPADDR_OK) ? a->rc : b->rc;
+    }
+    return IPADDR_OK;
+}
+
+static int cmd_fib_compress(ipaddr_ctx_t *ctx)
+{
+    ipaddr_lpm_t *lpm;
+    int rc = load_table("fib-compress", next_arg(ctx), &lpm);
+    if (rc != IPADDR_OK)
+        return rc;
+
+    print_walk_t w = { ctx, IPADDR_OK };
+    rc = ipaddr_lpm_compress(lpm, print_entry, &w);
+    if (rc != IPADDR_OK)
+        fprintf(stderr, "fib-compress: out of memory\n");
+    else
+        rc = w.rc;
+    ipaddr_lpm_free(lpm);
+    return rc;
+}
+
+/* State of a walk printing the differences between two tables */
+typedef struct {
+    const ipaddr_ctx_t *ctx;
+    int                 rc;
+    bool                differ;
+} diff_walk_t;
+
+/*
+ * Print a prefix of a table diff after its marker.  Returns false if it
+ * cannot be formatted.
+ */
+static bool print_diff_prefix(diff_walk_t *w, char marker, const ipaddr_t *prefix)
+{
+    char buf[IPADDR_MAX_ADDRSTRLEN + 33];
+
+    w->differ = true;
+    if (w->rc == IPADDR_OK)
+        w->rc = ipaddr_format(prefix, buf, sizeof(buf), w->ctx->netmask_mode);
+    if (w->rc != IPADDR_OK)
+        return false;
+    printf("%c %s", marker, buf);
+    return true;
+}
+
+/*
+ * Print " value", or nothing if value is NULL.
+ */
+static void print_diff_value(const char *value)
+{
+    if (value != NULL)
+        printf(" %s", value);
+}
+
+static void print_diff_entry(const ipaddr_t *prefix, int kind,
+                             const char *old_value, const char *new_value,
+                             void *arg)
+{
+    switch (kind) {
+    case IPADDR_LPM_ADDED:
+        if (!print_diff_prefix(arg, '+', prefix))
+            return;
+        print_diff_value(new_value);
+        break;
+    case IPADDR_LPM_REMOVED:
+        if (!print_diff_prefix(arg, '-', prefix))
+            return;
+        print_diff_value(old_value);
+        break;
+    default:
+        if (!print_diff_prefix(arg, '~', prefix))
+            return;
+        print_diff_value(old_value);
+        printf(" ->");
+        print_diff_value(new_value);
+        break;
+    }
+    putchar('\n');
+}
+
+static void print_diff_matches(const ipaddr_t *net, const char *value, void *arg)
+{
+    (void)value;
+    if (print_diff_prefix(arg, '!', net))
+        putchar('\n');
+}
+
+static int cmd_table_diff(ipaddr_ctx_t *ctx)
+{
+    table_load_t old = { "table-diff", next_arg(ctx), NULL, IPADDR_OK };
+    table_load_t new = { "table-diff", next_arg(ctx), NULL, IPADDR_OK };
+    if (strcmp(old.path, "-") == 0 && strcmp(new.path, "-") == 0) {
+        fprintf(stderr, "table-diff: only one table can come from stdin\n");
+        return IPADDR_ERR_USAGE;
+    }
+
+    int rc = load_table_pair(&old, &new);
+    if (rc != IPADDR_OK)
+        return rc;
+
+    /* Prefix changes first, then the networks whose lookups changed */
+    diff_walk_t w = { ctx, IPADDR_OK, false };
+    ipaddr_lpm_diff(old.lpm, new.lpm, print_diff_entry, &w);
+    rc = w.rc;
+    if (rc == IPADDR_OK) {
+        rc = ipaddr_lpm_diff_matches(old.lpm, new.lpm, print_diff_matches, &w);
+        if (rc != IPADDR_OK)
+            fprintf(stderr, "table-diff: out of memory\n");
+        else
+            rc = w.rc;
+    }
+    ipaddr_lpm_free(old.lpm);
+    ipaddr_lpm_free(new.lpm);
+
+    if (rc == IPADDR_OK && w.differ)
+        rc = IPADDR_ERR_BOOL;
+    return rc;
+}
+
+static int cmd_reverse_zone(ipaddr_ctx_t *ctx)
+{
+    const char *arg = next_arg(ctx);
+    const char *domain = next_arg(ctx);
+    const char *errmsg;
+    ipaddr_t net;
+
+    int rc = ipaddr_parse(arg, &net, &errmsg);
+    if (rc != IPADDR_OK) {
+        fprintf(stderr, "reverse-zone: invalid network '%s': %s\n", arg, errmsg);
+        return rc;
+    }
+
+    rc = ipaddr_reverse_zone(&net, domain, stdout);
+    if (rc == IPADDR_ERR_USAGE)
+        fprintf(stderr, "reverse-zone: invalid domain '%s'\n", domain);
+    else if (rc != IPADDR_OK)
+        fprintf(stderr, "Error: writing output: %s\n", strerror(errno));
+    return rc;
+}
+
+/*
+ * Load an inventory of networks, from stdin if path is "-".
+ */
+static int load_inventory(const char *cmd, const char *path,
+                          ipaddr_inventory_t **inv)
+{
+    *inv = ipaddr_inventory_new();
+    if (*inv == NULL) {
+        fprintf(stderr, "%s: out of memory\n", cmd);
+        return IPADDR_ERR_INTERNAL;
+    }
+
+    size_t lineno;
+    const char *errmsg;
+    int rc;
+    if (strcmp(path, "-") == 0) {
+        lineno = 0;
+        rc = ipaddr_inventory_read(*inv, stdin, &lineno, &errmsg);
+    } else {
+        rc = ipaddr_inventory_load(*inv, path, &lineno, &errmsg);
+    }
+    if (rc != IPADDR_OK) {
+        if (lineno > 0)
+            fprintf(stderr, "%s: %s:%zu: %s\n", cmd, path, lineno, errmsg);
+        else
+            fprintf(stderr, "%s: %s: %s\n", cmd, path, errmsg);
+        ipaddr_inventory_free(*inv);
+        *inv = NULL;
+    }
+    return rc;
+}
+
+/* State of the conflicts listing */
+typedef struct {
+    const ipaddr_ctx_t *ctx;
+    int                 rc;
+    bool                found;
+} conflict_walk_t;
+
+/*
+ * Print a network and its label, if any.
+ */
+static int print_labeled(const ipaddr_ctx_t *ctx, const ipaddr_t *net,
+                         const char *label)
+{
+    char buf[IPADDR_MAX_ADDRSTRLEN + 33];
+    int rc = ipaddr_format(net, buf, sizeof(buf), ctx->netmask_mode);
+    if (rc != IPADDR_OK)
+        return rc;
+    fputs(buf, stdout);
+    if (label != NULL)
+        printf(" %s", label);
+    return IPADDR_OK;
+}
+
+static void print_conflict(const ipaddr_t *outer, const char *outer_label,
+                           const ipaddr_t *inner, const char *inner_label,
+                           void *arg)
+{
+    conflict_walk_t *w = arg;
+    w->found = true;
+    if (w->rc != IPADDR_OK)
+        return;
+    w->rc = print_labeled(w->ctx, outer, outer_label);
+    if (w->rc == IPADDR_OK) {
+        putchar('\t');
+        w->rc = print_labeled(w->ctx, inner, inner_label);
+        putchar('\n');
+    }
+}
+
+static int cmd_conflicts(ipaddr_ctx_t *ctx)
+{
+    const char *path = next_arg(ctx);
+    ipaddr_inventory_t *inv;
+    int rc = load_inventory("conflicts", path, &inv);
+    if (rc != IPADDR_OK)
+        return rc;
+
+    conflict_walk_t w = { ctx, IPADDR_OK, false };
+    rc = ipaddr_inventory_conflicts(inv, print_conflict, &w);
+    if (rc != IPADDR_OK)
+        fprintf(stderr, "conflicts: out of memory\n");
+    else
+        rc = w.rc;
+    ipaddr_inventory_free(inv);
+
+    if (rc == IPADDR_OK && w.found)
+        rc = IPADDR_ERR_BOOL;
+    return rc;
+}
+
+static void print_hole(const ipaddr_t *net, void *arg)
+{
+    print_walk_t *w = arg;
+
+    if (w->rc == IPADDR_OK)
+        w->rc = print_addr(w->ctx, net, true, NULL);
+}
+
+static int cmd_coverage(ipaddr_ctx_t *ctx)
+{
+    const char *arg = next_arg(ctx);
+    const char *path = next_arg(ctx);
+    const char *errmsg;
+    ipaddr_t super;
+
+    int rc = ipaddr_parse(arg, &super, &errmsg);
+    if (rc != IPADDR_OK) {
+        fprintf(stderr, "coverage: invalid supernet '%s': %s\n", arg, errmsg);
+        return rc;
+    }
+
+    ipaddr_inventory_t *inv;
+    rc = load_inventory("coverage", path, &inv);
+    if (rc != IPADDR_OK)
+        return rc;
+
+    /* Holes first, as they are found, then the totals as comments */
+    ipaddr_coverage_t cov;
+    print_walk_t w = { ctx, IPADDR_OK };
+    ipaddr_inventory_coverage(inv, &super, print_hole, &w, &cov);
+    ipaddr_inventory_free(inv);
+    if (w.rc != IPADDR_OK)
+        return w.rc;
+
+    char covered[IPADDR_UINT128_STRLEN], total[IPADDR_UINT128_STRLEN];
+    uint128_to_str(cov.covered, covered, sizeof(covered));
+    uint128_to_str(cov.total, total, sizeof(total));
+    printf("# covered %s of %s addresses (%.6Lg%%)\n", covered, total,
+           (long double)cov.covered * 100 / (long double)cov.total);
+    if (cov.largest < 0) {
+        printf("# holes 0\n");
+        return IPADDR_OK;
+    }
+    printf("# holes %zu, largest /%d\n", cov.holes, cov.largest);
+    for (int len = 0; len <= 128; len++) {
+        if (cov.by_len[len] > 0)
+            printf("# /%d %zu\n", len, cov.by_len[len]);
+    }
+    return IPADDR_OK;
+}
+
+/*
+ * Get the longest prefix length of a subnet of pool with at least hosts
+ * usable addresses, as Python's hosts() counts them: IPv4 subnets lose
+ * their network and broadcast addresses, IPv6 subnets their subnet-router
+ * anycast address, except for the two smallest sizes.  Returns -1 if no
+ * subnet of the pool is large enough.
+ */
+static int hosts_prefix(const ipaddr_t *pool, unsigned long long hosts)
+{
+    int max_bits = ipaddr_max_prefix(pool);
+    int reserved = ipaddr_is_ipv4(pool) ? 2 : 1;
+    for (int len = max_bits; len >= pool->prefix_len; len--) {
+        int bits = max_bits - len;
+        if (bits >= 64)
+            return len;
+        unsigned long long usable = 1ULL << bits;
+        if (bits >= 2)
+            usable -= reserved;
+        if (usable >= hosts)
+            return len;
+    }
+    return -1;
+}
+
+/*
+ * Parse a line of a plan: "/N [LABEL]" for a /N, or "HOSTS [LABEL]" for
+ * the smallest subnet with that many usable addresses.
+ * Returns 0 on success, 1 for a line without a request, 2 on error.
+ */
+static int parse_request(char *line, const ipaddr_t *pool, int *prefix_len,
+                         const char **label)
+{
+    char *s = line + strspn(line, " \t\r\n");
+    if (*s == '\0' || *s == '#')
+        return IPADDR_ERR_BOOL;
+
+    char *v = s + strcspn(s, " \t\r\n");
+    if (*v != '\0') {
+        *v++ = '\0';
+        v += strspn(v, " \t\r\n");
+        char *end = v + strlen(v);
+        while (end > v && isspace((unsigned char)end[-1]))
+            *--end = '\0';
+    }
+    *label = *v != '\0' ? v : NULL;
+
+    bool is_len = (*s == '/');
+    char *end;
+    if (is_len)
+        s++;
+    if (!isdigit((unsigned char)*s))
+        return IPADDR_ERR_USAGE;
+    errno = 0;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (*end != '\0' || errno != 0)
+        return IPADDR_ERR_USAGE;
+
+    if (!is_len)
+        *prefix_len = hosts_prefix(pool, n);
+    else if (n >= (unsigned long long)pool->prefix_len &&
+             n <= (unsigned long long)ipaddr_max_prefix(pool))
+        *prefix_len = (int)n;
+    else
+        *prefix_len = -1;
+    return *prefix_len < 0 ? IPADDR_ERR_USAGE : IPADDR_OK;
+}
+
+/*
+ * Read the requests of a plan for pool.
+ */
+static int read_plan(const char *path, const ipaddr_t *pool,
+                     ipaddr_arena_t *labels, ipaddr_plan_request_t **reqs,
+                     size_t *n, size_t **lines)
+{
+    *reqs = NULL;
+    *lines = NULL;
+    *n = 0;
+
+    FILE *fp = strcmp(path, "-") == 0 ? stdin : fopen(path, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "plan: %s: %s\n", path, strerror(errno));
+        return IPADDR_ERR_USAGE;
+    }
+
+    char *line = NULL;
+    size_t cap = 0, lineno = 0, max = 0;
+    int rc = IPADDR_OK;
+
+    while (getline(&line, &cap, fp) != -1) {
+        int prefix_len;
+        const char *label;
+        lineno++;
+        rc = parse_request(line, pool, &prefix_len, &label);
+        if (rc == IPADDR_ERR_BOOL) {
+            rc = IPADDR_OK;
+            continue;
+        }
+        if (rc != IPADDR_OK) {
+            fprintf(stderr, "plan: %s:%zu: invalid size for the pool\n",
+                    path, lineno);
+            break;
+        }
+
+        if (*n == max) {
+            max = max ? max * 2 : 256;
+            ipaddr_plan_request_t *r = realloc(*reqs, max * sizeof(**reqs));
+            size_t *l = r ? realloc(*lines, max * sizeof(**lines)) : NULL;
+            if (r != NULL)
+                *reqs = r;
+            if (l != NULL)
+                *lines = l;
+            if (r == NULL || l == NULL) {
+                rc = IPADDR_ERR_INTERNAL;
+                break;
+            }
+        }
+        (*reqs)[*n].prefix_len = prefix_len;
+        (*reqs)[*n].label = label ? ipaddr_arena_strdup(labels, label) : NULL;
+        if (label != NULL && (*reqs)[*n].label == NULL) {
+            rc = IPADDR_ERR_INTERNAL;
+            break;
+        }
+        (*lines)[(*n)++] = lineno;
+    }
+    if (rc == IPADDR_ERR_INTERNAL)
+        fprintf(stderr, "plan: out of memory\n");
+    else if (rc == IPADDR_OK && ferror(fp)) {
+        fprintf(stderr, "plan: %s: %s\n", path, strerror(errno));
+        rc = IPADDR_ERR_USAGE;
+    }
+
+    free(line);
+    if (fp != stdin)
+        fclose(fp);
+    return rc;
+}
+
+static int cmd_plan(ipaddr_ctx_t *ctx)
+{
+    const char *arg = next_arg(ctx);
+    const char *path = next_arg(ctx);
+    const char *errmsg;
+    ipaddr_t pool;
+
+    int rc = ipaddr_parse(arg, &pool, &errmsg);
+    if (rc != IPADDR_OK) {
+        fprintf(stderr, "plan: invalid pool '%s': %s\n", arg, errmsg);
+        return rc;
+    }
+    ipaddr_network(&pool, &pool);
+    pool.has_prefix = true;
+
+    ipaddr_arena_t *labels = ipaddr_arena_new();
+    if (labels == NULL) {
+        fprintf(stderr, "plan: out of memory\n");
+        return IPADDR_ERR_INTERNAL;
+    }
+    ipaddr_plan_request_t *reqs;
+    size_t n, *lines, failed;
+    rc = read_plan(path, &pool, labels, &reqs, &n, &lines);
+    if (rc == IPADDR_OK) {
+        rc = ipaddr_pool_plan(&pool, reqs, n, &failed);
+        if (rc == IPADDR_ERR_BOOL)
+            fprintf(stderr, "plan: %s:%zu: no room left for a /%d in %s\n",
+                    path, lines[failed], reqs[failed].prefix_len, arg);
+        else if (rc != IPADDR_OK)
+            fprintf(stderr, "plan: out of memory\n");
+    }
+
+    /* The assignment, in the order of the requests */
+    for (size_t i = 0; i < n && rc == IPADDR_OK; i++)
+        rc = print_addr(ctx, &reqs[i].net, true, reqs[i].label);
+
+    free(reqs);
+    free(lines);
+    ipaddr_arena_free(labels);
+    return rc;
+}
+
+/*
+ * Report an error from a state file operation.
+ */
+static void state_error(const ipaddr_ctx_t *ctx, const char *cmd, int rc,
+                        size_t lineno, const char *errmsg)
+{
+    if (rc == IPADDR_ERR_USAGE && lineno > 0)
+        fprintf(stderr, "%s: %s:%zu: %s\n", cmd, ctx->state, lineno, errmsg);
+    else
+        fprintf(stderr, "%s: %s: %s\n", cmd, ctx->state, errmsg);
+}
+
+static void print_block(const ipaddr_t *block, void *arg)
+{
+    print_walk_t *w = arg;
+
+    if (w->rc == IPADDR_OK)
+        w->rc = print_addr(w->ctx, block, true, NULL);
+}
+
+static int cmd_alloc(ipaddr_ctx_t *ctx)
+{
+    const char *arg = next_arg(ctx);
+    const char *errmsg;
+    ipaddr_t pool;
+    int size = -1;
+    size_t count = 1;
+
+    int rc = ipaddr_parse(arg, &pool, &errmsg);
+    if (rc != IPADDR_OK) {
+        fprintf(stderr, "alloc: invalid pool '%s': %s\n", arg, errmsg);
+        return rc;
+    }
+    ipaddr_network(&pool, &pool);
+    pool.has_prefix = true;
+
+    /* --size /N [--count N], in any order */
+    while (ctx->argc > 0) {
+        const char *opt = next_arg(ctx);
+        const char *val = next_arg(ctx);
+        char *end;
+        if (val == NULL) {
+            fprintf(stderr, "alloc: %s requires an argument\n", opt);
+            return IPADDR_ERR_USAGE;
+        }
+        if (strcmp(opt, "--size") == 0) {
+            long len = strtol(val + (*val == '/'), &end, 10);
+            if (!isdigit((unsigned char)val[*val == '/']) || *end != '\0' ||
+                len < pool.prefix_len || len > ipaddr_max_prefix(&pool)) {
+                fprintf(stderr, "alloc: invalid size '%s' for %s\n", val, arg);
+                return IPADDR_ERR_USAGE;
+            }
+            size = (int)len;
+        } else if (strcmp(opt, "--count") == 0) {
+            errno = 0;
+            unsigned long long n = strtoull(val, &end, 10);
+            if (!isdigit((unsigned char)*val) || *end != '\0' || errno != 0 ||
+                n == 0 || n > SIZE_MAX / sizeof(uint128_t)) {
+                fprintf(stderr, "alloc: invalid count '%s'\n", val);
+                return IPADDR_ERR_USAGE;
+            }
+            count = (size_t)n;
+        } else {
+            fprintf(stderr, "alloc: unknown option '%s'\n", opt);
+            return IPADDR_ERR_USAGE;
+        }
+    }
+    if (size < 0) {
+        fprintf(stderr, "alloc: --size required\n");
+        return IPADDR_ERR_USAGE;
+    }
+
+    size_t lineno;
+    print_walk_t w = { ctx, IPADDR_OK };
+    rc = ipaddr_pool_state_alloc(ctx->state, &pool, size, count, print_block,
+                                 &w, &lineno, &errmsg);
+    if (rc == IPADDR_ERR_BOOL) {
+        char buf[IPADDR_MAX_ADDRSTRLEN + 5];
+        ipaddr_format(&pool, buf, sizeof(buf), false);
+        if (count > 1)
+            fprintf(stderr, "alloc: no room for %zu /%d in %s\n", count, size, buf);
+        else
+            fprintf(stderr, "alloc: no free /%d in %s\n", size, buf);
+    } else if (rc != IPADDR_OK) {
+        state_error(ctx, "alloc", rc, lineno, errmsg);
+    } else {
+        rc = w.rc;
+    }
+    return rc;
+}
+
+static int cmd_free(ipaddr_ctx_t *ctx)
+{
+    const char *arg = next_arg(ctx);
+    const char *errmsg;
+    ipaddr_t addr, block, merged;
+
+    int rc = ipaddr_parse(arg, &addr, &errmsg);
+    if (rc != IPADDR_OK) {
+        fprintf(stderr, "free: invalid network '%s': %s\n", arg, errmsg);
+        return rc;
+    }
+    ipaddr_network(&addr, &block);
+    block.has_prefix = true;
+
+    size_t lineno;
+    rc = ipaddr_pool_state_release(ctx->state, &block, &merged, &lineno, &errmsg);
+    if (rc == IPADDR_ERR_BOOL) {
+        fprintf(stderr, "free: %s is not allocated\n", arg);
+        return rc;
+    }
+    if (rc != IPADDR_OK) {
+        state_error(ctx, "free", rc, lineno, errmsg);
+        return rc;
+    }
+    return print_addr(ctx, &merged, true, NULL);
+}
+
+/*
+ * Table commands, which work on whole files instead of an address.
+ */
+static const cmd_t table_commands[] = {
+    /* name           alias          min max chain prefix handler */
+    { "fib-compress", NULL,          1,  1,  false, false, cmd_fib_compress },
+    { "table-diff",   NULL,          2,  2,  false, false, cmd_table_diff },
+    { "reverse-zone", NULL,          1,  2,  false, false, cmd_reverse_zone },
+    { "alloc",        NULL,          3,  5,  false, false, cmd_alloc },
+    { "conflicts",    NULL,          1,  1,  false, false, cmd_conflicts },
+    { "coverage",     NULL,          2,  2,  false, false, cmd_coverage },
+    { "plan",         NULL,          2,  2,  false, false, cmd_plan },
+    { "free",         NULL,          1,  1,  false, false, cmd_free },
+    { NULL, NULL, 0, 0, false, false, NULL }
+};
+
+/*
+ * Run the table command named by argv[0], if it is one.  Returns -1 if
+ * it is not.
+ */
+static int run_table_command(ipaddr_ctx_t *ctx, int argc, char **argv)
+{
+    const cmd_t *cmd;
+    for (cmd = table_commands; cmd->name != NULL; cmd++) {
+        if (strcmp(argv[0], cmd->name) == 0)
+            break;
+    }
+    if (cmd->name == NULL)
+        return -1;
+
+    if (argc - 1 < cmd->min_args) {
+        fprintf(stderr, "Error: %s requires %d argument(s)\n",
+                cmd->name, cmd->min_args);
+        return IPADDR_ERR_USAGE;
+    }
+    if (argc - 1 > cmd->max_args) {
+        fprintf(stderr, "Error: %s takes at most %d argument(s)\n",
+                cmd->name, cmd->max_args);
+        return IPADDR_ERR_USAGE;
+    }
+    if (ctx->output_format != IPADDR_FORMAT_TEXT && prints_text(cmd)) {
+        fprintf(stderr, "Error: %s does not print addresses\n", cmd->name);
+        return IPADDR_ERR_USAGE;
+    }
+    ctx->argc = argc - 1;
+    ctx->argv = argv + 1;
+    return cmd->handler(ctx);
+}
+
+/*
+ * Parse a size in bytes with an optional K, M, G or T suffix.
+ */
+static int parse_size(const char *str, size_t *size)
+{
+    char *end;
+    errno = 0;
+    unsigned long long val = strtoull(str, &end, 10);
+    if (errno != 0 || end == str || *str == '-')
+        return IPADDR_ERR_USAGE;
+
+    int shift = 0;
+    switch (toupper((unsigned char)*end)) {
+    case 'T': shift += 10; /* fall through */
+    case 'G': shift += 10; /* fall through */
+    case 'M': shift += 10; /* fall through */
+    case 'K': shift += 10; end++; break;
+    default:  break;
+    }
+    if (*end != '\0' || val > (SIZE_MAX >> shift))
+        return IPADDR_ERR_USAGE;
+
+    *size = (size_t)val << shift;
+    return IPADDR_OK;
+}
+
+/*
+ * Complete -O arrow output, if any.  Returns rc, or the error finishing
+ * the output.
+ */
+static int finish_output(int rc)
+{
+    if (arrow == NULL)
+        return rc;
+
+    /* A run rejected before any row leaves no stream, not an empty one */
+    if (rc == IPADDR_ERR_USAGE && ipaddr_arrow_empty(arrow)) {
+        ipaddr_arrow_free(arrow);
+        arrow = NULL;
+        return rc;
+    }
+    if (ipaddr_arrow_finish(arrow) != IPADDR_OK) {
+        fprintf(stderr, "Error: writing output: %s\n", strerror(errno));
+        rc = IPADDR_ERR_INTERNAL;
+    }
+    ipaddr_arrow_free(arrow);
+    arrow = NULL;
+    return rc;
+}
+
+/* Names of the address stream formats, indexed by IPADDR_FORMAT_* */
+static const char *const format_names[] = {
+    "text", "bin", "arrow", "parquet", "pcap", "flow"
+};
+
+/*
+ * Parse the name of an address stream format.
+ */
+static int parse_format(const char *str, int *format)
+{
+    for (size_t i = 0; i < sizeof(format_names) / sizeof(format_names[0]); i++) {
+        if (strcmp(str, format_names[i]) == 0) {
+            *format = (int)i;
+            return IPADDR_OK;
+        }
+    }
+    return IPADDR_ERR_USAGE;
+}
+
+/*
+ * Parse the --pcap or --flow argument (IPADDR_FLOW_* share the values of
+ * IPADDR_PCAP_*).
+ */
+static int parse_which(const char *str, int *which)
+{
+    if (strcmp(str, "src") == 0)
+        *which = IPADDR_PCAP_SRC;
+    else if (strcmp(str, "dst") == 0)
+        *which = IPADDR_PCAP_DST;
+    else if (strcmp(str, "both") == 0)
+        *which = IPADDR_PCAP_BOTH;
+    else
+        return IPADDR_ERR_USAGE;
+    return IPADDR_OK;
+}
+
+/* Long options without a short form */
+enum {
+    OPT_COLUMN = 256,
+    OPT_PCAP,
+    OPT_FLOW,
+    OPT_FLOW_PREFIX,
+    OPT_STATE
+};
+
+/*
+ * Main entry point.
+ */
+int main(int argc, char **argv)
+{
+    ipaddr_ctx_t ctx = { 0 };
+    const char *batch_path = NULL;
+    bool flow_prefix = false;
+    int opt;
+    int rc;
+
+    static const struct option long_options[] = {
+        { "memory-limit", required_argument, NULL, 'm' },
+        { "input-format", required_argument, NULL, 'I' },
+        { "output-format", required_argument, NULL, 'O' },
+        { "column",       required_argument, NULL, OPT_COLUMN },
+        { "pcap",         required_argument, NULL, OPT_PCAP },
+        { "flow",         required_argument, NULL, OPT_FLOW },
+        { "flow-prefix",  no_argument,       NULL, OPT_FLOW_PREFIX },
+        { "state",        required_argument, NULL, OPT_STATE },
+        { "help",         no_argument,       NULL, 'h' },
+        { NULL, 0, NULL, 0 }
+    };
+
+    /* Parse options ('+' forces POSIX behavior: stop at first non-option) */
+    while ((opt = getopt_long(argc, argv, "+Mf:rm:I:O:h", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'M':
+            ctx.netmask_mode = true;
+            break;
+        case 'f':
+            batch_path = optarg;
+            break;
+        case 'r':
+            ctx.reload = true;
+            break;
+        case 'm':
+            if (parse_size(optarg, &ctx.memory_limit) != IPADDR_OK) {
+                fprintf(stderr, "Error: invalid memory limit '%s'\n", optarg);
+                return IPADDR_ERR_USAGE;
+            }
+            break;
+        case OPT_COLUMN:
+            ctx.column = optarg;
+            break;
+        case OPT_PCAP:
+            if (parse_which(optarg, &ctx.pcap) != IPADDR_OK) {
+                fprintf(stderr, "Error: invalid --pcap '%s'\n", optarg);
+                return IPADDR_ERR_USAGE;
+            }
+            break;
+        case OPT_FLOW:
+            if (parse_which(optarg, &ctx.flow) != IPADDR_OK) {
+                fprintf(stderr, "Error: invalid --flow '%s'\n", optarg);
+                return IPADDR_ERR_USAGE;
+            }
+            break;
+        case OPT_FLOW_PREFIX:
+            flow_prefix = true;
+            break;
+        case OPT_STATE:
+            ctx.state = optarg;
+            break;
+        case 'I':
+        case 'O':
+            if (parse_format(optarg, (opt == 'I') ? &ctx.input_format
+                                                  : &ctx.output_format) != IPADDR_OK) {
+                fprintf(stderr, "Error: invalid format '%s'\n", optarg);
+                return IPADDR_ERR_USAGE;
+            }
+            break;
+        case 'h':
+            usage(argv[0]);
+            return 0;
+        default:
+            usage(argv[0]);
+            return IPADDR_ERR_USAGE;
+        }
+    }
+
+    argc -= optind;
+    argv += optind;
+
+    if (ctx.state == NULL)
+        ctx.state = "ipaddr.state";
+
+    /* A column implies Parquet input, --pcap a capture, --flow an export */
+    if (ctx.column != NULL && ctx.input_format == IPADDR_FORMAT_TEXT)
+        ctx.input_format = IPADDR_FORMAT_PARQUET;
+    if (ctx.pcap != 0 && ctx.input_format == IPADDR_FORMAT_TEXT)
+        ctx.input_format = IPADDR_FORMAT_PCAP;
+    if ((ctx.flow != 0 || flow_prefix) && ctx.input_format == IPADDR_FORMAT_TEXT)
+        ctx.input_format = IPADDR_FORMAT_FLOW;
+    if (ctx.input_format == IPADDR_FORMAT_PCAP && ctx.pcap == 0)
+        ctx.pcap = IPADDR_PCAP_BOTH;
+    if (ctx.input_format == IPADDR_FORMAT_FLOW && ctx.flow == 0)
+        ctx.flow = IPADDR_FLOW_BOTH;
+    if (ctx.input_format == IPADDR_FORMAT_ARROW) {
+        fprintf(stderr, "Error: arrow is an output format only\n");
+        return IPADDR_ERR_USAGE;
+    }
+    if (ctx.output_format == IPADDR_FORMAT_PARQUET ||
+        ctx.output_format == IPADDR_FORMAT_PCAP ||
+        ctx.output_format == IPADDR_FORMAT_FLOW) {
+        fprintf(stderr, "Error: %s is an input format only\n",
+                format_names[ctx.output_format]);
+        return IPADDR_ERR_USAGE;
+    }
+    if (ctx.input_format != IPADDR_FORMAT_TEXT && batch_path == NULL) {
+        fprintf(stderr, "Error: -I %s requires -f\n",
+                format_names[ctx.input_format]);
+        return IPADDR_ERR_USAGE;
+    }
+    if (ctx.input_format == IPADDR_FORMAT_PARQUET && ctx.column == NULL) {
+        fprintf(stderr, "Error: -I parquet requires --column\n");
+        return IPADDR_ERR_USAGE;
+    }
+    if (ctx.column != NULL && ctx.input_format != IPADDR_FORMAT_PARQUET) {
+        fprintf(stderr, "Error: --column requires Parquet input\n");
+        return IPADDR_ERR_USAGE;
+    }
+    if (ctx.pcap != 0 && ctx.input_format != IPADDR_FORMAT_PCAP) {
+        fprintf(stderr, "Error: --pcap requires pcap input\n");
+        return IPADDR_ERR_USAGE;
+    }
+    if ((ctx.flow != 0 || flow_prefix) && ctx.input_format != IPADDR_FORMAT_FLOW) {
+        fprintf(stderr, "Error: --flow requires flow input\n");
+        return IPADDR_ERR_USAGE;
+    }
+    if (flow_prefix)
+        ctx.flow |= IPADDR_FLOW_PREFIX;
+    if (ctx.output_format == IPADDR_FORMAT_ARROW) {
+        arrow = ipaddr_arrow_new(stdout);
+        if (arrow == NULL) {
+            fprintf(stderr, "Error: out of memory\n");
+            return IPADDR_ERR_INTERNAL;
+        }
+    }
+
+    /* Batch mode: addresses come from a file, all arguments are commands */
+    if (batch_path != NULL) {
+        ctx.batch = true;
+        ctx.argc = argc;
+        ctx.argv = argv;
+        rc = run_batch(&ctx, batch_path);
+        int agg_rc = finish_aggregate(&ctx);
+        if (agg_rc != IPADDR_OK)
+            rc = agg_rc;
+        rc = finish_output(rc);
+        free_tables();
+        if (fflush(stdout) != 0)
+            rc = IPADDR_ERR_INTERNAL;
+        return rc;
+    }
+
+    if (argc < 1) {
+        fprintf(stderr, "Error: address required\n");
+        usage(argv[0] ? argv[0] : "ipaddr");
+        return IPADDR_ERR_USAGE;
+    }
+
+    /* Table commands stand in for the address */
+    rc = run_table_command(&ctx, argc, argv);
+    if (rc >= 0) {
+        rc = finish_output(rc);
+        if (fflush(stdout) != 0)
+            rc = IPADDR_ERR_INTERNAL;
+        return rc;
+    }
+
+    /* Parse initial address */
+    const char *errmsg;
+    rc = ipaddr_parse(argv[0], &ctx.current, &errmsg);
+    if (rc != IPADDR_OK) {
+        fprintf(stderr, "Error: %s: %s\n", argv[0], errmsg);
+        return rc;
+    }
+
+    /* Set up remaining args for command processing */
+    ctx.argc = argc - 1;
+    ctx.argv = argv + 1;
+
+    rc = run_chain(&ctx);
+    if (rc == IPADDR_OK)
+        rc = finish_aggregate(&ctx);
+    return finish_output(rc);
+}
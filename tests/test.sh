@@ -8,9 +8,14 @@
 set -e
 
 IPADDR="${IPADDR:-./ipaddr}"
+TESTS=$(dirname "$0")
 PASS=0
 FAIL=0
 
+# Scratch directory for input files
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
 # Test output equality
 t() {
     expected="$1"; shift
@@ -42,6 +47,20 @@ te() {
     fi
 }
 
+# Test the leading bytes of a file, in hex
+tx() {
+    expected="$1"; file="$2"; count="${3:-}"
+    actual=$(od -An -tx1 ${count:+-N"$count"} "$file" 2>&1 | tr -d ' \n') || true
+    if [ "$expected" = "$actual" ]; then
+        PASS=$((PASS + 1))
+    else
+        FAIL=$((FAIL + 1))
+        echo "FAIL: $file"
+        echo "  Expected: '$expected'"
+        echo "  Got:      '$actual'"
+    fi
+}
+
 echo "=== Default (Normalization) Tests ==="
 
 # IPv4 normalization
@@ -56,6 +75,18 @@ t "::1" 0:0:0:0:0:0:0:1
 t "fe80::" fe80:0000::
 t "2001:db8::/32" 2001:db8::/32
 
+# Reverse DNS names; fewer labels name a network
+t "192.168.1.1" 1.1.168.192.in-addr.arpa
+t "192.168.0.0/16" 168.192.IN-ADDR.ARPA.
+t "0.0.0.0/0" in-addr.arpa
+t "2001:db8::1" 1.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.8.b.d.0.1.0.0.2.ip6.arpa
+t "2001:db8::/32" 8.B.D.0.1.0.0.2.ip6.arpa.
+te 2 256.1.168.192.in-addr.arpa
+te 2 01.1.168.192.in-addr.arpa
+te 2 5.4.3.2.1.in-addr.arpa
+te 2 10.0.ip6.arpa
+te 2 example.arpa
+
 # -M flag (netmask output)
 t "192.168.1.0/255.255.255.0" -M 192.168.1.0/24
 t "10.0.0.0/255.0.0.0" -M 10.0.0.0/8
@@ -86,6 +117,16 @@ t "1" ::1 to-int
 t "0" :: to-int
 t "42540766411282592856903984951653826561" 2001:db8::1 to-int
 
+echo "=== reverse-pointer Tests ==="
+
+t "1.1.168.192.in-addr.arpa" 192.168.1.1 reverse-pointer
+t "30.1.168.192.in-addr.arpa" 192.168.1.30/28 reverse-pointer
+t "1.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.8.b.d.0.1.0.0.2.ip6.arpa" 2001:db8::1 reverse-pointer
+t "2001:db8::1" -f - <<EOF
+1.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.8.b.d.0.1.0.0.2.ip6.arpa
+EOF
+te 2 -O bin 192.168.1.1 reverse-pointer
+
 echo "=== prefix-length / prefixlen Tests ==="
 
 t "24" 192.168.1.0/24 prefix-length
@@ -219,6 +260,79 @@ t "14" 192.168.1.30/28 host-index
 t "255" 192.168.1.255/24 host-index
 t "0" 10.0.0.0/8 host-index
 
+echo "=== Arithmetic Tests ==="
+
+t "10.0.0.6" 10.0.0.1 add 5
+t "10.0.1.45/24" 10.0.0.1/24 add 300
+t "9.255.255.255" 10.0.0.1 sub 2
+t "9.255.255.255" 10.0.0.1 add -2
+t "10.0.0.3" 10.0.0.1 sub -2
+t "10.0.0.13" 10.0.0.1 add 1 next next add 10 prev
+t "0:0:0:1::" ::ffff:ffff:ffff:ffff next
+t "fe80::2%eth0" fe80::1%eth0 next
+t "ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff" :: add 340282366920938463463374607431768211455
+t "255.255.255.255" 255.255.255.254 next
+# Overflow at the end of the family, not of the 128-bit integer
+te 2 255.255.255.255 next
+te 2 0.0.0.0 prev
+te 2 10.0.0.1 add 4294967294
+te 2 ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff next
+te 2 :: prev
+te 2 :: add 340282366920938463463374607431768211456
+te 2 10.0.0.1 add x
+te 2 10.0.0.1 add -
+t "4" 10.0.0.1 distance 10.0.0.5
+t "-4" 10.0.0.5 distance 10.0.0.1
+t "0" 10.0.0.1/24 distance 10.0.0.1/16
+t "340282366920938463463374607431768211455" :: distance ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff
+t "-340282366920938463463374607431768211455" ffff:ffff:ffff:ffff:ffff:ffff:ffff:ffff distance ::
+t "-1" 10.0.0.1 next distance 10.0.0.1
+te 2 10.0.0.1 distance ::1
+te 2 -O bin 10.0.0.1 distance 10.0.0.2
+
+echo "=== hosts Tests ==="
+
+t "$(printf '10.0.0.0\n10.0.0.1\n10.0.0.2\n10.0.0.3')" 10.0.0.1/30 hosts
+t "10.0.0.5" 10.0.0.5 hosts
+# A fixed seed gives a fixed order; its shards split it between them
+t "$(printf '10.0.0.1\n10.0.0.5\n10.0.0.2\n10.0.0.0\n10.0.0.6\n10.0.0.3\n10.0.0.7\n10.0.0.4')" 10.0.0.0/29 hosts --random --seed 42
+t "$(printf '10.0.0.1\n10.0.0.4')" 10.0.0.0/29 hosts --random --seed 42 --shard 1/3
+t "$(printf '10.0.0.5\n10.0.0.6')" 10.0.0.0/29 hosts --random --seed 42 --shard 2/3
+t "$(printf '10.0.0.2\n10.0.0.0\n10.0.0.3\n10.0.0.7')" 10.0.0.0/29 hosts --random --seed 42 --shard 3/3
+t "$(printf '2001:db8::3\n2001:db8::')" 2001:db8::/126 hosts --random --seed 42 --shard 2/2
+t "$(printf '10.0.0.1\n10.0.0.3')" 10.0.0.0/30 hosts --shard 2/2
+# The rest of the chain runs for each address, with tests as filters
+t "$(printf '167772161\n167772163')" 10.0.0.0/30 hosts --shard 2/2 to-int
+t "$(printf '172.31.255.253\n172.31.255.255')" 172.31.255.252/30 hosts --shard 2/2 is-private
+te 1 8.8.8.0/30 hosts is-private
+t "$(printf '10.0.0.0\n10.0.0.1\n10.0.0.2\n10.0.0.3')" 10.0.0.0/30 hosts --random uniq
+te 2 10.0.0.0/30 hosts --seed 1
+te 2 10.0.0.0/30 hosts --random --shard 1/2
+te 2 10.0.0.0/30 hosts --shard 3/2
+te 2 10.0.0.0/30 hosts --shard 1/0
+te 2 10.0.0.0/30 hosts --shard 2
+te 2 10.0.0.0/30 hosts --shard 2/
+te 2 10.0.0.0/30 hosts --random --seed x
+te 2 10.0.0.0/30 hosts --bogus
+te 2 -f "$TMP/missing.txt" hosts --shard 2/2
+
+echo "=== sample Tests ==="
+
+t "$(printf '10.0.0.91\n10.0.0.126\n10.0.0.76')" 10.0.0.0/24 sample 3 --seed 1
+t "$(printf '2001:db8::5a3d:6134:3118:7912\n2001:db8::62ee:3d38:b475:27a2')" 2001:db8::/64 sample 2 --seed 3
+# All of a network, each address once
+t "$(printf '10.0.0.2\n10.0.0.1\n10.0.0.3\n10.0.0.0')" 10.0.0.0/30 sample 4 --seed 2
+t "$(printf '10.0.0.0\n10.0.0.1\n10.0.0.2\n10.0.0.3')" 10.0.0.0/30 sample 4 uniq
+# A sample in the chain of another leaves the outer one's addresses alone
+t "$(printf '10.0.186.231\n10.0.186.12\n10.0.106.231\n10.0.106.12')" 10.0.0.0/16 sample 2 --seed 9 network super 24 sample 2 --seed 4
+t "10.0.0.7" 10.0.0.7 sample 1
+t "$(printf '167772162\n167772161')" 10.0.0.0/30 sample 2 --seed 2 to-int
+te 1 8.8.8.0/24 sample 3 is-private
+t "sample: 10.0.0.0/30 has fewer than 5 addresses" 10.0.0.0/30 sample 5
+te 2 10.0.0.0/30 sample x
+te 2 10.0.0.0/30 sample 1 --seed
+te 2 -f "$TMP/missing.txt" sample -1
+
 echo "=== subnet Tests ==="
 
 t "192.168.1.0/28" 192.168.1.0/24 subnet 28 0
@@ -315,6 +429,391 @@ t "192.168.6.0/24" 192.168.0.0/16 subnet 28 100 super 24
 t "3232236900" 192.168.0.0/16 subnet 24 5 host 100 to-int
 te 0 10.0.0.0/16 subnet 24 5 in 10.0.0.0/20
 
+echo "=== lookup Tests ==="
+
+cat > "$TMP/table.txt" <<EOF
+# prefix table
+10.0.0.0/8 corp
+10.1.0.0/16 lab
+192.168.1.7/24
+
+2001:db8::/32 doc
+EOF
+
+t "10.1.0.0/16 lab" 10.1.2.3 lookup "$TMP/table.txt"
+t "10.0.0.0/8 corp" 10.2.3.4 lookup "$TMP/table.txt"
+t "10.0.0.0/8 corp" 10.1.0.0/15 lookup "$TMP/table.txt"
+t "192.168.1.0/24" 192.168.1.200 lookup "$TMP/table.txt"
+t "2001:db8::/32 doc" 2001:db8::1 lookup "$TMP/table.txt"
+t "10.0.0.0/16" 10.0.5.5 lookup "$TMP/table.txt" subnet 16 0
+te 1 8.8.8.8 lookup "$TMP/table.txt"
+te 1 ::1 lookup "$TMP/table.txt"
+te 2 10.1.2.3 lookup "$TMP/missing.txt"
+
+printf '10.0.0.0/8 corp\n10.1.0.0/16 lab\n-10.1.0.0/16\n-172.16.0.0/12\n' > "$TMP/withdraw.txt"
+t "10.0.0.0/8 corp" 10.1.2.3 lookup "$TMP/withdraw.txt"
+
+# rib.mrt: TABLE_DUMP_V2 RIBs with two peers, an empty AS path, an extended
+# length attribute, multicast and BGP4MP records, IPv6 and add-path
+t "10.1.0.0/16 AS64502" 10.1.2.3 lookup "$TESTS/rib.mrt"
+t "10.0.0.0/8 AS64500" 10.2.3.4 lookup "$TESTS/rib.mrt"
+t "192.168.0.0/16" 192.168.1.1 lookup "$TESTS/rib.mrt"
+t "2001:db8::/32 AS64511" 2001:db8::1 lookup "$TESTS/rib.mrt"
+t "172.16.0.0/12 AS4200000000" 172.16.1.1 lookup "$TESTS/rib.mrt"
+te 1 224.0.0.1 lookup "$TESTS/rib.mrt"
+head -c 150 "$TESTS/rib.mrt" > "$TMP/short.mrt"
+t "lookup: $TMP/short.mrt:3: truncated record" 10.1.2.3 lookup "$TMP/short.mrt"
+if command -v gzip >/dev/null; then
+    gzip -c "$TESTS/rib.mrt" > "$TMP/rib.mrt.gz"
+    printf '10.2.3.4\n8.8.8.8\n2001:db8::5\n' > "$TMP/rib.in"
+    t "$(printf '10.0.0.0/8 AS64500\n2001:db8::/32 AS64511')" -f "$TMP/rib.in" lookup "$TMP/rib.mrt.gz"
+fi
+
+echo "=== Batch Mode (-f) Tests ==="
+
+cat > "$TMP/addrs.txt" <<EOF
+192.168.001.001
+  8.8.8.8
+# comment
+
+10.1.2.3/16
+2001:db8::1
+EOF
+
+t "$(printf '192.168.1.1\n8.8.8.8\n10.1.2.3/16\n2001:db8::1')" -f "$TMP/addrs.txt"
+t "$(printf '4\n4\n4\n6')" -f "$TMP/addrs.txt" version
+t "$(printf '192.168.1.0/24\n8.8.8.0/24\n10.1.2.0/24\n2001:d00::/24')" -f "$TMP/addrs.txt" address network super 24
+t "$(printf '192.168.1.1\n10.1.2.3/16')" -f "$TMP/addrs.txt" is-private
+t "$(printf '192.168.1.0/24\n10.1.0.0/16 lab\n2001:db8::/32 doc')" -f "$TMP/addrs.txt" lookup "$TMP/table.txt"
+t "$(printf '192.168.1.0/24\n10.1.0.0/16')" -f "$TMP/addrs.txt" lookup "$TMP/table.txt" is-private
+te 0 -f "$TMP/addrs.txt" is-global
+te 1 -f "$TMP/addrs.txt" is-multicast
+te 2 -f "$TMP/addrs.txt" unknowncmd
+te 2 -f "$TMP/missing.txt"
+
+printf '10.0.0.1\nbogus\n10.0.0.2\n' > "$TMP/bad.txt"
+te 2 -f "$TMP/bad.txt"
+
+# More addresses than one lookup batch
+for i in $(seq 1 20); do echo "10.$((i % 3)).0.$i"; done > "$TMP/many.txt"
+for i in $(seq 1 20); do echo "8.8.8.$i"; echo "2001:db8::$i"; done >> "$TMP/many.txt"
+t "$( (for i in $(seq 1 20); do
+        if [ $((i % 3)) -eq 1 ]; then echo "10.1.0.0/16 lab"; else echo "10.0.0.0/8 corp"; fi
+    done; for i in $(seq 1 20); do echo "2001:db8::/32 doc"; done) )" -f "$TMP/many.txt" lookup "$TMP/table.txt"
+# The same through a pipe, where batches take what is already readable
+t "$("$IPADDR" -f "$TMP/many.txt" lookup "$TMP/table.txt")" -f - lookup "$TMP/table.txt" < "$TMP/many.txt"
+mkfifo "$TMP/many.in"
+(head -n 30 "$TMP/many.txt"; sleep 1; tail -n +31 "$TMP/many.txt") > "$TMP/many.in" &
+t "$("$IPADDR" -f "$TMP/many.txt" lookup "$TMP/table.txt")" -f - lookup "$TMP/table.txt" < "$TMP/many.in"
+wait
+"$IPADDR" -O bin -f "$TMP/many.txt" > "$TMP/many.bin"
+mkfifo "$TMP/many-bin.in"
+cat "$TMP/many.bin" > "$TMP/many-bin.in" &
+t "$("$IPADDR" -f "$TMP/many.txt" lookup "$TMP/table.txt")" -I bin -f - lookup "$TMP/table.txt" < "$TMP/many-bin.in"
+wait
+cat "$TMP/bad.txt" >> "$TMP/many.txt"
+te 2 -f "$TMP/many.txt" lookup "$TMP/table.txt"
+
+echo "=== Aggregate Command Tests ==="
+
+cat > "$TMP/nets.txt" <<EOF
+10.0.1.0/24
+2001:db8::1
+10.0.0.0/24
+192.168.0.1
+10.0.0.128/25
+2001:db8::
+10.0.2.0/23
+10.0.0.0/24
+EOF
+
+t "$(printf '10.0.0.0/24\n10.0.0.0/24\n10.0.0.128/25\n10.0.1.0/24\n10.0.2.0/23\n192.168.0.1\n2001:db8::\n2001:db8::1')" -f "$TMP/nets.txt" sort
+t "$(printf '10.0.0.0/24\n10.0.0.128/25\n10.0.1.0/24\n10.0.2.0/23\n192.168.0.1\n2001:db8::\n2001:db8::1')" -f "$TMP/nets.txt" uniq
+t "$(printf '10.0.0.0/22\n192.168.0.1/32\n2001:db8::/127')" -f "$TMP/nets.txt" collapse
+t "$(printf '10.0.0.0/16\n192.168.0.0/16')" -f "$TMP/nets.txt" is-private address network super 16 uniq
+t "10.0.0.0/8" 10.1.2.3/8 collapse
+te 2 -f "$TMP/nets.txt" sort version
+te 2 -m 10X -f "$TMP/nets.txt" sort
+
+# Larger than the memory limit: sorted runs spill to temporary files
+for i in $(seq 3000 -1 1); do echo "10.$((i % 7)).$((i / 256)).$((i % 256))"; done > "$TMP/spill.txt"
+t "$("$IPADDR" -f "$TMP/spill.txt" sort)" -m 16K -f "$TMP/spill.txt" sort
+t "$("$IPADDR" -f "$TMP/spill.txt" collapse)" --memory-limit 16K -f "$TMP/spill.txt" collapse
+# More than SORT_FANIN runs, so runs are merged into the next level
+awk 'BEGIN { for (i = 70000; i > 0; i--) printf "10.%d.%d.%d\n", i % 5, int(i / 256) % 256, i % 256 }' > "$TMP/spill.txt"
+t "$("$IPADDR" -f "$TMP/spill.txt" uniq)" -m 16K -f "$TMP/spill.txt" uniq
+
+# heatmap: 2x2 /2 cells along the curve (0 top left, 1 below, 3 top right),
+# the busiest red, empty ones black; other families are left out
+printf '1.1.1.1\n1.2.3.4\n200.0.0.1\n::1\n' > "$TMP/heat.txt"
+"$IPADDR" -f "$TMP/heat.txt" heatmap --prefix 2 --out "$TMP/heat.ppm"
+tx "50360a3220320a3235350aff0000a8ff00000000000000" "$TMP/heat.ppm"
+# PNG signature and 256x256 header of the default /8 cells of 10.0.0.0/8
+"$IPADDR" 10.1.2.3 heatmap --net 10.0.0.0/8 --out "$TMP/heat.png"
+tx "89504e470d0a1a0a0000000d494844520000010000000100" "$TMP/heat.png" 24
+te 2 10.1.2.3 heatmap --prefix 3 --out "$TMP/heat.png"
+te 2 10.1.2.3 heatmap --prefix 26 --out "$TMP/heat.png"
+te 2 10.1.2.3 heatmap --out "$TMP/heat.gif"
+te 2 10.1.2.3 heatmap --out "$TMP/missing/heat.png"
+te 2 10.1.2.3 heatmap --prefix 8
+te 2 -O bin 10.1.2.3 heatmap --out "$TMP/heat.png"
+te 2 -f "$TMP/heat.txt" heatmap --out "$TMP/heat.png" sort
+
+# reservoir: a stream no longer than K is kept whole, in input order
+t "$(printf '10.0.0.50\n10.0.0.124\n10.0.0.75')" 10.0.0.0/24 hosts reservoir 3 --seed 5
+t "$(printf '10.0.0.0\n10.0.0.1\n10.0.0.2\n10.0.0.3')" 10.0.0.0/30 hosts reservoir 9
+t "$(printf '10.0.0.50\n10.0.0.34\n10.0.0.59\n10.0.0.106\n10.0.0.71\n10.0.0.120\n10.0.0.175\n10.0.0.173\n10.0.0.147\n10.0.0.240\n10.0.0.222\n10.0.0.225')" 10.0.0.0/24 hosts reservoir 3 --seed 5 --by-prefix 26
+t "$(printf '10.0.0.0/24\n192.168.0.1\n2001:db8::1')" -f "$TMP/nets.txt" reservoir 1 --by-prefix /16 --seed 1
+# A prefix past the length of IPv4 keeps K of each address
+t "$(printf '10.0.0.0/24\n10.0.0.0/24\n10.0.0.128/25\n10.0.1.0/24\n10.0.2.0/23\n192.168.0.1\n2001:db8::1\n2001:db8::')" -f "$TMP/nets.txt" reservoir 2 --by-prefix 120 --seed 1
+te 1 -f /dev/null reservoir 2
+te 2 -f /dev/null reservoir 0
+te 2 -f /dev/null reservoir 2 --by-prefix 129
+te 2 -f /dev/null reservoir 2 --seed
+te 2 -f /dev/null reservoir 2 sort
+
+echo "=== Table Command Tests ==="
+
+cat > "$TMP/fib.txt" <<EOF
+10.0.0.0/8 A
+10.128.0.0/9 B
+10.128.0.0/10 B
+10.192.0.0/10 A
+192.168.0.0/24 C
+192.168.1.0/24 C
+172.16.0.0/13
+172.24.0.0/13
+2001:db8::/32 X
+2001:db8::/33 Y
+2001:db8:8000::/33 Y
+EOF
+
+t "$(printf '10.0.0.0/8 A\n10.128.0.0/10 B\n172.16.0.0/12\n192.168.0.0/23 C\n2001:db8::/32 Y')" fib-compress "$TMP/fib.txt"
+# A default route takes the most common value; without one, addresses
+# that match nothing keep every prefix above them out
+printf '0.0.0.0/0 A\n10.0.0.0/8 B\n11.0.0.0/8 B\n' > "$TMP/fib-default.txt"
+t "$(printf '0.0.0.0/0 A\n10.0.0.0/7 B')" fib-compress "$TMP/fib-default.txt"
+printf '0.0.0.0/1 C\n128.0.0.0/2 C\n' > "$TMP/fib-hole.txt"
+t "$(printf '0.0.0.0/1 C\n128.0.0.0/2 C')" fib-compress - < "$TMP/fib-hole.txt"
+t "$(printf '10.0.0.0/8 AS64500\n10.1.0.0/16 AS64502\n172.16.0.0/12 AS4200000000\n192.168.0.0/16\n2001:db8::/32 AS64511')" fib-compress "$TESTS/rib.mrt"
+te 2 fib-compress "$TMP/missing.txt"
+te 2 fib-compress
+te 2 fib-compress "$TMP/fib.txt" extra
+
+printf '10.0.0.0/8 corp\n10.1.0.0/16 lab\n10.2.0.0/16 x\n192.168.0.0/16\n2001:db8::/32 doc\n' > "$TMP/old.txt"
+printf '10.0.0.0/8 corp\n10.1.0.0/16 prod\n10.3.0.0/16 x\n192.168.0.0/16 home\n2001:db8::/32 doc\n2001:db8:1::/48 doc\n' > "$TMP/new.txt"
+t "$(printf '~ 10.1.0.0/16 lab -> prod\n- 10.2.0.0/16 x\n+ 10.3.0.0/16 x\n~ 192.168.0.0/16 -> home\n+ 2001:db8:1::/48 doc\n! 10.1.0.0/16\n! 10.2.0.0/15\n! 192.168.0.0/16\n! 2001:db8:1::/48')" table-diff "$TMP/old.txt" "$TMP/new.txt"
+te 1 table-diff "$TMP/old.txt" "$TMP/new.txt"
+te 0 table-diff "$TMP/old.txt" - < "$TMP/old.txt"
+t "$(printf '+ 10.1.0.0/17 lab\n! 10.1.0.0/17')" table-diff "$TMP/old.txt" - <<EOF
+10.0.0.0/8 corp
+10.1.0.0/16 lab
+10.1.0.0/17 lab
+10.2.0.0/16 x
+192.168.0.0/16
+2001:db8::/32 doc
+EOF
+te 2 table-diff - - < "$TMP/old.txt"
+te 2 -O bin table-diff "$TMP/old.txt" "$TMP/new.txt"
+te 2 table-diff "$TMP/old.txt" "$TMP/missing.txt"
+
+t "$(printf '; PTR records for 192.168.1.0/29\n$ORIGIN 1.168.192.in-addr.arpa.\n1\tIN\tPTR\tip-192-168-1-1.invalid.\n2\tIN\tPTR\tip-192-168-1-2.invalid.\n3\tIN\tPTR\tip-192-168-1-3.invalid.\n4\tIN\tPTR\tip-192-168-1-4.invalid.\n5\tIN\tPTR\tip-192-168-1-5.invalid.\n6\tIN\tPTR\tip-192-168-1-6.invalid.')" reverse-zone 192.168.1.5/29
+t "$(printf '; PTR records for 10.0.0.0/31\n$ORIGIN 0.0.10.in-addr.arpa.\n0\tIN\tPTR\tip-10-0-0-0.example.com.\n1\tIN\tPTR\tip-10-0-0-1.example.com.')" reverse-zone 10.0.0.0/31 example.com.
+t "$(printf '; PTR records for 2001:db8::/126\n$ORIGIN 0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.0.8.b.d.0.1.0.0.2.ip6.arpa.\n1\tIN\tPTR\tip-2001-0db8-0000-0000-0000-0000-0000-0001.example.com.\n2\tIN\tPTR\tip-2001-0db8-0000-0000-0000-0000-0000-0002.example.com.\n3\tIN\tPTR\tip-2001-0db8-0000-0000-0000-0000-0000-0003.example.com.')" reverse-zone 2001:db8::/126 example.com
+te 2 reverse-zone 10.0.0.0/33
+
+# alloc/free: best fit from the buddy free lists, recorded in the state file
+t "10.0.0.0/26" --state "$TMP/pool.state" alloc 10.0.0.0/24 --size /26
+t "10.0.0.64/28" --state "$TMP/pool.state" alloc 10.0.0.0/24 --size /28
+t "$(printf '10.0.0.128/26\n10.0.0.192/26')" --state "$TMP/pool.state" alloc 10.0.0.0/24 --size 26 --count 2
+te 1 --state "$TMP/pool.state" alloc 10.0.0.0/24 --size /25
+t "10.0.0.0/26" --state "$TMP/pool.state" free 10.0.0.0/26
+t "10.0.0.0/25" --state "$TMP/pool.state" free 10.0.0.64/28
+te 1 --state "$TMP/pool.state" free 10.0.0.64/28
+t "10.0.0.0/25" --state "$TMP/pool.state" alloc 10.0.0.0/24 --size /25
+t "10.0.0.128/26 10.0.0.0/24" 10.0.0.130 lookup "$TMP/pool.state"
+t "$(printf '2001:db8::/48\n2001:db8:1::/48')" --state "$TMP/pool.state" alloc 2001:db8::/32 --size /48 --count 2
+te 2 --state "$TMP/pool.state" alloc 10.0.0.0/24 --size /23
+te 2 --state "$TMP/pool.state" alloc 10.0.0.0/24
+te 2 --state "$TMP/pool.state" alloc 10.0.0.0/24 --size /26 --bogus 1
+te 2 --state "$TMP/missing/pool.state" alloc 10.0.0.0/24 --size /26
+
+# The snapshot next to the state file follows lines appended to the file,
+# and a missing snapshot is rebuilt from the table
+t "10.1.0.0/25" --state "$TMP/snap.state" alloc 10.1.0.0/24 --size /25
+tx "6970616464725031" "$TMP/snap.state.snap" 8
+echo "10.1.0.128/26 10.1.0.0/24" >> "$TMP/snap.state"
+t "10.1.0.192/26" --state "$TMP/snap.state" alloc 10.1.0.0/24 --size /26
+echo "-10.1.0.0/25" >> "$TMP/snap.state"
+rm -f "$TMP/snap.state.snap"
+t "10.1.0.0/26" --state "$TMP/snap.state" alloc 10.1.0.0/24 --size /26
+t "10.1.0.0/25" --state "$TMP/snap.state" free 10.1.0.0/26
+t "10.1.0.192/26 10.1.0.0/24" 10.1.0.200 lookup "$TMP/snap.state"
+
+cat > "$TMP/inventory.txt" <<EOF
+# network label
+10.0.0.0/16 vpc-a
+10.0.1.0/24 subnet b
+10.1.0.0/16 vpc-b
+10.0.1.0/24
+10.0.2.0/23 subnet-c
+192.168.0.0/24
+2001:db8::/32 v6
+2001:db8:1::/48
+EOF
+t "$(printf '10.0.0.0/16 vpc-a\t10.0.1.0/24 subnet b\n10.0.0.0/16 vpc-a\t10.0.1.0/24\n10.0.1.0/24 subnet b\t10.0.1.0/24\n10.0.0.0/16 vpc-a\t10.0.2.0/23 subnet-c\n2001:db8::/32 v6\t2001:db8:1::/48')" conflicts "$TMP/inventory.txt"
+te 1 conflicts "$TMP/inventory.txt"
+te 0 conflicts - <<EOF
+10.0.0.0/24
+10.0.1.0/24
+10.0.2.0/25
+EOF
+te 1 conflicts - <<EOF
+10.0.0.0/24 a
+10.0.0.0/24 b
+EOF
+t "" conflicts - < /dev/null
+te 2 conflicts "$TMP/missing.txt"
+te 2 -O bin conflicts "$TMP/inventory.txt"
+
+t "$(printf '10.2.0.0/15\n10.4.0.0/14\n10.8.0.0/13\n10.16.0.0/12\n10.32.0.0/11\n10.64.0.0/10\n10.128.0.0/9\n# covered 131072 of 16777216 addresses (0.78125%%)\n# holes 7, largest /9\n# /9 1\n# /10 1\n# /11 1\n# /12 1\n# /13 1\n# /14 1\n# /15 1')" coverage 10.0.0.0/8 "$TMP/inventory.txt"
+t "$(printf '10.0.0.64/26\n# covered 192 of 256 addresses (75%%)\n# holes 1, largest /26\n# /26 1')" coverage 10.0.0.0/24 - <<EOF
+10.0.0.0/26
+10.0.0.128/25
+10.0.0.32/27
+9.0.0.0/8
+EOF
+t "$(printf '# covered 256 of 256 addresses (100%%)\n# holes 0')" coverage 10.0.0.5/24 "$TMP/inventory.txt"
+t "$(printf '2001:db8:1:1::/64\n2001:db8:1:2::/63\n2001:db8:1:4::/62\n2001:db8:1:8::/61\n2001:db8:1:10::/60\n2001:db8:1:20::/59\n2001:db8:1:40::/58\n2001:db8:1:80::/57\n2001:db8:1:100::/56\n2001:db8:1:200::/55\n2001:db8:1:400::/54\n2001:db8:1:800::/53\n2001:db8:1:1000::/52\n2001:db8:1:2000::/51\n2001:db8:1:4000::/50\n2001:db8:1:8000::/49\n# covered 18446744073709551616 of 1208925819614629174706176 addresses (0.00152588%%)\n# holes 16, largest /49\n# /49 1\n# /50 1\n# /51 1\n# /52 1\n# /53 1\n# /54 1\n# /55 1\n# /56 1\n# /57 1\n# /58 1\n# /59 1\n# /60 1\n# /61 1\n# /62 1\n# /63 1\n# /64 1')" coverage 2001:db8:1::/48 - <<EOF
+2001:db8:1::/64
+2001:db8::/48
+EOF
+te 2 coverage 10.0.0.0/33 "$TMP/inventory.txt"
+te 2 coverage 10.0.0.0/8 "$TMP/missing.txt"
+te 2 -O bin coverage 10.0.0.0/8 "$TMP/inventory.txt"
+
+# plan: largest first, in request order; HOSTS rounds up to usable addresses
+cat > "$TMP/sizes.txt" <<EOF
+/26 web
+/24 campus a
+# comment
+500 dorms
+2 p2p
+/30
+1 loopback
+EOF
+t "$(printf '10.0.3.0/26 web\n10.0.2.0/24 campus a\n10.0.0.0/23 dorms\n10.0.3.68/31 p2p\n10.0.3.64/30\n10.0.3.70/32 loopback')" plan 10.0.0.0/22 "$TMP/sizes.txt"
+t "$(printf '2001:db8::/64 a\n2001:db8:0:1::/64 b\n2001:db8:0:2::/127')" plan 2001:db8::/62 - <<EOF
+/64 a
+18446744073709551615 b
+2
+EOF
+te 1 plan 10.0.0.0/23 "$TMP/sizes.txt"
+t "plan: -:3: no room left for a /25 in 10.0.0.0/24" plan 10.0.0.0/24 - <<EOF
+/25
+/25
+/25
+EOF
+te 2 plan 10.0.0.0/24 "$TMP/sizes.txt"
+te 2 plan 10.0.0.0/22 - <<EOF
+/33
+EOF
+te 2 plan 10.0.0.0/22 "$TMP/missing.txt"
+
+echo "=== Binary Record Tests ==="
+
+"$IPADDR" -O bin -f "$TMP/nets.txt" > "$TMP/nets.bin"
+t "$("$IPADDR" -f "$TMP/nets.txt")" -I bin -f "$TMP/nets.bin"
+t "$("$IPADDR" -f "$TMP/nets.txt" collapse)" -I bin -f "$TMP/nets.bin" collapse
+"$IPADDR" -O bin fe80::1%lo > "$TMP/zone.bin"
+t "fe80::1%lo" -I bin -f "$TMP/zone.bin"
+"$IPADDR" -O bin 10.0.0.1/24 network > "$TMP/net.bin"
+t "10.0.0.0/24" -I bin -f "$TMP/net.bin"
+# Lookup values travel as payloads, which are skipped on input
+"$IPADDR" -O bin 10.1.2.3 lookup "$TMP/table.txt" > "$TMP/lookup.bin"
+t "10.1.0.0/16" -I bin -f "$TMP/lookup.bin" network
+te 2 -O bin 10.0.0.1 version
+te 2 -O xml 10.0.0.1
+te 2 -I bin 10.0.0.1
+head -c 30 "$TMP/nets.bin" > "$TMP/short.bin"
+te 2 -I bin -f "$TMP/short.bin"
+te 0 -O arrow -f "$TMP/nets.txt" collapse
+te 0 --output-format arrow 10.0.0.1 lookup "$TMP/table.txt"
+te 2 -O arrow 10.0.0.1 to-int
+# A rejected chain writes no stream, only the error
+t "Error: to-int does not print addresses" -O arrow -f "$TMP/nets.txt" to-int
+te 2 -I arrow -f "$TMP/nets.txt"
+
+echo "=== Parquet Input Tests ==="
+
+# addrs.parquet: ip is a dictionary-encoded string column with a null,
+# bin holds the same addresses as 4 or 16 raw bytes, bad has "bogus"
+t "$(printf '10.0.0.1\n192.168.1.0/24\n2001:db8::1\n10.0.0.1\nfe80::1%%lo')" -f "$TESTS/addrs.parquet" --column ip
+t "$(printf '10.0.0.1\n2001:db8::1\n10.0.0.1')" -f "$TESTS/addrs.parquet" --column bin
+t "$(printf '10.0.0.0/16\n192.168.0.0/16')" -I parquet --column ip -f "$TESTS/addrs.parquet" is-private network super 16 uniq
+te 2 -f "$TESTS/addrs.parquet" --column bad
+te 2 -f "$TESTS/addrs.parquet" --column nope
+te 2 -f "$TMP/nets.txt" --column ip
+te 2 -I parquet -f "$TESTS/addrs.parquet"
+
+echo "=== Packet Capture Input Tests ==="
+
+# addrs.pcap: big-endian pcap of IPv4, VLAN-tagged IPv6, ARP, QinQ-tagged
+# IPv4 and a packet captured too short; addrs.pcapng: Ethernet and raw IP
+# interfaces with enhanced and simple packet blocks
+t "$(printf '10.0.0.1\n2001:db8::1\n172.16.0.1')" -f "$TESTS/addrs.pcap" --pcap src
+t "$(printf '192.168.1.2\n2001:db8::2\n10.0.0.1')" -f "$TESTS/addrs.pcap" --pcap dst
+t "$(printf '10.0.0.1\n192.168.1.2\nfe80::1\nff02::1\n172.16.0.1\n10.0.0.1')" -I pcap -f "$TESTS/addrs.pcapng"
+t "$(printf '10.0.0.0/8\n172.0.0.0/8\n192.0.0.0/8')" -f "$TESTS/addrs.pcap" --pcap both is-private network super 8 collapse
+head -c 100 "$TESTS/addrs.pcap" > "$TMP/short.pcap"
+te 2 -f "$TMP/short.pcap" --pcap src
+te 2 -f "$TESTS/addrs.parquet" --pcap src
+te 2 -f "$TESTS/addrs.pcap" --pcap all
+te 2 -f "$TESTS/addrs.pcap" --pcap src --column ip
+
+echo "=== Flow Export Input Tests ==="
+
+# addrs.flow: a NetFlow v5 message with prefix lengths; v9 messages with
+# IPv4, options and IPv6 templates; IPFIX messages with variable-length
+# and enterprise fields, a set of an unknown template and a withdrawal
+t "$(printf '10.1.2.3\n10.9.9.9\n172.16.5.5\n172.16.5.5\n2001:db8::1\n203.0.113.5\n203.0.113.6')" -f "$TESTS/addrs.flow" --flow src
+t "$(printf '192.0.2.1\n198.51.100.7\n8.8.8.8\n9.9.9.9\n2001:db8::2\n10.0.0.1\n10.0.0.2')" -f "$TESTS/addrs.flow" --flow dst
+t "$(printf '10.1.2.3/16\n10.9.9.9\n172.16.5.5/12\n172.16.5.5\n10.0.0.1\n10.0.0.2')" -I flow --flow-prefix -f "$TESTS/addrs.flow" is-private
+t "$(printf '10.1.0.0/16\n10.9.9.9/32\n172.16.0.0/12\n203.0.113.5/32\n203.0.113.6/32\n2001:db8::/48')" -f "$TESTS/addrs.flow" --flow src --flow-prefix network collapse
+head -c 100 "$TESTS/addrs.flow" > "$TMP/short.flow"
+te 2 -f "$TMP/short.flow" --flow src
+te 2 -f "$TESTS/addrs.pcap" --flow src
+te 2 -f "$TESTS/addrs.flow" --flow all
+te 2 -f "$TESTS/addrs.flow" --flow src --pcap src
+
+echo "=== Table Reload (-r) Tests ==="
+
+printf '10.0.0.0/8 old\n' > "$TMP/reload.txt"
+mkfifo "$TMP/reload.in"
+(
+    echo 10.1.2.3
+    sleep 1
+    printf '10.0.0.0/8 new\n10.1.0.0/16 lab\n' > "$TMP/reload.txt"
+    sleep 2
+    echo 10.1.2.3
+    echo 10.2.3.4
+) > "$TMP/reload.in" &
+t "$(printf '10.0.0.0/8 old\n10.1.0.0/16 lab\n10.0.0.0/8 new')" -r -f "$TMP/reload.in" lookup "$TMP/reload.txt"
+wait
+
+printf '10.0.0.0/8 corp\n10.1.0.0/16 lab\n' > "$TMP/append.txt"
+mkfifo "$TMP/append.in"
+(
+    echo 10.1.2.3
+    sleep 1
+    printf -- '-10.1.0.0/16\n10.2.0.0/16 dev\n' >> "$TMP/append.txt"
+    sleep 2
+    echo 10.1.2.3
+    echo 10.2.3.4
+) > "$TMP/append.in" &
+t "$(printf '10.1.0.0/16 lab\n10.0.0.0/8 corp\n10.2.0.0/16 dev')" -r -f "$TMP/append.in" lookup "$TMP/append.txt"
+wait
+
 echo "=== Error Handling Tests ==="
 
 te 2 192.168.1.256 version